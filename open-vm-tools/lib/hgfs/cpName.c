@@ -84,34 +84,30 @@ CPName_GetComponent(char const *begin,   // IN: Beginning of buffer
    ASSERT(next);
    ASSERT(begin <= end);
 
-   for (walk = begin; ; walk++) {
-      if (walk == end) {
-         /* End of buffer. No NUL was found */
+   /* memchr scans a word or a vector at a time, components are long. */
+   walk = memchr(begin, '\0', end - begin);
+   if (walk == NULL) {
+      /* End of buffer. No NUL was found */
 
-         myNext = end;
-         break;
-      }
-
-      if (*walk == '\0') {
-         /* Found a NUL */
-
-         if (walk == begin) {
-            Log("%s: error: first char can't be NUL\n", __FUNCTION__);
-            return -1;
-         }
+      walk = end;
+      myNext = end;
+   } else {
+      /* Found a NUL */
 
-         myNext = walk + 1;
-         /* Skip consecutive path delimiters. */
-         while ((*myNext == '\0') && (myNext != end)) {
-            myNext++;
-         }
-         if (myNext == end) {
-            /* Last character in the buffer is not allowed to be NUL */
-            Log("%s: error: last char can't be NUL\n", __FUNCTION__);
-            return -1;
-         }
+      if (walk == begin) {
+         Log("%s: error: first char can't be NUL\n", __FUNCTION__);
+         return -1;
+      }
 
-         break;
+      myNext = walk + 1;
+      /* Skip consecutive path delimiters. */
+      while ((*myNext == '\0') && (myNext != end)) {
+         myNext++;
+      }
+      if (myNext == end) {
+         /* Last character in the buffer is not allowed to be NUL */
+         Log("%s: error: last char can't be NUL\n", __FUNCTION__);
+         return -1;
       }
    }
 
@@ -440,18 +436,26 @@ CPNameConvertTo(char const *nameIn, // IN:  Buf to convert
      * Copy the string to the output buf, converting all path separators into '\0'.
      * Collapse multiple consecutive path separators into a single one since
      * CPName_GetComponent can't handle consecutive path separators.
+     * The components are copied whole, found with the library string routines
+     * rather than byte by byte.
      */
    while (*nameIn != '\0' && bufOut < endOut) {
       if (*nameIn == pathSep) {
-         *bufOut = '\0';
+         *bufOut++ = '\0';
          do {
             nameIn++;
          } while (*nameIn == pathSep);
       } else {
-         *bufOut = *nameIn;
-         nameIn++;
+         char const *sep = strchr(nameIn, pathSep);
+         size_t len = (sep != NULL) ? sep - nameIn : strlen(nameIn);
+
+         if (len > (size_t)(endOut - bufOut)) {
+            len = endOut - bufOut;
+         }
+         memcpy(bufOut, nameIn, len);
+         nameIn += len;
+         bufOut += len;
       }
-      bufOut++;
    }
 
    /*
@@ -327,14 +327,12 @@ CPNameUtil_CharReplace(char *buf,      // IN/OUT
                        char newChar)   // IN
 
 {
-   size_t i;
+   char *end = buf + bufSize;
 
    ASSERT(buf);
 
-   for (i = 0; i < bufSize; i++) {
-      if (buf[i] == oldChar) {
-         buf[i] = newChar;
-      }
+   while ((buf = memchr(buf, oldChar, end - buf)) != NULL) {
+      *buf++ = newChar;
    }
 }
 
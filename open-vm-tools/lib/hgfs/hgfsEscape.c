@@ -598,6 +598,52 @@ HgfsIsEscapeSequence(char const *bufIn,   // IN: input name
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsEscapeFindCandidate --
+ *
+ *    Finds the next character of the input name that may need escaping: an
+ *    illegal character or the escape character.
+ *
+ *    Most names need no escaping at all, so rather than testing every
+ *    character against the illegal characters the name is searched for each
+ *    of them with memchr, which scans a word or a vector at a time. Every
+ *    search is bounded by the closest candidate found so far.
+ *
+ * Results:
+ *    Offset of the next candidate, sizeIn if there is none.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static uint32
+HgfsEscapeFindCandidate(char const *bufIn,   // IN: input name
+                        uint32 offset,       // IN: offset to search from
+                        uint32 sizeIn)       // IN: length of the name in characters
+{
+   char const *start = bufIn + offset;
+   char const *end = bufIn + sizeIn;
+   char const *found;
+   char const *illegal;
+
+   found = memchr(start, HGFS_ESCAPE_CHAR, end - start);
+   if (found != NULL) {
+      end = found;
+   }
+   for (illegal = HGFS_ILLEGAL_CHARS; *illegal != '\0' && end > start; illegal++) {
+      found = memchr(start, *illegal, end - start);
+      if (found != NULL) {
+         end = found;
+      }
+   }
+   return (uint32)(end - bufIn);
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -650,7 +696,9 @@ HgfsEscapeEnumerate(char const *bufIn,              // IN:  Buffer with unescape
 
    PROCESS_RESERVED_NAME(bufIn, sizeIn, processEscape, &offset, context);
 
-   for (i = offset; i < sizeIn; i++) {
+   for (i = HgfsEscapeFindCandidate(bufIn, offset, sizeIn);
+        i < sizeIn;
+        i = HgfsEscapeFindCandidate(bufIn, i + 1, sizeIn)) {
       if (strchr(HGFS_ILLEGAL_CHARS, bufIn[i]) != NULL) {
          if (!processEscape(bufIn, i, HGFS_ESCAPE_ILLEGAL_CHARACTER, context)) {
             return FALSE;
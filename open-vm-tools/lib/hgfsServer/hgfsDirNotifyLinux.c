@@ -0,0 +1,1797 @@
+/*********************************************************
+ * Copyright (C) 2016 VMware, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * hgfsDirNotifyLinux.c --
+ *
+ *	Directory change notification for Linux hosts, built on inotify.
+ *
+ *	Each shared folder keeps the table of its subscribers. Subscribers
+ *	watching the same directory share one inotify watch, recursive
+ *	subscribers add a watch for every directory below theirs. A reader
+ *	thread reads the inotify events in batches, translates them for each
+ *	matching subscriber and then invokes the subscribers' callbacks.
+ *
+ *	Watches are found by inotify watch descriptor through a hash table.
+ *	When a watched directory is renamed inside the shared folder the paths
+ *	of its watches and subscribers follow it; a watched directory moved
+ *	away to an unknown place is no longer watched.
+ *
+ *	Locking: gHgfsNotify.lock protects the tables. gHgfsNotify.deliveryLock
+ *	is held by the reader thread while it builds and delivers a batch, and
+ *	by the subscriber removal functions. So once a subscriber has been
+ *	removed no callback for it is running or will run, which is what keeps
+ *	the session passed to the callback valid. HgfsNotify_RemoveSharedFolder
+ *	is called with the server's shared folders lock held, which the
+ *	callbacks take, so it only takes the table lock.
+ *
+ *	The server only offers notification on shared memory channels, which
+ *	the guest tools do not have, and their server is configured without
+ *	HGFS_CONFIG_NOTIFY_ENABLED. Servers on such channels, like hgfsBench
+ *	with its loopback channel, use this backend.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/poll.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+
+#include "vmware.h"
+#include "vm_basic_types.h"
+#include "dbllnklst.h"
+#include "hashTable.h"
+#include "userlock.h"
+#include "mutexRankLib.h"
+#include "posix.h"
+#include "str.h"
+#include "util.h"
+
+#include "hgfsProto.h"
+#include "hgfsServer.h"
+#include "hgfsUtil.h"
+#include "hgfsDirNotify.h"
+
+#define LOGLEVEL_MODULE hgfs
+#include "loglevel_user.h"
+
+/*
+ * Bound on the events delivered for one read of the inotify queue. Events
+ * past the bound are dropped and the subscribers that lost events get an
+ * HGFS_NOTIFY_EVENTS_DROPPED event instead.
+ */
+#define HGFS_NOTIFY_MAX_BATCH_EVENTS   1024
+
+/* Initial size of the watch descriptor index. */
+#define HGFS_NOTIFY_WD_TABLE_SIZE      128
+
+/* Events that are only watched for when some subscriber asks for them. */
+#define HGFS_NOTIFY_NOISY_EVENTS  (IN_ACCESS | IN_OPEN | IN_CLOSE_NOWRITE)
+
+/* Events every watch gets: needed to track the watched directories. */
+#define HGFS_NOTIFY_BASE_EVENTS   (IN_CREATE | IN_DELETE | IN_MOVED_FROM |    \
+                                   IN_MOVED_TO | IN_DELETE_SELF |             \
+                                   IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+typedef struct HgfsNotifyShare {
+   DblLnkLst_Links links;
+   HgfsSharedFolderHandle handle;
+   char *path;                     /* Path of the shared folder on the host. */
+   char *shareName;
+   DblLnkLst_Links subscribers;    /* HgfsNotifySubscriber list. */
+} HgfsNotifyShare;
+
+typedef struct HgfsNotifySubscriber {
+   DblLnkLst_Links links;
+   HgfsSubscriberHandle handle;
+   HgfsNotifyShare *share;
+   char *path;                     /* Relative to the share, "" for its root. */
+   uint32 eventFilter;             /* HGFS_NOTIFY_* events to report. */
+   Bool recursive;
+   HgfsNotifyEventReceiveCb *eventCb;
+   struct HgfsSessionInfo *session;
+   Bool overflowed;                /* Events were dropped in this batch. */
+} HgfsNotifySubscriber;
+
+typedef struct HgfsNotifyWatch {
+   DblLnkLst_Links links;
+   int wd;
+   struct HgfsNotifyWatch *nextByWd; /* Next watch with the same wd. */
+   HgfsNotifyShare *share;
+   char *path;                     /* Relative to the share, "" for its root. */
+   uint32 mask;                    /* inotify events of the watch. */
+   Bool moved;                     /* Renamed, its IN_MOVE_SELF is expected. */
+} HgfsNotifyWatch;
+
+/* A directory moved from a watched directory, until its IN_MOVED_TO. */
+typedef struct HgfsNotifyMove {
+   DblLnkLst_Links links;
+   uint32 cookie;
+   HgfsNotifyShare *share;
+   char *path;                     /* Relative to the share. */
+   uint32 batch;                   /* Batch of the IN_MOVED_FROM. */
+} HgfsNotifyMove;
+
+typedef struct HgfsNotifyDelivery {
+   HgfsNotifyEventReceiveCb *eventCb;
+   HgfsSharedFolderHandle share;
+   HgfsSubscriberHandle subscriber;
+   struct HgfsSessionInfo *session;
+   char *name;
+   uint32 mask;
+} HgfsNotifyDelivery;
+
+typedef struct HgfsNotifyState {
+   /* Protects the tables below. */
+   MXUserExclLock *lock;
+
+   /* Held while a batch of events is delivered, see the top of the file. */
+   MXUserExclLock *deliveryLock;
+
+   DblLnkLst_Links shares;         /* HgfsNotifyShare list. */
+   DblLnkLst_Links watches;        /* HgfsNotifyWatch list. */
+   HashTable *watchesByWd;         /* wd to its HgfsNotifyWatch chain. */
+   DblLnkLst_Links moves;          /* HgfsNotifyMove list. */
+   uint32 batch;                   /* Number of the batch being processed. */
+   HgfsSharedFolderHandle nextShareHandle;
+   HgfsSubscriberHandle nextSubscriberHandle;
+
+   int inotifyFd;
+   int wakeupPipe[2];              /* Written to stop the reader thread. */
+   pthread_t reader;
+
+   /* Events are dropped while the server is check point synchronizing. */
+   Bool syncDeactivated;
+} HgfsNotifyState;
+
+static HgfsNotifyState gHgfsNotify;
+static Bool gHgfsNotifyInitialized = FALSE;
+
+static void HgfsNotifyAddTreeWatches(HgfsNotifyShare *share,
+                                     const char *path,
+                                     uint32 mask);
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyBuildPath --
+ *
+ *    Join two path components, either of which may be empty.
+ *
+ * Results:
+ *    The joined path, to be freed by the caller.
+ *
+ * Side effects:
+ *    Memory allocation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static char *
+HgfsNotifyBuildPath(const char *dir,   // IN: directory
+                    const char *name)  // IN: name in the directory
+{
+   if ('\0' == *dir) {
+      return Util_SafeStrdup(name);
+   }
+   if ('\0' == *name) {
+      return Util_SafeStrdup(dir);
+   }
+   if ('/' == dir[strlen(dir) - 1]) {
+      return Str_SafeAsprintf(NULL, "%s%s", dir, name);
+   }
+   return Str_SafeAsprintf(NULL, "%s/%s", dir, name);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyFilterToMask --
+ *
+ *    Translate HGFS_NOTIFY_* events into the inotify events that generate
+ *    them.
+ *
+ * Results:
+ *    inotify event mask.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static uint32
+HgfsNotifyFilterToMask(uint32 eventFilter)  // IN: HGFS_NOTIFY_* events
+{
+   uint32 mask = HGFS_NOTIFY_BASE_EVENTS;
+
+   if (eventFilter & HGFS_NOTIFY_ACCESS) {
+      mask |= IN_ACCESS;
+   }
+   if (eventFilter & HGFS_NOTIFY_OPEN) {
+      mask |= IN_OPEN;
+   }
+   if (eventFilter & HGFS_NOTIFY_CLOSE_NOWRITE) {
+      mask |= IN_CLOSE_NOWRITE;
+   }
+   if (eventFilter & (HGFS_NOTIFY_ATTRIB | HGFS_NOTIFY_ATIME |
+                      HGFS_NOTIFY_CTIME | HGFS_NOTIFY_CHANGE_EA |
+                      HGFS_NOTIFY_CHANGE_SECURITY)) {
+      mask |= IN_ATTRIB;
+   }
+   if (eventFilter & (HGFS_NOTIFY_MODIFY | HGFS_NOTIFY_SIZE |
+                      HGFS_NOTIFY_MTIME)) {
+      mask |= IN_MODIFY;
+   }
+   if (eventFilter & HGFS_NOTIFY_CLOSE_WRITE) {
+      mask |= IN_CLOSE_WRITE;
+   }
+   return mask;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyMaskToEvents --
+ *
+ *    Translate an inotify event into HGFS_NOTIFY_* events.
+ *
+ * Results:
+ *    HGFS_NOTIFY_* events, 0 if the event is not reported to clients.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static uint32
+HgfsNotifyMaskToEvents(uint32 mask)  // IN: inotify event mask
+{
+   Bool isDir = (mask & IN_ISDIR) != 0;
+   uint32 events = 0;
+
+   if (mask & IN_ACCESS) {
+      events |= HGFS_NOTIFY_ACCESS;
+   }
+   if (mask & IN_ATTRIB) {
+      events |= HGFS_NOTIFY_ATTRIB | HGFS_NOTIFY_CHANGE_SECURITY;
+   }
+   if (mask & IN_MODIFY) {
+      events |= HGFS_NOTIFY_MODIFY | HGFS_NOTIFY_SIZE | HGFS_NOTIFY_MTIME;
+   }
+   if (mask & IN_OPEN) {
+      events |= HGFS_NOTIFY_OPEN;
+   }
+   if (mask & IN_CLOSE_WRITE) {
+      events |= HGFS_NOTIFY_CLOSE_WRITE;
+   }
+   if (mask & IN_CLOSE_NOWRITE) {
+      events |= HGFS_NOTIFY_CLOSE_NOWRITE;
+   }
+   if (mask & IN_CREATE) {
+      events |= isDir ? HGFS_NOTIFY_CREATE_DIR : HGFS_NOTIFY_CREATE_FILE;
+   }
+   if (mask & IN_DELETE) {
+      events |= isDir ? HGFS_NOTIFY_DELETE_DIR : HGFS_NOTIFY_DELETE_FILE;
+   }
+   if (mask & IN_MOVED_FROM) {
+      events |= isDir ? HGFS_NOTIFY_OLD_DIR_NAME : HGFS_NOTIFY_OLD_FILE_NAME;
+   }
+   if (mask & IN_MOVED_TO) {
+      events |= isDir ? HGFS_NOTIFY_NEW_DIR_NAME : HGFS_NOTIFY_NEW_FILE_NAME;
+   }
+   if (mask & IN_DELETE_SELF) {
+      events |= HGFS_NOTIFY_DELETE_SELF;
+   }
+   if (mask & IN_MOVE_SELF) {
+      events |= HGFS_NOTIFY_MOVE_SELF;
+   }
+   return events;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyFindShare --
+ *
+ *    Find a shared folder by handle.
+ *
+ *    Caller should hold gHgfsNotify.lock.
+ *
+ * Results:
+ *    The shared folder or NULL.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsNotifyShare *
+HgfsNotifyFindShare(HgfsSharedFolderHandle handle)  // IN: shared folder handle
+{
+   DblLnkLst_Links *link;
+
+   DblLnkLst_ForEach(link, &gHgfsNotify.shares) {
+      HgfsNotifyShare *share = DblLnkLst_Container(link, HgfsNotifyShare, links);
+
+      if (share->handle == handle) {
+         return share;
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyLookupWd --
+ *
+ *    Find the watches of an inotify watch descriptor. There is more than
+ *    one when shared folders overlap.
+ *
+ *    Caller should hold gHgfsNotify.lock.
+ *
+ * Results:
+ *    The first watch of the chain linked through nextByWd, or NULL.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsNotifyWatch *
+HgfsNotifyLookupWd(int wd)  // IN: inotify watch descriptor
+{
+   HgfsNotifyWatch *watch;
+
+   if (!HashTable_Lookup(gHgfsNotify.watchesByWd, (const void *)(uintptr_t)wd,
+                         (void **)&watch)) {
+      return NULL;
+   }
+   return watch;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyIndexWatch --
+ *
+ *    Add a watch to the chain of its watch descriptor.
+ *
+ *    Caller should hold gHgfsNotify.lock.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyIndexWatch(HgfsNotifyWatch *watch)  // IN: watch
+{
+   watch->nextByWd = HgfsNotifyLookupWd(watch->wd);
+   HashTable_ReplaceOrInsert(gHgfsNotify.watchesByWd,
+                             (const void *)(uintptr_t)watch->wd, watch);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyUnindexWatch --
+ *
+ *    Remove a watch from the chain of its watch descriptor.
+ *
+ *    Caller should hold gHgfsNotify.lock.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyUnindexWatch(HgfsNotifyWatch *watch)  // IN: watch
+{
+   const void *key = (const void *)(uintptr_t)watch->wd;
+   HgfsNotifyWatch *first = HgfsNotifyLookupWd(watch->wd);
+
+   if (first == watch) {
+      if (NULL == watch->nextByWd) {
+         HashTable_Delete(gHgfsNotify.watchesByWd, key);
+      } else {
+         HashTable_ReplaceOrInsert(gHgfsNotify.watchesByWd, key,
+                                   watch->nextByWd);
+      }
+   } else {
+      HgfsNotifyWatch *prev;
+
+      for (prev = first; NULL != prev; prev = prev->nextByWd) {
+         if (prev->nextByWd == watch) {
+            prev->nextByWd = watch->nextByWd;
+            break;
+         }
+      }
+   }
+   watch->nextByWd = NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyFindWatch --
+ *
+ *    Find the watch of a directory of a shared folder.
+ *
+ *    Caller should hold gHgfsNotify.lock.
+ *
+ * Results:
+ *    The watch or NULL.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsNotifyWatch *
+HgfsNotifyFindWatch(HgfsNotifyShare *share,  // IN: shared folder
+                    const char *path)        // IN: relative directory path
+{
+   DblLnkLst_Links *link;
+
+   DblLnkLst_ForEach(link, &gHgfsNotify.watches) {
+      HgfsNotifyWatch *watch = DblLnkLst_Container(link, HgfsNotifyWatch, links);
+
+      if (watch->share == share && strcmp(watch->path, path) == 0) {
+         return watch;
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyAddWatch --
+ *
+ *    Watch a directory of a shared folder for the given events. An existing
+ *    watch of the directory is reused and its events extended if needed, so
+ *    subscribers on the same directory share one inotify watch.
+ *
+ *    Caller should hold gHgfsNotify.lock.
+ *
+ * Results:
+ *    TRUE if the directory is watched.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsNotifyAddWatch(HgfsNotifyShare *share,  // IN: shared folder
+                   const char *path,        // IN: relative directory path
+                   uint32 mask)             // IN: inotify events
+{
+   HgfsNotifyWatch *watch = HgfsNotifyFindWatch(share, path);
+   char *fullPath;
+   int wd;
+
+   if (NULL != watch && (watch->mask & mask) == mask) {
+      return TRUE;
+   }
+   if (NULL != watch) {
+      mask |= watch->mask;
+   }
+
+   fullPath = HgfsNotifyBuildPath(share->path, path);
+   wd = inotify_add_watch(gHgfsNotify.inotifyFd, fullPath, mask);
+   if (wd < 0) {
+      LOG(4, ("%s: failed to watch \"%s\": %s\n", __FUNCTION__, fullPath,
+              strerror(errno)));
+      free(fullPath);
+      return FALSE;
+   }
+   free(fullPath);
+
+   if (NULL == watch) {
+      watch = Util_SafeCalloc(1, sizeof *watch);
+      DblLnkLst_Init(&watch->links);
+      watch->share = share;
+      watch->path = Util_SafeStrdup(path);
+      DblLnkLst_LinkLast(&gHgfsNotify.watches, &watch->links);
+   } else if (watch->wd != wd) {
+      HgfsNotifyUnindexWatch(watch);
+   } else {
+      watch->mask = mask;
+      return TRUE;
+   }
+   watch->wd = wd;
+   watch->mask = mask;
+   HgfsNotifyIndexWatch(watch);
+
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyFreeWatch --
+ *
+ *    Remove a watch. The inotify watch is only removed once no other watch
+ *    record refers to it (two shares can contain the same directory).
+ *
+ *    Caller should hold gHgfsNotify.lock.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Memory is freed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyFreeWatch(HgfsNotifyWatch *watch,  // IN: watch
+                    Bool removeWatch)        // IN: inotify watch still exists
+{
+   DblLnkLst_Unlink1(&watch->links);
+   HgfsNotifyUnindexWatch(watch);
+
+   if (removeWatch && NULL == HgfsNotifyLookupWd(watch->wd)) {
+      inotify_rm_watch(gHgfsNotify.inotifyFd, watch->wd);
+   }
+
+   free(watch->path);
+   free(watch);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyIsInSubtree --
+ *
+ *    Check if a directory is a subscriber's directory or, for a recursive
+ *    subscriber, below it.
+ *
+ * Results:
+ *    The path of the directory relative to the subscriber's directory, or
+ *    NULL if the subscriber does not cover the directory.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static const char *
+HgfsNotifyIsInSubtree(const HgfsNotifySubscriber *subscriber, // IN: subscriber
+                      const char *path)                       // IN: relative path
+{
+   size_t len = strlen(subscriber->path);
+
+   if (strcmp(subscriber->path, path) == 0) {
+      return "";
+   }
+   if (!subscriber->recursive) {
+      return NULL;
+   }
+   if (0 == len) {
+      return path;
+   }
+   if (strncmp(subscriber->path, path, len) == 0 && path[len] == '/') {
+      return path + len + 1;
+   }
+   return NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyCollectWatches --
+ *
+ *    Remove the watches that no subscriber covers any more.
+ *
+ *    Caller should hold gHgfsNotify.lock.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyCollectWatches(void)
+{
+   DblLnkLst_Links *link, *nextLink;
+
+   DblLnkLst_ForEachSafe(link, nextLink, &gHgfsNotify.watches) {
+      HgfsNotifyWatch *watch = DblLnkLst_Container(link, HgfsNotifyWatch, links);
+      DblLnkLst_Links *subLink;
+      Bool used = FALSE;
+
+      DblLnkLst_ForEach(subLink, &watch->share->subscribers) {
+         HgfsNotifySubscriber *subscriber =
+            DblLnkLst_Container(subLink, HgfsNotifySubscriber, links);
+
+         if (NULL != HgfsNotifyIsInSubtree(subscriber, watch->path)) {
+            used = TRUE;
+            break;
+         }
+      }
+      if (!used) {
+         HgfsNotifyFreeWatch(watch, TRUE);
+      }
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyFreeSubscriber --
+ *
+ *    Unlink and free a subscriber. The caller collects the watches.
+ *
+ *    Caller should hold gHgfsNotify.lock.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Memory is freed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyFreeSubscriber(HgfsNotifySubscriber *subscriber)  // IN: subscriber
+{
+   DblLnkLst_Unlink1(&subscriber->links);
+   free(subscriber->path);
+   free(subscriber);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyAddTreeWatches --
+ *
+ *    Watch all the directories below a directory of a shared folder, for a
+ *    recursive subscriber. Symlinks are not followed.
+ *
+ *    Caller should hold gHgfsNotify.lock.
+ *
+ * Results:
+ *    None. Directories that can't be watched are skipped.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyAddTreeWatches(HgfsNotifyShare *share,  // IN: shared folder
+                         const char *path,        // IN: relative directory path
+                         uint32 mask)             // IN: inotify events
+{
+   char *fullPath = HgfsNotifyBuildPath(share->path, path);
+   DIR *dir = Posix_OpenDir(fullPath);
+   struct dirent *entry;
+
+   free(fullPath);
+   if (NULL == dir) {
+      return;
+   }
+
+   while (NULL != (entry = readdir(dir))) {
+      char *subPath;
+
+      if (entry->d_type != DT_DIR ||
+          strcmp(entry->d_name, ".") == 0 ||
+          strcmp(entry->d_name, "..") == 0) {
+         continue;
+      }
+
+      subPath = HgfsNotifyBuildPath(path, entry->d_name);
+      if (HgfsNotifyAddWatch(share, subPath, mask)) {
+         HgfsNotifyAddTreeWatches(share, subPath, mask);
+      }
+      free(subPath);
+   }
+   closedir(dir);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyIsPathBelow --
+ *
+ *    Check if a path is a directory or below it.
+ *
+ * Results:
+ *    The rest of the path after the directory, "" for the directory itself,
+ *    or NULL if the path is not below it.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static const char *
+HgfsNotifyIsPathBelow(const char *path,  // IN: relative path
+                      const char *dir)   // IN: relative directory path
+{
+   size_t len = strlen(dir);
+
+   if (0 == len) {
+      return path;
+   }
+   if (strncmp(path, dir, len) != 0) {
+      return NULL;
+   }
+   if ('\0' == path[len]) {
+      return "";
+   }
+   return ('/' == path[len]) ? path + len + 1 : NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyRenameTree --
+ *
+ *    A watched directory of a shared folder was renamed: move the watches
+ *    and subscribers of it and below it to the new path.
+ *
+ *    Caller should hold gHgfsNotify.lock.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Memory allocation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyRenameTree(HgfsNotifyShare *share,  // IN: shared folder
+                     const char *oldPath,     // IN: old relative path
+                     const char *newPath)     // IN: new relative path
+{
+   DblLnkLst_Links *link;
+
+   LOG(4, ("%s: \"%s\" moved to \"%s\"\n", __FUNCTION__, oldPath, newPath));
+
+   DblLnkLst_ForEach(link, &gHgfsNotify.watches) {
+      HgfsNotifyWatch *watch = DblLnkLst_Container(link, HgfsNotifyWatch, links);
+      const char *rest;
+      char *path;
+
+      if (watch->share != share ||
+          NULL == (rest = HgfsNotifyIsPathBelow(watch->path, oldPath))) {
+         continue;
+      }
+      if ('\0' == *rest) {
+         watch->moved = TRUE;
+      }
+      path = HgfsNotifyBuildPath(newPath, rest);
+      free(watch->path);
+      watch->path = path;
+   }
+
+   DblLnkLst_ForEach(link, &share->subscribers) {
+      HgfsNotifySubscriber *subscriber =
+         DblLnkLst_Container(link, HgfsNotifySubscriber, links);
+      const char *rest = HgfsNotifyIsPathBelow(subscriber->path, oldPath);
+
+      if (NULL != rest) {
+         char *path = HgfsNotifyBuildPath(newPath, rest);
+
+         free(subscriber->path);
+         subscriber->path = path;
+      }
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyRemoveTree --
+ *
+ *    Stop watching a directory of a shared folder and the directories below
+ *    it, which are no longer at their paths.
+ *
+ *    Caller should hold gHgfsNotify.lock.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Memory is freed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyRemoveTree(HgfsNotifyShare *share,  // IN: shared folder
+                     const char *path)        // IN: relative directory path
+{
+   DblLnkLst_Links *link, *nextLink;
+   char *dir = Util_SafeStrdup(path);
+
+   LOG(4, ("%s: \"%s\" moved away\n", __FUNCTION__, dir));
+
+   DblLnkLst_ForEachSafe(link, nextLink, &gHgfsNotify.watches) {
+      HgfsNotifyWatch *watch = DblLnkLst_Container(link, HgfsNotifyWatch, links);
+
+      if (watch->share == share &&
+          NULL != HgfsNotifyIsPathBelow(watch->path, dir)) {
+         HgfsNotifyFreeWatch(watch, TRUE);
+      }
+   }
+   free(dir);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyTrackMove --
+ *
+ *    Follow a directory renamed from or to a watched directory. The
+ *    IN_MOVED_FROM is remembered by its cookie, the IN_MOVED_TO with the
+ *    same cookie in the same shared folder renames the watches below it.
+ *
+ *    Caller should hold gHgfsNotify.lock.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Memory allocation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyTrackMove(const struct inotify_event *event)  // IN: inotify event
+{
+   const char *name = (event->len > 0) ? event->name : "";
+   HgfsNotifyWatch *watch;
+
+   for (watch = HgfsNotifyLookupWd(event->wd);
+        NULL != watch;
+        watch = watch->nextByWd) {
+      char *path = HgfsNotifyBuildPath(watch->path, name);
+
+      if (event->mask & IN_MOVED_FROM) {
+         HgfsNotifyMove *move = Util_SafeCalloc(1, sizeof *move);
+
+         DblLnkLst_Init(&move->links);
+         move->cookie = event->cookie;
+         move->share = watch->share;
+         move->path = path;
+         move->batch = gHgfsNotify.batch;
+         DblLnkLst_LinkLast(&gHgfsNotify.moves, &move->links);
+      } else {
+         DblLnkLst_Links *link;
+
+         DblLnkLst_ForEach(link, &gHgfsNotify.moves) {
+            HgfsNotifyMove *move = DblLnkLst_Container(link, HgfsNotifyMove,
+                                                       links);
+
+            if (move->cookie == event->cookie && move->share == watch->share) {
+               HgfsNotifyRenameTree(watch->share, move->path, path);
+               DblLnkLst_Unlink1(&move->links);
+               free(move->path);
+               free(move);
+               break;
+            }
+         }
+         free(path);
+      }
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyExpireMoves --
+ *
+ *    Forget the moves whose IN_MOVED_TO did not come in the batch of their
+ *    IN_MOVED_FROM or the next one: the directory left the watched
+ *    directories, its own watch, if any, is dropped on its IN_MOVE_SELF.
+ *
+ *    Caller should hold gHgfsNotify.lock.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Memory is freed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyExpireMoves(Bool all)  // IN: forget all the moves
+{
+   DblLnkLst_Links *link, *nextLink;
+
+   DblLnkLst_ForEachSafe(link, nextLink, &gHgfsNotify.moves) {
+      HgfsNotifyMove *move = DblLnkLst_Container(link, HgfsNotifyMove, links);
+
+      if (all || move->batch != gHgfsNotify.batch) {
+         DblLnkLst_Unlink1(&move->links);
+         free(move->path);
+         free(move);
+      }
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyMovedSelf --
+ *
+ *    A watched directory was moved. If the move was followed the watch
+ *    already has its new path, otherwise the directory went where it is not
+ *    watched from and its watches no longer match their paths.
+ *
+ *    Caller should hold gHgfsNotify.lock.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    May remove watches.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyMovedSelf(int wd)  // IN: inotify watch descriptor
+{
+   HgfsNotifyWatch *watch = HgfsNotifyLookupWd(wd);
+
+   while (NULL != watch) {
+      if (watch->moved) {
+         watch->moved = FALSE;
+         watch = watch->nextByWd;
+      } else {
+         HgfsNotifyRemoveTree(watch->share, watch->path);
+         /* Other watches of the chain may be gone too, start over. */
+         watch = HgfsNotifyLookupWd(wd);
+      }
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyQueueDelivery --
+ *
+ *    Add an event for a subscriber to the batch being built. An event that
+ *    repeats one already queued for the subscriber (e.g. a stream of writes
+ *    to a file) is coalesced with it.
+ *
+ *    Caller should hold gHgfsNotify.lock.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Memory allocation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyQueueDelivery(HgfsNotifySubscriber *subscriber,  // IN: subscriber
+                        const char *name,                  // IN: relative name
+                        uint32 events,                     // IN: HGFS_NOTIFY_* events
+                        HgfsNotifyDelivery **batch,        // IN/OUT: batch
+                        uint32 *batchSize,                 // IN/OUT: events in batch
+                        uint32 *batchCapacity)             // IN/OUT: batch slots
+{
+   HgfsNotifyDelivery *delivery;
+   uint32 i;
+
+   for (i = *batchSize; i > 0; i--) {
+      delivery = &(*batch)[i - 1];
+      if (delivery->subscriber == subscriber->handle) {
+         if (delivery->mask == events && strcmp(delivery->name, name) == 0) {
+            return;
+         }
+         break;
+      }
+   }
+
+   if (*batchSize == HGFS_NOTIFY_MAX_BATCH_EVENTS) {
+      subscriber->overflowed = TRUE;
+      return;
+   }
+
+   if (*batchSize == *batchCapacity) {
+      *batchCapacity = (0 == *batchCapacity) ? 32 : *batchCapacity * 2;
+      *batch = Util_SafeRealloc(*batch, *batchCapacity * sizeof **batch);
+   }
+
+   delivery = &(*batch)[(*batchSize)++];
+   delivery->eventCb = subscriber->eventCb;
+   delivery->share = subscriber->share->handle;
+   delivery->subscriber = subscriber->handle;
+   delivery->session = subscriber->session;
+   delivery->name = Util_SafeStrdup(name);
+   delivery->mask = events;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyProcessEvent --
+ *
+ *    Translate one inotify event for all the subscribers it concerns.
+ *
+ *    Caller should hold gHgfsNotify.lock.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    May add or remove watches.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyProcessEvent(const struct inotify_event *event,  // IN: inotify event
+                       HgfsNotifyDelivery **batch,         // IN/OUT: batch
+                       uint32 *batchSize,                  // IN/OUT: events in batch
+                       uint32 *batchCapacity)              // IN/OUT: batch slots
+{
+   DblLnkLst_Links *link;
+   HgfsNotifyWatch *watch;
+   HgfsNotifyWatch *nextWatch;
+
+   if (event->mask & IN_Q_OVERFLOW) {
+      /* The kernel queue overflowed: every subscriber may have lost events. */
+      DblLnkLst_ForEach(link, &gHgfsNotify.shares) {
+         HgfsNotifyShare *share = DblLnkLst_Container(link, HgfsNotifyShare, links);
+         DblLnkLst_Links *subLink;
+
+         DblLnkLst_ForEach(subLink, &share->subscribers) {
+            DblLnkLst_Container(subLink, HgfsNotifySubscriber, links)->overflowed = TRUE;
+         }
+      }
+      return;
+   }
+
+   /* Renamed directories keep their watches, under their new paths. */
+   if ((event->mask & (IN_MOVED_FROM | IN_MOVED_TO)) && (event->mask & IN_ISDIR)) {
+      HgfsNotifyTrackMove(event);
+   }
+
+   for (watch = HgfsNotifyLookupWd(event->wd); NULL != watch; watch = nextWatch) {
+      const char *name = (event->len > 0) ? event->name : "";
+      uint32 events = HgfsNotifyMaskToEvents(event->mask);
+      DblLnkLst_Links *subLink;
+      char *newDir = NULL;
+
+      nextWatch = watch->nextByWd;
+
+      if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && (event->mask & IN_ISDIR)) {
+         newDir = HgfsNotifyBuildPath(watch->path, name);
+      }
+
+      DblLnkLst_ForEach(subLink, &watch->share->subscribers) {
+         HgfsNotifySubscriber *subscriber =
+            DblLnkLst_Container(subLink, HgfsNotifySubscriber, links);
+         const char *subPath = HgfsNotifyIsInSubtree(subscriber, watch->path);
+         uint32 subEvents;
+         char *relName;
+
+         if (NULL == subPath) {
+            continue;
+         }
+
+         /* Keep watching new directories for recursive subscribers. */
+         if (NULL != newDir && subscriber->recursive) {
+            uint32 mask = HgfsNotifyFilterToMask(subscriber->eventFilter);
+
+            if (HgfsNotifyAddWatch(watch->share, newDir, mask)) {
+               HgfsNotifyAddTreeWatches(watch->share, newDir, mask);
+            }
+         }
+
+         /* The watched directory itself only matters to its subscribers. */
+         if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+            if ('\0' != *subPath) {
+               continue;
+            }
+            subEvents = events;
+         } else {
+            subEvents = events & subscriber->eventFilter;
+         }
+         if (0 == subEvents) {
+            continue;
+         }
+
+         relName = HgfsNotifyBuildPath(subPath, name);
+         HgfsNotifyQueueDelivery(subscriber, relName, subEvents, batch,
+                                 batchSize, batchCapacity);
+         free(relName);
+      }
+      free(newDir);
+
+      if (event->mask & IN_IGNORED) {
+         /* The directory is gone and the kernel removed the watch. */
+         HgfsNotifyFreeWatch(watch, FALSE);
+      }
+   }
+
+   if (event->mask & IN_MOVE_SELF) {
+      HgfsNotifyMovedSelf(event->wd);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyDeliverBatch --
+ *
+ *    Build and deliver the events for one read of the inotify queue,
+ *    followed by one HGFS_NOTIFY_EVENTS_DROPPED event for each subscriber
+ *    that lost events.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Calls the subscribers' callbacks.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNotifyDeliverBatch(const char *buffer,  // IN: inotify events
+                       size_t bufferSize)   // IN: bytes in buffer
+{
+   HgfsNotifyDelivery *batch = NULL;
+   uint32 batchSize = 0;
+   uint32 batchCapacity = 0;
+   DblLnkLst_Links *link;
+   size_t offset;
+   uint32 i;
+
+   MXUser_AcquireExclLock(gHgfsNotify.deliveryLock);
+   MXUser_AcquireExclLock(gHgfsNotify.lock);
+
+   for (offset = 0; offset < bufferSize; ) {
+      const struct inotify_event *event =
+         (const struct inotify_event *)(buffer + offset);
+
+      if (!gHgfsNotify.syncDeactivated) {
+         HgfsNotifyProcessEvent(event, &batch, &batchSize, &batchCapacity);
+      }
+      offset += sizeof *event + event->len;
+   }
+   HgfsNotifyExpireMoves(FALSE);
+   gHgfsNotify.batch++;
+
+   DblLnkLst_ForEach(link, &gHgfsNotify.shares) {
+      HgfsNotifyShare *share = DblLnkLst_Container(link, HgfsNotifyShare, links);
+      DblLnkLst_Links *subLink;
+
+      DblLnkLst_ForEach(subLink, &share->subscribers) {
+         HgfsNotifySubscriber *subscriber =
+            DblLnkLst_Container(subLink, HgfsNotifySubscriber, links);
+
+         if (subscriber->overflowed) {
+            subscriber->overflowed = FALSE;
+            if (batchSize == batchCapacity) {
+               batchCapacity = (0 == batchCapacity) ? 32 : batchCapacity * 2;
+               batch = Util_SafeRealloc(batch, batchCapacity * sizeof *batch);
+            }
+            batch[batchSize].eventCb = subscriber->eventCb;
+            batch[batchSize].share = share->handle;
+            batch[batchSize].subscriber = subscriber->handle;
+            batch[batchSize].session = subscriber->session;
+            batch[batchSize].name = NULL;
+            batch[batchSize].mask = HGFS_NOTIFY_EVENTS_DROPPED;
+            batchSize++;
+         }
+      }
+   }
+
+   MXUser_ReleaseExclLock(gHgfsNotify.lock);
+
+   LOG(4, ("%s: delivering %u events\n", __FUNCTION__, batchSize));
+   for (i = 0; i < batchSize; i++) {
+      batch[i].eventCb(batch[i].share, batch[i].subscriber, batch[i].name,
+                       batch[i].mask, batch[i].session);
+      free(batch[i].name);
+   }
+   free(batch);
+
+   MXUser_ReleaseExclLock(gHgfsNotify.deliveryLock);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotifyReader --
+ *
+ *    Reader thread body: read and deliver inotify events until woken up
+ *    through the wakeup pipe.
+ *
+ * Results:
+ *    NULL.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void *
+HgfsNotifyReader(void *unused)  // IN: unused
+{
+   /* Room for many events at once, aligned for struct inotify_event. */
+   char buffer[64 * 1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+   for (;;) {
+      struct pollfd fds[2];
+      ssize_t bytesRead;
+
+      fds[0].fd = gHgfsNotify.inotifyFd;
+      fds[0].events = POLLIN;
+      fds[1].fd = gHgfsNotify.wakeupPipe[0];
+      fds[1].events = POLLIN;
+
+      if (poll(fds, ARRAYSIZE(fds), -1) < 0) {
+         if (errno == EINTR) {
+            continue;
+         }
+         LOG(4, ("%s: poll failed: %s\n", __FUNCTION__, strerror(errno)));
+         break;
+      }
+      if (fds[1].revents != 0) {
+         break;
+      }
+
+      bytesRead = read(gHgfsNotify.inotifyFd, buffer, sizeof buffer);
+      if (bytesRead < 0) {
+         if (errno == EINTR || errno == EAGAIN) {
+            continue;
+         }
+         LOG(4, ("%s: read failed: %s\n", __FUNCTION__, strerror(errno)));
+         break;
+      }
+      HgfsNotifyDeliverBatch(buffer, bytesRead);
+   }
+
+   return NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotify_Init --
+ *
+ *    Initialization for the notification component: creates the inotify
+ *    instance and starts the reader thread.
+ *
+ * Results:
+ *    HGFS_STATUS_SUCCESS or an error if inotify is not available.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsInternalStatus
+HgfsNotify_Init(void)
+{
+   HgfsInternalStatus status;
+
+   ASSERT(!gHgfsNotifyInitialized);
+
+   gHgfsNotify.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+   if (gHgfsNotify.inotifyFd < 0) {
+      status = errno;
+      LOG(4, ("%s: inotify_init1 failed: %s\n", __FUNCTION__, strerror(status)));
+      return status;
+   }
+
+   if (pipe(gHgfsNotify.wakeupPipe) < 0) {
+      status = errno;
+      LOG(4, ("%s: pipe failed: %s\n", __FUNCTION__, strerror(status)));
+      close(gHgfsNotify.inotifyFd);
+      return status;
+   }
+
+   gHgfsNotify.lock = MXUser_CreateExclLock("hgfsNotifyLock",
+                                            RANK_hgfsNotifyLock);
+   gHgfsNotify.deliveryLock = MXUser_CreateExclLock("hgfsNotifyDeliveryLock",
+                                                    RANK_hgfsNotifyDeliveryLock);
+   DblLnkLst_Init(&gHgfsNotify.shares);
+   DblLnkLst_Init(&gHgfsNotify.watches);
+   DblLnkLst_Init(&gHgfsNotify.moves);
+   gHgfsNotify.watchesByWd = HashTable_Alloc(HGFS_NOTIFY_WD_TABLE_SIZE,
+                                             HASH_INT_KEY, NULL);
+   gHgfsNotify.batch = 0;
+   gHgfsNotify.nextShareHandle = 0;
+   gHgfsNotify.nextSubscriberHandle = 0;
+   gHgfsNotify.syncDeactivated = FALSE;
+
+   status = pthread_create(&gHgfsNotify.reader, NULL, HgfsNotifyReader, NULL);
+   if (0 != status) {
+      LOG(4, ("%s: failed to start the reader: %s\n", __FUNCTION__,
+              strerror(status)));
+      HashTable_Free(gHgfsNotify.watchesByWd);
+      MXUser_DestroyExclLock(gHgfsNotify.deliveryLock);
+      MXUser_DestroyExclLock(gHgfsNotify.lock);
+      close(gHgfsNotify.wakeupPipe[0]);
+      close(gHgfsNotify.wakeupPipe[1]);
+      close(gHgfsNotify.inotifyFd);
+      return status;
+   }
+
+   gHgfsNotifyInitialized = TRUE;
+
+   return HGFS_STATUS_SUCCESS;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotify_Exit --
+ *
+ *    Exit for the notification component: stops the reader thread and
+ *    frees all shared folders, subscribers and watches.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsNotify_Exit(void)
+{
+   DblLnkLst_Links *link, *nextLink;
+
+   if (!gHgfsNotifyInitialized) {
+      return;
+   }
+
+   if (write(gHgfsNotify.wakeupPipe[1], "x", 1) != 1) {
+      LOG(4, ("%s: failed to wake up the reader\n", __FUNCTION__));
+   }
+   pthread_join(gHgfsNotify.reader, NULL);
+
+   DblLnkLst_ForEachSafe(link, nextLink, &gHgfsNotify.shares) {
+      HgfsNotify_RemoveSharedFolder(
+         DblLnkLst_Container(link, HgfsNotifyShare, links)->handle);
+   }
+   ASSERT(!DblLnkLst_IsLinked(&gHgfsNotify.watches));
+   HgfsNotifyExpireMoves(TRUE);
+   HashTable_Free(gHgfsNotify.watchesByWd);
+
+   close(gHgfsNotify.wakeupPipe[0]);
+   close(gHgfsNotify.wakeupPipe[1]);
+   close(gHgfsNotify.inotifyFd);
+   MXUser_DestroyExclLock(gHgfsNotify.deliveryLock);
+   MXUser_DestroyExclLock(gHgfsNotify.lock);
+
+   gHgfsNotifyInitialized = FALSE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotify_Deactivate --
+ *
+ *    Deactivates generating file system change notifications. Events that
+ *    occur while the server is check point synchronizing are dropped.
+ *    Watches only exist while there are subscribers so there is nothing to
+ *    do for HGFS_NOTIFY_REASON_SUBSCRIBERS.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsNotify_Deactivate(HgfsNotifyActivateReason reason) // IN: reason
+{
+   if (HGFS_NOTIFY_REASON_SERVER_SYNC == reason) {
+      MXUser_AcquireExclLock(gHgfsNotify.lock);
+      gHgfsNotify.syncDeactivated = TRUE;
+      MXUser_ReleaseExclLock(gHgfsNotify.lock);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotify_Activate --
+ *
+ *    Activates generating file system change notifications.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsNotify_Activate(HgfsNotifyActivateReason reason) // IN: reason
+{
+   if (HGFS_NOTIFY_REASON_SERVER_SYNC == reason) {
+      MXUser_AcquireExclLock(gHgfsNotify.lock);
+      gHgfsNotify.syncDeactivated = FALSE;
+      MXUser_ReleaseExclLock(gHgfsNotify.lock);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotify_AddSharedFolder --
+ *
+ *    Allocates memory and initializes new shared folder structure.
+ *    Nothing is watched until a subscriber is added.
+ *
+ * Results:
+ *    Opaque handle for the new shared folder.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsSharedFolderHandle
+HgfsNotify_AddSharedFolder(const char *path,       // IN: path in the host
+                           const char *shareName)  // IN: name of the shared folder
+{
+   HgfsNotifyShare *share;
+   size_t pathLen = strlen(path);
+
+   share = Util_SafeCalloc(1, sizeof *share);
+   DblLnkLst_Init(&share->links);
+   DblLnkLst_Init(&share->subscribers);
+   /* The share of all host drives has an empty path: the host root. */
+   share->path = Util_SafeStrdup('\0' == *path ? "/" : path);
+   share->shareName = Util_SafeStrdup(shareName);
+   pathLen = strlen(share->path);
+
+   /* Watch paths are joined with a separator. */
+   while (pathLen > 1 && share->path[pathLen - 1] == '/') {
+      share->path[--pathLen] = '\0';
+   }
+
+   MXUser_AcquireExclLock(gHgfsNotify.lock);
+   share->handle = gHgfsNotify.nextShareHandle++;
+   if (HGFS_INVALID_FOLDER_HANDLE == share->handle) {
+      share->handle = gHgfsNotify.nextShareHandle++;
+   }
+   DblLnkLst_LinkLast(&gHgfsNotify.shares, &share->links);
+   MXUser_ReleaseExclLock(gHgfsNotify.lock);
+
+   LOG(4, ("%s: share %s (%s) handle %u\n", __FUNCTION__, shareName, path,
+           share->handle));
+
+   return share->handle;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotify_AddSubscriber --
+ *
+ *    Allocates memory and initializes new subscriber structure.
+ *    Inserts allocated subscriber into the shared folder's table and
+ *    watches its directory, and for a recursive subscriber all the
+ *    directories below it.
+ *
+ * Results:
+ *    Opaque subscriber handle for the new subscriber or HGFS_INVALID_SUBSCRIBER_HANDLE
+ *    if adding subscriber fails.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsSubscriberHandle
+HgfsNotify_AddSubscriber(HgfsSharedFolderHandle sharedFolder, // IN: shared folder handle
+                         const char *path,                    // IN: relative path
+                         uint32 eventFilter,                  // IN: event filter
+                         uint32 recursive,                    // IN: look in subfolders
+                         HgfsNotifyEventReceiveCb eventCb,    // IN notification callback
+                         struct HgfsSessionInfo *session)     // IN: server context
+{
+   HgfsSubscriberHandle result = HGFS_INVALID_SUBSCRIBER_HANDLE;
+   HgfsNotifySubscriber *subscriber;
+   HgfsNotifyShare *share;
+   uint32 mask;
+   size_t pathLen;
+
+   MXUser_AcquireExclLock(gHgfsNotify.lock);
+
+   share = HgfsNotifyFindShare(sharedFolder);
+   if (NULL == share) {
+      LOG(4, ("%s: no shared folder for handle %u\n", __FUNCTION__,
+              sharedFolder));
+      goto exit;
+   }
+
+   subscriber = Util_SafeCalloc(1, sizeof *subscriber);
+   DblLnkLst_Init(&subscriber->links);
+   subscriber->share = share;
+   subscriber->eventFilter = eventFilter;
+   subscriber->recursive = recursive != 0;
+   subscriber->eventCb = eventCb;
+   subscriber->session = session;
+
+   /* Relative paths are kept without leading and trailing separators. */
+   while ('/' == *path) {
+      path++;
+   }
+   subscriber->path = Util_SafeStrdup(path);
+   pathLen = strlen(subscriber->path);
+   while (pathLen > 0 && subscriber->path[pathLen - 1] == '/') {
+      subscriber->path[--pathLen] = '\0';
+   }
+
+   mask = HgfsNotifyFilterToMask(eventFilter);
+   if (!HgfsNotifyAddWatch(share, subscriber->path, mask)) {
+      free(subscriber->path);
+      free(subscriber);
+      goto exit;
+   }
+   if (subscriber->recursive) {
+      HgfsNotifyAddTreeWatches(share, subscriber->path, mask);
+   }
+
+   subscriber->handle = gHgfsNotify.nextSubscriberHandle++;
+   if (HGFS_INVALID_SUBSCRIBER_HANDLE == subscriber->handle) {
+      subscriber->handle = gHgfsNotify.nextSubscriberHandle++;
+   }
+   DblLnkLst_LinkLast(&share->subscribers, &subscriber->links);
+   result = subscriber->handle;
+
+exit:
+   MXUser_ReleaseExclLock(gHgfsNotify.lock);
+
+   LOG(4, ("%s: share %u path \"%s\" filter %#x recursive %u: %"FMT64"x\n",
+           __FUNCTION__, sharedFolder, path, eventFilter, recursive, result));
+   return result;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotify_RemoveSharedFolder --
+ *
+ *    Deallcates memory used by shared folder and performs necessary cleanup.
+ *    Also deletes all subscribers that are defined for the shared folder.
+ *
+ * Results:
+ *    TRUE if the shared folder was found.
+ *
+ * Side effects:
+ *    Removes all subscribers that correspond to the shared folder and invalidates
+ *    thier handles.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsNotify_RemoveSharedFolder(HgfsSharedFolderHandle sharedFolder) // IN
+{
+   DblLnkLst_Links *link, *nextLink;
+   HgfsNotifyShare *share;
+
+   MXUser_AcquireExclLock(gHgfsNotify.lock);
+
+   share = HgfsNotifyFindShare(sharedFolder);
+   if (NULL != share) {
+      DblLnkLst_ForEachSafe(link, nextLink, &share->subscribers) {
+         HgfsNotifyFreeSubscriber(
+            DblLnkLst_Container(link, HgfsNotifySubscriber, links));
+      }
+      HgfsNotifyCollectWatches();
+      DblLnkLst_Unlink1(&share->links);
+   }
+
+   MXUser_ReleaseExclLock(gHgfsNotify.lock);
+
+   if (NULL == share) {
+      return FALSE;
+   }
+
+   free(share->path);
+   free(share->shareName);
+   free(share);
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotify_RemoveSubscriber --
+ *
+ *    Deallcates memory used by NotificationSubscriber and performs necessary cleanup.
+ *
+ * Results:
+ *    TRUE if the subscriber was found.
+ *
+ * Side effects:
+ *    Waits for the delivery of the current batch of events.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsNotify_RemoveSubscriber(HgfsSubscriberHandle subscriber) // IN
+{
+   DblLnkLst_Links *link;
+   Bool found = FALSE;
+
+   MXUser_AcquireExclLock(gHgfsNotify.deliveryLock);
+   MXUser_AcquireExclLock(gHgfsNotify.lock);
+
+   DblLnkLst_ForEach(link, &gHgfsNotify.shares) {
+      HgfsNotifyShare *share = DblLnkLst_Container(link, HgfsNotifyShare, links);
+      DblLnkLst_Links *subLink;
+
+      DblLnkLst_ForEach(subLink, &share->subscribers) {
+         HgfsNotifySubscriber *current =
+            DblLnkLst_Container(subLink, HgfsNotifySubscriber, links);
+
+         if (current->handle == subscriber) {
+            HgfsNotifyFreeSubscriber(current);
+            found = TRUE;
+            break;
+         }
+      }
+      if (found) {
+         break;
+      }
+   }
+   if (found) {
+      HgfsNotifyCollectWatches();
+   }
+
+   MXUser_ReleaseExclLock(gHgfsNotify.lock);
+   MXUser_ReleaseExclLock(gHgfsNotify.deliveryLock);
+
+   return found;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNotify_RemoveSessionSubscribers --
+ *
+ *    Removes all entries that are related to a particular session.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Waits for the delivery of the current batch of events, no callback
+ *    for the session runs once this returns.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsNotify_RemoveSessionSubscribers(struct HgfsSessionInfo *session) // IN
+{
+   DblLnkLst_Links *link;
+
+   MXUser_AcquireExclLock(gHgfsNotify.deliveryLock);
+   MXUser_AcquireExclLock(gHgfsNotify.lock);
+
+   DblLnkLst_ForEach(link, &gHgfsNotify.shares) {
+      HgfsNotifyShare *share = DblLnkLst_Container(link, HgfsNotifyShare, links);
+      DblLnkLst_Links *subLink, *nextSubLink;
+
+      DblLnkLst_ForEachSafe(subLink, nextSubLink, &share->subscribers) {
+         HgfsNotifySubscriber *subscriber =
+            DblLnkLst_Container(subLink, HgfsNotifySubscriber, links);
+
+         if (subscriber->session == session) {
+            HgfsNotifyFreeSubscriber(subscriber);
+         }
+      }
+   }
+   HgfsNotifyCollectWatches();
+
+   MXUser_ReleaseExclLock(gHgfsNotify.lock);
+   MXUser_ReleaseExclLock(gHgfsNotify.deliveryLock);
+}
@@ -47,6 +47,10 @@
 #include "hgfsServerParameters.h"
 #include "hgfsServerOplock.h"
 #include "hgfsDirNotify.h"
+#include "hgfsThreadpool.h"
+#include "hgfsServerStats.h"
+#include "hostinfo.h"
+#include "hashTable.h"
 #include "userlock.h"
 #include "poll.h"
 #include "mutexRankLib.h"
@@ -128,6 +132,19 @@
 /* Default maximun number of open nodes that have server locks. */
 #define MAX_LOCKED_FILENODES 10
 
+/*
+ * Nodes or searches of a session examined per hold of its array lock when
+ * invalidating its objects, so that its requests are not held off for the
+ * whole invalidation.
+ */
+#define HGFS_INVALIDATE_BATCH 64
+
+/* Buckets of the session id index of a transport session. */
+#define HGFS_SESSION_TABLE_SIZE 64
+
+/* Size of a session id index key: 16 hex digits. */
+#define HGFS_SESSION_KEY_SIZE 17
+
 
 struct HgfsTransportSessionInfo {
    /* Default session id. */
@@ -139,6 +156,9 @@ struct HgfsTransportSessionInfo {
    /* List of sessions */
    DblLnkLst_Links sessionArray;
 
+   /* Sessions of the list indexed by session id, see HgfsServerSessionKey. */
+   HashTable *sessionTable;
+
    /* Max packet size that is supported by both client and server. */
    uint32 maxPacketSize;
 
@@ -175,6 +195,8 @@ typedef struct HgfsInputParam {
    HgfsOp op;                    /* Hgfs operation command code */
    uint32 id;                    /* Request ID to be matched with the reply */
    Bool sessionEnabled;          /* Requests have session enabled headers */
+   VmTimeType receiveTimeUS;     /* When the request was received */
+   Bool compoundRequest;         /* Reply goes into a compound reply */
 } HgfsInputParam;
 
 /*
@@ -183,7 +205,11 @@ typedef struct HgfsInputParam {
  */
 static HgfsServerConfig gHgfsCfgSettings = {
    (HGFS_CONFIG_NOTIFY_ENABLED | HGFS_CONFIG_VOL_INFO_MIN),
-   HGFS_MAX_CACHED_FILENODES
+   HGFS_MAX_CACHED_FILENODES,
+   HGFS_DEFAULT_WORKER_THREADS,
+   HGFS_DEFAULT_MAX_ASYNC_REQUESTS,
+   HGFS_DEFAULT_MAX_READ_AHEAD_BYTES,
+   HGFS_DEFAULT_MAX_WRITE_BEHIND_BYTES
 };
 
 /*
@@ -194,11 +220,120 @@ static Atomic_uint32 hgfsHandleCounter = {0};
 
 /*
  * Number of outstanding asynchronous operations.
+ *
+ * gHgfsAsyncVar is also broadcast when the last asynchronous request of a
+ * session completes, see HgfsServerAsyncDrainSession.
  */
 static Atomic_uint32 gHgfsAsyncCounter = {0};
 static MXUserExclLock *gHgfsAsyncLock;
 static MXUserCondVar  *gHgfsAsyncVar;
 
+/* TRUE if asynchronous requests are processed by the worker threads. */
+static Bool gHgfsThreadpoolActive = FALSE;
+
+/* Adaptation of the open node cache bound, see HgfsNodeCacheAdapt. */
+#define HGFS_NODE_CACHE_ADAPT_LOOKUPS   64
+#define HGFS_NODE_CACHE_MISS_RATIO      8     /* Grow above 1 miss in 8. */
+#define HGFS_NODE_CACHE_MAX_NODES       1024
+
+/* Bounds of the read-ahead window of a node, see HgfsServerReadAhead. */
+#define HGFS_READ_AHEAD_MIN_WINDOW   (128 * 1024)
+#define HGFS_READ_AHEAD_MAX_WINDOW   (4 * 1024 * 1024)
+
+/*
+ * Streams not read for that long give their hinted bytes back. The streams
+ * of a session are aged at most every HGFS_READ_AHEAD_AGE_US.
+ */
+#define HGFS_READ_AHEAD_IDLE_US      (2 * 1000 * 1000)
+#define HGFS_READ_AHEAD_AGE_US       (HGFS_READ_AHEAD_IDLE_US / 8)
+
+/*
+ * Bytes hinted for read-ahead and not yet read, over all the nodes of all
+ * the sessions. Bounded by gHgfsCfgSettings.maxReadAheadBytes.
+ */
+static Atomic_uint32 gHgfsReadAheadCharged = {0};
+
+/*
+ * Write-behind, see HgfsServerWriteBehind. Sessions having write-behind data
+ * are queued, holding a reference, until gHgfsWriteBehindTimer flushes them.
+ */
+#define HGFS_WRITE_BEHIND_DELAY_MS   200
+#define HGFS_WRITE_BEHIND_CACHE_SHARE 4  /* 1 in 4 cached nodes buffered at most. */
+
+/*
+ * Write-behind buffer of a node: holds size bytes of data to be written to
+ * fileDesc at offset, or appended, with the flags of the writes that were
+ * coalesced. error is the error of a flush not yet returned to the client.
+ * All the fields are protected by the node's lock.
+ */
+typedef struct HgfsWriteBehind {
+   DblLnkLst_Links links;   /* On the session's writeBehindNodes with data. */
+   HgfsHandle handle;       /* Of the node, to find it from that list. */
+   fileDesc fileDesc;
+   char *data;
+   uint64 offset;
+   uint32 size;
+   HgfsWriteFlags flags;
+   Bool sequential;
+   Bool append;
+   HgfsInternalStatus error;
+} HgfsWriteBehind;
+
+static MXUserExclLock *gHgfsWriteBehindLock = NULL;
+static DblLnkLst_Links gHgfsWriteBehindSessions;
+static HgfsThreadpoolTimer *gHgfsWriteBehindTimer = NULL;
+
+/*
+ * Room left in a compound reply for the next request to be run. Replies
+ * other than reads fit in the original packet size.
+ */
+#define HGFS_COMPOUND_MIN_REPLY_SPACE   HGFS_PACKET_MAX
+
+/*
+ * Resolved name cache.
+ *
+ * Maps the CPName of a request, with its case flags and share options, to
+ * the local name HgfsServerGetLocalNameInfo converted and case looked up
+ * it to. The symlink check is not cached, it is repeated on every hit.
+ *
+ * Every directory above a cached local name has an HgfsNameCacheDir that
+ * counts the entries below it and lists the entries right in it. When a
+ * name is created, renamed or deleted, the entries of the same name and
+ * those looked up case insensitively in the same directory are removed.
+ * If cached names lie below the name, the cache generation is bumped,
+ * which makes all the current entries stale. Entries are also removed when
+ * the shares change, and otherwise expire after a while so that changes
+ * made on the host are seen.
+ */
+#define HGFS_NAME_CACHE_MAX_ENTRIES   4096
+#define HGFS_NAME_CACHE_TTL_US        (5 * 1000 * 1000)
+
+typedef struct HgfsNameCacheDir {
+   char *path;
+   uint32 numBelow;            /* Entries at any depth below the directory */
+   DblLnkLst_Links entries;    /* Entries right in the directory */
+} HgfsNameCacheDir;
+
+typedef struct HgfsNameCacheEntry {
+   DblLnkLst_Links links;      /* Link in the LRU list, most recent first */
+   DblLnkLst_Links dirLinks;   /* Link in the entries of the directory */
+   HgfsNameCacheDir *dir;      /* Directory of the local name */
+   char *key;                  /* Case flags, share options and CPName */
+   Bool caseInsensitive;       /* Name was looked up case insensitively */
+   char *rootDir;              /* Share path the name was resolved in */
+   char *localName;
+   size_t localNameLen;
+   uint32 generation;
+   VmTimeType insertTimeUS;
+} HgfsNameCacheEntry;
+
+static MXUserExclLock *gHgfsNameCacheLock;
+static HashTable *gHgfsNameCache;          /* Key to HgfsNameCacheEntry */
+static HashTable *gHgfsNameCacheDirs;      /* Path to HgfsNameCacheDir */
+static DblLnkLst_Links gHgfsNameCacheLru;
+static uint32 gHgfsNameCacheNumEntries;
+static uint32 gHgfsNameCacheGeneration;
+
 static HgfsServerMgrCallbacks *gHgfsMgrData = NULL;
 
 /*
@@ -240,6 +375,14 @@ static HgfsSharedFolderHandle HgfsServerRegisterShare(const char *shareName,
                                                       const char *sharePath,
                                                       Bool addFolder);
 
+static void HgfsNameCacheInit(void);
+static void HgfsNameCacheExit(void);
+static void HgfsNameCacheFlush(void);
+static void HgfsNameCacheInvalidate(const char *localName);
+static void HgfsNameCacheInvalidateTree(const char *localName);
+static void HgfsNameCacheInvalidateHandle(HgfsHandle handle,
+                                          HgfsSessionInfo *session);
+
 /*
  * Callback table passed to transport and any channels.
  */
@@ -302,6 +445,11 @@ static Bool HgfsAddToCacheInternal(HgfsHandle handle,
 static Bool HgfsIsCachedInternal(HgfsHandle handle,
                                  HgfsSessionInfo *session);
 static Bool HgfsRemoveLruNode(HgfsSessionInfo *session);
+static void HgfsNodeCacheAdapt(HgfsSessionInfo *session);
+static HgfsNodeCacheStats *HgfsNodeCacheShareStats(char const *shareName,
+                                                   size_t shareNameLen,
+                                                   HgfsSessionInfo *session);
+static void HgfsNodeCacheStatsLog(HgfsSessionInfo *session);
 static Bool HgfsRemoveFromCacheInternal(HgfsHandle handle,
                                         HgfsSessionInfo *session);
 static void HgfsRemoveSearchInternal(HgfsSearch *search,
@@ -334,6 +482,30 @@ static HgfsFileNode *HgfsGetNewNode(HgfsSessionInfo *session);
 static HgfsHandle HgfsFileNode2Handle(HgfsFileNode const *fileNode);
 static HgfsFileNode *HgfsHandle2FileNode(HgfsHandle handle,
                                          HgfsSessionInfo *session);
+static HgfsFileNode *HgfsFileDesc2FileNode(fileDesc fd,
+                                           Bool cachedOnly,
+                                           HgfsSessionInfo *session);
+static Bool HgfsNodeIndexAlloc(uint32 numNodes,
+                               HgfsSessionInfo *session);
+static void HgfsNodeIndexInsert(HgfsFileNode *node,
+                                HgfsSessionInfo *session);
+static void HgfsNodeIndexRemove(HgfsFileNode *node,
+                                HgfsSessionInfo *session);
+static void HgfsNodeIndexUpdateFileDesc(HgfsFileNode *node,
+                                        fileDesc fd,
+                                        HgfsSessionInfo *session);
+static void HgfsServerReadAheadReset(HgfsFileNode *node);
+static void HgfsServerReadAheadAge(HgfsSessionInfo *session);
+static void HgfsServerWriteBehindReset(HgfsFileNode *node,
+                                       HgfsSessionInfo *session);
+static void HgfsServerWriteBehindFlush(HgfsWriteBehind *writeBehind,
+                                       HgfsSessionInfo *session);
+static void HgfsServerWriteBehindFlushSession(HgfsSessionInfo *session);
+static Bool HgfsServerWriteBehindIsDirty(HgfsFileNode const *node);
+static HgfsInternalStatus HgfsServerWriteBehindBarrier(HgfsInputParam *input);
+static void HgfsServerWriteBehindTimer(void *unused);
+static HgfsInternalStatus HgfsServerWriteBehindFlushHandle(HgfsHandle handle,
+                                                           HgfsSessionInfo *session);
 static void HgfsServerExitSessionInternal(HgfsSessionInfo *session);
 static Bool HgfsIsShareRoot(char const *cpName, size_t cpNameSize);
 static void HgfsServerCompleteRequest(HgfsInternalStatus status,
@@ -365,6 +537,8 @@ static Bool HgfsPacketSend(HgfsPacket *packet,
 static void HgfsServerOpen(HgfsInputParam *input);
 static void HgfsServerRead(HgfsInputParam *input);
 static void HgfsServerWrite(HgfsInputParam *input);
+static void HgfsServerCopyFileRange(HgfsInputParam *input);
+static void HgfsServerCompound(HgfsInputParam *input);
 static void HgfsServerSearchOpen(HgfsInputParam *input);
 static void HgfsServerSearchRead(HgfsInputParam *input);
 static void HgfsServerGetattr(HgfsInputParam *input);
@@ -571,6 +745,257 @@ HgfsServerGetNextHandleCounter(void)
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNodeIndexHashFileDesc --
+ *
+ *    Compute the hash of a file descriptor (OS handle) for the node index.
+ *
+ * Results:
+ *    The hash value, not yet reduced to the number of buckets.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static INLINE uint32
+HgfsNodeIndexHashFileDesc(fileDesc fd)  // IN: OS handle (file descriptor)
+{
+#ifdef _WIN32
+   /* Windows handle values are multiples of 4. */
+   return (uint32)((uintptr_t)fd >> 2);
+#else
+   return (uint32)fd;
+#endif
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNodeIndexAlloc --
+ *
+ *    (Re)build the handle and file descriptor indices of the session's node
+ *    array, sized for numNodes nodes. All in use nodes are rehashed into
+ *    the new buckets.
+ *
+ *    The indices only hold nodeArray indices so a failure here leaves the
+ *    previous (smaller) indices in place, which are still correct.
+ *
+ *    The session's nodeArrayLock should be acquired prior to calling this
+ *    function, except when the session is being created.
+ *
+ * Results:
+ *    TRUE on success, FALSE if memory could not be allocated.
+ *
+ * Side effects:
+ *    Memory allocation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsNodeIndexAlloc(uint32 numNodes,           // IN: Number of nodes to index
+                   HgfsSessionInfo *session)  // IN: Session info
+{
+   uint32 numBuckets = 1;
+   uint32 *handleBuckets;
+   uint32 *fdBuckets;
+   uint32 i;
+
+   ASSERT(session);
+
+   while (numBuckets < numNodes) {
+      numBuckets <<= 1;
+   }
+
+   handleBuckets = malloc(numBuckets * sizeof *handleBuckets);
+   fdBuckets = malloc(numBuckets * sizeof *fdBuckets);
+   if (handleBuckets == NULL || fdBuckets == NULL) {
+      LOG(4, ("%s: can't allocate %u index buckets\n", __FUNCTION__,
+              numBuckets));
+      free(handleBuckets);
+      free(fdBuckets);
+
+      return FALSE;
+   }
+
+   /* All bits set is HGFS_NODE_INDEX_INVALID. */
+   memset(handleBuckets, 0xff, numBuckets * sizeof *handleBuckets);
+   memset(fdBuckets, 0xff, numBuckets * sizeof *fdBuckets);
+
+   free(session->nodeHandleBuckets);
+   free(session->nodeFdBuckets);
+   session->nodeHandleBuckets = handleBuckets;
+   session->nodeFdBuckets = fdBuckets;
+   session->numNodeBuckets = numBuckets;
+
+   for (i = 0; i < session->numNodes; i++) {
+      if (session->nodeArray[i].state != FILENODE_STATE_UNUSED) {
+         HgfsNodeIndexInsert(&session->nodeArray[i], session);
+      }
+   }
+
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNodeIndexInsert --
+ *
+ *    Add an in use node to the handle and file descriptor indices.
+ *
+ *    The session's nodeArrayLock should be acquired prior to calling this
+ *    function.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNodeIndexInsert(HgfsFileNode *node,        // IN: file node
+                    HgfsSessionInfo *session)  // IN: session info
+{
+   uint32 nodeIndex = (uint32)(node - session->nodeArray);
+   uint32 mask = session->numNodeBuckets - 1;
+   uint32 *bucket;
+
+   ASSERT(nodeIndex < session->numNodes);
+
+   bucket = &session->nodeHandleBuckets[node->handle & mask];
+   node->handleHashNext = *bucket;
+   *bucket = nodeIndex;
+
+   bucket = &session->nodeFdBuckets[HgfsNodeIndexHashFileDesc(node->fileDesc) & mask];
+   node->fdHashNext = *bucket;
+   *bucket = nodeIndex;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNodeIndexUnlinkFileDesc --
+ *
+ *    Unlink a node from the file descriptor index chain it is on.
+ *
+ *    The session's nodeArrayLock should be acquired prior to calling this
+ *    function.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNodeIndexUnlinkFileDesc(HgfsFileNode *node,        // IN: file node
+                            HgfsSessionInfo *session)  // IN: session info
+{
+   uint32 nodeIndex = (uint32)(node - session->nodeArray);
+   uint32 mask = session->numNodeBuckets - 1;
+   uint32 *next;
+
+   next = &session->nodeFdBuckets[HgfsNodeIndexHashFileDesc(node->fileDesc) & mask];
+   while (*next != nodeIndex) {
+      ASSERT(*next != HGFS_NODE_INDEX_INVALID);
+      next = &session->nodeArray[*next].fdHashNext;
+   }
+   *next = node->fdHashNext;
+   node->fdHashNext = HGFS_NODE_INDEX_INVALID;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNodeIndexRemove --
+ *
+ *    Remove a node from the handle and file descriptor indices.
+ *
+ *    The session's nodeArrayLock should be acquired prior to calling this
+ *    function.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNodeIndexRemove(HgfsFileNode *node,        // IN: file node
+                    HgfsSessionInfo *session)  // IN: session info
+{
+   uint32 nodeIndex = (uint32)(node - session->nodeArray);
+   uint32 mask = session->numNodeBuckets - 1;
+   uint32 *next;
+
+   next = &session->nodeHandleBuckets[node->handle & mask];
+   while (*next != nodeIndex) {
+      ASSERT(*next != HGFS_NODE_INDEX_INVALID);
+      next = &session->nodeArray[*next].handleHashNext;
+   }
+   *next = node->handleHashNext;
+   node->handleHashNext = HGFS_NODE_INDEX_INVALID;
+
+   HgfsNodeIndexUnlinkFileDesc(node, session);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNodeIndexUpdateFileDesc --
+ *
+ *    Change the file descriptor of an in use node and move the node to
+ *    the matching file descriptor index chain.
+ *
+ *    The session's nodeArrayLock should be acquired prior to calling this
+ *    function.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNodeIndexUpdateFileDesc(HgfsFileNode *node,        // IN: file node
+                            fileDesc fd,               // IN: new OS handle
+                            HgfsSessionInfo *session)  // IN: session info
+{
+   uint32 nodeIndex = (uint32)(node - session->nodeArray);
+   uint32 *bucket;
+
+   HgfsNodeIndexUnlinkFileDesc(node, session);
+   node->fileDesc = fd;
+
+   bucket = &session->nodeFdBuckets[HgfsNodeIndexHashFileDesc(fd) &
+                                    (session->numNodeBuckets - 1)];
+   node->fdHashNext = *bucket;
+   *bucket = nodeIndex;
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -596,22 +1021,72 @@ static HgfsFileNode *
 HgfsHandle2FileNode(HgfsHandle handle,        // IN: Hgfs file handle
                     HgfsSessionInfo *session) // IN: Session info
 {
-   unsigned int i;
-   HgfsFileNode *fileNode = NULL;
+   uint32 i;
 
    ASSERT(session);
    ASSERT(session->nodeArray);
 
-   /* XXX: This O(n) lookup can and should be optimized. */
-   for (i = 0; i < session->numNodes; i++) {
-      if (session->nodeArray[i].state != FILENODE_STATE_UNUSED &&
-          session->nodeArray[i].handle == handle) {
-         fileNode = &session->nodeArray[i];
-         break;
+   i = session->nodeHandleBuckets[handle & (session->numNodeBuckets - 1)];
+   while (i != HGFS_NODE_INDEX_INVALID) {
+      HgfsFileNode *fileNode = &session->nodeArray[i];
+
+      ASSERT(fileNode->state != FILENODE_STATE_UNUSED);
+      if (fileNode->handle == handle) {
+         return fileNode;
+      }
+      i = fileNode->handleHashNext;
+   }
+
+   return NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsFileDesc2FileNode --
+ *
+ *    Retrieve an in use file node by its file descriptor (OS handle).
+ *
+ *    Nodes which are not cached keep the descriptor value they last had
+ *    open, so only a cached node is guaranteed to own the descriptor.
+ *
+ *    The session's nodeArrayLock should be acquired prior to calling this
+ *    function.
+ *
+ * Results:
+ *    The file node if found, NULL otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsFileNode *
+HgfsFileDesc2FileNode(fileDesc fd,               // IN: OS handle (file descriptor)
+                      Bool cachedOnly,           // IN: Only match cached nodes
+                      HgfsSessionInfo *session)  // IN: Session info
+{
+   uint32 i;
+
+   ASSERT(session);
+   ASSERT(session->nodeArray);
+
+   i = session->nodeFdBuckets[HgfsNodeIndexHashFileDesc(fd) &
+                              (session->numNodeBuckets - 1)];
+   while (i != HGFS_NODE_INDEX_INVALID) {
+      HgfsFileNode *fileNode = &session->nodeArray[i];
+
+      ASSERT(fileNode->state != FILENODE_STATE_UNUSED);
+      if (fileNode->fileDesc == fd &&
+          (!cachedOnly || fileNode->state == FILENODE_STATE_IN_USE_CACHED)) {
+         return fileNode;
       }
+      i = fileNode->fdHashNext;
    }
 
-   return fileNode;
+   return NULL;
 }
 
 
@@ -679,6 +1154,7 @@ HgfsDumpAllNodes(HgfsSessionInfo *session)  // IN: session info
           session->nodeArray[i].localId.fileId,
           session->nodeArray[i].fileDesc);
    }
+   HgfsNodeCacheStatsLog(session);
    Log("Done\n");
 }
 
@@ -710,7 +1186,7 @@ HgfsHandle2FileDesc(HgfsHandle handle,        // IN: Hgfs file handle
    Bool found = FALSE;
    HgfsFileNode *fileNode = NULL;
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   MXUser_AcquireForRead(session->nodeArrayLock);
    fileNode = HgfsHandle2FileNode(handle, session);
    if (fileNode == NULL) {
       goto exit;
@@ -723,7 +1199,7 @@ HgfsHandle2FileDesc(HgfsHandle handle,        // IN: Hgfs file handle
    found = TRUE;
 
 exit:
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
 
    return found;
 }
@@ -755,7 +1231,7 @@ HgfsHandle2AppendFlag(HgfsHandle handle,        // IN: Hgfs file handle
    Bool found = FALSE;
    HgfsFileNode *fileNode = NULL;
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   MXUser_AcquireForRead(session->nodeArrayLock);
    fileNode = HgfsHandle2FileNode(handle, session);
    if (fileNode == NULL) {
       goto exit;
@@ -765,7 +1241,7 @@ HgfsHandle2AppendFlag(HgfsHandle handle,        // IN: Hgfs file handle
    found = TRUE;
 
 exit:
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
 
    return found;
 }
@@ -799,7 +1275,7 @@ HgfsHandle2LocalId(HgfsHandle handle,        // IN: Hgfs file handle
 
    ASSERT(localId);
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   MXUser_AcquireForRead(session->nodeArrayLock);
    fileNode = HgfsHandle2FileNode(handle, session);
    if (fileNode == NULL) {
       goto exit;
@@ -811,7 +1287,7 @@ HgfsHandle2LocalId(HgfsHandle handle,        // IN: Hgfs file handle
    found = TRUE;
 
 exit:
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
 
    return found;
 }
@@ -839,26 +1315,21 @@ HgfsFileDesc2Handle(fileDesc fd,              // IN: OS handle (file descriptor)
                     HgfsSessionInfo *session, // IN: Session info
                     HgfsHandle *handle)       // OUT: Hgfs file handle
 {
-   unsigned int i;
    Bool found = FALSE;
    HgfsFileNode *existingFileNode = NULL;
 
    ASSERT(session);
    ASSERT(session->nodeArray);
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   MXUser_AcquireForRead(session->nodeArrayLock);
 
-   for (i = 0; i < session->numNodes; i++) {
-      existingFileNode = &session->nodeArray[i];
-      if ((existingFileNode->state == FILENODE_STATE_IN_USE_CACHED) &&
-          (existingFileNode->fileDesc == fd)) {
-         *handle = HgfsFileNode2Handle(existingFileNode);
-         found = TRUE;
-         break;
-      }
+   existingFileNode = HgfsFileDesc2FileNode(fd, TRUE, session);
+   if (existingFileNode != NULL) {
+      *handle = HgfsFileNode2Handle(existingFileNode);
+      found = TRUE;
    }
 
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
 
    return found;
 }
@@ -894,7 +1365,7 @@ HgfsHandle2ShareMode(HgfsHandle handle,         // IN: Hgfs file handle
       return found;
    }
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   MXUser_AcquireForRead(session->nodeArrayLock);
 
    existingFileNode = HgfsHandle2FileNode(handle, session);
    if (existingFileNode == NULL) {
@@ -907,7 +1378,7 @@ HgfsHandle2ShareMode(HgfsHandle handle,         // IN: Hgfs file handle
    found = (nameStatus == HGFS_NAME_STATUS_COMPLETE);
 
 exit_unlock:
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
 
    return found;
 }
@@ -977,7 +1448,7 @@ HgfsHandle2FileNameMode(HgfsHandle handle,       // IN: Hgfs file handle
       return found;
    }
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   MXUser_AcquireForRead(session->nodeArrayLock);
 
    existingFileNode = HgfsHandle2FileNode(handle, session);
    if (existingFileNode == NULL) {
@@ -996,7 +1467,7 @@ HgfsHandle2FileNameMode(HgfsHandle handle,       // IN: Hgfs file handle
    found = TRUE;
 
 exit_unlock:
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
 
    *fileName = name;
    *fileNameSize = nameSize;
@@ -1037,7 +1508,7 @@ HgfsHandle2NotifyInfo(HgfsHandle handle,                    // IN: Hgfs file han
    size_t nameSize;
 
    ASSERT(fileName != NULL && fileNameSize != NULL);
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   MXUser_AcquireForRead(session->nodeArrayLock);
 
    existingFileNode = HgfsHandle2FileNode(handle, session);
    if (NULL != existingFileNode) {
@@ -1051,7 +1522,7 @@ HgfsHandle2NotifyInfo(HgfsHandle handle,                    // IN: Hgfs file han
       found = TRUE;
    }
 
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
 
    return found;
 }
@@ -1087,7 +1558,7 @@ HgfsGetNodeCopy(HgfsHandle handle,        // IN: Hgfs file handle
 
    ASSERT(copy);
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   MXUser_AcquireForRead(session->nodeArrayLock);
 
    original = HgfsHandle2FileNode(handle, session);
    if (original == NULL) {
@@ -1118,7 +1589,7 @@ HgfsGetNodeCopy(HgfsHandle handle,        // IN: Hgfs file handle
    found = TRUE;
 
 exit:
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
 
    return found;
 }
@@ -1151,7 +1622,7 @@ HgfsHandleIsSequentialOpen(HgfsHandle handle,        // IN:  Hgfs file handle
 
    ASSERT(sequentialOpen);
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   MXUser_AcquireForRead(session->nodeArrayLock);
 
    node = HgfsHandle2FileNode(handle, session);
    if (node == NULL) {
@@ -1162,7 +1633,7 @@ HgfsHandleIsSequentialOpen(HgfsHandle handle,        // IN:  Hgfs file handle
    success = TRUE;
 
 exit:
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
 
    return success;
 }
@@ -1195,7 +1666,7 @@ HgfsHandleIsSharedFolderOpen(HgfsHandle handle,        // IN:  Hgfs file handle
 
    ASSERT(sharedFolderOpen);
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   MXUser_AcquireForRead(session->nodeArrayLock);
 
    node = HgfsHandle2FileNode(handle, session);
    if (node == NULL) {
@@ -1206,7 +1677,7 @@ HgfsHandleIsSharedFolderOpen(HgfsHandle handle,        // IN:  Hgfs file handle
    success = TRUE;
 
 exit:
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
 
    return success;
 }
@@ -1239,19 +1710,19 @@ HgfsUpdateNodeFileDesc(HgfsHandle handle,        // IN: Hgfs file handle
    HgfsFileNode *node;
    Bool updated = FALSE;
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   MXUser_AcquireForWrite(session->nodeArrayLock);
 
    node = HgfsHandle2FileNode(handle, session);
    if (node == NULL) {
       goto exit;
    }
 
-   node->fileDesc = fd;
+   HgfsNodeIndexUpdateFileDesc(node, fd, session);
    node->fileCtx = fileCtx;
    updated = TRUE;
 
 exit:
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
 
    return updated;
 }
@@ -1280,27 +1751,32 @@ HgfsUpdateNodeServerLock(fileDesc fd,                // IN: OS handle
                          HgfsSessionInfo *session,   // IN: Session info
                          HgfsLockType serverLock)    // IN: new oplock
 {
-   unsigned int i;
    HgfsFileNode *existingFileNode = NULL;
+   HgfsWriteBehind *writeBehind = NULL;
+   MXUserExclLock *lock = NULL;
    Bool updated = FALSE;
 
    ASSERT(session);
    ASSERT(session->nodeArray);
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   MXUser_AcquireForWrite(session->nodeArrayLock);
 
-   for (i = 0; i < session->numNodes; i++) {
-      existingFileNode = &session->nodeArray[i];
-      if (existingFileNode->state != FILENODE_STATE_UNUSED) {
-         if (existingFileNode->fileDesc == fd) {
-            existingFileNode->serverLock = serverLock;
-            updated = TRUE;
-            break;
-         }
-      }
+   existingFileNode = HgfsFileDesc2FileNode(fd, FALSE, session);
+   if (existingFileNode != NULL) {
+      existingFileNode->serverLock = serverLock;
+      lock = existingFileNode->lock;
+      MXUser_AcquireExclLock(lock);
+      writeBehind = existingFileNode->writeBehind;
+      updated = TRUE;
    }
 
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
+
+   /* Write the data cached under the old lock before the break completes. */
+   if (NULL != lock) {
+      HgfsServerWriteBehindFlush(writeBehind, session);
+      MXUser_ReleaseExclLock(lock);
+   }
 
    return updated;
 }
@@ -1331,7 +1807,7 @@ HgfsUpdateNodeAppendFlag(HgfsHandle handle,        // IN: Hgfs file handle
    HgfsFileNode *node;
    Bool updated = FALSE;
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   MXUser_AcquireForWrite(session->nodeArrayLock);
 
    node = HgfsHandle2FileNode(handle, session);
    if (node == NULL) {
@@ -1344,7 +1820,7 @@ HgfsUpdateNodeAppendFlag(HgfsHandle handle,        // IN: Hgfs file handle
    updated = TRUE;
 
 exit:
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
 
    return updated;
 }
@@ -1555,9 +2031,11 @@ HgfsGetNewNode(HgfsSessionInfo *session)  // IN: session info
           * because if we are here, it is empty.
           */
 
-         /* Rebase the anchor of the cached file nodes list. */
+         /* Rebase the anchors of the cached and pinned file nodes lists. */
          HgfsServerRebase(session->nodeCachedList.prev, DblLnkLst_Links)
          HgfsServerRebase(session->nodeCachedList.next, DblLnkLst_Links)
+         HgfsServerRebase(session->nodePinnedList.prev, DblLnkLst_Links)
+         HgfsServerRebase(session->nodePinnedList.next, DblLnkLst_Links)
 
 #undef HgfsServerRebase
       }
@@ -1571,6 +2049,18 @@ HgfsGetNewNode(HgfsSessionInfo *session)  // IN: session info
          newMem[i].utf8Name = NULL;
          newMem[i].utf8NameLen = 0;
          newMem[i].fileCtx = NULL;
+         newMem[i].cacheStats = NULL;
+         newMem[i].lock = MXUser_CreateExclLock("HgfsFileNodeLock",
+                                                RANK_hgfsFileNodeLock);
+         newMem[i].readAheadNext = 0;
+         newMem[i].readAheadEnd = 0;
+         newMem[i].readAheadWindow = 0;
+         newMem[i].readAheadCharged = 0;
+         newMem[i].writeBehind = NULL;
+         Atomic_Write(&newMem[i].useCount, 0);
+         Atomic_Write(&newMem[i].referenced, 0);
+         newMem[i].handleHashNext = HGFS_NODE_INDEX_INVALID;
+         newMem[i].fdHashNext = HGFS_NODE_INDEX_INVALID;
 
          /* Append at the end of the list */
          DblLnkLst_LinkLast(&session->nodeFreeList, &newMem[i].links);
@@ -1578,6 +2068,12 @@ HgfsGetNewNode(HgfsSessionInfo *session)  // IN: session info
       session->nodeArray = newMem;
       session->numNodes = newNumNodes;
 
+      /*
+       * Grow the indices along with the array. On failure the existing
+       * indices remain valid, only with longer hash chains.
+       */
+      HgfsNodeIndexAlloc(newNumNodes, session);
+
       if (DOLOG(4)) {
          Log("Dumping nodes after pointer changes\n");
          HgfsDumpAllNodes(session);
@@ -1631,9 +2127,17 @@ HgfsRemoveFileNode(HgfsFileNode *node,        // IN: file node
       node->utf8Name = NULL;
    }
 
+   /* Nodes that failed initialization were never indexed. */
+   if (node->state != FILENODE_STATE_UNUSED) {
+      HgfsNodeIndexRemove(node, session);
+   }
+
    node->state = FILENODE_STATE_UNUSED;
    ASSERT(node->fileCtx == NULL);
    node->fileCtx = NULL;
+   node->cacheStats = NULL;
+   HgfsServerReadAheadReset(node);
+   HgfsServerWriteBehindReset(node, session);
 
    if (node->shareInfo.rootDir) {
       free((void*)node->shareInfo.rootDir);
@@ -1696,9 +2200,9 @@ static void
 HgfsFreeFileNode(HgfsHandle handle,         // IN: Handle to free
                  HgfsSessionInfo *session)  // IN: Session info
 {
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   MXUser_AcquireForWrite(session->nodeArrayLock);
    HgfsFreeFileNodeInternal(handle, session);
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
 }
 
 
@@ -1814,6 +2318,9 @@ HgfsAddNewFileNode(HgfsFileOpenInfo *openInfo,  // IN: open info struct
    newNode->shareInfo.readPermissions = openInfo->shareInfo.readPermissions;
    newNode->shareInfo.writePermissions = openInfo->shareInfo.writePermissions;
    newNode->shareInfo.handle = openInfo->shareInfo.handle;
+   newNode->cacheStats = HgfsNodeCacheShareStats(shareName, shareNameLen,
+                                                 session);
+   HgfsNodeIndexInsert(newNode, session);
 
    LOG(4, ("%s: got new node, handle %u\n", __FUNCTION__,
            HgfsFileNode2Handle(newNode)));
@@ -1856,8 +2363,10 @@ HgfsAddToCacheInternal(HgfsHandle handle,         // IN: HGFS file handle
       return TRUE;
    }
 
+   HgfsNodeCacheAdapt(session);
+
    /* Remove the LRU node if the list is full. */
-   if (session->numCachedOpenNodes == gHgfsCfgSettings.maxCachedOpenNodes) {
+   if (session->numCachedOpenNodes >= session->maxCachedOpenNodes) {
       if (!HgfsRemoveLruNode(session)) {
          LOG(4, ("%s: Unable to remove LRU node from cache.\n",
                  __FUNCTION__));
@@ -1866,12 +2375,13 @@ HgfsAddToCacheInternal(HgfsHandle handle,         // IN: HGFS file handle
       }
    }
 
-   ASSERT(session->numCachedOpenNodes < gHgfsCfgSettings.maxCachedOpenNodes);
+   ASSERT(session->numCachedOpenNodes < session->maxCachedOpenNodes);
 
    node = HgfsHandle2FileNode(handle, session);
    ASSERT(node);
    /* Append at the end of the list. */
    DblLnkLst_LinkLast(&session->nodeCachedList, &node->links);
+   Atomic_Write(&node->referenced, 0);
 
    node->state = FILENODE_STATE_IN_USE_CACHED;
    session->numCachedOpenNodes++;
@@ -1950,6 +2460,13 @@ HgfsRemoveFromCacheInternal(HgfsHandle handle,        // IN: Hgfs handle to the
        * Instead, we'll just await the lobotomization of the node cache to
        * really fix this.
        */
+      /*
+       * Write-behind data is written without the nodeArrayLock before the
+       * file is closed: by the close of the handle, before the session
+       * exits, and eviction and share removal skip the nodes holding some.
+       */
+      ASSERT(!HgfsServerWriteBehindIsDirty(node));
+      HgfsServerReadAheadReset(node);
       if (HgfsPlatformCloseFile(node->fileDesc, node->fileCtx)) {
          LOG(4, ("%s: Could not close fd %u\n", __FUNCTION__, node->fileDesc));
 
@@ -1964,7 +2481,7 @@ HgfsRemoveFromCacheInternal(HgfsHandle handle,        // IN: Hgfs handle to the
       * we have a problem (see bug 36244).
       */
 
-      ASSERT(session->numCachedOpenNodes < gHgfsCfgSettings.maxCachedOpenNodes);
+      ASSERT(session->numCachedOpenNodes < session->maxCachedOpenNodes);
    }
 
    return TRUE;
@@ -2048,9 +2565,9 @@ HgfsIsServerLockAllowed(HgfsSessionInfo *session)  // IN: session info
 {
    Bool allowed;
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   MXUser_AcquireForRead(session->nodeArrayLock);
    allowed = session->numCachedLockedNodes < MAX_LOCKED_FILENODES;
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
 
    return allowed;
 }
@@ -2167,6 +2684,7 @@ HgfsGetNewSearch(HgfsSessionInfo *session)  // IN: session info
          newMem[i].shareInfo.rootDirLen = 0;
          newMem[i].dents = NULL;
          newMem[i].numDents = 0;
+         newMem[i].dirStream = NULL;
 
          /* Append at the end of the list */
          DblLnkLst_LinkLast(&session->searchFreeList, &newMem[i].links);
@@ -2273,7 +2791,7 @@ HgfsGetSearchCopy(HgfsHandle handle,        // IN: Hgfs search handle
 
    ASSERT(copy);
 
-   MXUser_AcquireExclLock(session->searchArrayLock);
+   MXUser_AcquireForRead(session->searchArrayLock);
    original = HgfsSearchHandle2Search(handle, session);
    if (original == NULL) {
       goto exit;
@@ -2299,12 +2817,21 @@ HgfsGetSearchCopy(HgfsHandle handle,        // IN: Hgfs search handle
    copy->dents = NULL;
    copy->numDents = 0;
 
+   /*
+    * A lazy search shares its open directory with the copy so that the
+    * entry attributes can be looked up relative to it.
+    */
+   copy->dirStream = NULL;
+   if (NULL != original->dirStream) {
+      HgfsPlatformScandirDup(original->dirStream, &copy->dirStream);
+   }
+
    copy->handle = original->handle;
    copy->type = original->type;
    found = TRUE;
 
 exit:
-   MXUser_ReleaseExclLock(session->searchArrayLock);
+   MXUser_ReleaseRWLock(session->searchArrayLock);
 
    return found;
 }
@@ -2351,6 +2878,7 @@ HgfsAddNewSearch(char const *utf8Dir,       // IN: UTF8 name of dir to search in
 
    newSearch->dents = NULL;
    newSearch->numDents = 0;
+   newSearch->dirStream = NULL;
    newSearch->flags = 0;
    newSearch->type = type;
    newSearch->handle = HgfsServerGetNextHandleCounter();
@@ -2433,6 +2961,8 @@ HgfsRemoveSearchInternal(HgfsSearch *search,       // IN: search
            HgfsSearch2SearchHandle(search), search->utf8Dir));
 
    HgfsFreeSearchDirents(search);
+   HgfsPlatformScandirClose(search->dirStream);
+   search->dirStream = NULL;
    free(search->utf8Dir);
    free(search->utf8ShareName);
    free((char*)search->shareInfo.rootDir);
@@ -2473,7 +3003,7 @@ HgfsRemoveSearch(HgfsHandle handle,        // IN: search
    HgfsSearch *search;
    Bool success = FALSE;
 
-   MXUser_AcquireExclLock(session->searchArrayLock);
+   MXUser_AcquireForWrite(session->searchArrayLock);
 
    search = HgfsSearchHandle2Search(handle, session);
    if (search != NULL) {
@@ -2481,7 +3011,7 @@ HgfsRemoveSearch(HgfsHandle handle,        // IN: search
       success = TRUE;
    }
 
-   MXUser_ReleaseExclLock(session->searchArrayLock);
+   MXUser_ReleaseRWLock(session->searchArrayLock);
 
    return success;
 }
@@ -2514,7 +3044,7 @@ HgfsSearchHasReadAllEntries(HgfsHandle handle,        // IN:  Hgfs file handle
 
    ASSERT(NULL != readAllEntries);
 
-   MXUser_AcquireExclLock(session->searchArrayLock);
+   MXUser_AcquireForRead(session->searchArrayLock);
 
    search = HgfsSearchHandle2Search(handle, session);
    if (NULL == search) {
@@ -2525,7 +3055,7 @@ HgfsSearchHasReadAllEntries(HgfsHandle handle,        // IN:  Hgfs file handle
    success = TRUE;
 
 exit:
-   MXUser_ReleaseExclLock(session->searchArrayLock);
+   MXUser_ReleaseRWLock(session->searchArrayLock);
 
    return success;
 }
@@ -2553,7 +3083,7 @@ HgfsSearchSetReadAllEntries(HgfsHandle handle,        // IN:  Hgfs file handle
 {
    HgfsSearch *search;
 
-   MXUser_AcquireExclLock(session->searchArrayLock);
+   MXUser_AcquireForWrite(session->searchArrayLock);
 
    search = HgfsSearchHandle2Search(handle, session);
    if (NULL == search) {
@@ -2563,7 +3093,7 @@ HgfsSearchSetReadAllEntries(HgfsHandle handle,        // IN:  Hgfs file handle
    search->flags |= HGFS_SEARCH_FLAG_READ_ALL_ENTRIES;
 
 exit:
-   MXUser_ReleaseExclLock(session->searchArrayLock);
+   MXUser_ReleaseRWLock(session->searchArrayLock);
 }
 
 
@@ -2597,7 +3127,7 @@ HgfsServerGetDirEntry(HgfsHandle handle,                // IN: Handle to search
    struct DirectoryEntry *dent = NULL;
    HgfsInternalStatus status = HGFS_ERROR_SUCCESS;
 
-   MXUser_AcquireExclLock(session->searchArrayLock);
+   MXUser_AcquireForWrite(session->searchArrayLock);
 
    search = HgfsSearchHandle2Search(handle, session);
    if (search == NULL) {
@@ -2605,12 +3135,19 @@ HgfsServerGetDirEntry(HgfsHandle handle,                // IN: Handle to search
       goto out;
    }
 
-   /* No more entries or none. */
-   if (search->dents == NULL) {
+   /* No more entries or none. Lazy searches read their entries on demand. */
+   if (search->dents == NULL && search->dirStream == NULL) {
       goto out;
    }
 
    if (HGFS_SEARCH_LAST_ENTRY_INDEX == index) {
+      /* Only searches that hold all their entries know the final one. */
+      if (NULL != search->dirStream) {
+         status = HgfsPlatformScandirFinish(search);
+         if (HGFS_ERROR_SUCCESS != status || 0 == search->numDents) {
+            goto out;
+         }
+      }
       /* Set the index to the final entry. */
       index = search->numDents - 1;
    }
@@ -2621,7 +3158,7 @@ HgfsServerGetDirEntry(HgfsHandle handle,                // IN: Handle to search
                                     remove,
                                     &dent);
 out:
-   MXUser_ReleaseExclLock(session->searchArrayLock);
+   MXUser_ReleaseRWLock(session->searchArrayLock);
    *dirEntry = dent;
 
    return status;
@@ -2706,7 +3243,7 @@ HgfsUpdateNodeNames(const char *oldLocalName,  // IN: Name of file to look for
 
    newBufferLen = strlen(newLocalName);
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   MXUser_AcquireForWrite(session->nodeArrayLock);
 
    for (i = 0; i < session->numNodes; i++) {
       fileNode = &session->nodeArray[i];
@@ -2732,7 +3269,7 @@ HgfsUpdateNodeNames(const char *oldLocalName,  // IN: Name of file to look for
       }
    }
 
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
 }
 
 
@@ -2764,20 +3301,30 @@ HgfsServerClose(HgfsInputParam *input)  // IN: Input params
 
    if (HgfsUnpackCloseRequest(input->payload, input->payloadSize,
                               input->op, &file)) {
+      HgfsInternalStatus writeStatus;
+
       LOG(4, ("%s: close fh %u\n", __FUNCTION__, file));
 
+      /* The handle is closed even if the data written behind is lost. */
+      writeStatus = HgfsServerWriteBehindFlushHandle(file, input->session);
+
       if (!HgfsRemoveFromCache(file, input->session)) {
          LOG(4, ("%s: Could not remove the node from cache.\n", __FUNCTION__));
          status = HGFS_ERROR_INVALID_HANDLE;
       } else {
          HgfsFreeFileNode(file, input->session);
-         if (!HgfsPackCloseReply(input->packet, input->request, input->op,
-                                 &replyPayloadSize, input->session)) {
+         if (HGFS_ERROR_SUCCESS != writeStatus) {
+            LOG(4, ("%s: Deferred write error %d.\n", __FUNCTION__,
+                    writeStatus));
+            status = writeStatus;
+         } else if (!HgfsPackCloseReply(input->packet, input->request,
+                                        input->op, &replyPayloadSize,
+                                        input->session)) {
             status = HGFS_ERROR_INTERNAL;
          }
       }
    } else {
-      status = HGFS_ERROR_INTERNAL;
+      status = HGFS_ERROR_PROTOCOL;
    }
 
    HgfsServerCompleteRequest(status, replyPayloadSize, input);
@@ -2828,7 +3375,7 @@ HgfsServerSearchClose(HgfsInputParam *input)  // IN: Input params
          status = HGFS_ERROR_INVALID_HANDLE;
       }
    } else {
-      status = HGFS_ERROR_INTERNAL;
+      status = HGFS_ERROR_PROTOCOL;
    }
 
    HgfsServerCompleteRequest(status, replyPayloadSize, input);
@@ -2874,11 +3421,11 @@ static struct {
    { HgfsServerRename,           sizeof (HgfsRequestRenameV2),          REQ_SYNC },
 
    { HgfsServerOpen,             HGFS_SIZEOF_OP(HgfsRequestOpenV3),             REQ_SYNC },
-   { HgfsServerRead,             HGFS_SIZEOF_OP(HgfsRequestReadV3),             REQ_SYNC },
-   { HgfsServerWrite,            HGFS_SIZEOF_OP(HgfsRequestWriteV3),            REQ_SYNC },
+   { HgfsServerRead,             HGFS_SIZEOF_OP(HgfsRequestReadV3),             REQ_ASYNC},
+   { HgfsServerWrite,            HGFS_SIZEOF_OP(HgfsRequestWriteV3),            REQ_ASYNC},
    { HgfsServerClose,            HGFS_SIZEOF_OP(HgfsRequestCloseV3),            REQ_SYNC },
    { HgfsServerSearchOpen,       HGFS_SIZEOF_OP(HgfsRequestSearchOpenV3),       REQ_SYNC },
-   { HgfsServerSearchRead,       HGFS_SIZEOF_OP(HgfsRequestSearchReadV3),       REQ_SYNC },
+   { HgfsServerSearchRead,       HGFS_SIZEOF_OP(HgfsRequestSearchReadV3),       REQ_ASYNC},
    { HgfsServerSearchClose,      HGFS_SIZEOF_OP(HgfsRequestSearchCloseV3),      REQ_SYNC },
    { HgfsServerGetattr,          HGFS_SIZEOF_OP(HgfsRequestGetattrV3),          REQ_SYNC },
    { HgfsServerSetattr,          HGFS_SIZEOF_OP(HgfsRequestSetattrV3),          REQ_SYNC },
@@ -2897,12 +3444,30 @@ static struct {
     */
    { HgfsServerCreateSession,    sizeof (HgfsRequestCreateSessionV4),              REQ_SYNC},
    { HgfsServerDestroySession,   sizeof (HgfsRequestDestroySessionV4),             REQ_SYNC},
-   { HgfsServerRead,             sizeof (HgfsRequestReadV3),                       REQ_SYNC},
-   { HgfsServerWrite,            sizeof (HgfsRequestWriteV3),                      REQ_SYNC},
+   { HgfsServerRead,             sizeof (HgfsRequestReadV3),                       REQ_ASYNC},
+   { HgfsServerWrite,            sizeof (HgfsRequestWriteV3),                      REQ_ASYNC},
    { HgfsServerSetDirNotifyWatch,    sizeof (HgfsRequestSetWatchV4),               REQ_SYNC},
    { HgfsServerRemoveDirNotifyWatch, sizeof (HgfsRequestRemoveWatchV4),            REQ_SYNC},
    { NULL,                       0,                                                REQ_SYNC}, // No Op notify
-   { HgfsServerSearchRead,       sizeof (HgfsRequestSearchReadV4),                 REQ_SYNC},
+   { HgfsServerSearchRead,       sizeof (HgfsRequestSearchReadV4),                 REQ_ASYNC},
+   { NULL,                       0,                                                REQ_SYNC}, // No Op open
+   { NULL,                       0,                                                REQ_SYNC}, // No Op enumerate streams
+   { NULL,                       0,                                                REQ_SYNC}, // No Op getattr
+   { NULL,                       0,                                                REQ_SYNC}, // No Op setattr
+   { NULL,                       0,                                                REQ_SYNC}, // No Op delete
+   { NULL,                       0,                                                REQ_SYNC}, // No Op linkmove
+   { NULL,                       0,                                                REQ_SYNC}, // No Op fsctl
+   { NULL,                       0,                                                REQ_SYNC}, // No Op access check
+   { NULL,                       0,                                                REQ_SYNC}, // No Op fsync
+   { NULL,                       0,                                                REQ_SYNC}, // No Op query volume
+   { NULL,                       0,                                                REQ_SYNC}, // No Op oplock acquire
+   { NULL,                       0,                                                REQ_SYNC}, // No Op oplock break
+   { NULL,                       0,                                                REQ_SYNC}, // No Op lock byte range
+   { NULL,                       0,                                                REQ_SYNC}, // No Op unlock byte range
+   { NULL,                       0,                                                REQ_SYNC}, // No Op query EAs
+   { NULL,                       0,                                                REQ_SYNC}, // No Op set EAs
+   { HgfsServerCopyFileRange,    sizeof (HgfsRequestCopyFileRangeV4),              REQ_ASYNC},
+   { HgfsServerCompound,         sizeof (HgfsRequestCompoundV4),                   REQ_SYNC},
 
 };
 
@@ -2940,6 +3505,7 @@ HgfsServerInputAllocInit(HgfsPacket *packet,                        // IN: packe
 
    localParams = Util_SafeCalloc(1, sizeof *localParams);
 
+   localParams->receiveTimeUS = Hostinfo_SystemTimerUS();
    localParams->packet = packet;
    localParams->request = request;
    localParams->requestSize = requestSize;
@@ -3207,6 +3773,7 @@ HgfsServerCompleteRequest(HgfsInternalStatus status,   // IN: Status of the requ
    size_t replySize;
    size_t replyTotalSize;
    size_t replyHeaderSize;
+   size_t replyDataSize;
    uint64 replySessionId;
 
    if (HGFS_ERROR_SUCCESS == status) {
@@ -3247,11 +3814,21 @@ HgfsServerCompleteRequest(HgfsInternalStatus status,   // IN: Status of the requ
       goto exit;
    }
 
-   if (!HgfsPacketSend(input->packet, input->transportSession, 0)) {
+   /* The data buffer is released once the reply is sent. */
+   replyDataSize = (NULL != input->packet->dataPacket) ?
+                   input->packet->dataPacketDataSize : 0;
+
+   /* The reply of a request of a compound is sent with the compound reply. */
+   if (!input->compoundRequest &&
+       !HgfsPacketSend(input->packet, input->transportSession, 0)) {
       /* Send failed. Drop the reply. */
       Log("%s: Error sending reply\n", __FUNCTION__);
    }
 
+   HgfsServerStats_Record(input->op, input->requestSize, replySize,
+                          replyDataSize, status,
+                          Hostinfo_SystemTimerUS() - input->receiveTimeUS);
+
 exit:
    HgfsServerInputExit(input);
 }
@@ -3277,6 +3854,8 @@ static void
 HgfsServerProcessRequest(void *context)
 {
    HgfsInputParam *input = (HgfsInputParam *)context;
+   HgfsInternalStatus status;
+
    if (!input->request) {
       input->request = HSPU_GetMetaPacket(input->packet,
                                           &input->requestSize,
@@ -3284,10 +3863,196 @@ HgfsServerProcessRequest(void *context)
    }
 
    input->payload = (char *)input->request + input->payloadOffset;
+   status = HgfsServerWriteBehindBarrier(input);
+   if (HGFS_ERROR_SUCCESS != status) {
+      HgfsServerCompleteRequest(status, 0, input);
+      return;
+   }
    (*handlers[input->op].handler)(input);
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerAsyncProcessRequest --
+ *
+ *    Worker thread entry point for an asynchronous request. Processes the
+ *    request and then drops the session's count of requests in flight,
+ *    waking up any receive thread waiting for the session to drain.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    Releases the session reference taken by HgfsServerSessionReceive.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerAsyncProcessRequest(void *context)  // IN: request input params
+{
+   HgfsInputParam *input = context;
+   HgfsSessionInfo *session = input->session;
+
+   HgfsServerProcessRequest(input);
+
+   if (Atomic_ReadDec32(&session->numAsyncRequests) == 1) {
+      MXUser_AcquireExclLock(gHgfsAsyncLock);
+      MXUser_BroadcastCondVar(gHgfsAsyncVar);
+      MXUser_ReleaseExclLock(gHgfsAsyncLock);
+   }
+   HgfsServerSessionPut(session);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerAsyncDrainSession --
+ *
+ *    Wait until all asynchronous requests of the session have been replied
+ *    to.
+ *
+ *    Called before processing a synchronous request so that it is ordered
+ *    after all the earlier requests of the session, e.g. a close never
+ *    overtakes a write to the same handle still queued to a worker.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    May block the receive thread.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerAsyncDrainSession(HgfsSessionInfo *session)  // IN: session info
+{
+   if (Atomic_Read(&session->numAsyncRequests) == 0) {
+      return;
+   }
+
+   MXUser_AcquireExclLock(gHgfsAsyncLock);
+   while (Atomic_Read(&session->numAsyncRequests) != 0) {
+      MXUser_WaitCondVarExclLock(gHgfsAsyncLock, gHgfsAsyncVar);
+   }
+   MXUser_ReleaseExclLock(gHgfsAsyncLock);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerAsyncOrderKeys --
+ *
+ *    Get the handles an asynchronous request works on. The worker threads
+ *    run the requests of a handle one at a time in the order they were
+ *    received, so e.g. a read sent after a write to the same file sees the
+ *    written data, and a search read continues where the previous one
+ *    stopped.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerAsyncOrderKeys(const HgfsInputParam *input,                  // IN: request
+                         uint64 keys[HGFS_THREADPOOL_NUM_KEYS])        // OUT: handles
+{
+   keys[0] = HGFS_THREADPOOL_NO_KEY;
+   keys[1] = HGFS_THREADPOOL_NO_KEY;
+
+   switch (input->op) {
+   case HGFS_OP_READ_V3:
+   case HGFS_OP_READ_FAST_V4:
+      if (input->payloadSize >= sizeof (HgfsRequestReadV3)) {
+         keys[0] = ((const HgfsRequestReadV3 *)input->payload)->file;
+      }
+      break;
+   case HGFS_OP_WRITE_V3:
+   case HGFS_OP_WRITE_FAST_V4:
+      if (input->payloadSize >= sizeof (HgfsRequestWriteV3)) {
+         keys[0] = ((const HgfsRequestWriteV3 *)input->payload)->file;
+      }
+      break;
+   case HGFS_OP_SEARCH_READ_V3:
+      if (input->payloadSize >= sizeof (HgfsRequestSearchReadV3)) {
+         keys[0] = ((const HgfsRequestSearchReadV3 *)input->payload)->search;
+      }
+      break;
+   case HGFS_OP_SEARCH_READ_V4:
+      if (input->payloadSize >= sizeof (HgfsRequestSearchReadV4)) {
+         keys[0] = ((const HgfsRequestSearchReadV4 *)input->payload)->fid;
+      }
+      break;
+   case HGFS_OP_COPY_FILE_RANGE_V4:
+      if (input->payloadSize >= sizeof (HgfsRequestCopyFileRangeV4)) {
+         const HgfsRequestCopyFileRangeV4 *request = input->payload;
+
+         keys[0] = request->srcFile;
+         keys[1] = request->dstFile;
+      }
+      break;
+   default:
+      break;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerIsAsyncRequest --
+ *
+ *    Decide if the request is dispatched to the worker threads.
+ *
+ *    The op must be marked as asynchronous, the channel must support
+ *    replies sent from a thread other than the receive thread, and the
+ *    session must be below its bound of requests in flight. Above the bound
+ *    the request is processed on the receive thread (after draining the
+ *    session), which pushes back on the client.
+ *
+ * Results:
+ *    TRUE if the request can be processed asynchronously.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsServerIsAsyncRequest(HgfsInputParam *input)  // IN: request input params
+{
+   if (handlers[input->op].reqType != REQ_ASYNC ||
+       0 == (input->transportSession->channelCapabilities.flags &
+             HGFS_CHANNEL_ASYNC)) {
+      return FALSE;
+   }
+
+   if (!gHgfsThreadpoolActive) {
+#ifndef VMX86_TOOLS
+      return TRUE;
+#else
+      /* Tools code has no poll loop to process requests async. */
+      return FALSE;
+#endif
+   }
+
+   return input->session != NULL &&
+          Atomic_Read(&input->session->numAsyncRequests) <
+             gHgfsCfgSettings.maxAsyncRequests;
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -3352,13 +4117,15 @@ HgfsServerSessionReceive(HgfsPacket *packet,      // IN: Hgfs Packet
           (handlers[input->op].handler != NULL) &&
           (input->requestSize >= handlers[input->op].minReqSize)) {
          /* Initial validation passed, process the client request now. */
-         if ((handlers[input->op].reqType == REQ_ASYNC) &&
-             (transportSession->channelCapabilities.flags & HGFS_CHANNEL_ASYNC)) {
+         if (HgfsServerIsAsyncRequest(input)) {
              packet->state |= HGFS_STATE_ASYNC_REQUEST;
          }
          if (0 != (packet->state & HGFS_STATE_ASYNC_REQUEST)) {
+            uint64 keys[HGFS_THREADPOOL_NUM_KEYS];
+
             LOG(4, ("%s: %d: @@Async\n", __FUNCTION__, __LINE__));
-#ifndef VMX86_TOOLS
+            /* The payload is unmapped below. */
+            HgfsServerAsyncOrderKeys(input, keys);
             /*
              * Asynchronous processing is supported by the transport.
              * We can release mappings here and reacquire when needed.
@@ -3367,20 +4134,34 @@ HgfsServerSessionReceive(HgfsPacket *packet,      // IN: Hgfs Packet
             input->request = NULL;
             Atomic_Inc(&gHgfsAsyncCounter);
 
-            /* Remove pending requests during poweroff. */
-            Poll_Callback(POLL_CS_MAIN,
-                          POLL_FLAG_REMOVE_AT_POWEROFF,
-                          HgfsServerProcessRequest,
-                          input,
-                          POLL_REALTIME,
-                          1000,
-                          NULL);
+            if (gHgfsThreadpoolActive) {
+               /* The worker drops the count and the session reference. */
+               HgfsServerSessionGet(input->session);
+               Atomic_Inc(&input->session->numAsyncRequests);
+               if (!HgfsThreadpool_QueueOrderedWorkItem(
+                      HgfsServerAsyncProcessRequest, input, keys[0], keys[1])) {
+                  HgfsServerAsyncProcessRequest(input);
+               }
+            } else {
+#ifndef VMX86_TOOLS
+               /* Remove pending requests during poweroff. */
+               Poll_Callback(POLL_CS_MAIN,
+                             POLL_FLAG_REMOVE_AT_POWEROFF,
+                             HgfsServerProcessRequest,
+                             input,
+                             POLL_REALTIME,
+                             1000,
+                             NULL);
 #else
-            /* Tools code should never process request async. */
-            ASSERT(0);
+               /* Tools code should never process request async. */
+               ASSERT(0);
 #endif
+            }
          } else {
             LOG(4, ("%s: %d: ##Sync\n", __FUNCTION__, __LINE__));
+            if (NULL != input->session) {
+               HgfsServerAsyncDrainSession(input->session);
+            }
             HgfsServerProcessRequest(input);
          }
       } else {
@@ -3403,13 +4184,36 @@ HgfsServerSessionReceive(HgfsPacket *packet,      // IN: Hgfs Packet
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerSessionKey --
+ *
+ *   Format the key of a session id in the session index.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerSessionKey(uint64 sessionId,                   // IN: session id
+                     char key[HGFS_SESSION_KEY_SIZE])    // OUT: index key
+{
+   Str_Sprintf(key, HGFS_SESSION_KEY_SIZE, "%016"FMT64"x", sessionId);
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
  * HgfsServerTransportGetSessionInfo --
  *
- *   Scans the list of sessions and return the session with the specified
- *   session id.
+ *   Looks up the session with the specified session id in the session index.
  *
  * Results:
  *    A valid pointer to HgfsSessionInfo if there is a session with the
@@ -3425,8 +4229,8 @@ static HgfsSessionInfo *
 HgfsServerTransportGetSessionInfo(HgfsTransportSessionInfo *transportSession,       // IN: transport session info
                                   uint64 sessionId)                                 // IN: session id
 {
-   DblLnkLst_Links *curr;
    HgfsSessionInfo *session = NULL;
+   char key[HGFS_SESSION_KEY_SIZE];
 
    ASSERT(transportSession);
 
@@ -3434,15 +4238,14 @@ HgfsServerTransportGetSessionInfo(HgfsTransportSessionInfo *transportSession,
       return NULL;
    }
 
+   HgfsServerSessionKey(sessionId, key);
+
    MXUser_AcquireExclLock(transportSession->sessionArrayLock);
 
-   DblLnkLst_ForEach(curr, &transportSession->sessionArray) {
-      session = DblLnkLst_Container(curr, HgfsSessionInfo, links);
-      if (session->sessionId == sessionId) {
-         HgfsServerSessionGet(session);
-         break;
-      }
-      session = NULL;
+   if (HashTable_Lookup(transportSession->sessionTable, key,
+                        (void **)&session)) {
+      ASSERT(session->sessionId == sessionId);
+      HgfsServerSessionGet(session);
    }
 
    MXUser_ReleaseExclLock(transportSession->sessionArrayLock);
@@ -3451,6 +4254,81 @@ HgfsServerTransportGetSessionInfo(HgfsTransportSessionInfo *transportSession,
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerTransportGetSessions --
+ *
+ *   Takes a reference on each session of the list, so that they can be
+ *   walked without holding the session list lock.
+ *
+ * Results:
+ *    An allocated array of the sessions, to be released with
+ *    HgfsServerTransportPutSessions.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsSessionInfo **
+HgfsServerTransportGetSessions(HgfsTransportSessionInfo *transportSession,  // IN: transport session info
+                               uint32 *numSessions)                         // OUT: number of sessions
+{
+   HgfsSessionInfo **sessions;
+   DblLnkLst_Links *curr;
+   uint32 i = 0;
+
+   ASSERT(transportSession);
+
+   MXUser_AcquireExclLock(transportSession->sessionArrayLock);
+
+   sessions = Util_SafeMalloc((transportSession->numSessions + 1) *
+                              sizeof *sessions);
+   DblLnkLst_ForEach(curr, &transportSession->sessionArray) {
+      sessions[i] = DblLnkLst_Container(curr, HgfsSessionInfo, links);
+      HgfsServerSessionGet(sessions[i]);
+      i++;
+   }
+   ASSERT(i == transportSession->numSessions);
+
+   MXUser_ReleaseExclLock(transportSession->sessionArrayLock);
+
+   *numSessions = i;
+   return sessions;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerTransportPutSessions --
+ *
+ *   Releases the sessions taken by HgfsServerTransportGetSessions.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    Sessions removed from the list in the meantime may be freed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerTransportPutSessions(HgfsSessionInfo **sessions,  // IN: sessions
+                               uint32 numSessions)          // IN: number of sessions
+{
+   uint32 i;
+
+   for (i = 0; i < numSessions; i++) {
+      HgfsServerSessionPut(sessions[i]);
+   }
+   free(sessions);
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -3533,9 +4411,13 @@ void
 HgfsServerTransportRemoveSessionFromList(HgfsTransportSessionInfo *transportSession,   // IN: transport session info
                                          HgfsSessionInfo *session)                     // IN: session info
 {
+   char key[HGFS_SESSION_KEY_SIZE];
+
    ASSERT(transportSession);
    ASSERT(session);
 
+   HgfsServerSessionKey(session->sessionId, key);
+   HashTable_Delete(transportSession->sessionTable, key);
    DblLnkLst_Unlink1(&session->links);
    transportSession->numSessions--;
    HgfsServerSessionPut(session);
@@ -3553,6 +4435,7 @@ HgfsServerTransportRemoveSessionFromList(HgfsTransportSessionInfo *transportSess
  *    HGFS_ERROR_SUCCESS if the session is successfully added to the list,
  *    HGFS_ERROR_TOO_MANY_SESSIONS if maximum number of sessions were already
  *                                 added to the list.
+ *    HGFS_ERROR_INTERNAL if a session with the same id is in the list.
  *
  * Side effects:
  *    None
@@ -3565,16 +4448,26 @@ HgfsServerTransportAddSessionToList(HgfsTransportSessionInfo *transportSession,
                                     HgfsSessionInfo *session)                         // IN: session info
 {
    HgfsInternalStatus status = HGFS_ERROR_TOO_MANY_SESSIONS;
+   char key[HGFS_SESSION_KEY_SIZE];
 
    ASSERT(transportSession);
    ASSERT(session);
 
+   HgfsServerSessionKey(session->sessionId, key);
+
    MXUser_AcquireExclLock(transportSession->sessionArrayLock);
 
    if (transportSession->numSessions == MAX_SESSION_COUNT) {
       goto abort;
    }
 
+   if (!HashTable_Insert(transportSession->sessionTable, key, session)) {
+      LOG(4, ("%s: duplicate session id %"FMT64"x\n", __FUNCTION__,
+              session->sessionId));
+      status = HGFS_ERROR_INTERNAL;
+      goto abort;
+   }
+
    DblLnkLst_LinkLast(&transportSession->sessionArray, &session->links);
    transportSession->numSessions++;
    HgfsServerSessionGet(session);
@@ -3668,6 +4561,9 @@ HgfsServerRegisterShare(const char *shareName,   // IN: shared folder name
            (shareName ? shareName : "NULL"), (sharePath ? sharePath : "NULL"),
            (addFolder ? "add" : "remove")));
 
+   /* Names may now resolve into another share path or not at all. */
+   HgfsNameCacheFlush();
+
    if (!gHgfsDirNotifyActive) {
       LOG(8, ("%s: notification disabled\n", __FUNCTION__));
       goto exit;
@@ -3857,6 +4753,31 @@ HgfsServer_InitState(HgfsServerCallbacks **callbackTable,         // IN/OUT: our
 
    gHgfsAsyncVar = MXUser_CreateCondVarExclLock(gHgfsAsyncLock);
 
+   HgfsNameCacheInit();
+
+   /*
+    * Other platforms serialize file I/O with the session's fileIOLock, which
+    * is ranked below the node lock write-behind data is flushed under.
+    */
+#if !defined(__linux__) && !defined(__APPLE__)
+   gHgfsCfgSettings.maxWriteBehindBytes = 0;
+#endif
+   if (0 != gHgfsCfgSettings.maxWriteBehindBytes) {
+      DblLnkLst_Init(&gHgfsWriteBehindSessions);
+      gHgfsWriteBehindLock = MXUser_CreateExclLock("HgfsWriteBehindLock",
+                                                   RANK_hgfsWriteBehindLock);
+      gHgfsWriteBehindTimer =
+         HgfsThreadpool_CreateTimer(HgfsServerWriteBehindTimer, NULL,
+                                    HGFS_WRITE_BEHIND_DELAY_MS);
+      Log("%s: write-behind of up to %u bytes per file.\n", __FUNCTION__,
+          gHgfsCfgSettings.maxWriteBehindBytes);
+   }
+
+   gHgfsThreadpoolActive =
+      HgfsThreadpool_Init(gHgfsCfgSettings.numWorkerThreads);
+   Log("%s: %u worker threads for asynchronous requests.\n", __FUNCTION__,
+       gHgfsThreadpoolActive ? gHgfsCfgSettings.numWorkerThreads : 0);
+
    if (!HgfsPlatformInit()) {
       LOG(4, ("Could not initialize server platform specific \n"));
       result = FALSE;
@@ -3923,6 +4844,24 @@ HgfsServer_ExitState(void)
       gHgfsSharedFoldersLock = NULL;
    }
 
+   /* Run any queued requests and stop the workers. */
+   if (gHgfsThreadpoolActive) {
+      HgfsThreadpool_Exit();
+      gHgfsThreadpoolActive = FALSE;
+   }
+
+   /* Flush the sessions still queued and drop their references. */
+   if (NULL != gHgfsWriteBehindTimer) {
+      HgfsThreadpool_DestroyTimer(gHgfsWriteBehindTimer);
+      gHgfsWriteBehindTimer = NULL;
+   }
+
+   if (NULL != gHgfsWriteBehindLock) {
+      ASSERT(!DblLnkLst_IsLinked(&gHgfsWriteBehindSessions));
+      MXUser_DestroyExclLock(gHgfsWriteBehindLock);
+      gHgfsWriteBehindLock = NULL;
+   }
+
    if (NULL != gHgfsAsyncLock) {
       MXUser_DestroyExclLock(gHgfsAsyncLock);
       gHgfsAsyncLock = NULL;
@@ -3933,6 +4872,9 @@ HgfsServer_ExitState(void)
       gHgfsAsyncVar = NULL;
    }
 
+   HgfsNameCacheExit();
+   HgfsServerStats_Exit();
+
    HgfsPlatformDestroy();
    /*
     * Reset the server manager callbacks.
@@ -4264,6 +5206,10 @@ HgfsServerSessionConnect(void *transportData,                         // IN: tra
                                RANK_hgfsSessionArrayLock);
 
    DblLnkLst_Init(&transportSession->sessionArray);
+   transportSession->sessionTable = HashTable_Alloc(HGFS_SESSION_TABLE_SIZE,
+                                                    HASH_STRING_KEY |
+                                                    HASH_FLAG_COPYKEY,
+                                                    NULL);
 
    transportSession->defaultSessionId = HGFS_INVALID_SESSION_ID;
 
@@ -4316,11 +5262,11 @@ HgfsServerAllocateSession(HgfsTransportSessionInfo *transportSession, // IN:
    session->fileIOLock = MXUser_CreateExclLock("HgfsFileIOLock",
                                                RANK_hgfsFileIOLock);
 
-   session->nodeArrayLock = MXUser_CreateExclLock("HgfsNodeArrayLock",
-                                                  RANK_hgfsNodeArrayLock);
+   session->nodeArrayLock = MXUser_CreateRWLock("HgfsNodeArrayLock",
+                                                RANK_hgfsNodeArrayLock);
 
-   session->searchArrayLock = MXUser_CreateExclLock("HgfsSearchArrayLock",
-                                                    RANK_hgfsSearchArrayLock);
+   session->searchArrayLock = MXUser_CreateRWLock("HgfsSearchArrayLock",
+                                                  RANK_hgfsSearchArrayLock);
 
    session->sessionId = HgfsGenerateSessionId();
    session->state = HGFS_SESSION_STATE_OPEN;
@@ -4337,6 +5283,10 @@ HgfsServerAllocateSession(HgfsTransportSessionInfo *transportSession, // IN:
 
    DblLnkLst_Init(&session->nodeFreeList);
    DblLnkLst_Init(&session->nodeCachedList);
+   DblLnkLst_Init(&session->nodePinnedList);
+   DblLnkLst_Init(&session->nodeCacheShareStats);
+   DblLnkLst_Init(&session->nodeCacheStats.links);
+   session->maxCachedOpenNodes = gHgfsCfgSettings.maxCachedOpenNodes;
 
    /* Allocate array of FileNodes and add them to free list. */
    session->numNodes = NUM_FILE_NODES;
@@ -4347,10 +5297,16 @@ HgfsServerAllocateSession(HgfsTransportSessionInfo *transportSession, // IN:
 
    for (i = 0; i < session->numNodes; i++) {
       DblLnkLst_Init(&session->nodeArray[i].links);
+      session->nodeArray[i].lock = MXUser_CreateExclLock("HgfsFileNodeLock",
+                                                         RANK_hgfsFileNodeLock);
+      session->nodeArray[i].handleHashNext = HGFS_NODE_INDEX_INVALID;
+      session->nodeArray[i].fdHashNext = HGFS_NODE_INDEX_INVALID;
       /* Append at the end of the list. */
       DblLnkLst_LinkLast(&session->nodeFreeList, &session->nodeArray[i].links);
    }
 
+   VERIFY(HgfsNodeIndexAlloc(session->numNodes, session));
+
    /*
     * Initialize the search handling components.
     */
@@ -4360,6 +5316,12 @@ HgfsServerAllocateSession(HgfsTransportSessionInfo *transportSession, // IN:
 
    Atomic_Write(&session->refCount, 0);
 
+   /* Write-behind data, see HgfsServerWriteBehind. */
+   Atomic_Write(&session->numWriteBehindNodes, 0);
+   Atomic_Write(&session->numWriteBehindErrors, 0);
+   DblLnkLst_Init(&session->writeBehindLinks);
+   DblLnkLst_Init(&session->writeBehindNodes);
+
    /* Give our session a reference to hold while we are open. */
    HgfsServerSessionGet(session);
 
@@ -4379,6 +5341,13 @@ HgfsServerAllocateSession(HgfsTransportSessionInfo *transportSession, // IN:
    HgfsServerGetDefaultCapabilities(session->hgfsSessionCapabilities,
                                     &session->numberOfCapabilities);
 
+   /*
+    * The server copies between its own file descriptors, the data does not
+    * go through the transport, so any transport supports it.
+    */
+   HgfsServerSetSessionCapability(HGFS_OP_COPY_FILE_RANGE_V4,
+                                  HGFS_REQUEST_SUPPORTED, session);
+
    if (transportSession->channelCapabilities.flags & HGFS_CHANNEL_SHARED_MEM) {
       HgfsServerSetSessionCapability(HGFS_OP_READ_FAST_V4,
                                      HGFS_REQUEST_SUPPORTED, session);
@@ -4547,6 +5516,7 @@ HgfsServerSessionClose(void *clientData)    // IN: session context
 static void
 HgfsServerExitSessionInternal(HgfsSessionInfo *session)    // IN: session context
 {
+   DblLnkLst_Links *link, *nextLink;
    int i;
 
    ASSERT(session);
@@ -4568,7 +5538,10 @@ HgfsServerExitSessionInternal(HgfsSessionInfo *session)    // IN: session contex
       HgfsNotify_RemoveSessionSubscribers(session);
    }
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   /* Without the nodeArrayLock, see HgfsRemoveFromCacheInternal. */
+   HgfsServerWriteBehindFlushSession(session);
+
+   MXUser_AcquireForWrite(session->nodeArrayLock);
 
    Log("%s: exit session %p id %"FMT64"x\n", __FUNCTION__, session, session->sessionId);
 
@@ -4576,25 +5549,38 @@ HgfsServerExitSessionInternal(HgfsSessionInfo *session)    // IN: session contex
    for (i = 0; i < session->numNodes; i++) {
       HgfsHandle handle;
 
-      if (session->nodeArray[i].state == FILENODE_STATE_UNUSED) {
-         continue;
+      if (session->nodeArray[i].state != FILENODE_STATE_UNUSED) {
+         handle = HgfsFileNode2Handle(&session->nodeArray[i]);
+         HgfsRemoveFromCacheInternal(handle, session);
+         HgfsFreeFileNodeInternal(handle, session);
       }
-
-      handle = HgfsFileNode2Handle(&session->nodeArray[i]);
-      HgfsRemoveFromCacheInternal(handle, session);
-      HgfsFreeFileNodeInternal(handle, session);
+      MXUser_DestroyExclLock(session->nodeArray[i].lock);
    }
    free(session->nodeArray);
    session->nodeArray = NULL;
+   HgfsNodeCacheStatsLog(session);
+   DblLnkLst_ForEachSafe(link, nextLink, &session->nodeCacheShareStats) {
+      HgfsNodeCacheStats *stats = DblLnkLst_Container(link, HgfsNodeCacheStats,
+                                                      links);
+
+      DblLnkLst_Unlink1(&stats->links);
+      free(stats->shareName);
+      free(stats);
+   }
+   free(session->nodeHandleBuckets);
+   session->nodeHandleBuckets = NULL;
+   free(session->nodeFdBuckets);
+   session->nodeFdBuckets = NULL;
+   session->numNodeBuckets = 0;
 
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
 
    /*
     * Recycle all searches that are still in use, then destroy the
     * search pool.
     */
 
-   MXUser_AcquireExclLock(session->searchArrayLock);
+   MXUser_AcquireForWrite(session->searchArrayLock);
 
    for (i = 0; i < session->numSearches; i++) {
       if (DblLnkLst_IsLinked(&session->searchArray[i].links)) {
@@ -4605,11 +5591,11 @@ HgfsServerExitSessionInternal(HgfsSessionInfo *session)    // IN: session contex
    free(session->searchArray);
    session->searchArray = NULL;
 
-   MXUser_ReleaseExclLock(session->searchArrayLock);
+   MXUser_ReleaseRWLock(session->searchArrayLock);
 
    /* Teardown the locks for the sessions and destroy itself. */
-   MXUser_DestroyExclLock(session->nodeArrayLock);
-   MXUser_DestroyExclLock(session->searchArrayLock);
+   MXUser_DestroyRWLock(session->nodeArrayLock);
+   MXUser_DestroyRWLock(session->searchArrayLock);
    MXUser_DestroyExclLock(session->fileIOLock);
 
    free(session);
@@ -4664,6 +5650,30 @@ HgfsServer_SetHandleCounter(uint32 newHandleCounter)
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServer_GetStats --
+ *
+ *    Return the per operation request counters and latency histograms of
+ *    the server, and the open node cache counters of each share, as text.
+ *
+ * Results:
+ *    NUL terminated text, to be freed by the caller.
+ *
+ * Side effects:
+ *    The counters are cleared if reset is set.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+char *
+HgfsServer_GetStats(Bool reset)  // IN: clear the counters
+{
+   return HgfsServerStats_Format(reset);
+}
+
+
 /*
  *----------------------------------------------------------------------------
  *
@@ -4828,6 +5838,10 @@ HgfsPacketSend(HgfsPacket *packet,            // IN/OUT: Hgfs Packet
  *      Iterates over all nodes and searches, invalidating and removing those
  *      that are no longer within a share.
  *
+ *      The node and search array locks are dropped every HGFS_INVALIDATE_BATCH
+ *      entries to let the requests of the session through. The arrays may
+ *      grow in the meantime, so entries are always accessed by index.
+ *
  * Results:
  *      None
  *
@@ -4849,7 +5863,10 @@ HgfsInvalidateSessionObjects(DblLnkLst_Links *shares,  // IN: List of new shares
    ASSERT(session->searchArray);
    LOG(4, ("%s: Beginning\n", __FUNCTION__));
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   /* Without the nodeArrayLock, see HgfsRemoveFromCacheInternal. */
+   HgfsServerWriteBehindFlushSession(session);
+
+   MXUser_AcquireForWrite(session->nodeArrayLock);
 
    /*
     * Iterate over each node, skipping those that are unused. For each node,
@@ -4879,9 +5896,15 @@ HgfsInvalidateSessionObjects(DblLnkLst_Links *shares,  // IN: List of new shares
          }
       }
 
-      /* If the node wasn't found in any share, remove it. */
-      if (l == shares) {
-         LOG(4, ("%s: Node is invalid, removing\n", __FUNCTION__));
+      /*
+       * If the node wasn't found in any share, remove it. A node with
+       * write-behind data is left for the next invalidation, once the data
+       * was written without the nodeArrayLock.
+       */
+      if (l == shares && HgfsServerWriteBehindIsDirty(&session->nodeArray[i])) {
+         LOG(4, ("%s: Node is invalid, has data to write\n", __FUNCTION__));
+      } else if (l == shares) {
+         LOG(4, ("%s: Node is invalid, removing\n", __FUNCTION__));
          if (!HgfsRemoveFromCacheInternal(handle, session)) {
             LOG(4, ("%s: Could not remove node with "
                     "fh %d from the cache.\n", __FUNCTION__, handle));
@@ -4889,11 +5912,16 @@ HgfsInvalidateSessionObjects(DblLnkLst_Links *shares,  // IN: List of new shares
             HgfsFreeFileNodeInternal(handle, session);
          }
       }
+
+      if ((i + 1) % HGFS_INVALIDATE_BATCH == 0) {
+         MXUser_ReleaseRWLock(session->nodeArrayLock);
+         MXUser_AcquireForWrite(session->nodeArrayLock);
+      }
    }
 
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
 
-   MXUser_AcquireExclLock(session->searchArrayLock);
+   MXUser_AcquireForWrite(session->searchArrayLock);
 
    /*
     * Iterate over each search, skipping those that are on the free list. For
@@ -4902,6 +5930,11 @@ HgfsInvalidateSessionObjects(DblLnkLst_Links *shares,  // IN: List of new shares
    for (i = 0; i < session->numSearches; i++) {
       DblLnkLst_Links *l;
 
+      if (i > 0 && i % HGFS_INVALIDATE_BATCH == 0) {
+         MXUser_ReleaseRWLock(session->searchArrayLock);
+         MXUser_AcquireForWrite(session->searchArrayLock);
+      }
+
       if (DblLnkLst_IsLinked(&session->searchArray[i].links)) {
          continue;
       }
@@ -4933,7 +5966,7 @@ HgfsInvalidateSessionObjects(DblLnkLst_Links *shares,  // IN: List of new shares
       }
    }
 
-   MXUser_ReleaseExclLock(session->searchArrayLock);
+   MXUser_ReleaseRWLock(session->searchArrayLock);
 
    LOG(4, ("%s: Ending\n", __FUNCTION__));
 }
@@ -4947,8 +5980,8 @@ HgfsInvalidateSessionObjects(DblLnkLst_Links *shares,  // IN: List of new shares
  *      Iterates over all sessions and invalidate session objects for the shares
  *      removed.
  *
- *      Caller guarantees that the sessions won't go away under us, so no locks
- *      needed.
+ *      The sessions are invalidated one at a time without holding the session
+ *      list lock, so that requests of the other sessions are not held off.
  *
  * Results:
  *      None
@@ -4964,19 +5997,19 @@ HgfsServerSessionInvalidateObjects(void *clientData,         // IN:
                                    DblLnkLst_Links *shares)  // IN: List of new shares
 {
    HgfsTransportSessionInfo *transportSession = clientData;
-   DblLnkLst_Links *curr;
+   HgfsSessionInfo **sessions;
+   uint32 numSessions;
+   uint32 i;
 
    ASSERT(transportSession);
-   MXUser_AcquireExclLock(transportSession->sessionArrayLock);
 
-   DblLnkLst_ForEach(curr, &transportSession->sessionArray) {
-      HgfsSessionInfo *session = DblLnkLst_Container(curr, HgfsSessionInfo, links);
-      HgfsServerSessionGet(session);
-      HgfsInvalidateSessionObjects(shares, session);
-      HgfsServerSessionPut(session);
+   sessions = HgfsServerTransportGetSessions(transportSession, &numSessions);
+   for (i = 0; i < numSessions; i++) {
+      HgfsInvalidateSessionObjects(shares, sessions[i]);
    }
+   HgfsServerTransportPutSessions(sessions, numSessions);
 
-   MXUser_ReleaseExclLock(transportSession->sessionArrayLock);
+   HgfsNameCacheFlush();
 }
 
 
@@ -4996,8 +6029,9 @@ HgfsServerSessionInvalidateObjects(void *clientData,         // IN:
  *      session is marked as active. When this function is called the next time,
  *      any sessions that are still inactive will be invalidated.
  *
- *      Caller guarantees that the sessions won't go away under us, so no locks
- *      needed.
+ *      Calls are serialized by the caller. As for HgfsServerSessionInvalidateObjects
+ *      the sessions are walked without holding the session list lock, which is
+ *      only taken to close a session.
  *
  * Results:
  *      Number of active sessions remaining inside the HGFS server.
@@ -5013,16 +6047,19 @@ HgfsServerSessionInvalidateInactiveSessions(void *clientData)         // IN:
 {
    HgfsTransportSessionInfo *transportSession = clientData;
    uint32 numActiveSessionsLeft = 0;
-   DblLnkLst_Links shares, *curr, *next;
+   DblLnkLst_Links shares;
+   HgfsSessionInfo **sessions;
+   uint32 numSessions;
+   uint32 i;
 
    ASSERT(transportSession);
-   MXUser_AcquireExclLock(transportSession->sessionArrayLock);
 
    DblLnkLst_Init(&shares);
 
-   DblLnkLst_ForEachSafe(curr, next,  &transportSession->sessionArray) {
-      HgfsSessionInfo *session = DblLnkLst_Container(curr, HgfsSessionInfo, links);
-      HgfsServerSessionGet(session);
+   sessions = HgfsServerTransportGetSessions(transportSession, &numSessions);
+
+   for (i = 0; i < numSessions; i++) {
+      HgfsSessionInfo *session = sessions[i];
 
       session->numInvalidationAttempts++;
       numActiveSessionsLeft++;
@@ -5034,17 +6071,25 @@ HgfsServerSessionInvalidateInactiveSessions(void *clientData)         // IN:
       if (session->isInactive) {
 
          if (session->numInvalidationAttempts == MAX_SESSION_INVALIDATION_ATTEMPTS) {
-            LOG(4, ("%s: closing inactive session %"FMT64"x\n", __FUNCTION__,
-                    session->sessionId));
-            session->state = HGFS_SESSION_STATE_CLOSED;
-            HgfsServerTransportRemoveSessionFromList(transportSession,
-                                                     session);
-            /*
-             * We need to reduce the refcount by 1 since we want to
-             * destroy the session.
-             */
             numActiveSessionsLeft--;
-            HgfsServerSessionPut(session);
+
+            MXUser_AcquireExclLock(transportSession->sessionArrayLock);
+
+            /* The session may have been destroyed in the meantime. */
+            if (DblLnkLst_IsLinked(&session->links)) {
+               LOG(4, ("%s: closing inactive session %"FMT64"x\n", __FUNCTION__,
+                       session->sessionId));
+               session->state = HGFS_SESSION_STATE_CLOSED;
+               HgfsServerTransportRemoveSessionFromList(transportSession,
+                                                        session);
+               /*
+                * We need to reduce the refcount by 1 since we want to
+                * destroy the session.
+                */
+               HgfsServerSessionPut(session);
+            }
+
+            MXUser_ReleaseExclLock(transportSession->sessionArrayLock);
          } else {
             HgfsInvalidateSessionObjects(&shares, session);
          }
@@ -5053,10 +6098,10 @@ HgfsServerSessionInvalidateInactiveSessions(void *clientData)         // IN:
          session->numInvalidationAttempts = 0;
       }
 
-      HgfsServerSessionPut(session);
+      HgfsServerReadAheadAge(session);
    }
 
-   MXUser_ReleaseExclLock(transportSession->sessionArrayLock);
+   HgfsServerTransportPutSessions(sessions, numSessions);
 
    return numActiveSessionsLeft;
 }
@@ -5124,488 +6169,1060 @@ HgfsServerStatFs(const char *pathName, // IN: Path we're interested in
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsServerGetLocalNameInfo --
- *
- *    Construct local name based on the crossplatform CPName for the file and the
- *    share information.
+ * HgfsNameCacheInit --
  *
- *    The name returned is allocated and must be freed by the caller.
- *    The name length is optionally returned.
+ *    Set up the resolved name cache.
  *
  * Results:
- *    A status code indicating either success (correspondent share exists) or
- *    a failure status.
+ *    None.
  *
  * Side effects:
- *    Memory allocation in the success case
+ *    None.
  *
  *-----------------------------------------------------------------------------
  */
 
-static HgfsNameStatus
-HgfsServerGetLocalNameInfo(const char *cpName,      // IN:  Cross-platform filename to check
-                           size_t cpNameSize,       // IN:  Size of name cpName
-                           uint32 caseFlags,        // IN:  Case-sensitivity flags
-                           HgfsShareInfo *shareInfo,// OUT: properties of the shared folder
-                           char **bufOut,           // OUT: File name in local fs
-                           size_t *outLen)          // OUT: Length of name out optional
+static void
+HgfsNameCacheInit(void)
 {
-   HgfsNameStatus nameStatus;
-   const char *inEnd;
-   const char *next;
-   char *myBufOut;
-   char *convertedMyBufOut;
-   char *out;
-   size_t outSize;
-   size_t myBufOutLen;
-   size_t convertedMyBufOutLen;
-   int len;
-   uint32 pathNameLen;
-   char tempBuf[HGFS_PATH_MAX];
-   size_t tempSize;
-   char *tempPtr;
-   uint32 startIndex = 0;
-   HgfsShareOptions shareOptions;
-
-   ASSERT(cpName);
-   ASSERT(bufOut);
+   gHgfsNameCacheLock = MXUser_CreateExclLock("nameCacheLock",
+                                              RANK_hgfsNameCacheLock);
+   gHgfsNameCache = HashTable_Alloc(HGFS_NAME_CACHE_MAX_ENTRIES,
+                                    HASH_STRING_KEY, NULL);
+   gHgfsNameCacheDirs = HashTable_Alloc(HGFS_NAME_CACHE_MAX_ENTRIES,
+                                        HASH_STRING_KEY, NULL);
+   DblLnkLst_Init(&gHgfsNameCacheLru);
+   gHgfsNameCacheNumEntries = 0;
+   gHgfsNameCacheGeneration = 0;
+}
 
-   inEnd = cpName + cpNameSize;
 
-   if (!Unicode_IsBufferValid(cpName, cpNameSize, STRING_ENCODING_UTF8)) {
-      LOG(4, ("%s: invalid UTF8 string @ %p\n", __FUNCTION__, cpName));
-      return HGFS_NAME_STATUS_FAILURE;
-   }
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNameCacheDirGet --
+ *
+ *    Find the cache directory of a path, or add it. Called with the cache
+ *    lock held.
+ *
+ * Results:
+ *    The directory.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-   /*
-    * Get first component.
-    */
-   len = CPName_GetComponent(cpName, inEnd, &next);
-   if (len < 0) {
-      LOG(4, ("%s: get first component failed\n", __FUNCTION__));
+static HgfsNameCacheDir *
+HgfsNameCacheDirGet(const char *path,  // IN: directory path
+                    size_t pathLen)    // IN: length of the path
+{
+   HgfsNameCacheDir *dir;
+   char *dirPath = Util_SafeMalloc(pathLen + 1);
 
-      return HGFS_NAME_STATUS_FAILURE;
-   }
+   ASSERT(MXUser_IsCurThreadHoldingExclLock(gHgfsNameCacheLock));
 
-   /* See if we are dealing with the base of the namespace */
-   if (!len) {
-      return HGFS_NAME_STATUS_INCOMPLETE_BASE;
-   }
+   memcpy(dirPath, path, pathLen);
+   dirPath[pathLen] = '\0';
 
-   /* Check permission on the share and get the share path */
-   nameStatus = HgfsServerPolicy_ProcessCPName(cpName,
-                                               len,
-                                               &shareInfo->readPermissions,
-                                               &shareInfo->writePermissions,
-                                               &shareInfo->handle,
-                                               &shareInfo->rootDir);
-   if (nameStatus != HGFS_NAME_STATUS_COMPLETE) {
-      LOG(4, ("%s: No such share (%s)\n", __FUNCTION__, cpName));
-      return nameStatus;
+   if (HashTable_Lookup(gHgfsNameCacheDirs, dirPath, (void **)&dir)) {
+      free(dirPath);
+   } else {
+      dir = Util_SafeCalloc(1, sizeof *dir);
+      dir->path = dirPath;
+      DblLnkLst_Init(&dir->entries);
+      HashTable_Insert(gHgfsNameCacheDirs, dir->path, dir);
    }
-   shareInfo->rootDirLen = strlen(shareInfo->rootDir);
 
-   /* Get the config options. */
-   nameStatus = HgfsServerPolicy_GetShareOptions(cpName, len, &shareOptions);
-   if (nameStatus != HGFS_NAME_STATUS_COMPLETE) {
-      LOG(4, ("%s: no matching share: %s.\n", __FUNCTION__, cpName));
-      return nameStatus;
-   }
+   return dir;
+}
 
-   /* Point to the next component, if any */
-   cpNameSize -= next - cpName;
-   cpName = next;
 
-   /*
-    * Allocate space for the string. We trim the unused space later.
-    */
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNameCacheDirPut --
+ *
+ *    Drop the count of an entry below a cache directory, freeing it when no
+ *    entry is left below it. Called with the cache lock held.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-   outSize = HGFS_PATH_MAX;
-   myBufOut = (char *) malloc(outSize * sizeof *myBufOut);
-   if (!myBufOut) {
-      LOG(4, ("%s: out of memory allocating string\n", __FUNCTION__));
+static void
+HgfsNameCacheDirPut(HgfsNameCacheDir *dir)  // IN: cache directory
+{
+   ASSERT(MXUser_IsCurThreadHoldingExclLock(gHgfsNameCacheLock));
+   ASSERT(dir->numBelow > 0);
 
-      return HGFS_NAME_STATUS_OUT_OF_MEMORY;
+   if (--dir->numBelow == 0) {
+      ASSERT(!DblLnkLst_IsLinked(&dir->entries));
+      HashTable_Delete(gHgfsNameCacheDirs, dir->path);
+      free(dir->path);
+      free(dir);
    }
+}
 
-   out = myBufOut;
-
-   /*
-    * See if we are dealing with a "root" share or regular share
-    */
-   if (shareInfo->rootDirLen == 0) {
-      size_t prefixLen;
 
-      /* Are root shares allowed? If not, we exit with an error. */
-      if (0 == (gHgfsCfgSettings.flags & HGFS_CONFIG_SHARE_ALL_HOST_DRIVES_ENABLED)) {
-         LOG(4, ("%s: Root share being used\n", __FUNCTION__));
-         nameStatus = HGFS_NAME_STATUS_ACCESS_DENIED;
-         goto error;
-      }
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNameCacheDirsUpdate --
+ *
+ *    Count an entry in, or out of, the cache directories above its local
+ *    name, and link it in, or unlink it from, the entries of its directory.
+ *    Called with the cache lock held.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-      /*
-       * This is a "root" share. Interpret the input appropriately as
-       * either a drive letter or UNC name and append it to the output
-       * buffer (for Win32) or simply get the prefix for root (for
-       * linux).
-       */
-      tempSize = sizeof tempBuf;
-      tempPtr = tempBuf;
-      nameStatus = CPName_ConvertFromRoot(&cpName,
-                                          &cpNameSize, &tempSize, &tempPtr);
-      if (nameStatus != HGFS_NAME_STATUS_COMPLETE) {
-         LOG(4, ("%s: ConvertFromRoot not complete\n", __FUNCTION__));
-         goto error;
-      }
+static void
+HgfsNameCacheDirsUpdate(HgfsNameCacheEntry *entry,  // IN: cache entry
+                        Bool add)                   // IN: count in or out
+{
+   const char *name = entry->localName;
+   const char *sep;
 
-      prefixLen = tempPtr - tempBuf;
+   if (!add && NULL != entry->dir) {
+      DblLnkLst_Unlink1(&entry->dirLinks);
+   }
 
-      /* Copy the UTF8 prefix to the output buffer. */
-      if (prefixLen >= HGFS_PATH_MAX) {
-         Log("%s: error: prefix too long\n", __FUNCTION__);
-         nameStatus = HGFS_NAME_STATUS_TOO_LONG;
-         goto error;
-      }
+   for (sep = strchr(name, DIRSEPC); sep != NULL;
+        sep = strchr(sep + 1, DIRSEPC)) {
+      HgfsNameCacheDir *dir = HgfsNameCacheDirGet(name, sep - name);
 
-      memcpy(out, tempBuf, prefixLen);
-      out += prefixLen;
-      *out = 0;
-      outSize -= prefixLen;
-   } else {
-      /*
-       * This is a regular share. Append the path to the out buffer.
-       */
-      if (outSize < shareInfo->rootDirLen + 1) {
-         LOG(4, ("%s: share path too big\n", __FUNCTION__));
-         nameStatus = HGFS_NAME_STATUS_TOO_LONG;
-         goto error;
+      if (add) {
+         dir->numBelow++;
+         entry->dir = dir;
+      } else {
+         HgfsNameCacheDirPut(dir);
       }
+   }
 
-      memcpy(out, shareInfo->rootDir, shareInfo->rootDirLen + 1);
-      out += shareInfo->rootDirLen;
-      outSize -= shareInfo->rootDirLen;
+   if (add && NULL != entry->dir) {
+      DblLnkLst_LinkLast(&entry->dir->entries, &entry->dirLinks);
    }
+}
 
-   /* Convert the rest of the input name (if any) to a local name */
-   tempSize = sizeof tempBuf;
-   tempPtr = tempBuf;
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNameCacheRemove --
+ *
+ *    Remove an entry from the resolved name cache and free it. Called with
+ *    the cache lock held.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-   if (CPName_ConvertFrom(&cpName, &cpNameSize, &tempSize,
-                          &tempPtr) < 0) {
-      LOG(4, ("%s: CP name conversion failed\n", __FUNCTION__));
-      nameStatus = HGFS_NAME_STATUS_FAILURE;
-      goto error;
-   }
+static void
+HgfsNameCacheRemove(HgfsNameCacheEntry *entry)  // IN: cache entry
+{
+   ASSERT(MXUser_IsCurThreadHoldingExclLock(gHgfsNameCacheLock));
 
-   /*
-    * For volume root directory shares the prefix will have a trailing
-    * separator and since our remaining paths start with a separator, we
-    * will skip over the second separator for this case. Bug 166755.
-    */
+   HashTable_Delete(gHgfsNameCache, entry->key);
+   DblLnkLst_Unlink1(&entry->links);
+   HgfsNameCacheDirsUpdate(entry, FALSE);
+   gHgfsNameCacheNumEntries--;
 
-   if ((out != myBufOut) && (*(out - 1) == DIRSEPC) && (tempBuf[0] == DIRSEPC)) {
-      startIndex++;
-   }
-   pathNameLen = tempPtr - &tempBuf[startIndex];
+   free(entry->key);
+   free(entry->rootDir);
+   free(entry->localName);
+   free(entry);
+}
 
-   /* Copy UTF8 to the output buffer. */
-   if (pathNameLen >= outSize) {
-      LOG(4, ("%s: pathname too long\n", __FUNCTION__));
-      nameStatus = HGFS_NAME_STATUS_TOO_LONG;
-      goto error;
-   }
 
-   memcpy(out, &tempBuf[startIndex], pathNameLen);
-   outSize -= pathNameLen;
-   out += pathNameLen;
-   *out = 0;
-   myBufOutLen = out - myBufOut;
-
-#if defined(__APPLE__)
-   {
-      size_t nameLen;
-      /*
-       * For Mac hosts the unicode format is decomposed (form D)
-       * so there is a need to convert the incoming name from HGFS clients
-       * which is assumed to be in the normalized form C (precomposed).
-       */
-
-      if (!CodeSet_Utf8FormCToUtf8FormD(myBufOut, myBufOutLen, &tempPtr,
-                                        &nameLen)) {
-         LOG(4, ("%s: unicode conversion to form D failed.\n", __FUNCTION__));
-         nameStatus = HGFS_NAME_STATUS_FAILURE;
-         goto error;
-      }
-
-      free(myBufOut);
-      LOG(4, ("%s: name is \"%s\"\n", __FUNCTION__, tempPtr));
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNameCacheFlush --
+ *
+ *    Remove all the entries of the resolved name cache, as the shares or
+ *    their options may have changed.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-      /* Save returned pointers, update buffer length. */
-      myBufOut = tempPtr;
-      out = tempPtr + nameLen;
-      myBufOutLen = nameLen;
+static void
+HgfsNameCacheFlush(void)
+{
+   if (NULL == gHgfsNameCacheLock) {
+      return;
    }
-#endif /* defined(__APPLE__) */
-
-   /*
-    * Look up the file name using the proper case if the config option is not set
-    * to use the host default and lookup is supported for this platform.
-    */
 
-   if (!HgfsServerPolicy_IsShareOptionSet(shareOptions,
-                                          HGFS_SHARE_HOST_DEFAULT_CASE) &&
-       HgfsPlatformDoFilenameLookup()) {
-      nameStatus = HgfsPlatformFilenameLookup(shareInfo->rootDir, shareInfo->rootDirLen,
-                                              myBufOut, myBufOutLen, caseFlags,
-                                              &convertedMyBufOut,
-                                              &convertedMyBufOutLen);
+   MXUser_AcquireExclLock(gHgfsNameCacheLock);
+   while (DblLnkLst_IsLinked(&gHgfsNameCacheLru)) {
+      HgfsNameCacheRemove(DblLnkLst_Container(gHgfsNameCacheLru.next,
+                                              HgfsNameCacheEntry, links));
+   }
+   MXUser_ReleaseExclLock(gHgfsNameCacheLock);
+}
 
-      /*
-       * On successful lookup, use the found matching file name for further operations.
-       */
 
-      if (nameStatus != HGFS_NAME_STATUS_COMPLETE) {
-         LOG(4, ("%s: HgfsPlatformFilenameLookup failed.\n", __FUNCTION__));
-         goto error;
-      }
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNameCacheExit --
+ *
+ *    Tear down the resolved name cache.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-      free(myBufOut);
-      myBufOut = convertedMyBufOut;
-      myBufOutLen = convertedMyBufOutLen;
-      ASSERT(myBufOut);
+static void
+HgfsNameCacheExit(void)
+{
+   if (NULL == gHgfsNameCacheLock) {
+      return;
    }
 
-   /* Check for symlinks if the followSymlinks option is not set. */
-   if (!HgfsServerPolicy_IsShareOptionSet(shareOptions,
-                                          HGFS_SHARE_FOLLOW_SYMLINKS)) {
-      /*
-       * Verify that either the path is same as share path or the path until the
-       * parent directory is within the share.
-       *
-       * XXX: Symlink check could become susceptible to TOCTOU (time-of-check,
-       * time-of-use) attack when we move to asynchrounous HGFS operations.
-       * We should use the resolved file path for further file system
-       * operations, instead of using the one passed from the client.
-       */
-      nameStatus = HgfsPlatformPathHasSymlink(myBufOut, myBufOutLen, shareInfo->rootDir,
-                                              shareInfo->rootDirLen);
-      if (nameStatus != HGFS_NAME_STATUS_COMPLETE) {
-         LOG(4, ("%s: parent path failed to be resolved: %d\n",
-                 __FUNCTION__, nameStatus));
-         goto error;
-      }
-   }
+   HgfsNameCacheFlush();
+   HashTable_Free(gHgfsNameCache);
+   gHgfsNameCache = NULL;
+   HashTable_Free(gHgfsNameCacheDirs);
+   gHgfsNameCacheDirs = NULL;
+   MXUser_DestroyExclLock(gHgfsNameCacheLock);
+   gHgfsNameCacheLock = NULL;
+}
 
-   {
-      char *p;
 
-      /* Trim unused memory */
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNameCacheKey --
+ *
+ *    Build the cache key of a name: the case flags and the share options
+ *    followed by the CPName, with the component separators escaped so the
+ *    key is a string.
+ *
+ * Results:
+ *    The key, to be freed by the caller.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-      /* Enough space for resulting string + NUL termination */
-      p = realloc(myBufOut, (myBufOutLen + 1) * sizeof *p);
-      if (!p) {
-         LOG(4, ("%s: failed to trim memory\n", __FUNCTION__));
-      } else {
-         myBufOut = p;
-      }
+static char *
+HgfsNameCacheKey(const char *cpName,              // IN: cross-platform name
+                 size_t cpNameSize,               // IN: name size
+                 uint32 caseFlags,                // IN: case-sensitivity flags
+                 HgfsShareOptions shareOptions)   // IN: options of the share
+{
+   char *key = Util_SafeMalloc(2 * cpNameSize + 32);
+   char *p = key;
+   size_t i;
 
-      if (outLen) {
-         *outLen = myBufOutLen;
+   p += Str_Sprintf(p, 32, "%u:%u:", caseFlags, shareOptions);
+   for (i = 0; i < cpNameSize; i++) {
+      if (cpName[i] == '\0' || cpName[i] == '\\') {
+         *p++ = '\\';
+         *p++ = cpName[i] == '\0' ? '0' : '\\';
+      } else {
+         *p++ = cpName[i];
       }
    }
+   *p = '\0';
 
-   LOG(4, ("%s: name is \"%s\"\n", __FUNCTION__, myBufOut));
-
-   *bufOut = myBufOut;
-
-   return HGFS_NAME_STATUS_COMPLETE;
-
-error:
-   free(myBufOut);
-
-   return nameStatus;
+   return key;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsServerIsSharedFolderOnly --
- *
- *    Test a name if it is a shared folder only or not
+ * HgfsNameCacheLookup --
  *
- *    This function assumes that CPName_GetComponent() will always succeed
- *    with a size greater than 0, so it must ONLY be called after a call to
- *    HgfsServerGetLocalNameInfo() that returns HGFS_NAME_STATUS_COMPLETE.
+ *    Look up the local name a CPName was resolved to. An entry is used only
+ *    if it is recent enough, not made stale by a change of a directory above
+ *    it, and the share still has the same path.
  *
  * Results:
- *    True if it is a shared folder only, otherwise false
+ *    TRUE and an allocated copy of the local name if found, FALSE otherwise.
  *
  * Side effects:
- *    None
+ *    Expired entries are removed.
  *
  *-----------------------------------------------------------------------------
  */
 
-Bool
-HgfsServerIsSharedFolderOnly(char const *cpName,// IN:  Cross-platform filename to check
-                             size_t cpNameSize) // IN:  Size of name cpName
+static Bool
+HgfsNameCacheLookup(const char *key,      // IN: name cache key
+                    const char *rootDir,  // IN: share path
+                    char **localName,     // OUT: local name
+                    size_t *localNameLen) // OUT: local name length
 {
-   char const *inEnd;
-   char const *next;
-   int len;
-
-   ASSERT(cpName);
-
-   inEnd = cpName + cpNameSize;
-   len = CPName_GetComponent(cpName, inEnd, &next);
+   HgfsNameCacheEntry *entry;
+   Bool found = FALSE;
 
-   ASSERT(len > 0);
-   (void) len; /* Shuts up gcc's -Werror=unused-but-set-variable. */
+   MXUser_AcquireExclLock(gHgfsNameCacheLock);
+   if (HashTable_Lookup(gHgfsNameCache, key, (void **)&entry)) {
+      if (Hostinfo_SystemTimerUS() - entry->insertTimeUS >
+             HGFS_NAME_CACHE_TTL_US ||
+          entry->generation != gHgfsNameCacheGeneration ||
+          strcmp(entry->rootDir, rootDir) != 0) {
+         HgfsNameCacheRemove(entry);
+      } else {
+         *localName = Util_SafeMalloc(entry->localNameLen + 1);
+         memcpy(*localName, entry->localName, entry->localNameLen + 1);
+         *localNameLen = entry->localNameLen;
+         DblLnkLst_Unlink1(&entry->links);
+         DblLnkLst_LinkFirst(&gHgfsNameCacheLru, &entry->links);
+         found = TRUE;
+      }
+   }
+   MXUser_ReleaseExclLock(gHgfsNameCacheLock);
 
-   return (next == inEnd);
+   return found;
 }
 
 
-#ifdef VMX86_LOG
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsServerDirDumpDents --
+ * HgfsNameCacheInsert --
  *
- *    Dump a set of directory entries (debugging code)
+ *    Cache the local name a CPName was resolved to, evicting the least
+ *    recently used entry if the cache is full.
  *
  * Results:
  *    None.
  *
  * Side effects:
- *    None.
+ *    The cache owns the key.
  *
  *-----------------------------------------------------------------------------
  */
 
-void
-HgfsServerDirDumpDents(HgfsHandle searchHandle,  // IN: Handle to dump dents from
-                       HgfsSessionInfo *session) // IN: Session info
+static void
+HgfsNameCacheInsert(char *key,               // IN: name cache key
+                    Bool caseInsensitive,    // IN: resolved case insensitively
+                    const char *rootDir,     // IN: share path
+                    const char *localName,   // IN: local name
+                    size_t localNameLen)     // IN: local name length
 {
-   HgfsSearch *search;
+   HgfsNameCacheEntry *entry;
+   HgfsNameCacheEntry *oldEntry;
 
-   MXUser_AcquireExclLock(session->searchArrayLock);
+   entry = Util_SafeCalloc(1, sizeof *entry);
+   DblLnkLst_Init(&entry->links);
+   DblLnkLst_Init(&entry->dirLinks);
+   entry->key = key;
+   entry->caseInsensitive = caseInsensitive;
+   entry->rootDir = Util_SafeStrdup(rootDir);
+   entry->localName = Util_SafeMalloc(localNameLen + 1);
+   memcpy(entry->localName, localName, localNameLen + 1);
+   entry->localNameLen = localNameLen;
+   entry->insertTimeUS = Hostinfo_SystemTimerUS();
 
-   search = HgfsSearchHandle2Search(searchHandle, session);
-   if (search != NULL) {
-      HgfsPlatformDirDumpDents(search);
+   MXUser_AcquireExclLock(gHgfsNameCacheLock);
+
+   if (HashTable_Lookup(gHgfsNameCache, key, (void **)&oldEntry)) {
+      HgfsNameCacheRemove(oldEntry);
+   }
+   if (gHgfsNameCacheNumEntries >= HGFS_NAME_CACHE_MAX_ENTRIES) {
+      HgfsNameCacheRemove(DblLnkLst_Container(gHgfsNameCacheLru.prev,
+                                              HgfsNameCacheEntry, links));
    }
 
-   MXUser_ReleaseExclLock(session->searchArrayLock);
+   entry->generation = gHgfsNameCacheGeneration;
+   HashTable_Insert(gHgfsNameCache, entry->key, entry);
+   DblLnkLst_LinkFirst(&gHgfsNameCacheLru, &entry->links);
+   HgfsNameCacheDirsUpdate(entry, TRUE);
+   gHgfsNameCacheNumEntries++;
+
+   MXUser_ReleaseExclLock(gHgfsNameCacheLock);
 }
-#endif
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsServerSearchRealDir --
- *
- *    Handle a search on a real directory. Takes a pointer to an enumerator
- *    for the directory's contents and returns a handle to a search that is
- *    correctly set up with the real directory's entries.
+ * HgfsNameCacheInvalidateInternal --
  *
- *    The casual reader will notice that the "type" of this search is obviously
- *    always DIRECTORY_SEARCH_TYPE_DIR, but the caller is nonetheless required
- *    to pass it in, for completeness' sake with respect to
- *    HgfsServerSearchVirtualDir.
+ *    A file or directory was created, renamed or deleted: remove the cached
+ *    names of it, and those looked up case insensitively in its directory
+ *    as the name may now match them with another case. The cached names
+ *    below it are made stale, if any, when the caller asks so.
  *
  * Results:
- *    Zero on success, returns a handle to the created search.
- *    Non-zero on failure.
+ *    None.
  *
  * Side effects:
- *    Memory allocation on success
+ *    May bump the cache generation.
  *
  *-----------------------------------------------------------------------------
  */
 
-HgfsInternalStatus
-HgfsServerSearchRealDir(char const *baseDir,      // IN: Directory to search
-                        size_t baseDirLen,        // IN: Length of directory
-                        char const *shareName,    // IN: Share name containing the directory
-                        char const *rootDir,      // IN: Shared folder root directory
-                        HgfsSessionInfo *session, // IN: Session info
-                        HgfsHandle *handle)       // OUT: Search handle
+static void
+HgfsNameCacheInvalidateInternal(const char *localName,  // IN: changed name
+                                Bool tree)              // IN: and below it
 {
-   HgfsSearch *search = NULL;
-   HgfsInternalStatus status = 0;
-   HgfsNameStatus nameStatus;
-   Bool followSymlinks;
-   HgfsShareOptions configOptions;
+   HgfsNameCacheDir *dir;
+   const char *sep;
+   size_t localNameLen;
 
-   ASSERT(baseDir);
-   ASSERT(handle);
-   ASSERT(shareName);
+   ASSERT(localName);
 
-   MXUser_AcquireExclLock(session->searchArrayLock);
+   localNameLen = strlen(localName);
+   sep = strrchr(localName, DIRSEPC);
 
-   search = HgfsAddNewSearch(baseDir, DIRECTORY_SEARCH_TYPE_DIR, shareName,
-                             rootDir, session);
-   if (!search) {
-      LOG(4, ("%s: failed to get new search\n", __FUNCTION__));
-      status = HGFS_ERROR_INTERNAL;
-      goto out;
-   }
+   MXUser_AcquireExclLock(gHgfsNameCacheLock);
 
-   /* Get the config options. */
-   nameStatus = HgfsServerPolicy_GetShareOptions(shareName, strlen(shareName),
-                                                 &configOptions);
-   if (nameStatus != HGFS_NAME_STATUS_COMPLETE) {
-      LOG(4, ("%s: no matching share: %s.\n", __FUNCTION__, shareName));
-      status = HGFS_ERROR_INTERNAL;
-      HgfsRemoveSearchInternal(search, session);
-      goto out;
-   }
+   if (NULL != sep) {
+      DblLnkLst_Links *link;
+      DblLnkLst_Links *nextLink;
 
-   followSymlinks = HgfsServerPolicy_IsShareOptionSet(configOptions,
-                                                      HGFS_SHARE_FOLLOW_SYMLINKS);
+      /* Hold the directory while its entries are removed. */
+      dir = HgfsNameCacheDirGet(localName, sep - localName);
+      dir->numBelow++;
 
-   status = HgfsPlatformScandir(baseDir, baseDirLen, followSymlinks,
-                                &search->dents, &search->numDents);
-   if (HGFS_ERROR_SUCCESS != status) {
-      LOG(4, ("%s: couldn't scandir\n", __FUNCTION__));
-      HgfsRemoveSearchInternal(search, session);
-      goto out;
-   }
+      DblLnkLst_ForEachSafe(link, nextLink, &dir->entries) {
+         HgfsNameCacheEntry *entry =
+            DblLnkLst_Container(link, HgfsNameCacheEntry, dirLinks);
 
-   *handle = HgfsSearch2SearchHandle(search);
+         if (entry->caseInsensitive ||
+             (entry->localNameLen == localNameLen &&
+              memcmp(entry->localName, localName, localNameLen) == 0)) {
+            HgfsNameCacheRemove(entry);
+         }
+      }
+      HgfsNameCacheDirPut(dir);
+   }
 
-  out:
-   MXUser_ReleaseExclLock(session->searchArrayLock);
+   if (tree &&
+       HashTable_Lookup(gHgfsNameCacheDirs, localName, (void **)&dir)) {
+      LOG(4, ("%s: %u names below \"%s\" made stale\n", __FUNCTION__,
+              dir->numBelow, localName));
+      gHgfsNameCacheGeneration++;
+   }
 
-   return status;
+   MXUser_ReleaseExclLock(gHgfsNameCacheLock);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsServerSearchVirtualDir --
+ * HgfsNameCacheInvalidate --
  *
- *    Handle a search on a virtual directory (i.e. one that does not
- *    really exist on the server). Takes a pointer to an enumerator
- *    for the directory's contents and returns a handle to a search that is
- *    correctly set up with the virtual directory's entries.
+ *    Invalidate the cached names of a file or directory which was created
+ *    or deleted, and so has nothing below it.
  *
  * Results:
- *    Zero on success, returns a handle to the created search.
- *    Non-zero on failure.
+ *    None.
  *
  * Side effects:
- *    Memory allocation on success
+ *    None.
  *
  *-----------------------------------------------------------------------------
  */
 
-HgfsInternalStatus
+static void
+HgfsNameCacheInvalidate(const char *localName)  // IN: changed local name
+{
+   HgfsNameCacheInvalidateInternal(localName, FALSE);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNameCacheInvalidateTree --
+ *
+ *    Invalidate the cached names of a file or directory which was renamed or
+ *    replaced, and of everything below it.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    May make all the cached names stale.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNameCacheInvalidateTree(const char *localName)  // IN: changed local name
+{
+   HgfsNameCacheInvalidateInternal(localName, TRUE);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNameCacheInvalidateHandle --
+ *
+ *    Invalidate the cached names of the file or directory of a handle
+ *    which is about to be deleted.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNameCacheInvalidateHandle(HgfsHandle handle,          // IN: file handle
+                              HgfsSessionInfo *session)   // IN: session info
+{
+   char *localName;
+   size_t localNameSize;
+
+   if (HgfsHandle2FileName(handle, session, &localName, &localNameSize)) {
+      HgfsNameCacheInvalidate(localName);
+      free(localName);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerGetLocalNameInfo --
+ *
+ *    Construct local name based on the crossplatform CPName for the file and the
+ *    share information.
+ *
+ *    The name returned is allocated and must be freed by the caller.
+ *    The name length is optionally returned.
+ *
+ * Results:
+ *    A status code indicating either success (correspondent share exists) or
+ *    a failure status.
+ *
+ * Side effects:
+ *    Memory allocation in the success case
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsNameStatus
+HgfsServerGetLocalNameInfo(const char *cpName,      // IN:  Cross-platform filename to check
+                           size_t cpNameSize,       // IN:  Size of name cpName
+                           uint32 caseFlags,        // IN:  Case-sensitivity flags
+                           HgfsShareInfo *shareInfo,// OUT: properties of the shared folder
+                           char **bufOut,           // OUT: File name in local fs
+                           size_t *outLen)          // OUT: Length of name out optional
+{
+   HgfsNameStatus nameStatus;
+   const char *inEnd;
+   const char *next;
+   char *myBufOut;
+   char *convertedMyBufOut;
+   char *out;
+   size_t outSize;
+   size_t myBufOutLen;
+   size_t convertedMyBufOutLen;
+   int len;
+   uint32 pathNameLen;
+   char tempBuf[HGFS_PATH_MAX];
+   size_t tempSize;
+   char *tempPtr;
+   uint32 startIndex = 0;
+   HgfsShareOptions shareOptions;
+   char *cacheKey;
+
+   ASSERT(cpName);
+   ASSERT(bufOut);
+
+   inEnd = cpName + cpNameSize;
+
+   if (!Unicode_IsBufferValid(cpName, cpNameSize, STRING_ENCODING_UTF8)) {
+      LOG(4, ("%s: invalid UTF8 string @ %p\n", __FUNCTION__, cpName));
+      return HGFS_NAME_STATUS_FAILURE;
+   }
+
+   /*
+    * Get first component.
+    */
+   len = CPName_GetComponent(cpName, inEnd, &next);
+   if (len < 0) {
+      LOG(4, ("%s: get first component failed\n", __FUNCTION__));
+
+      return HGFS_NAME_STATUS_FAILURE;
+   }
+
+   /* See if we are dealing with the base of the namespace */
+   if (!len) {
+      return HGFS_NAME_STATUS_INCOMPLETE_BASE;
+   }
+
+   /* Check permission on the share and get the share path */
+   nameStatus = HgfsServerPolicy_ProcessCPName(cpName,
+                                               len,
+                                               &shareInfo->readPermissions,
+                                               &shareInfo->writePermissions,
+                                               &shareInfo->handle,
+                                               &shareInfo->rootDir);
+   if (nameStatus != HGFS_NAME_STATUS_COMPLETE) {
+      LOG(4, ("%s: No such share (%s)\n", __FUNCTION__, cpName));
+      return nameStatus;
+   }
+   shareInfo->rootDirLen = strlen(shareInfo->rootDir);
+
+   /* Get the config options. */
+   nameStatus = HgfsServerPolicy_GetShareOptions(cpName, len, &shareOptions);
+   if (nameStatus != HGFS_NAME_STATUS_COMPLETE) {
+      LOG(4, ("%s: no matching share: %s.\n", __FUNCTION__, cpName));
+      return nameStatus;
+   }
+
+   /*
+    * The share permissions and path are always looked up above, the rest
+    * of the resolution may have been done by a recent request.
+    */
+   cacheKey = HgfsNameCacheKey(cpName, cpNameSize, caseFlags, shareOptions);
+   if (HgfsNameCacheLookup(cacheKey, shareInfo->rootDir, &myBufOut,
+                           &myBufOutLen)) {
+      free(cacheKey);
+      cacheKey = NULL;
+      goto checkSymlinks;
+   }
+
+   /* Point to the next component, if any */
+   cpNameSize -= next - cpName;
+   cpName = next;
+
+   /*
+    * Allocate space for the string. We trim the unused space later.
+    */
+
+   outSize = HGFS_PATH_MAX;
+   myBufOut = (char *) malloc(outSize * sizeof *myBufOut);
+   if (!myBufOut) {
+      LOG(4, ("%s: out of memory allocating string\n", __FUNCTION__));
+      free(cacheKey);
+
+      return HGFS_NAME_STATUS_OUT_OF_MEMORY;
+   }
+
+   out = myBufOut;
+
+   /*
+    * See if we are dealing with a "root" share or regular share
+    */
+   if (shareInfo->rootDirLen == 0) {
+      size_t prefixLen;
+
+      /* Are root shares allowed? If not, we exit with an error. */
+      if (0 == (gHgfsCfgSettings.flags & HGFS_CONFIG_SHARE_ALL_HOST_DRIVES_ENABLED)) {
+         LOG(4, ("%s: Root share being used\n", __FUNCTION__));
+         nameStatus = HGFS_NAME_STATUS_ACCESS_DENIED;
+         goto error;
+      }
+
+      /*
+       * This is a "root" share. Interpret the input appropriately as
+       * either a drive letter or UNC name and append it to the output
+       * buffer (for Win32) or simply get the prefix for root (for
+       * linux).
+       */
+      tempSize = sizeof tempBuf;
+      tempPtr = tempBuf;
+      nameStatus = CPName_ConvertFromRoot(&cpName,
+                                          &cpNameSize, &tempSize, &tempPtr);
+      if (nameStatus != HGFS_NAME_STATUS_COMPLETE) {
+         LOG(4, ("%s: ConvertFromRoot not complete\n", __FUNCTION__));
+         goto error;
+      }
+
+      prefixLen = tempPtr - tempBuf;
+
+      /* Copy the UTF8 prefix to the output buffer. */
+      if (prefixLen >= HGFS_PATH_MAX) {
+         Log("%s: error: prefix too long\n", __FUNCTION__);
+         nameStatus = HGFS_NAME_STATUS_TOO_LONG;
+         goto error;
+      }
+
+      memcpy(out, tempBuf, prefixLen);
+      out += prefixLen;
+      *out = 0;
+      outSize -= prefixLen;
+   } else {
+      /*
+       * This is a regular share. Append the path to the out buffer.
+       */
+      if (outSize < shareInfo->rootDirLen + 1) {
+         LOG(4, ("%s: share path too big\n", __FUNCTION__));
+         nameStatus = HGFS_NAME_STATUS_TOO_LONG;
+         goto error;
+      }
+
+      memcpy(out, shareInfo->rootDir, shareInfo->rootDirLen + 1);
+      out += shareInfo->rootDirLen;
+      outSize -= shareInfo->rootDirLen;
+   }
+
+   /* Convert the rest of the input name (if any) to a local name */
+   tempSize = sizeof tempBuf;
+   tempPtr = tempBuf;
+
+
+   if (CPName_ConvertFrom(&cpName, &cpNameSize, &tempSize,
+                          &tempPtr) < 0) {
+      LOG(4, ("%s: CP name conversion failed\n", __FUNCTION__));
+      nameStatus = HGFS_NAME_STATUS_FAILURE;
+      goto error;
+   }
+
+   /*
+    * For volume root directory shares the prefix will have a trailing
+    * separator and since our remaining paths start with a separator, we
+    * will skip over the second separator for this case. Bug 166755.
+    */
+
+   if ((out != myBufOut) && (*(out - 1) == DIRSEPC) && (tempBuf[0] == DIRSEPC)) {
+      startIndex++;
+   }
+   pathNameLen = tempPtr - &tempBuf[startIndex];
+
+   /* Copy UTF8 to the output buffer. */
+   if (pathNameLen >= outSize) {
+      LOG(4, ("%s: pathname too long\n", __FUNCTION__));
+      nameStatus = HGFS_NAME_STATUS_TOO_LONG;
+      goto error;
+   }
+
+   memcpy(out, &tempBuf[startIndex], pathNameLen);
+   outSize -= pathNameLen;
+   out += pathNameLen;
+   *out = 0;
+   myBufOutLen = out - myBufOut;
+
+#if defined(__APPLE__)
+   {
+      size_t nameLen;
+      /*
+       * For Mac hosts the unicode format is decomposed (form D)
+       * so there is a need to convert the incoming name from HGFS clients
+       * which is assumed to be in the normalized form C (precomposed).
+       */
+
+      if (!CodeSet_Utf8FormCToUtf8FormD(myBufOut, myBufOutLen, &tempPtr,
+                                        &nameLen)) {
+         LOG(4, ("%s: unicode conversion to form D failed.\n", __FUNCTION__));
+         nameStatus = HGFS_NAME_STATUS_FAILURE;
+         goto error;
+      }
+
+      free(myBufOut);
+      LOG(4, ("%s: name is \"%s\"\n", __FUNCTION__, tempPtr));
+
+      /* Save returned pointers, update buffer length. */
+      myBufOut = tempPtr;
+      out = tempPtr + nameLen;
+      myBufOutLen = nameLen;
+   }
+#endif /* defined(__APPLE__) */
+
+   /*
+    * Look up the file name using the proper case if the config option is not set
+    * to use the host default and lookup is supported for this platform.
+    */
+
+   if (!HgfsServerPolicy_IsShareOptionSet(shareOptions,
+                                          HGFS_SHARE_HOST_DEFAULT_CASE) &&
+       HgfsPlatformDoFilenameLookup()) {
+      nameStatus = HgfsPlatformFilenameLookup(shareInfo->rootDir, shareInfo->rootDirLen,
+                                              myBufOut, myBufOutLen, caseFlags,
+                                              &convertedMyBufOut,
+                                              &convertedMyBufOutLen);
+
+      /*
+       * On successful lookup, use the found matching file name for further operations.
+       */
+
+      if (nameStatus != HGFS_NAME_STATUS_COMPLETE) {
+         LOG(4, ("%s: HgfsPlatformFilenameLookup failed.\n", __FUNCTION__));
+         goto error;
+      }
+
+      free(myBufOut);
+      myBufOut = convertedMyBufOut;
+      myBufOutLen = convertedMyBufOutLen;
+      ASSERT(myBufOut);
+   }
+
+   {
+      char *p;
+
+      /* Trim unused memory */
+
+      /* Enough space for resulting string + NUL termination */
+      p = realloc(myBufOut, (myBufOutLen + 1) * sizeof *p);
+      if (!p) {
+         LOG(4, ("%s: failed to trim memory\n", __FUNCTION__));
+      } else {
+         myBufOut = p;
+      }
+   }
+
+   /*
+    * The symlink check is not cached: a component may be replaced by a
+    * symlink on the host at any time.
+    */
+   HgfsNameCacheInsert(cacheKey, caseFlags == HGFS_FILE_NAME_CASE_INSENSITIVE,
+                       shareInfo->rootDir, myBufOut, myBufOutLen);
+   cacheKey = NULL;
+
+checkSymlinks:
+   /* Check for symlinks if the followSymlinks option is not set. */
+   if (!HgfsServerPolicy_IsShareOptionSet(shareOptions,
+                                          HGFS_SHARE_FOLLOW_SYMLINKS)) {
+      /*
+       * Verify that either the path is same as share path or the path until the
+       * parent directory is within the share.
+       *
+       * XXX: Symlink check could become susceptible to TOCTOU (time-of-check,
+       * time-of-use) attack when we move to asynchrounous HGFS operations.
+       * We should use the resolved file path for further file system
+       * operations, instead of using the one passed from the client.
+       */
+      nameStatus = HgfsPlatformPathHasSymlink(myBufOut, myBufOutLen, shareInfo->rootDir,
+                                              shareInfo->rootDirLen);
+      if (nameStatus != HGFS_NAME_STATUS_COMPLETE) {
+         LOG(4, ("%s: parent path failed to be resolved: %d\n",
+                 __FUNCTION__, nameStatus));
+         goto error;
+      }
+   }
+
+   if (outLen) {
+      *outLen = myBufOutLen;
+   }
+
+   LOG(4, ("%s: name is \"%s\"\n", __FUNCTION__, myBufOut));
+
+   *bufOut = myBufOut;
+
+   return HGFS_NAME_STATUS_COMPLETE;
+
+error:
+   free(myBufOut);
+   free(cacheKey);
+
+   return nameStatus;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerIsSharedFolderOnly --
+ *
+ *    Test a name if it is a shared folder only or not
+ *
+ *    This function assumes that CPName_GetComponent() will always succeed
+ *    with a size greater than 0, so it must ONLY be called after a call to
+ *    HgfsServerGetLocalNameInfo() that returns HGFS_NAME_STATUS_COMPLETE.
+ *
+ * Results:
+ *    True if it is a shared folder only, otherwise false
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsServerIsSharedFolderOnly(char const *cpName,// IN:  Cross-platform filename to check
+                             size_t cpNameSize) // IN:  Size of name cpName
+{
+   char const *inEnd;
+   char const *next;
+   int len;
+
+   ASSERT(cpName);
+
+   inEnd = cpName + cpNameSize;
+   len = CPName_GetComponent(cpName, inEnd, &next);
+
+   ASSERT(len > 0);
+   (void) len; /* Shuts up gcc's -Werror=unused-but-set-variable. */
+
+   return (next == inEnd);
+}
+
+
+#ifdef VMX86_LOG
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerDirDumpDents --
+ *
+ *    Dump a set of directory entries (debugging code)
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsServerDirDumpDents(HgfsHandle searchHandle,  // IN: Handle to dump dents from
+                       HgfsSessionInfo *session) // IN: Session info
+{
+   HgfsSearch *search;
+
+   MXUser_AcquireForRead(session->searchArrayLock);
+
+   search = HgfsSearchHandle2Search(searchHandle, session);
+   if (search != NULL) {
+      HgfsPlatformDirDumpDents(search);
+   }
+
+   MXUser_ReleaseRWLock(session->searchArrayLock);
+}
+#endif
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerSearchRealDir --
+ *
+ *    Handle a search on a real directory. Takes a pointer to an enumerator
+ *    for the directory's contents and returns a handle to a search that is
+ *    correctly set up with the real directory's entries.
+ *
+ *    The casual reader will notice that the "type" of this search is obviously
+ *    always DIRECTORY_SEARCH_TYPE_DIR, but the caller is nonetheless required
+ *    to pass it in, for completeness' sake with respect to
+ *    HgfsServerSearchVirtualDir.
+ *
+ * Results:
+ *    Zero on success, returns a handle to the created search.
+ *    Non-zero on failure.
+ *
+ * Side effects:
+ *    Memory allocation on success
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsInternalStatus
+HgfsServerSearchRealDir(char const *baseDir,      // IN: Directory to search
+                        size_t baseDirLen,        // IN: Length of directory
+                        char const *shareName,    // IN: Share name containing the directory
+                        char const *rootDir,      // IN: Shared folder root directory
+                        HgfsSessionInfo *session, // IN: Session info
+                        HgfsHandle *handle)       // OUT: Search handle
+{
+   HgfsSearch *search = NULL;
+   HgfsInternalStatus status = 0;
+   HgfsNameStatus nameStatus;
+   Bool followSymlinks;
+   HgfsShareOptions configOptions;
+
+   ASSERT(baseDir);
+   ASSERT(handle);
+   ASSERT(shareName);
+
+   MXUser_AcquireForWrite(session->searchArrayLock);
+
+   search = HgfsAddNewSearch(baseDir, DIRECTORY_SEARCH_TYPE_DIR, shareName,
+                             rootDir, session);
+   if (!search) {
+      LOG(4, ("%s: failed to get new search\n", __FUNCTION__));
+      status = HGFS_ERROR_INTERNAL;
+      goto out;
+   }
+
+   /* Get the config options. */
+   nameStatus = HgfsServerPolicy_GetShareOptions(shareName, strlen(shareName),
+                                                 &configOptions);
+   if (nameStatus != HGFS_NAME_STATUS_COMPLETE) {
+      LOG(4, ("%s: no matching share: %s.\n", __FUNCTION__, shareName));
+      status = HGFS_ERROR_INTERNAL;
+      HgfsRemoveSearchInternal(search, session);
+      goto out;
+   }
+
+   followSymlinks = HgfsServerPolicy_IsShareOptionSet(configOptions,
+                                                      HGFS_SHARE_FOLLOW_SYMLINKS);
+
+   /* The entries are read as the client asks for them. */
+   status = HgfsPlatformScandirOpen(baseDir, baseDirLen, followSymlinks,
+                                    &search->dirStream);
+   if (HGFS_ERROR_SUCCESS != status) {
+      LOG(4, ("%s: couldn't open directory\n", __FUNCTION__));
+      HgfsRemoveSearchInternal(search, session);
+      goto out;
+   }
+
+   *handle = HgfsSearch2SearchHandle(search);
+
+  out:
+   MXUser_ReleaseRWLock(session->searchArrayLock);
+
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerSearchVirtualDir --
+ *
+ *    Handle a search on a virtual directory (i.e. one that does not
+ *    really exist on the server). Takes a pointer to an enumerator
+ *    for the directory's contents and returns a handle to a search that is
+ *    correctly set up with the virtual directory's entries.
+ *
+ * Results:
+ *    Zero on success, returns a handle to the created search.
+ *    Non-zero on failure.
+ *
+ * Side effects:
+ *    Memory allocation on success
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsInternalStatus
 HgfsServerSearchVirtualDir(HgfsServerResEnumGetFunc getName,      // IN: Name enumerator
                            HgfsServerResEnumInitFunc initName,    // IN: Init function
                            HgfsServerResEnumExitFunc cleanupName, // IN: Cleanup function
@@ -5613,39 +7230,1295 @@ HgfsServerSearchVirtualDir(HgfsServerResEnumGetFunc getName,      // IN: Name en
                            HgfsSessionInfo *session,              // IN: Session info
                            HgfsHandle *handle)                    // OUT: Search handle
 {
-   HgfsInternalStatus status = 0;
-   HgfsSearch *search = NULL;
+   HgfsInternalStatus status = 0;
+   HgfsSearch *search = NULL;
+
+   ASSERT(getName);
+   ASSERT(initName);
+   ASSERT(cleanupName);
+   ASSERT(handle);
+
+   MXUser_AcquireForWrite(session->searchArrayLock);
+
+   search = HgfsAddNewSearch("", type, "", "", session);
+   if (!search) {
+      LOG(4, ("%s: failed to get new search\n", __FUNCTION__));
+      status = HGFS_ERROR_INTERNAL;
+      goto out;
+   }
+
+   status = HgfsPlatformScanvdir(getName,
+                                 initName,
+                                 cleanupName,
+                                 type,
+                                 &search->dents,
+                                 &search->numDents);
+   if (HGFS_ERROR_SUCCESS != status) {
+      LOG(4, ("%s: couldn't get dents\n", __FUNCTION__));
+      HgfsRemoveSearchInternal(search, session);
+      goto out;
+   }
+
+   *handle = HgfsSearch2SearchHandle(search);
+
+  out:
+   MXUser_ReleaseRWLock(session->searchArrayLock);
+
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerRestartSearchVirtualDir --
+ *
+ *    Restart a search on a virtual directory (i.e. one that does not
+ *    really exist on the server). Takes a pointer to an enumerator
+ *    for the directory's contents and returns a handle to a search that is
+ *    correctly set up with the virtual directory's entries.
+ *
+ * Results:
+ *    Zero on success, returns a handle to the created search.
+ *    Non-zero on failure.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsInternalStatus
+HgfsServerRestartSearchVirtualDir(HgfsServerResEnumGetFunc getName,      // IN: Name enumerator
+                                  HgfsServerResEnumInitFunc initName,    // IN: Init function
+                                  HgfsServerResEnumExitFunc cleanupName, // IN: Cleanup function
+                                  HgfsSessionInfo *session,              // IN: Session info
+                                  HgfsHandle searchHandle)               // IN: search to restart
+{
+   HgfsInternalStatus status = 0;
+   HgfsSearch *vdirSearch;
+
+   ASSERT(getName);
+   ASSERT(initName);
+   ASSERT(cleanupName);
+   ASSERT(searchHandle);
+
+   MXUser_AcquireForWrite(session->searchArrayLock);
+
+   vdirSearch = HgfsSearchHandle2Search(searchHandle, session);
+   if (NULL == vdirSearch) {
+      status = HGFS_ERROR_INVALID_HANDLE;
+      goto exit;
+   }
+
+   /* Release the virtual directory's old set of entries. */
+   HgfsFreeSearchDirents(vdirSearch);
+
+   /* Restart by rescanning the virtual directory. */
+   status = HgfsPlatformScanvdir(getName,
+                                 initName,
+                                 cleanupName,
+                                 vdirSearch->type,
+                                 &vdirSearch->dents,
+                                 &vdirSearch->numDents);
+   if (HGFS_ERROR_SUCCESS != status) {
+      LOG(4, ("%s: couldn't get root dents %u\n", __FUNCTION__, status));
+      goto exit;
+   }
+
+   /* Clear the flag to indicate that the client has read the entries. */
+   vdirSearch->flags &= ~HGFS_SEARCH_FLAG_READ_ALL_ENTRIES;
+
+exit:
+   MXUser_ReleaseRWLock(session->searchArrayLock);
+
+   LOG(4, ("%s: refreshing dents return %d\n", __FUNCTION__, status));
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerRestartSearchRealDir --
+ *
+ *    Restart a lazy search on a real directory. The buffered entries are
+ *    released and the directory is read again from the start as the client
+ *    asks for the entries.
+ *
+ * Results:
+ *    Zero on success.
+ *    Non-zero on failure.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsInternalStatus
+HgfsServerRestartSearchRealDir(HgfsSessionInfo *session,  // IN: Session info
+                               HgfsHandle searchHandle)   // IN: search to restart
+{
+   HgfsInternalStatus status = 0;
+   HgfsSearch *search;
+
+   MXUser_AcquireForWrite(session->searchArrayLock);
+
+   search = HgfsSearchHandle2Search(searchHandle, session);
+   if (NULL == search) {
+      status = HGFS_ERROR_INVALID_HANDLE;
+      goto exit;
+   }
+
+   if (NULL == search->dirStream) {
+      /* All the entries were read when the search was created. */
+      status = EINVAL;
+      goto exit;
+   }
+
+   status = HgfsPlatformScandirRewind(search);
+   if (HGFS_ERROR_SUCCESS != status) {
+      goto exit;
+   }
+
+   /* Clear the flag to indicate that the client has read the entries. */
+   search->flags &= ~HGFS_SEARCH_FLAG_READ_ALL_ENTRIES;
+
+exit:
+   MXUser_ReleaseRWLock(session->searchArrayLock);
+
+   LOG(4, ("%s: rewinding dents return %d\n", __FUNCTION__, status));
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsRemoveFromCache --
+ *
+ *    Grab a node cache lock and call HgfsRemoveFromCacheInternal.
+ *
+ *    If the node was not already in the cache then nothing is done.
+ *
+ * Results:
+ *    TRUE on success
+ *    FALSE on failure
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsRemoveFromCache(HgfsHandle handle,	      // IN: Hgfs handle to the node
+                    HgfsSessionInfo *session) // IN: Session info
+{
+   Bool removed = FALSE;
+
+   MXUser_AcquireForWrite(session->nodeArrayLock);
+   removed = HgfsRemoveFromCacheInternal(handle, session);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
+
+   return removed;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsIsCached --
+ *
+ *    Check if a node is in the cache. This is the lookup done before using
+ *    the file descriptor of a node, so it counts the cache hits and misses,
+ *    see HgfsNodeCacheAdapt.
+ *
+ *    Unlike HgfsIsCachedInternal it does not move the node to the end of
+ *    the LRU list, which would need the nodeArrayLock for write on every
+ *    read and write: it marks the node referenced instead, and
+ *    HgfsRemoveLruNode gives referenced nodes a second chance.
+ *
+ * Results:
+ *    TRUE if the node is found in the cache.
+ *    FALSE if the node is not in the cache.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsIsCached(HgfsHandle handle,         // IN: Structure representing file node
+             HgfsSessionInfo *session)  // IN: Session info
+{
+   HgfsFileNode *node;
+   Bool cached = FALSE;
+
+   MXUser_AcquireForRead(session->nodeArrayLock);
+   node = HgfsHandle2FileNode(handle, session);
+   if (NULL != node && node->state == FILENODE_STATE_IN_USE_CACHED) {
+      cached = TRUE;
+      /* Skip the write when already set, keeping the node's line shared. */
+      if (0 == Atomic_Read(&node->referenced)) {
+         Atomic_Write(&node->referenced, 1);
+      }
+   }
+
+   if (NULL != node && NULL != node->cacheStats) {
+      if (cached) {
+         Atomic_Inc64(&node->cacheStats->hits);
+         Atomic_Inc64(&session->nodeCacheStats.hits);
+         HgfsServerStats_RecordNodeCache(node->cacheStats->server,
+                                         HGFS_STATS_NODE_CACHE_HIT);
+      } else {
+         Atomic_Inc64(&node->cacheStats->misses);
+         Atomic_Inc64(&session->nodeCacheStats.misses);
+         HgfsServerStats_RecordNodeCache(node->cacheStats->server,
+                                         HGFS_STATS_NODE_CACHE_MISS);
+         Atomic_Inc(&session->nodeCacheMisses);
+      }
+      Atomic_Inc(&session->nodeCacheLookups);
+   }
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
+
+   return cached;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsHoldFd --
+ *
+ *    Mark the file descriptor of a node in use, before the caller gets it
+ *    from the node. With requests running on the worker threads, another
+ *    request may otherwise close it to make room in the node cache while
+ *    the caller still reads or writes it, or the descriptor number may be
+ *    reused for another file.
+ *
+ *    Each successful call is paired with a call to HgfsReleaseFd once the
+ *    file descriptor is no longer used.
+ *
+ * Results:
+ *    TRUE on success.
+ *    FALSE if the handle is not valid.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsHoldFd(HgfsHandle handle,         // IN: Hgfs handle of the node
+           HgfsSessionInfo *session)  // IN: Session info
+{
+   HgfsFileNode *node;
+
+   MXUser_AcquireForRead(session->nodeArrayLock);
+   node = HgfsHandle2FileNode(handle, session);
+   if (NULL != node) {
+      Atomic_Inc(&node->useCount);
+   }
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
+
+   return NULL != node;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsReleaseFd --
+ *
+ *    Release the use of the file descriptor of a node taken by HgfsHoldFd,
+ *    usually through HgfsPlatformGetFd.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    The file may be closed to make room in the node cache again.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsReleaseFd(HgfsHandle handle,         // IN: Hgfs handle of the node
+              HgfsSessionInfo *session)  // IN: Session info
+{
+   HgfsFileNode *node;
+
+   MXUser_AcquireForRead(session->nodeArrayLock);
+   node = HgfsHandle2FileNode(handle, session);
+   if (NULL != node) {
+      ASSERT(Atomic_Read(&node->useCount) > 0);
+      Atomic_Dec(&node->useCount);
+   }
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsRemoveLruNode--
+ *
+ *    Removes the least recently used node in the cache, approximately: the
+ *    first node of the list is the one added or passed over the longest
+ *    ago, and it is removed unless a lookup marked it referenced since, see
+ *    HgfsIsCached. Referenced nodes are unmarked and moved to the end of
+ *    the list (second chance), so a full pass removes a node. Nodes which
+ *    can't be removed, including those in use by another request, are
+ *    moved to the pinned list on the way.
+ *
+ *    XXX: Right now we do not remove nodes that have server locks on them
+ *         This is not correct and should be fixed before the release.
+ *         Instead we should cancel the server lock (by calling IoCancel)
+ *         notify client of the lock break, and close the file.
+ *
+ *    Assumes that there is at least one node in the cache.
+ *
+ *    The session's nodeArrayLock should be acquired prior to calling this
+ *    function.
+ *
+ * Results:
+ *    TRUE on success
+ *    FALSE on failure
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsRemoveLruNode(HgfsSessionInfo *session)   // IN: session info
+{
+   HgfsFileNode *lruNode = NULL;
+   HgfsHandle handle;
+   Bool found = FALSE;
+
+   ASSERT(session);
+   ASSERT(session->numCachedOpenNodes > 0);
+
+   if (!DblLnkLst_IsLinked(&session->nodeCachedList)) {
+      /*
+       * Every cached node is pinned. Give the pinned nodes another look as
+       * some may have lost their server lock or file context since.
+       */
+      DblLnkLst_Links *link, *nextLink;
+
+      DblLnkLst_ForEachSafe(link, nextLink, &session->nodePinnedList) {
+         DblLnkLst_Unlink1(link);
+         DblLnkLst_LinkLast(&session->nodeCachedList, link);
+      }
+   }
+
+   /*
+    * Remove the first item from the list that does not have a server lock,
+    * file context or is open in sequential mode.
+    */
+   while (!found && DblLnkLst_IsLinked(&session->nodeCachedList)) {
+      lruNode = DblLnkLst_Container(session->nodeCachedList.next,
+                                    HgfsFileNode, links);
+
+      ASSERT(lruNode->state == FILENODE_STATE_IN_USE_CACHED);
+      if (lruNode->serverLock != HGFS_LOCK_NONE || lruNode->fileCtx != NULL
+          || (lruNode->flags & HGFS_FILE_NODE_SEQUENTIAL_FL) != 0
+          || Atomic_Read(&lruNode->useCount) != 0
+          || HgfsServerWriteBehindIsDirty(lruNode)) {
+         /*
+	  * Move this node with the server lock to the pinned list.
+	  * Also, prevent files opened in HGFS_FILE_NODE_SEQUENTIAL_FL mode
+	  * from being closed. -- On some platforms, this mode does not
+	  * allow files to be closed/re-opened (eg: When restoring a file
+	  * into a Windows guest you cannot use BackupWrite, then close and
+	  * re-open the file and continue to use BackupWrite.
+	  * Nor close a file another request is reading or writing, see
+	  * HgfsHoldFd, or which has write-behind data not yet written.
+	  */
+         DblLnkLst_Unlink1(&lruNode->links);
+         DblLnkLst_LinkLast(&session->nodePinnedList, &lruNode->links);
+      } else if (0 != Atomic_ReadWrite(&lruNode->referenced, 0)) {
+         /* Used since it was added or last passed over: second chance. */
+         DblLnkLst_Unlink1(&lruNode->links);
+         DblLnkLst_LinkLast(&session->nodeCachedList, &lruNode->links);
+      } else {
+         found = TRUE;
+      }
+   }
+   if (found) {
+      handle = HgfsFileNode2Handle(lruNode);
+      if (!HgfsRemoveFromCacheInternal(handle, session)) {
+         LOG(4, ("%s: Could not remove the node from cache.\n", __FUNCTION__));
+         return FALSE;
+      }
+      Atomic_Inc64(&session->nodeCacheStats.evictions);
+      if (NULL != lruNode->cacheStats) {
+         Atomic_Inc64(&lruNode->cacheStats->evictions);
+         HgfsServerStats_RecordNodeCache(lruNode->cacheStats->server,
+                                         HGFS_STATS_NODE_CACHE_EVICTION);
+      }
+   } else {
+      LOG(4, ("%s: Could not find a node to remove from cache.\n", __FUNCTION__));
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNodeCacheAdapt --
+ *
+ *    Adapt the bound of the open node cache of a session to its use, once
+ *    HGFS_NODE_CACHE_ADAPT_LOOKUPS lookups were counted by HgfsIsCached.
+ *    A full cache that misses often is closing files which are still being
+ *    used and then reopening them, so it doubles, up to
+ *    HGFS_NODE_CACHE_MAX_NODES. A cache that did not miss and is mostly
+ *    empty halves back, never below the configured maxCachedOpenNodes.
+ *
+ *    Called when a node is added to the cache, so not on the path of the
+ *    reads and writes that hit the cache: the bound only matters when
+ *    nodes are added.
+ *
+ *    The session's nodeArrayLock should be acquired for write prior to
+ *    calling this function.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNodeCacheAdapt(HgfsSessionInfo *session)  // IN: session info
+{
+   uint32 maxNodes = session->maxCachedOpenNodes;
+   uint32 lookups;
+   uint32 misses;
+
+   if (Atomic_Read(&session->nodeCacheLookups) <
+          HGFS_NODE_CACHE_ADAPT_LOOKUPS) {
+      return;
+   }
+
+   /* Lookups counted meanwhile by readers go to the next period. */
+   lookups = Atomic_ReadWrite(&session->nodeCacheLookups, 0);
+   misses = Atomic_ReadWrite(&session->nodeCacheMisses, 0);
+
+   if (misses * HGFS_NODE_CACHE_MISS_RATIO > lookups &&
+       session->numCachedOpenNodes >= maxNodes) {
+      maxNodes = MAX(maxNodes, MIN(maxNodes * 2, HGFS_NODE_CACHE_MAX_NODES));
+   } else if (misses == 0 && session->numCachedOpenNodes < maxNodes / 4) {
+      maxNodes = MAX(maxNodes / 2, gHgfsCfgSettings.maxCachedOpenNodes);
+   }
+
+   if (maxNodes != session->maxCachedOpenNodes) {
+      LOG(4, ("%s: session %"FMT64"x %u of %u lookups missed, cache bound "
+              "%u -> %u\n", __FUNCTION__, session->sessionId, misses,
+              lookups, session->maxCachedOpenNodes, maxNodes));
+      session->maxCachedOpenNodes = maxNodes;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNodeCacheShareStats --
+ *
+ *    Find the open node cache counters of a share in a session, adding
+ *    them on the first file opened on the share.
+ *
+ *    The session's nodeArrayLock should be acquired for write prior to
+ *    calling this function.
+ *
+ * Results:
+ *    The share's counters.
+ *
+ * Side effects:
+ *    Memory may be allocated.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsNodeCacheStats *
+HgfsNodeCacheShareStats(char const *shareName,      // IN: share name
+                        size_t shareNameLen,        // IN: share name length
+                        HgfsSessionInfo *session)   // IN: session info
+{
+   HgfsNodeCacheStats *stats;
+   DblLnkLst_Links *link;
+
+   DblLnkLst_ForEach(link, &session->nodeCacheShareStats) {
+      stats = DblLnkLst_Container(link, HgfsNodeCacheStats, links);
+      if (strncmp(stats->shareName, shareName, shareNameLen) == 0 &&
+          stats->shareName[shareNameLen] == '\0') {
+         return stats;
+      }
+   }
+
+   stats = Util_SafeCalloc(1, sizeof *stats);
+   DblLnkLst_Init(&stats->links);
+   stats->shareName = Util_SafeMalloc(shareNameLen + 1);
+   memcpy(stats->shareName, shareName, shareNameLen);
+   stats->shareName[shareNameLen] = '\0';
+   stats->server = HgfsServerStats_GetShare(shareName, shareNameLen);
+   DblLnkLst_LinkLast(&session->nodeCacheShareStats, &stats->links);
+
+   return stats;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsNodeCacheStatsLog --
+ *
+ *    Log the open node cache counters of a session.
+ *
+ *    The session's nodeArrayLock should be acquired prior to calling this
+ *    function.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsNodeCacheStatsLog(HgfsSessionInfo *session)  // IN: session info
+{
+#ifdef VMX86_LOG
+   DblLnkLst_Links *link;
+#endif
+
+   LOG(4, ("%s: session %"FMT64"x: %u of %u nodes cached, hits %"FMT64"u "
+           "misses %"FMT64"u evictions %"FMT64"u\n", __FUNCTION__,
+           session->sessionId, session->numCachedOpenNodes,
+           session->maxCachedOpenNodes,
+           Atomic_Read64(&session->nodeCacheStats.hits),
+           Atomic_Read64(&session->nodeCacheStats.misses),
+           Atomic_Read64(&session->nodeCacheStats.evictions)));
+
+#ifdef VMX86_LOG
+   DblLnkLst_ForEach(link, &session->nodeCacheShareStats) {
+      HgfsNodeCacheStats *stats = DblLnkLst_Container(link, HgfsNodeCacheStats,
+                                                      links);
+
+      LOG(4, ("%s:    share \"%s\": hits %"FMT64"u misses %"FMT64"u "
+              "evictions %"FMT64"u\n", __FUNCTION__, stats->shareName,
+              Atomic_Read64(&stats->hits), Atomic_Read64(&stats->misses),
+              Atomic_Read64(&stats->evictions)));
+   }
+#endif
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsAddToCache --
+ *
+ *    Grabs the cache lock and calls HgfsAddToCacheInternal.
+ *
+ * Results:
+ *    TRUE on success
+ *    FALSE on failure
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsAddToCache(HgfsHandle handle,        // IN: HGFS file handle
+               HgfsSessionInfo *session) // IN: Session info
+{
+   Bool added = FALSE;
+
+   MXUser_AcquireForWrite(session->nodeArrayLock);
+   added = HgfsAddToCacheInternal(handle, session);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
+
+   return added;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsCreateAndCacheFileNode --
+ *
+ *    Get a node from the free node list and cache it.
+ *
+ * Results:
+ *    TRUE on success
+ *    FALSE on failure
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsCreateAndCacheFileNode(HgfsFileOpenInfo *openInfo, // IN: Open info struct
+                           HgfsLocalId const *localId, // IN: Local unique file ID
+                           fileDesc fileDesc,          // IN: Handle to the fileopenInfo,
+                           Bool append,                // IN: flag to append
+                           HgfsSessionInfo *session)   // IN: session info
+{
+   HgfsHandle handle;
+   HgfsFileNode *node = NULL;
+   char const *inEnd;
+   char const *next;
+   int len;
+   Bool sharedFolderOpen = FALSE;
+
+   ASSERT(openInfo);
+   ASSERT(localId);
+   ASSERT(session);
+
+   inEnd = openInfo->cpName + openInfo->cpNameSize;
+
+   /*
+    * Get first component.
+    */
+
+   len = CPName_GetComponent(openInfo->cpName, inEnd, &next);
+   if (len < 0) {
+      LOG(4, ("%s: get first component failed\n", __FUNCTION__));
+      HgfsPlatformCloseFile(fileDesc, NULL);
+      return FALSE;
+   }
+
+   /* See if we are dealing with the base of the namespace */
+   if (!len) {
+      HgfsPlatformCloseFile(fileDesc, NULL);
+      return FALSE;
+   }
+
+   if (!next) {
+      sharedFolderOpen = TRUE;
+   }
+
+   MXUser_AcquireForWrite(session->nodeArrayLock);
+
+   node = HgfsAddNewFileNode(openInfo, localId, fileDesc, append, len,
+                             openInfo->cpName, sharedFolderOpen, session);
+
+   if (node == NULL) {
+      LOG(4, ("%s: Failed to add new node.\n", __FUNCTION__));
+      MXUser_ReleaseRWLock(session->nodeArrayLock);
+
+      HgfsPlatformCloseFile(fileDesc, NULL);
+      return FALSE;
+   }
+   handle = HgfsFileNode2Handle(node);
+
+   if (!HgfsAddToCacheInternal(handle, session)) {
+      HgfsFreeFileNodeInternal(handle, session);
+      HgfsPlatformCloseFile(fileDesc, NULL);
+
+      LOG(4, ("%s: Failed to add node to the cache.\n", __FUNCTION__));
+      MXUser_ReleaseRWLock(session->nodeArrayLock);
+
+      return FALSE;
+   }
+
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
+
+   /* Only after everything is successful, save the handle in the open info. */
+   openInfo->file = handle;
+
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsAllocReply --
+ *
+ *    Retrieves the hgfs protocol reply data buffer that follows the reply header
+ *    and zeroes the header and the first replyInitSize bytes of the reply data.
+ *    The rest of the reply data is left for the caller to fill, e.g. the data
+ *    of a read.
+ *
+ * Results:
+ *    Cannot fail, returns the protocol reply data buffer for the corresponding
+ *    processed protocol request.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void *
+HgfsAllocReply(HgfsPacket *packet,           // IN/OUT: Hgfs Packet
+               const void *packetHeader,     // IN: packet header
+               size_t replyDataSize,         // IN: replyDataSize size
+               size_t replyInitSize,         // IN: reply data size to zero
+               HgfsSessionInfo *session)     // IN: Session Info
+{
+   const HgfsRequest *request = packetHeader;
+   size_t replyPacketSize;
+   size_t headerSize = 0; /* Replies prior to V3 do not have a header. */
+   void *replyHeader;
+   void *replyData;
+
+   /*
+    * XXX - this should be modified to use the common HgfsServerGetReplyHeaderSize
+    * so that all requests and replies are handled consistently.
+    */
+   if (HGFS_OP_NEW_HEADER == request->op) {
+      headerSize = sizeof(HgfsHeader);
+   } else if (request->op < HGFS_OP_CREATE_SESSION_V4 &&
+              request->op > HGFS_OP_RENAME_V2) {
+      headerSize = sizeof(HgfsReply);
+   }
+   replyHeader = HSPU_GetReplyPacket(packet,
+                                     session->transportSession->channelCbTable,
+                                     headerSize + replyDataSize,
+                                     &replyPacketSize);
+
+   ASSERT(replyHeader && (replyPacketSize >= headerSize + replyDataSize));
+
+   ASSERT(replyInitSize <= replyDataSize);
+   memset(replyHeader, 0, headerSize + replyInitSize);
+   if (replyDataSize > 0) {
+      replyData = (char *)replyHeader + headerSize;
+   } else {
+      replyData = NULL;
+      ASSERT(FALSE);
+   }
+
+   return replyData;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsAllocInitReply --
+ *
+ *    Retrieves the hgfs protocol reply data buffer that follows the reply header.
+ *
+ * Results:
+ *    Cannot fail, returns the zeroed protocol reply data buffer for the
+ *    corresponding processed protocol request.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void *
+HgfsAllocInitReply(HgfsPacket *packet,           // IN/OUT: Hgfs Packet
+                   const void *packetHeader,     // IN: packet header
+                   size_t replyDataSize,         // IN: replyDataSize size
+                   HgfsSessionInfo *session)     // IN: Session Info
+{
+   return HgfsAllocReply(packet, packetHeader, replyDataSize, replyDataSize,
+                         session);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerValidateRead --
+ *
+ *    Validate a Read request's arguments.
+ *
+ *    Note, the readOffset is ignored here but is checked in the platform specific
+ *    read handler.
+ *
+ * Results:
+ *    HGFS_ERROR_SUCCESS on success.
+ *    HGFS error code on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsInternalStatus
+HgfsServerValidateRead(HgfsInputParam *input,  // IN: Input params
+                       HgfsHandle readHandle,  // IN: read Handle
+                       uint32 readSize,        // IN: size to read
+                       uint64 readOffset,      // IN: offset to read unused
+                       fileDesc *readfd,       // OUT: read file descriptor
+                       size_t *readReplySize,  // OUT: read reply size
+                       size_t *readDataSize)   // OUT: read data size
+{
+   HgfsInternalStatus status = HGFS_ERROR_SUCCESS;
+   size_t replyReadHeaderSize;
+   size_t replyReadResultSize = 0;
+   size_t replyReadResultDataSize = 0;
+   size_t replyReadDataSize = 0;
+   fileDesc readFileDesc = 0;
+   Bool useMappedBuffer;
+
+   useMappedBuffer = (input->transportSession->channelCbTable->getWriteVa != NULL);
+   replyReadHeaderSize = HgfsServerGetReplyHeaderSize(input->sessionEnabled,
+                                                      input->op);
+   switch (input->op) {
+   case HGFS_OP_READ_FAST_V4:
+      /* Data is packed into a separate buffer from the read results. */
+      replyReadResultSize = sizeof (HgfsReplyReadV3);
+      replyReadResultDataSize = 0;
+      replyReadDataSize = readSize;
+      break;
+   case HGFS_OP_READ_V3:
+      /* Data is packed as a part of the read results. */
+      replyReadResultSize = sizeof (HgfsReplyReadV3);
+      replyReadResultDataSize = readSize;
+      replyReadDataSize = 0;
+      break;
+   case HGFS_OP_READ:
+      /* Data is packed as a part of the read results. */
+      replyReadResultSize = sizeof (HgfsReplyRead);
+      replyReadResultDataSize = readSize;
+      replyReadDataSize = 0;
+      break;
+   default:
+      status = HGFS_ERROR_PROTOCOL;
+      LOG(4, ("%s: Unsupported protocol version passed %d -> PROTOCOL_ERROR.\n",
+               __FUNCTION__, input->op));
+      NOT_IMPLEMENTED();
+      goto exit;
+   }
+
+   if (!HSPU_ValidateDataPacketSize(input->packet, replyReadDataSize) ||
+       !HSPU_ValidateReplyPacketSize(input->packet,
+                                     replyReadHeaderSize,
+                                     replyReadResultSize,
+                                     replyReadResultDataSize,
+                                     useMappedBuffer)) {
+      status = HGFS_ERROR_INVALID_PARAMETER;
+      LOG(4, ("%s: Error: arg validation read size -> %d.\n",
+               __FUNCTION__, status));
+      goto exit;
+   }
+
+   /* Validate the file handle by retrieving it possibly from the cache. */
+   status = HgfsPlatformGetFd(readHandle, input->session, FALSE, &readFileDesc);
+   if (status != HGFS_ERROR_SUCCESS) {
+      LOG(4, ("%s: Error: arg validation handle -> %d.\n",
+               __FUNCTION__, status));
+      goto exit;
+   }
+
+exit:
+   *readDataSize = replyReadDataSize;
+   *readReplySize = replyReadResultSize + replyReadResultDataSize;
+   *readfd = readFileDesc;
+   LOG(4, ("%s: arg validation check return (%"FMTSZ"u) %d.\n",
+            __FUNCTION__, replyReadDataSize, status));
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerReadAheadReset --
+ *
+ *    Forget the read-ahead state of a node and return the bytes it has
+ *    hinted to the global budget.
+ *
+ *    The session's nodeArrayLock should be acquired for write, or for read
+ *    along with the node's lock, prior to calling this function.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerReadAheadReset(HgfsFileNode *node)  // IN/OUT: file node
+{
+   if (node->readAheadCharged != 0) {
+      Atomic_Sub(&gHgfsReadAheadCharged, node->readAheadCharged);
+   }
+   node->readAheadNext = 0;
+   node->readAheadEnd = 0;
+   node->readAheadWindow = 0;
+   node->readAheadCharged = 0;
+}
 
-   ASSERT(getName);
-   ASSERT(initName);
-   ASSERT(cleanupName);
-   ASSERT(handle);
 
-   MXUser_AcquireExclLock(session->searchArrayLock);
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerReadAheadAge --
+ *
+ *    Return to the global budget the bytes hinted for the streams of a
+ *    session that were not read for HGFS_READ_AHEAD_IDLE_US: their readers
+ *    stopped without closing the file, and the host has most likely
+ *    evicted the data by now.
+ *
+ *    Walking the nodes takes every node lock, and the reads call this
+ *    whenever the budget is nearly used up, so a session is only walked
+ *    once per HGFS_READ_AHEAD_AGE_US: more often would only find the few
+ *    streams which went idle meanwhile.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerReadAheadAge(HgfsSessionInfo *session)  // IN: session info
+{
+   uint64 nowUS = Hostinfo_SystemTimerUS();
+   uint64 agedUS = Atomic_Read64(&session->readAheadAgedUS);
+   unsigned int i;
 
-   search = HgfsAddNewSearch("", type, "", "", session);
-   if (!search) {
-      LOG(4, ("%s: failed to get new search\n", __FUNCTION__));
-      status = HGFS_ERROR_INTERNAL;
-      goto out;
+   /* Only the thread that moves the time forward walks the nodes. */
+   if (nowUS - agedUS < HGFS_READ_AHEAD_AGE_US ||
+       Atomic_ReadIfEqualWrite64(&session->readAheadAgedUS, agedUS,
+                                 nowUS) != agedUS) {
+      return;
+   }
+
+   MXUser_AcquireForRead(session->nodeArrayLock);
+
+   for (i = 0; i < session->numNodes; i++) {
+      HgfsFileNode *node = &session->nodeArray[i];
+
+      MXUser_AcquireExclLock(node->lock);
+      if (0 != node->readAheadCharged &&
+          nowUS - node->readAheadTimeUS > HGFS_READ_AHEAD_IDLE_US) {
+         LOG(10, ("%s: handle %u idle, %u bytes returned\n", __FUNCTION__,
+                  HgfsFileNode2Handle(node), node->readAheadCharged));
+         HgfsServerReadAheadReset(node);
+      }
+      MXUser_ReleaseExclLock(node->lock);
+   }
+
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerReadAhead --
+ *
+ *    Sequential access detection for reads. A read starting where the
+ *    previous read of the node ended continues a stream: once less than
+ *    half a window is hinted ahead of the reader, the host is told about
+ *    the next window, which doubles up to HGFS_READ_AHEAD_MAX_WINDOW. Any
+ *    other read ends the stream.
+ *
+ *    Bytes hinted and not yet read are charged to a budget shared by all
+ *    the nodes, so the host page cache is never asked to hold more than
+ *    maxReadAheadBytes on behalf of the readers. The bytes of streams left
+ *    idle are returned by HgfsServerReadAheadAge. Nodes opened sequential
+ *    have no meaningful offsets and are never read ahead.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    May start host I/O on the file.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerReadAhead(HgfsHandle file,           // IN: Hgfs file handle
+                    fileDesc readFd,           // IN: file descriptor of file
+                    uint64 offset,             // IN: offset of the read
+                    uint32 size,               // IN: size of the read
+                    HgfsSessionInfo *session)  // IN: session info
+{
+   uint32 maxCharged = gHgfsCfgSettings.maxReadAheadBytes;
+   uint64 readEnd = offset + size;
+   uint64 hintOffset = 0;
+   uint32 hintSize = 0;
+   uint32 charged;
+   HgfsFileNode *node;
+
+   if (0 == maxCharged || 0 == size) {
+      return;
+   }
+
+   /* Make room from the idle streams before the budget runs out. */
+   if (Atomic_Read(&gHgfsReadAheadCharged) + HGFS_READ_AHEAD_MAX_WINDOW >
+       maxCharged) {
+      HgfsServerReadAheadAge(session);
+   }
+
+   MXUser_AcquireForRead(session->nodeArrayLock);
+
+   node = HgfsHandle2FileNode(file, session);
+   if (NULL == node ||
+       node->fileDesc != readFd ||
+       0 != (node->flags & HGFS_FILE_NODE_SEQUENTIAL_FL)) {
+      MXUser_ReleaseRWLock(session->nodeArrayLock);
+      return;
+   }
+
+   MXUser_AcquireExclLock(node->lock);
+   node->readAheadTimeUS = Hostinfo_SystemTimerUS();
+
+   if (offset != node->readAheadNext) {
+      /* Random access: end the stream, the next read may start a new one. */
+      HgfsServerReadAheadReset(node);
+      node->readAheadNext = readEnd;
+      goto exit;
+   }
+
+   /* Only what is hinted beyond this read stays charged. */
+   charged = node->readAheadEnd > readEnd ?
+             (uint32)MIN(node->readAheadEnd - readEnd, node->readAheadCharged) : 0;
+   Atomic_Sub(&gHgfsReadAheadCharged, node->readAheadCharged - charged);
+   node->readAheadCharged = charged;
+   node->readAheadNext = readEnd;
+
+   if (node->readAheadEnd < readEnd) {
+      node->readAheadEnd = readEnd;
+   }
+   if (node->readAheadEnd - readEnd >= node->readAheadWindow / 2 &&
+       0 != node->readAheadWindow) {
+      goto exit;
+   }
+
+   node->readAheadWindow = (0 == node->readAheadWindow) ?
+                           HGFS_READ_AHEAD_MIN_WINDOW :
+                           MIN(node->readAheadWindow * 2,
+                               HGFS_READ_AHEAD_MAX_WINDOW);
+   hintOffset = node->readAheadEnd;
+   hintSize = node->readAheadWindow;
+
+   /* Take the hint out of the budget, trimmed to what is left of it. */
+   charged = Atomic_ReadAdd32(&gHgfsReadAheadCharged, hintSize);
+   if (charged >= maxCharged) {
+      Atomic_Sub(&gHgfsReadAheadCharged, hintSize);
+      hintSize = 0;
+   } else if (charged + hintSize > maxCharged) {
+      Atomic_Sub(&gHgfsReadAheadCharged, charged + hintSize - maxCharged);
+      hintSize = maxCharged - charged;
+   }
+   node->readAheadCharged += hintSize;
+   node->readAheadEnd += hintSize;
+
+exit:
+   MXUser_ReleaseExclLock(node->lock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
+
+   if (0 != hintSize) {
+      LOG(10, ("%s: handle %u read ahead %u bytes at %"FMT64"u\n",
+               __FUNCTION__, file, hintSize, hintOffset));
+      HgfsPlatformReadAhead(readFd, hintOffset, hintSize);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerRead --
+ *
+ *    Handle a Read request.
+ *
+ * Results:
+ *    HGFS_ERROR_SUCCESS on success.
+ *    HGFS error code on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerRead(HgfsInputParam *input)  // IN: Input params
+{
+   HgfsInternalStatus status;
+   HgfsHandle file;
+   fileDesc readFd;
+   uint64 offset;
+   uint32 requiredSize;
+   size_t replyPayloadSize = 0;
+   size_t replyReadSize = 0;
+   size_t replyReadDataSize = 0;
+   void *replyRead;
+   Bool fdHeld = FALSE;
+
+   HGFS_ASSERT_INPUT(input);
+
+   if (!HgfsUnpackReadRequest(input->payload, input->payloadSize, input->op, &file,
+                              &offset, &requiredSize)) {
+      LOG(4, ("%s: Failed to unpack a valid packet -> PROTOCOL_ERROR.\n", __FUNCTION__));
+      status = HGFS_ERROR_PROTOCOL;
+      goto exit;
+   }
+
+   /*
+    * Validate the read arguments with the data and reply buffers to ensure
+    * there isn't a malformed request or we read more data than the buffer can
+    * hold.
+    */
+   status = HgfsServerValidateRead(input,
+                                   file,
+                                   requiredSize,
+                                   offset,
+                                   &readFd,
+                                   &replyReadSize,
+                                   &replyReadDataSize);
+   if (status != HGFS_ERROR_SUCCESS) {
+      LOG(4, ("%s: Error: validate args %u.\n", __FUNCTION__, status));
+      goto exit;
+   }
+   fdHeld = TRUE;
+
+   HgfsServerReadAhead(file, readFd, offset, requiredSize, input->session);
+
+   /* Only the reply arguments need zeroing, the read fills the data. */
+   replyRead = HgfsAllocReply(input->packet,
+                              input->request,
+                              replyReadSize,
+                              (HGFS_OP_READ == input->op) ?
+                                 offsetof(HgfsReplyRead, payload) :
+                                 offsetof(HgfsReplyReadV3, payload),
+                              input->session);
+
+   switch (input->op) {
+   case HGFS_OP_READ_FAST_V4:
+   case HGFS_OP_READ_V3: {
+         HgfsReplyReadV3 *reply = replyRead;
+         Bool readUseDataBuffer = replyReadDataSize != 0;
+         uint32 actualSize = 0;
+
+         /*
+          * The read data size holds the size of the data to read which will be read
+          * into the separate data packet buffer. Zero indicates data is read into the
+          * same buffer as the reply arguments.
+          *
+          * The data packet is read into directly through its guest mappings,
+          * it is never bounced through a contiguous buffer.
+          */
+         if (readUseDataBuffer) {
+            HgfsVmxIov *dataIov;
+            uint32 dataIovCount;
+
+            dataIov = HSPU_GetDataPacketIov(input->packet, BUF_WRITEABLE,
+                                            input->transportSession->channelCbTable,
+                                            &dataIovCount);
+            if (NULL == dataIov) {
+               status = HGFS_ERROR_PROTOCOL;
+               LOG(4, ("%s: V3/V4 Failed to get payload -> PROTOCOL_ERROR.\n", __FUNCTION__));
+               break;
+            }
+            status = HgfsPlatformReadFileV(readFd, input->session, offset,
+                                           requiredSize, dataIov, dataIovCount,
+                                           &actualSize);
+         } else {
+            status = HgfsPlatformReadFile(readFd, input->session, offset,
+                                          requiredSize, &reply->payload[0],
+                                          &actualSize);
+         }
+         if (HGFS_ERROR_SUCCESS == status) {
+            reply->actualSize = actualSize;
+            reply->reserved = 0;
+            replyPayloadSize = sizeof *reply;
+
+            if (readUseDataBuffer) {
+               HSPU_SetDataPacketSize(input->packet, actualSize);
+            } else {
+               replyPayloadSize += actualSize;
+            }
+         }
+         break;
+      }
+   case HGFS_OP_READ: {
+         HgfsReplyRead *reply = replyRead;
+
+         status = HgfsPlatformReadFile(readFd, input->session, offset, requiredSize,
+                                       reply->payload, &reply->actualSize);
+         if (HGFS_ERROR_SUCCESS == status) {
+            replyPayloadSize = sizeof *reply + reply->actualSize;
+         } else {
+            LOG(4, ("%s: V1 Failed to read-> %d.\n", __FUNCTION__, status));
+         }
+         break;
+      }
+   default:
+      NOT_REACHED();
+      break;
+   }
+
+exit:
+   if (fdHeld) {
+      HgfsReleaseFd(file, input->session);
    }
+   HgfsServerCompleteRequest(status, replyPayloadSize, input);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerWriteBehindTakeError --
+ *
+ *    Get and clear the deferred error of a write-behind buffer.
+ *
+ *    The node's lock must be acquired.
+ *
+ * Results:
+ *    The error of a flush not yet returned to the client, or
+ *    HGFS_ERROR_SUCCESS.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsInternalStatus
+HgfsServerWriteBehindTakeError(HgfsWriteBehind *writeBehind,  // IN/OUT: buffer
+                               HgfsSessionInfo *session)      // IN: session info
+{
+   HgfsInternalStatus status;
 
-   status = HgfsPlatformScanvdir(getName,
-                                 initName,
-                                 cleanupName,
-                                 type,
-                                 &search->dents,
-                                 &search->numDents);
-   if (HGFS_ERROR_SUCCESS != status) {
-      LOG(4, ("%s: couldn't get dents\n", __FUNCTION__));
-      HgfsRemoveSearchInternal(search, session);
-      goto out;
+   if (NULL == writeBehind ||
+       HGFS_ERROR_SUCCESS == writeBehind->error) {
+      return HGFS_ERROR_SUCCESS;
    }
 
-   *handle = HgfsSearch2SearchHandle(search);
-
-  out:
-   MXUser_ReleaseExclLock(session->searchArrayLock);
+   status = writeBehind->error;
+   writeBehind->error = HGFS_ERROR_SUCCESS;
+   Atomic_Dec(&session->numWriteBehindErrors);
 
    return status;
 }
@@ -5654,16 +8527,15 @@ HgfsServerSearchVirtualDir(HgfsServerResEnumGetFunc getName,      // IN: Name en
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsServerRestartSearchVirtualDir --
+ * HgfsServerWriteBehindClean --
  *
- *    Restart a search on a virtual directory (i.e. one that does not
- *    really exist on the server). Takes a pointer to an enumerator
- *    for the directory's contents and returns a handle to a search that is
- *    correctly set up with the virtual directory's entries.
+ *    Free the data of a write-behind buffer, written or dropped, and take
+ *    the buffer off the session's list of buffers holding data.
+ *
+ *    The node's lock must be acquired.
  *
  * Results:
- *    Zero on success, returns a handle to the created search.
- *    Non-zero on failure.
+ *    None.
  *
  * Side effects:
  *    None.
@@ -5671,594 +8543,704 @@ HgfsServerSearchVirtualDir(HgfsServerResEnumGetFunc getName,      // IN: Name en
  *-----------------------------------------------------------------------------
  */
 
-HgfsInternalStatus
-HgfsServerRestartSearchVirtualDir(HgfsServerResEnumGetFunc getName,      // IN: Name enumerator
-                                  HgfsServerResEnumInitFunc initName,    // IN: Init function
-                                  HgfsServerResEnumExitFunc cleanupName, // IN: Cleanup function
-                                  HgfsSessionInfo *session,              // IN: Session info
-                                  HgfsHandle searchHandle)               // IN: search to restart
+static void
+HgfsServerWriteBehindClean(HgfsWriteBehind *writeBehind,  // IN/OUT: buffer
+                           HgfsSessionInfo *session)      // IN: session info
 {
-   HgfsInternalStatus status = 0;
-   HgfsSearch *vdirSearch;
+   if (NULL == writeBehind->data) {
+      return;
+   }
 
-   ASSERT(getName);
-   ASSERT(initName);
-   ASSERT(cleanupName);
-   ASSERT(searchHandle);
+   MXUser_AcquireExclLock(gHgfsWriteBehindLock);
+   DblLnkLst_Unlink1(&writeBehind->links);
+   MXUser_ReleaseExclLock(gHgfsWriteBehindLock);
 
-   MXUser_AcquireExclLock(session->searchArrayLock);
+   free(writeBehind->data);
+   writeBehind->data = NULL;
+   writeBehind->size = 0;
+   Atomic_Dec(&session->numWriteBehindNodes);
+}
 
-   vdirSearch = HgfsSearchHandle2Search(searchHandle, session);
-   if (NULL == vdirSearch) {
-      status = HGFS_ERROR_INVALID_HANDLE;
-      goto exit;
-   }
 
-   /* Release the virtual directory's old set of entries. */
-   HgfsFreeSearchDirents(vdirSearch);
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerWriteBehindIsDirty --
+ *
+ *    Check if a node has write-behind data, which must be written before
+ *    its file is closed.
+ *
+ *    The session's nodeArrayLock must be acquired for write. A node being
+ *    written to is held by the write request, see HgfsHoldFd, so only a
+ *    node being flushed can change meanwhile, from dirty to clean.
+ *
+ * Results:
+ *    TRUE if the node has data to write, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-   /* Restart by rescanning the virtual directory. */
-   status = HgfsPlatformScanvdir(getName,
-                                 initName,
-                                 cleanupName,
-                                 vdirSearch->type,
-                                 &vdirSearch->dents,
-                                 &vdirSearch->numDents);
-   if (HGFS_ERROR_SUCCESS != status) {
-      LOG(4, ("%s: couldn't get root dents %u\n", __FUNCTION__, status));
-      goto exit;
-   }
+static Bool
+HgfsServerWriteBehindIsDirty(HgfsFileNode const *node)  // IN: file node
+{
+   Bool dirty;
 
-   /* Clear the flag to indicate that the client has read the entries. */
-   vdirSearch->flags &= ~HGFS_SEARCH_FLAG_READ_ALL_ENTRIES;
+   if (NULL == node->writeBehind) {
+      return FALSE;
+   }
 
-exit:
-   MXUser_ReleaseExclLock(session->searchArrayLock);
+   MXUser_AcquireExclLock(gHgfsWriteBehindLock);
+   dirty = DblLnkLst_IsLinked(&node->writeBehind->links);
+   MXUser_ReleaseExclLock(gHgfsWriteBehindLock);
 
-   LOG(4, ("%s: refreshing dents return %d\n", __FUNCTION__, status));
-   return status;
+   return dirty;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsRemoveFromCache --
+ * HgfsServerWriteBehindReset --
  *
- *    Grab a node cache lock and call HgfsRemoveFromCacheInternal.
+ *    Drop the write-behind data and any deferred error of a node without
+ *    writing them.
  *
- *    If the node was not already in the cache then nothing is done.
+ *    The session's nodeArrayLock must be acquired for write.
  *
  * Results:
- *    TRUE on success
- *    FALSE on failure
+ *    None.
  *
  * Side effects:
- *    None
+ *    Waits for a flush of the node in progress.
  *
  *-----------------------------------------------------------------------------
  */
 
-Bool
-HgfsRemoveFromCache(HgfsHandle handle,	      // IN: Hgfs handle to the node
-                    HgfsSessionInfo *session) // IN: Session info
+static void
+HgfsServerWriteBehindReset(HgfsFileNode *node,        // IN/OUT: file node
+                           HgfsSessionInfo *session)  // IN: session info
 {
-   Bool removed = FALSE;
+   HgfsWriteBehind *writeBehind = node->writeBehind;
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
-   removed = HgfsRemoveFromCacheInternal(handle, session);
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   if (NULL == writeBehind) {
+      return;
+   }
 
-   return removed;
+   MXUser_AcquireExclLock(node->lock);
+   HgfsServerWriteBehindClean(writeBehind, session);
+   HgfsServerWriteBehindTakeError(writeBehind, session);
+   node->writeBehind = NULL;
+   MXUser_ReleaseExclLock(node->lock);
+
+   free(writeBehind);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsIsCached --
+ * HgfsServerWriteBehindFlush --
  *
- *    Grab a lock and call HgfsIsCachedInternal.
+ *    Write the data of a write-behind buffer to its file. The writes it
+ *    holds were already reported as done to the client, so a failure is
+ *    recorded in the buffer and returned by the next request on the handle.
+ *
+ *    The node's lock must be acquired, which keeps the file open and the
+ *    other writes of the node waiting. The nodeArrayLock is not needed and
+ *    should not be held, so that the requests of the other nodes go on.
  *
  * Results:
- *    TRUE if the node is found in the cache.
- *    FALSE if the node is not in the cache.
+ *    None.
  *
  * Side effects:
- *    None
+ *    May set writeBehind->error.
  *
  *-----------------------------------------------------------------------------
  */
 
-Bool
-HgfsIsCached(HgfsHandle handle,         // IN: Structure representing file node
-             HgfsSessionInfo *session)  // IN: Session info
+static void
+HgfsServerWriteBehindFlush(HgfsWriteBehind *writeBehind,  // IN/OUT: buffer
+                           HgfsSessionInfo *session)      // IN: session info
 {
-   Bool cached = FALSE;
+   HgfsInternalStatus status = HGFS_ERROR_SUCCESS;
+   uint32 flushedSize = 0;
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
-   cached = HgfsIsCachedInternal(handle, session);
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   if (NULL == writeBehind || NULL == writeBehind->data) {
+      return;
+   }
 
-   return cached;
+   while (flushedSize < writeBehind->size) {
+      uint32 writtenSize = 0;
+
+      status = HgfsPlatformWriteFile(writeBehind->fileDesc,
+                                     session,
+                                     writeBehind->offset + flushedSize,
+                                     writeBehind->size - flushedSize,
+                                     writeBehind->flags,
+                                     writeBehind->sequential,
+                                     writeBehind->append,
+                                     writeBehind->data + flushedSize,
+                                     &writtenSize);
+      if (HGFS_ERROR_SUCCESS == status && 0 == writtenSize) {
+         status = HGFS_ERROR_IO;
+      }
+      if (HGFS_ERROR_SUCCESS != status) {
+         break;
+      }
+      flushedSize += writtenSize;
+   }
+
+   LOG(4, ("%s: fd %u flushed %u of %u bytes: %d\n", __FUNCTION__,
+           writeBehind->fileDesc, flushedSize, writeBehind->size,
+           status));
+
+   /* Keep the first error, later writes may depend on the lost data. */
+   if (HGFS_ERROR_SUCCESS != status &&
+       HGFS_ERROR_SUCCESS == writeBehind->error) {
+      writeBehind->error = status;
+      Atomic_Inc(&session->numWriteBehindErrors);
+   }
+
+   HgfsServerWriteBehindClean(writeBehind, session);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsRemoveLruNode--
+ * HgfsServerWriteBehindAcquire --
  *
- *    Removes the least recently used node in the cache. The first node is
- *    removed since most recently used nodes are moved to the end of the
- *    list.
+ *    Find the node of a handle and acquire its lock, which protects the
+ *    write-behind buffer of the node. The nodeArrayLock is released before
+ *    returning, so the buffer can be flushed with only the node's lock.
  *
- *    XXX: Right now we do not remove nodes that have server locks on them
- *         This is not correct and should be fixed before the release.
- *         Instead we should cancel the server lock (by calling IoCancel)
- *         notify client of the lock break, and close the file.
+ * Results:
+ *    The node's lock, to be released by the caller, and the write-behind
+ *    buffer of the node in writeBehind, NULL if the node has none.
+ *    NULL if the handle is not valid.
  *
- *    Assumes that there is at least one node in the cache.
+ * Side effects:
+ *    None.
  *
- *    The session's nodeArrayLock should be acquired prior to calling this
- *    function.
+ *-----------------------------------------------------------------------------
+ */
+
+static MXUserExclLock *
+HgfsServerWriteBehindAcquire(HgfsHandle handle,              // IN: Hgfs file handle
+                             HgfsSessionInfo *session,       // IN: session info
+                             HgfsWriteBehind **writeBehind)  // OUT: buffer
+{
+   MXUserExclLock *lock = NULL;
+   HgfsFileNode *node;
+
+   MXUser_AcquireForRead(session->nodeArrayLock);
+
+   node = HgfsHandle2FileNode(handle, session);
+   if (NULL != node) {
+      lock = node->lock;
+      MXUser_AcquireExclLock(lock);
+      *writeBehind = node->writeBehind;
+   }
+
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
+
+   return lock;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerWriteBehindFlushSession --
+ *
+ *    Write the write-behind data of the nodes of a session, going through
+ *    its list of buffers holding data. The nodeArrayLock is only held to
+ *    get to each node, not while writing.
+ *
+ *    Buffers are taken from the head of the list, so all those which held
+ *    data when called have been written when this returns. The buffers
+ *    filled meanwhile may be left to the next flush, so it ends even if
+ *    writes keep coming.
  *
  * Results:
- *    TRUE on success
- *    FALSE on failure
+ *    None.
  *
  * Side effects:
- *    None
+ *    See HgfsServerWriteBehindFlush.
  *
  *-----------------------------------------------------------------------------
  */
 
-Bool
-HgfsRemoveLruNode(HgfsSessionInfo *session)   // IN: session info
+static void
+HgfsServerWriteBehindFlushSession(HgfsSessionInfo *session)  // IN: session info
 {
-   HgfsFileNode *lruNode = NULL;
-   HgfsHandle handle;
-   Bool found = FALSE;
-   uint32 numOpenNodes = session->numCachedOpenNodes;
+   uint32 numNodes = Atomic_Read(&session->numWriteBehindNodes);
 
-   ASSERT(session);
-   ASSERT(session->numCachedOpenNodes > 0);
-
-   /*
-    * Remove the first item from the list that does not have a server lock,
-    * file context or is open in sequential mode.
-    */
-   while (!found && (numOpenNodes-- > 0)) {
-      lruNode = DblLnkLst_Container(session->nodeCachedList.next,
-                                    HgfsFileNode, links);
+   while (numNodes-- > 0) {
+      HgfsWriteBehind *writeBehind;
+      MXUserExclLock *lock;
+      HgfsHandle handle;
 
-      ASSERT(lruNode->state == FILENODE_STATE_IN_USE_CACHED);
-      if (lruNode->serverLock != HGFS_LOCK_NONE || lruNode->fileCtx != NULL
-          || (lruNode->flags & HGFS_FILE_NODE_SEQUENTIAL_FL) != 0) {
-         /*
-	  * Move this node with the server lock to the beginning of the list.
-	  * Also, prevent files opened in HGFS_FILE_NODE_SEQUENTIAL_FL mode
-	  * from being closed. -- On some platforms, this mode does not
-	  * allow files to be closed/re-opened (eg: When restoring a file
-	  * into a Windows guest you cannot use BackupWrite, then close and
-	  * re-open the file and continue to use BackupWrite.
-	  */
-         DblLnkLst_Unlink1(&lruNode->links);
-         DblLnkLst_LinkLast(&session->nodeCachedList, &lruNode->links);
-      } else {
-         found = TRUE;
+      MXUser_AcquireExclLock(gHgfsWriteBehindLock);
+      if (!DblLnkLst_IsLinked(&session->writeBehindNodes)) {
+         MXUser_ReleaseExclLock(gHgfsWriteBehindLock);
+         break;
       }
-   }
-   if (found) {
-      handle = HgfsFileNode2Handle(lruNode);
-      if (!HgfsRemoveFromCacheInternal(handle, session)) {
-         LOG(4, ("%s: Could not remove the node from cache.\n", __FUNCTION__));
-         return FALSE;
+      writeBehind = DblLnkLst_Container(session->writeBehindNodes.next,
+                                        HgfsWriteBehind, links);
+      handle = writeBehind->handle;
+      MXUser_ReleaseExclLock(gHgfsWriteBehindLock);
+
+      /* The buffer may be flushed or freed meanwhile, start from the handle. */
+      lock = HgfsServerWriteBehindAcquire(handle, session, &writeBehind);
+      if (NULL != lock) {
+         HgfsServerWriteBehindFlush(writeBehind, session);
+         MXUser_ReleaseExclLock(lock);
       }
-   } else {
-      LOG(4, ("%s: Could not find a node to remove from cache.\n", __FUNCTION__));
-      return FALSE;
    }
-
-   return TRUE;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsAddToCache --
+ * HgfsServerWriteBehindFlushHandle --
  *
- *    Grabs the cache lock and calls HgfsAddToCacheInternal.
+ *    Flush the write-behind data of a handle, e.g. about to be closed.
  *
  * Results:
- *    TRUE on success
- *    FALSE on failure
+ *    The deferred error of the handle if a flush failed, which is returned
+ *    for the request on the handle, HGFS_ERROR_SUCCESS otherwise.
  *
  * Side effects:
- *    None
+ *    Clears the deferred error of the handle.
  *
  *-----------------------------------------------------------------------------
  */
 
-Bool
-HgfsAddToCache(HgfsHandle handle,        // IN: HGFS file handle
-               HgfsSessionInfo *session) // IN: Session info
+static HgfsInternalStatus
+HgfsServerWriteBehindFlushHandle(HgfsHandle handle,          // IN: Hgfs file handle
+                                 HgfsSessionInfo *session)   // IN: session info
 {
-   Bool added = FALSE;
+   HgfsInternalStatus status = HGFS_ERROR_SUCCESS;
+   HgfsWriteBehind *writeBehind;
+   MXUserExclLock *lock;
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
-   added = HgfsAddToCacheInternal(handle, session);
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   lock = HgfsServerWriteBehindAcquire(handle, session, &writeBehind);
+   if (NULL != lock) {
+      HgfsServerWriteBehindFlush(writeBehind, session);
+      status = HgfsServerWriteBehindTakeError(writeBehind, session);
+      MXUser_ReleaseExclLock(lock);
+   }
 
-   return added;
+   return status;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsCreateAndCacheFileNode --
+ * HgfsServerWriteBehindRequestFiles --
  *
- *    Get a node from the free node list and cache it.
+ *    Get the handles of the open files a request other than a write or a
+ *    close reads or changes, which fail with the deferred write-behind
+ *    error of the handle.
  *
  * Results:
- *    TRUE on success
- *    FALSE on failure
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerWriteBehindRequestFiles(const HgfsInputParam *input,  // IN: request
+                                  HgfsHandle files[2])          // OUT: handles
+{
+   const HgfsFileNameV3 *fileName = NULL;
+
+   files[0] = HGFS_INVALID_HANDLE;
+   files[1] = HGFS_INVALID_HANDLE;
+
+   switch (input->op) {
+   case HGFS_OP_READ_V3:
+   case HGFS_OP_READ_FAST_V4:
+      if (input->payloadSize >= sizeof (HgfsRequestReadV3)) {
+         files[0] = ((const HgfsRequestReadV3 *)input->payload)->file;
+      }
+      break;
+   case HGFS_OP_GETATTR_V3:
+      if (input->payloadSize >= sizeof (HgfsRequestGetattrV3)) {
+         fileName = &((const HgfsRequestGetattrV3 *)input->payload)->fileName;
+      }
+      break;
+   case HGFS_OP_SETATTR_V3:
+      if (input->payloadSize >= sizeof (HgfsRequestSetattrV3)) {
+         fileName = &((const HgfsRequestSetattrV3 *)input->payload)->fileName;
+      }
+      break;
+   case HGFS_OP_COPY_FILE_RANGE_V4:
+      if (input->payloadSize >= sizeof (HgfsRequestCopyFileRangeV4)) {
+         const HgfsRequestCopyFileRangeV4 *request = input->payload;
+
+         files[0] = request->srcFile;
+         files[1] = request->dstFile;
+      }
+      break;
+   default:
+      break;
+   }
+
+   if (NULL != fileName &&
+       0 != (fileName->flags & HGFS_FILE_NAME_USE_FILE_DESC)) {
+      files[0] = fileName->fid;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerWriteBehindBarrier --
+ *
+ *    Write the write-behind data of a session before processing a request
+ *    other than a write, so that it observes the effect of all the writes
+ *    which were replied to, whatever the handle or name it refers to.
+ *
+ *    A flush which failed is reported to the client by the next request on
+ *    the handle: a write or close returns the error itself, another request
+ *    on the handle such as a read or getattr fails with it here.
+ *
+ * Results:
+ *    The deferred error of a handle the request refers to, which the
+ *    request is failed with, HGFS_ERROR_SUCCESS otherwise.
  *
  * Side effects:
- *    None
+ *    See HgfsServerWriteBehindFlush.
  *
  *-----------------------------------------------------------------------------
  */
 
-Bool
-HgfsCreateAndCacheFileNode(HgfsFileOpenInfo *openInfo, // IN: Open info struct
-                           HgfsLocalId const *localId, // IN: Local unique file ID
-                           fileDesc fileDesc,          // IN: Handle to the fileopenInfo,
-                           Bool append,                // IN: flag to append
-                           HgfsSessionInfo *session)   // IN: session info
+static HgfsInternalStatus
+HgfsServerWriteBehindBarrier(HgfsInputParam *input)  // IN: request
 {
-   HgfsHandle handle;
-   HgfsFileNode *node = NULL;
-   char const *inEnd;
-   char const *next;
-   int len;
-   Bool sharedFolderOpen = FALSE;
-
-   ASSERT(openInfo);
-   ASSERT(localId);
-   ASSERT(session);
-
-   inEnd = openInfo->cpName + openInfo->cpNameSize;
-
-   /*
-    * Get first component.
-    */
+   HgfsSessionInfo *session = input->session;
+   HgfsInternalStatus status = HGFS_ERROR_SUCCESS;
+   HgfsHandle files[2];
+   unsigned int i;
 
-   len = CPName_GetComponent(openInfo->cpName, inEnd, &next);
-   if (len < 0) {
-      LOG(4, ("%s: get first component failed\n", __FUNCTION__));
-      HgfsPlatformCloseFile(fileDesc, NULL);
-      return FALSE;
+   if (NULL == session ||
+       HGFS_OP_WRITE == input->op ||
+       HGFS_OP_WRITE_V3 == input->op ||
+       HGFS_OP_WRITE_FAST_V4 == input->op) {
+      return HGFS_ERROR_SUCCESS;
    }
 
-   /* See if we are dealing with the base of the namespace */
-   if (!len) {
-      HgfsPlatformCloseFile(fileDesc, NULL);
-      return FALSE;
-   }
+   HgfsServerWriteBehindFlushSession(session);
 
-   if (!next) {
-      sharedFolderOpen = TRUE;
+   if (0 == Atomic_Read(&session->numWriteBehindErrors)) {
+      return HGFS_ERROR_SUCCESS;
    }
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
-
-   node = HgfsAddNewFileNode(openInfo, localId, fileDesc, append, len,
-                             openInfo->cpName, sharedFolderOpen, session);
-
-   if (node == NULL) {
-      LOG(4, ("%s: Failed to add new node.\n", __FUNCTION__));
-      MXUser_ReleaseExclLock(session->nodeArrayLock);
-
-      HgfsPlatformCloseFile(fileDesc, NULL);
-      return FALSE;
+   HgfsServerWriteBehindRequestFiles(input, files);
+   for (i = 0; i < ARRAYSIZE(files) && HGFS_ERROR_SUCCESS == status; i++) {
+      if (HGFS_INVALID_HANDLE != files[i]) {
+         status = HgfsServerWriteBehindFlushHandle(files[i], session);
+      }
    }
-   handle = HgfsFileNode2Handle(node);
-
-   if (!HgfsAddToCacheInternal(handle, session)) {
-      HgfsFreeFileNodeInternal(handle, session);
-      HgfsPlatformCloseFile(fileDesc, NULL);
-
-      LOG(4, ("%s: Failed to add node to the cache.\n", __FUNCTION__));
-      MXUser_ReleaseExclLock(session->nodeArrayLock);
 
-      return FALSE;
+   if (HGFS_ERROR_SUCCESS != status) {
+      LOG(4, ("%s: op %d failed with the write-behind error %d\n",
+              __FUNCTION__, input->op, status));
    }
 
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
-
-   /* Only after everything is successful, save the handle in the open info. */
-   openInfo->file = handle;
-
-   return TRUE;
+   return status;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsAllocInitReply --
+ * HgfsServerWriteBehindTimer --
  *
- *    Retrieves the hgfs protocol reply data buffer that follows the reply header.
+ *    Write the write-behind data of the sessions queued since the timer was
+ *    armed and drop the references the queue held on them.
  *
  * Results:
- *    Cannot fail, returns the protocol reply data buffer for the corresponding
- *    processed protocol request.
+ *    None.
  *
  * Side effects:
- *    None
+ *    See HgfsServerWriteBehindFlush.
  *
  *-----------------------------------------------------------------------------
  */
 
-void *
-HgfsAllocInitReply(HgfsPacket *packet,           // IN/OUT: Hgfs Packet
-                   const void *packetHeader,     // IN: packet header
-                   size_t replyDataSize,         // IN: replyDataSize size
-                   HgfsSessionInfo *session)     // IN: Session Info
+static void
+HgfsServerWriteBehindTimer(void *unused)  // IN: unused
 {
-   const HgfsRequest *request = packetHeader;
-   size_t replyPacketSize;
-   size_t headerSize = 0; /* Replies prior to V3 do not have a header. */
-   void *replyHeader;
-   void *replyData;
+   DblLnkLst_Links sessions;
 
-   /*
-    * XXX - this should be modified to use the common HgfsServerGetReplyHeaderSize
-    * so that all requests and replies are handled consistently.
-    */
-   if (HGFS_OP_NEW_HEADER == request->op) {
-      headerSize = sizeof(HgfsHeader);
-   } else if (request->op < HGFS_OP_CREATE_SESSION_V4 &&
-              request->op > HGFS_OP_RENAME_V2) {
-      headerSize = sizeof(HgfsReply);
-   }
-   replyHeader = HSPU_GetReplyPacket(packet,
-                                     session->transportSession->channelCbTable,
-                                     headerSize + replyDataSize,
-                                     &replyPacketSize);
+   /* Sessions queued again while flushing wait for the next expiry. */
+   DblLnkLst_Init(&sessions);
+   MXUser_AcquireExclLock(gHgfsWriteBehindLock);
+   DblLnkLst_Swap(&sessions, &gHgfsWriteBehindSessions);
+   MXUser_ReleaseExclLock(gHgfsWriteBehindLock);
 
-   ASSERT(replyHeader && (replyPacketSize >= headerSize + replyDataSize));
+   while (DblLnkLst_IsLinked(&sessions)) {
+      HgfsSessionInfo *session = DblLnkLst_Container(sessions.next,
+                                                     HgfsSessionInfo,
+                                                     writeBehindLinks);
 
-   memset(replyHeader, 0, headerSize + replyDataSize);
-   if (replyDataSize > 0) {
-      replyData = (char *)replyHeader + headerSize;
-   } else {
-      replyData = NULL;
-      ASSERT(FALSE);
-   }
+      MXUser_AcquireExclLock(gHgfsWriteBehindLock);
+      DblLnkLst_Unlink1(&session->writeBehindLinks);
+      MXUser_ReleaseExclLock(gHgfsWriteBehindLock);
 
-   return replyData;
+      HgfsServerWriteBehindFlushSession(session);
+      HgfsServerSessionPut(session);
+   }
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsServerValidateRead --
+ * HgfsServerWriteBehindQueue --
  *
- *    Validate a Read request's arguments.
+ *    Queue a session which has write-behind data to be flushed by the timer,
+ *    unless it is already queued.
  *
- *    Note, the readOffset is ignored here but is checked in the platform specific
- *    read handler.
+ *    Called with the lock of the node which was buffered acquired.
  *
  * Results:
- *    HGFS_ERROR_SUCCESS on success.
- *    HGFS error code on failure.
+ *    None.
  *
  * Side effects:
- *    None
+ *    Takes a reference on the session until the timer flushes it.
  *
  *-----------------------------------------------------------------------------
  */
 
-static HgfsInternalStatus
-HgfsServerValidateRead(HgfsInputParam *input,  // IN: Input params
-                       HgfsHandle readHandle,  // IN: read Handle
-                       uint32 readSize,        // IN: size to read
-                       uint64 readOffset,      // IN: offset to read unused
-                       fileDesc *readfd,       // OUT: read file descriptor
-                       size_t *readReplySize,  // OUT: read reply size
-                       size_t *readDataSize)   // OUT: read data size
+static void
+HgfsServerWriteBehindQueue(HgfsSessionInfo *session)  // IN: session info
 {
-   HgfsInternalStatus status = HGFS_ERROR_SUCCESS;
-   size_t replyReadHeaderSize;
-   size_t replyReadResultSize = 0;
-   size_t replyReadResultDataSize = 0;
-   size_t replyReadDataSize = 0;
-   fileDesc readFileDesc = 0;
-   Bool useMappedBuffer;
-
-   useMappedBuffer = (input->transportSession->channelCbTable->getWriteVa != NULL);
-   replyReadHeaderSize = HgfsServerGetReplyHeaderSize(input->sessionEnabled,
-                                                      input->op);
-   switch (input->op) {
-   case HGFS_OP_READ_FAST_V4:
-      /* Data is packed into a separate buffer from the read results. */
-      replyReadResultSize = sizeof (HgfsReplyReadV3);
-      replyReadResultDataSize = 0;
-      replyReadDataSize = readSize;
-      break;
-   case HGFS_OP_READ_V3:
-      /* Data is packed as a part of the read results. */
-      replyReadResultSize = sizeof (HgfsReplyReadV3);
-      replyReadResultDataSize = readSize;
-      replyReadDataSize = 0;
-      break;
-   case HGFS_OP_READ:
-      /* Data is packed as a part of the read results. */
-      replyReadResultSize = sizeof (HgfsReplyRead);
-      replyReadResultDataSize = readSize;
-      replyReadDataSize = 0;
-      break;
-   default:
-      status = HGFS_ERROR_PROTOCOL;
-      LOG(4, ("%s: Unsupported protocol version passed %d -> PROTOCOL_ERROR.\n",
-               __FUNCTION__, input->op));
-      NOT_IMPLEMENTED();
-      goto exit;
+   MXUser_AcquireExclLock(gHgfsWriteBehindLock);
+   if (!DblLnkLst_IsLinked(&session->writeBehindLinks)) {
+      HgfsServerSessionGet(session);
+      DblLnkLst_LinkLast(&gHgfsWriteBehindSessions, &session->writeBehindLinks);
    }
+   MXUser_ReleaseExclLock(gHgfsWriteBehindLock);
 
-   if (!HSPU_ValidateDataPacketSize(input->packet, replyReadDataSize) ||
-       !HSPU_ValidateReplyPacketSize(input->packet,
-                                     replyReadHeaderSize,
-                                     replyReadResultSize,
-                                     replyReadResultDataSize,
-                                     useMappedBuffer)) {
-      status = HGFS_ERROR_INVALID_PARAMETER;
-      LOG(4, ("%s: Error: arg validation read size -> %d.\n",
-               __FUNCTION__, status));
-      goto exit;
-   }
+   HgfsThreadpool_ArmTimer(gHgfsWriteBehindTimer);
+}
 
-   /* Validate the file handle by retrieving it possibly from the cache. */
-   status = HgfsPlatformGetFd(readHandle, input->session, FALSE, &readFileDesc);
-   if (status != HGFS_ERROR_SUCCESS) {
-      LOG(4, ("%s: Error: arg validation handle -> %d.\n",
-               __FUNCTION__, status));
-      goto exit;
-   }
 
-exit:
-   *readDataSize = replyReadDataSize;
-   *readReplySize = replyReadResultSize + replyReadResultDataSize;
-   *readfd = readFileDesc;
-   LOG(4, ("%s: arg validation check return (%"FMTSZ"u) %d.\n",
-            __FUNCTION__, replyReadDataSize, status));
-   return status;
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerWriteBehindCoalesces --
+ *
+ *    Check if a write can be appended to the data of a write-behind buffer:
+ *    it has the same flags and continues the buffered run, i.e. starts where
+ *    the run ends or the run does not use offsets because it appends or
+ *    writes sequentially.
+ *
+ *    The node's lock must be acquired.
+ *
+ * Results:
+ *    TRUE if the write coalesces, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsServerWriteBehindCoalesces(HgfsWriteBehind const *writeBehind,  // IN: buffer
+                               uint64 writeOffset,                  // IN: write offset
+                               HgfsWriteFlags writeFlags)           // IN: write flags
+{
+   return NULL != writeBehind &&
+          NULL != writeBehind->data &&
+          writeFlags == writeBehind->flags &&
+          (0 != (writeFlags & HGFS_WRITE_APPEND) ||
+           writeBehind->sequential ||
+           writeBehind->append ||
+           writeOffset == writeBehind->offset + writeBehind->size);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsServerRead --
+ * HgfsServerWriteBehindPrepare --
  *
- *    Handle a Read request.
+ *    Flush the write-behind data of a handle before a write which does not
+ *    coalesce with it, as that write may reopen the file, e.g. to append.
  *
  * Results:
- *    HGFS_ERROR_SUCCESS on success.
- *    HGFS error code on failure.
+ *    The deferred error of the handle if a flush failed, which is returned
+ *    for this write, HGFS_ERROR_SUCCESS otherwise.
  *
  * Side effects:
- *    None
+ *    Clears the deferred error of the handle.
  *
  *-----------------------------------------------------------------------------
  */
 
-static void
-HgfsServerRead(HgfsInputParam *input)  // IN: Input params
+static HgfsInternalStatus
+HgfsServerWriteBehindPrepare(HgfsHandle handle,          // IN: Hgfs file handle
+                             HgfsSessionInfo *session,   // IN: session info
+                             uint64 writeOffset,         // IN: write offset
+                             HgfsWriteFlags writeFlags)  // IN: write flags
 {
-   HgfsInternalStatus status;
-   HgfsHandle file;
-   fileDesc readFd;
-   uint64 offset;
-   uint32 requiredSize;
-   size_t replyPayloadSize = 0;
-   size_t replyReadSize = 0;
-   size_t replyReadDataSize = 0;
-   void *replyRead;
+   HgfsInternalStatus status = HGFS_ERROR_SUCCESS;
+   HgfsWriteBehind *writeBehind;
+   MXUserExclLock *lock;
+
+   lock = HgfsServerWriteBehindAcquire(handle, session, &writeBehind);
+   if (NULL != lock) {
+      if (!HgfsServerWriteBehindCoalesces(writeBehind, writeOffset,
+                                          writeFlags)) {
+         HgfsServerWriteBehindFlush(writeBehind, session);
+      }
+      status = HgfsServerWriteBehindTakeError(writeBehind, session);
+      MXUser_ReleaseExclLock(lock);
+   }
 
-   HGFS_ASSERT_INPUT(input);
+   return status;
+}
 
-   if (!HgfsUnpackReadRequest(input->payload, input->payloadSize, input->op, &file,
-                              &offset, &requiredSize)) {
-      LOG(4, ("%s: Failed to unpack a valid packet -> PROTOCOL_ERROR.\n", __FUNCTION__));
-      status = HGFS_ERROR_PROTOCOL;
-      goto exit;
-   }
 
-   /*
-    * Validate the read arguments with the data and reply buffers to ensure
-    * there isn't a malformed request or we read more data than the buffer can
-    * hold.
-    */
-   status = HgfsServerValidateRead(input,
-                                   file,
-                                   requiredSize,
-                                   offset,
-                                   &readFd,
-                                   &replyReadSize,
-                                   &replyReadDataSize);
-   if (status != HGFS_ERROR_SUCCESS) {
-      LOG(4, ("%s: Error: validate args %u.\n", __FUNCTION__, status));
-      goto exit;
-   }
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerWriteBehind --
+ *
+ *    Write inline data to a file through its node's write-behind buffer.
+ *
+ *    Writes smaller than maxWriteBehindBytes are copied to the buffer and
+ *    reported as done. Following writes which coalesce with them are
+ *    appended until the buffer is full, any other write first flushes the
+ *    buffer. The buffer is written as a whole when the handle is closed,
+ *    before any request other than a write of the session is processed
+ *    (e.g. a read, getattr or rename), when the server lock of the node
+ *    changes, and at the latest HGFS_WRITE_BEHIND_DELAY_MS after it was
+ *    filled. Nodes holding data are not closed to make room in the node
+ *    cache, nor when their share is removed, until it is written.
+ *
+ *    Only nodes in the node cache are buffered, so that their file stays
+ *    open until the buffer is flushed. As nodes holding data are not
+ *    evicted, about one in HGFS_WRITE_BEHIND_CACHE_SHARE of the cached
+ *    nodes at most get a buffer; the writes of the others are not delayed.
+ *    The buffer is protected by the node's lock, which is held without the
+ *    nodeArrayLock while the buffer is written, so a flush only holds up the
+ *    requests of its node.
+ *
+ * Results:
+ *    HGFS_ERROR_SUCCESS and the size written or buffered on success.
+ *    The error of the write or of flushing the buffer to make room for it
+ *    otherwise.
+ *
+ * Side effects:
+ *    May queue the session to the write-behind timer.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-   replyRead = HgfsAllocInitReply(input->packet,
-                                  input->request,
-                                  replyReadSize,
-                                  input->session);
+static HgfsInternalStatus
+HgfsServerWriteBehind(HgfsHandle handle,           // IN: Hgfs file handle
+                      HgfsSessionInfo *session,    // IN: session info
+                      fileDesc writeFd,            // IN: file descriptor
+                      uint64 writeOffset,          // IN: file offset to write to
+                      uint32 writeSize,            // IN: length of data to write
+                      HgfsWriteFlags writeFlags,   // IN: write flags
+                      Bool writeSequential,        // IN: write is sequential
+                      Bool writeAppend,            // IN: write is appended
+                      const void *writeData,       // IN: data to be written
+                      uint32 *writtenSize)         // OUT: length written
+{
+   uint32 maxSize = gHgfsCfgSettings.maxWriteBehindBytes;
+   HgfsInternalStatus status = HGFS_ERROR_SUCCESS;
+   HgfsWriteBehind *writeBehind;
+   MXUserExclLock *lock;
+   Bool buffered = FALSE;
+   uint32 maxNodes;
+   HgfsFileNode *node;
 
-   switch (input->op) {
-   case HGFS_OP_READ_FAST_V4:
-   case HGFS_OP_READ_V3: {
-         HgfsReplyReadV3 *reply = replyRead;
-         void *payload;
-         Bool readUseDataBuffer = replyReadDataSize != 0;
+   MXUser_AcquireForRead(session->nodeArrayLock);
 
-         /*
-          * The read data size holds the size of the data to read which will be read
-          * into the separate data packet buffer. Zero indicates data is read into the
-          * same buffer as the reply arguments.
-          */
-         if (readUseDataBuffer) {
-            payload = HSPU_GetDataPacketBuf(input->packet, BUF_WRITEABLE,
-                                            input->transportSession->channelCbTable);
-         } else {
-            payload = &reply->payload[0];
-         }
-         if (payload) {
-            status = HgfsPlatformReadFile(readFd, input->session, offset,
-                                          requiredSize, payload,
-                                          &reply->actualSize);
-            if (HGFS_ERROR_SUCCESS == status) {
-               reply->reserved = 0;
-               replyPayloadSize = sizeof *reply;
+   node = HgfsHandle2FileNode(handle, session);
+   if (NULL == node ||
+       FILENODE_STATE_IN_USE_CACHED != node->state ||
+       writeFd != node->fileDesc) {
+      MXUser_ReleaseRWLock(session->nodeArrayLock);
+      goto write;
+   }
+
+   maxNodes = session->maxCachedOpenNodes / HGFS_WRITE_BEHIND_CACHE_SHARE;
+   lock = node->lock;
+   MXUser_AcquireExclLock(lock);
+   if (NULL == node->writeBehind) {
+      node->writeBehind = Util_SafeCalloc(1, sizeof *node->writeBehind);
+      DblLnkLst_Init(&node->writeBehind->links);
+      node->writeBehind->handle = handle;
+   }
+   writeBehind = node->writeBehind;
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
+
+   if (HgfsServerWriteBehindCoalesces(writeBehind, writeOffset, writeFlags) &&
+       writeSize <= maxSize - writeBehind->size) {
+      memcpy(writeBehind->data + writeBehind->size, writeData, writeSize);
+      writeBehind->size += writeSize;
+      buffered = TRUE;
+      goto unlock;
+   }
+
+   HgfsServerWriteBehindFlush(writeBehind, session);
+   status = HgfsServerWriteBehindTakeError(writeBehind, session);
+   if (HGFS_ERROR_SUCCESS != status || writeSize >= maxSize ||
+       Atomic_Read(&session->numWriteBehindNodes) >= maxNodes) {
+      goto unlock;
+   }
+
+   writeBehind->data = Util_SafeMalloc(maxSize);
+   memcpy(writeBehind->data, writeData, writeSize);
+   writeBehind->fileDesc = writeFd;
+   writeBehind->offset = writeOffset;
+   writeBehind->size = writeSize;
+   writeBehind->flags = writeFlags;
+   writeBehind->sequential = writeSequential;
+   writeBehind->append = writeAppend;
+   MXUser_AcquireExclLock(gHgfsWriteBehindLock);
+   DblLnkLst_LinkLast(&session->writeBehindNodes, &writeBehind->links);
+   MXUser_ReleaseExclLock(gHgfsWriteBehindLock);
+   if (0 == Atomic_ReadInc32(&session->numWriteBehindNodes)) {
+      HgfsServerWriteBehindQueue(session);
+   }
+   buffered = TRUE;
+
+unlock:
+   MXUser_ReleaseExclLock(lock);
 
-               if (readUseDataBuffer) {
-                  HSPU_SetDataPacketSize(input->packet, reply->actualSize);
-               } else {
-                  replyPayloadSize += reply->actualSize;
-               }
-            }
-         } else {
-            status = HGFS_ERROR_PROTOCOL;
-            LOG(4, ("%s: V3/V4 Failed to get payload -> PROTOCOL_ERROR.\n", __FUNCTION__));
-         }
-         break;
-      }
-   case HGFS_OP_READ: {
-         HgfsReplyRead *reply = replyRead;
+   if (HGFS_ERROR_SUCCESS != status) {
+      return status;
+   }
 
-         status = HgfsPlatformReadFile(readFd, input->session, offset, requiredSize,
-                                       reply->payload, &reply->actualSize);
-         if (HGFS_ERROR_SUCCESS == status) {
-            replyPayloadSize = sizeof *reply + reply->actualSize;
-         } else {
-            LOG(4, ("%s: V1 Failed to read-> %d.\n", __FUNCTION__, status));
-         }
-         break;
-      }
-   default:
-      NOT_REACHED();
-      break;
+   if (buffered) {
+      *writtenSize = writeSize;
+      return HGFS_ERROR_SUCCESS;
    }
 
-exit:
-   HgfsServerCompleteRequest(status, replyPayloadSize, input);
+write:
+   return HgfsPlatformWriteFile(writeFd, session, writeOffset, writeSize,
+                                writeFlags, writeSequential, writeAppend,
+                                writeData, writtenSize);
 }
 
 
@@ -6400,6 +9382,7 @@ HgfsServerValidateWrite(HgfsInputParam *input,     // IN: Input params
    if (!HgfsHandleIsSequentialOpen(writeHandle, input->session, &sequentialHandle)) {
       status = HGFS_ERROR_INVALID_HANDLE;
       LOG(4, ("%s: Could not get sequential open status\n", __FUNCTION__));
+      HgfsReleaseFd(writeHandle, input->session);
       goto exit;
    }
 
@@ -6407,6 +9390,7 @@ HgfsServerValidateWrite(HgfsInputParam *input,     // IN: Input params
    if (!HgfsHandle2AppendFlag(writeHandle, input->session, &appendHandle)) {
       status = HGFS_ERROR_INVALID_HANDLE;
       LOG(4, ("%s: Could not get append mode\n", __FUNCTION__));
+      HgfsReleaseFd(writeHandle, input->session);
       goto exit;
    }
 #endif
@@ -6451,6 +9435,7 @@ HgfsServerWrite(HgfsInputParam *input)  // IN: Input params
    fileDesc writeFd;
    Bool writeSequential;
    Bool writeAppend;
+   Bool fdHeld = FALSE;
 
    HGFS_ASSERT_INPUT(input);
 
@@ -6462,6 +9447,19 @@ HgfsServerWrite(HgfsInputParam *input)  // IN: Input params
       goto exit;
    }
 
+   /*
+    * Return the error of data written behind before this write, and flush
+    * it if this write cannot be added to it.
+    */
+   if (0 != gHgfsCfgSettings.maxWriteBehindBytes) {
+      status = HgfsServerWriteBehindPrepare(writeFile, input->session,
+                                            writeOffset, writeFlags);
+      if (status != HGFS_ERROR_SUCCESS) {
+         LOG(4, ("%s: Error: deferred write %u.\n", __FUNCTION__, status));
+         goto exit;
+      }
+   }
+
    /*
     * Validate the write arguments with the data and request buffers to ensure
     * there isn't a malformed request or we try to write more data than is in the buffer.
@@ -6478,29 +9476,59 @@ HgfsServerWrite(HgfsInputParam *input)  // IN: Input params
       LOG(4, ("%s: Error: validate args %u.\n", __FUNCTION__, status));
       goto exit;
    }
+   fdHeld = TRUE;
 
    if (writeSize > 0) {
-      if (NULL == writeData) {
-         /* No inline data to write, get it from the transport shared memory. */
+      if (NULL != writeData && 0 != gHgfsCfgSettings.maxWriteBehindBytes) {
+         status = HgfsServerWriteBehind(writeFile,
+                                        input->session,
+                                        writeFd,
+                                        writeOffset,
+                                        writeSize,
+                                        writeFlags,
+                                        writeSequential,
+                                        writeAppend,
+                                        writeData,
+                                        &writtenSize);
+      } else if (NULL != writeData) {
+         status = HgfsPlatformWriteFile(writeFd,
+                                        input->session,
+                                        writeOffset,
+                                        writeSize,
+                                        writeFlags,
+                                        writeSequential,
+                                        writeAppend,
+                                        writeData,
+                                        &writtenSize);
+      } else {
+         HgfsVmxIov *dataIov;
+         uint32 dataIovCount;
+
+         /*
+          * No inline data to write, write it straight from the guest mappings
+          * of the transport shared memory.
+          */
          HSPU_SetDataPacketSize(input->packet, writeSize);
-         writeData = HSPU_GetDataPacketBuf(input->packet, BUF_READABLE,
-                                           input->transportSession->channelCbTable);
-         if (NULL == writeData) {
+         dataIov = HSPU_GetDataPacketIov(input->packet, BUF_READABLE,
+                                         input->transportSession->channelCbTable,
+                                         &dataIovCount);
+         if (NULL == dataIov) {
             LOG(4, ("%s: Error: Op %d mapping write data buffer\n", __FUNCTION__, input->op));
             status = HGFS_ERROR_PROTOCOL;
             goto exit;
          }
-      }
 
-      status = HgfsPlatformWriteFile(writeFd,
-                                     input->session,
-                                     writeOffset,
-                                     writeSize,
-                                     writeFlags,
-                                     writeSequential,
-                                     writeAppend,
-                                     writeData,
-                                     &writtenSize);
+         status = HgfsPlatformWriteFileV(writeFd,
+                                         input->session,
+                                         writeOffset,
+                                         writeSize,
+                                         writeFlags,
+                                         writeSequential,
+                                         writeAppend,
+                                         dataIov,
+                                         dataIovCount,
+                                         &writtenSize);
+      }
       if (HGFS_ERROR_SUCCESS != status) {
          goto exit;
       }
@@ -6512,10 +9540,375 @@ HgfsServerWrite(HgfsInputParam *input)  // IN: Input params
    }
 
 exit:
+   if (fdHeld) {
+      HgfsReleaseFd(writeFile, input->session);
+   }
    HgfsServerCompleteRequest(status, writeReplySize, input);
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerCopyFileRange --
+ *
+ *    Handle a copy file range request: copy a byte range of an open file into
+ *    another open file in the server, instead of the client reading the data
+ *    and writing it back.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerCopyFileRange(HgfsInputParam *input)  // IN: Input params
+{
+   HgfsInternalStatus status;
+   HgfsHandle srcFile;
+   HgfsHandle dstFile;
+   uint64 srcOffset;
+   uint64 dstOffset;
+   uint64 length;
+   uint64 actualSize = 0;
+   fileDesc srcFd;
+   fileDesc dstFd;
+   Bool srcSequential;
+   Bool dstSequential;
+   size_t replyPayloadSize = 0;
+
+   HGFS_ASSERT_INPUT(input);
+
+   if (!HgfsUnpackCopyFileRangeRequest(input->payload, input->payloadSize,
+                                       input->op, &srcFile, &srcOffset,
+                                       &dstFile, &dstOffset, &length)) {
+      LOG(4, ("%s: Failed to unpack a valid packet -> PROTOCOL_ERROR.\n", __FUNCTION__));
+      status = HGFS_ERROR_PROTOCOL;
+      goto exit;
+   }
+
+   if (!HgfsHandleIsSequentialOpen(srcFile, input->session, &srcSequential) ||
+       !HgfsHandleIsSequentialOpen(dstFile, input->session, &dstSequential)) {
+      status = HGFS_ERROR_INVALID_HANDLE;
+      goto exit;
+   }
+   if (srcSequential || dstSequential) {
+      LOG(4, ("%s: Cannot copy with sequential handles\n", __FUNCTION__));
+      status = HGFS_ERROR_INVALID_PARAMETER;
+      goto exit;
+   }
+
+   /*
+    * Both descriptors stay held until the copy is done: neither file is
+    * closed to make room in the open node cache, whether for the other one
+    * or for a request on another handle, see HgfsHoldFd.
+    */
+   status = HgfsPlatformGetFd(dstFile, input->session, FALSE, &dstFd);
+   if (HGFS_ERROR_SUCCESS == status) {
+      status = HgfsPlatformGetFd(srcFile, input->session, FALSE, &srcFd);
+      if (HGFS_ERROR_SUCCESS != status) {
+         HgfsReleaseFd(dstFile, input->session);
+      }
+   }
+   if (HGFS_ERROR_SUCCESS != status) {
+      LOG(4, ("%s: Error: arg validation handle -> %d.\n", __FUNCTION__, status));
+      goto exit;
+   }
+
+   status = HgfsPlatformCopyFileRange(srcFd, srcOffset, dstFd, dstOffset,
+                                      length, &actualSize);
+   HgfsReleaseFd(srcFile, input->session);
+   HgfsReleaseFd(dstFile, input->session);
+   if (HGFS_ERROR_SUCCESS == status) {
+      if (!HgfsPackCopyFileRangeReply(input->packet, input->request, input->op,
+                                      actualSize, &replyPayloadSize,
+                                      input->session)) {
+         status = HGFS_ERROR_INTERNAL;
+      }
+   }
+
+exit:
+   HgfsServerCompleteRequest(status, replyPayloadSize, input);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerCompoundProcessRequest --
+ *
+ *    Process one request of a compound request. The reply is written to the
+ *    reply buffer of the packet, which is part of the compound reply.
+ *
+ * Results:
+ *    TRUE if a reply was written.
+ *    FALSE if the request is too malformed to reply to.
+ *
+ * Side effects:
+ *    The handle of the request may be replaced with the last handle.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsServerCompoundProcessRequest(HgfsInputParam *input,   // IN: compound request
+                                 char *request,           // IN/OUT: request packet
+                                 size_t requestSize,      // IN: request packet size
+                                 uint32 flags,            // IN: HGFS_COMPOUND_FLAG_xxx
+                                 uint32 handleOffset,     // IN: handle offset
+                                 HgfsHandle lastHandle,   // IN: last handle returned
+                                 HgfsPacket *packet)      // IN/OUT: reply buffer
+{
+   HgfsInternalStatus status;
+   HgfsInputParam *subInput;
+   Bool sessionEnabled = FALSE;
+   uint64 sessionId = HGFS_INVALID_SESSION_ID;
+   uint32 requestId = 0;
+   HgfsOp op = HGFS_OP_MAX;
+   size_t payloadSize = 0;
+   const void *payload = NULL;
+
+   status = HgfsUnpackPacketParams(request, requestSize, &sessionEnabled,
+                                   &sessionId, &requestId, &op,
+                                   &payloadSize, &payload);
+   if (HGFS_ERROR_INTERNAL == status || !sessionEnabled) {
+      /* Without a V4 header there is no reply to add to the compound reply. */
+      LOG(4, ("%s: Malformed request in compound.\n", __FUNCTION__));
+      return FALSE;
+   }
+
+   if (HGFS_ERROR_SUCCESS == status) {
+      switch (op) {
+      case HGFS_OP_CREATE_SESSION_V4:
+      case HGFS_OP_DESTROY_SESSION_V4:
+      case HGFS_OP_READ_FAST_V4:
+      case HGFS_OP_WRITE_FAST_V4:
+      case HGFS_OP_SEARCH_READ_V4:
+      case HGFS_OP_COMPOUND_V4:
+         /* These need a session change or a data packet. */
+         status = HGFS_ERROR_PROTOCOL;
+         break;
+      default:
+         if (op < HGFS_OP_OPEN_V3 ||
+             op >= ARRAYSIZE(handlers) ||
+             NULL == handlers[op].handler ||
+             requestSize < handlers[op].minReqSize) {
+            status = HGFS_ERROR_PROTOCOL;
+         }
+         break;
+      }
+   }
+
+   if (HGFS_ERROR_SUCCESS == status && sessionId != input->session->sessionId) {
+      status = HGFS_ERROR_STALE_SESSION;
+   }
+
+   if (HGFS_ERROR_SUCCESS == status &&
+       0 != (flags & HGFS_COMPOUND_FLAG_USE_HANDLE)) {
+      if (HGFS_INVALID_HANDLE == lastHandle) {
+         status = HGFS_ERROR_INVALID_HANDLE;
+      } else if (handleOffset > payloadSize ||
+                 payloadSize - handleOffset < sizeof lastHandle) {
+         status = HGFS_ERROR_PROTOCOL;
+      } else {
+         memcpy((char *)payload + handleOffset, &lastHandle, sizeof lastHandle);
+      }
+   }
+
+   /* The sub request input drops these references when it completes. */
+   HgfsServerSessionGet(input->session);
+   HgfsServerTransportSessionGet(input->transportSession);
+   HgfsServerInputAllocInit(packet,
+                            input->transportSession,
+                            input->session,
+                            request,
+                            requestSize,
+                            sessionEnabled,
+                            requestId,
+                            op,
+                            payloadSize,
+                            payload,
+                            &subInput);
+   subInput->compoundRequest = TRUE;
+
+   if (HGFS_ERROR_SUCCESS == status) {
+      status = HgfsServerWriteBehindBarrier(subInput);
+   }
+
+   if (HGFS_ERROR_SUCCESS == status) {
+      (*handlers[op].handler)(subInput);
+   } else {
+      LOG(4, ("%s: Error %d in compound request op %d\n", __FUNCTION__,
+              status, op));
+      HgfsServerCompleteRequest(status, 0, subInput);
+   }
+
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerCompound --
+ *
+ *    Handle a compound request: run its requests in order, each replying
+ *    into the compound reply, so that e.g. the open, getattr, read and close
+ *    of a small file take a single round trip. A request can use the handle
+ *    returned by an earlier open of the compound.
+ *
+ *    Processing stops at the first request which fails, or when the
+ *    compound reply has no room for another reply, and the client resends
+ *    the requests that were not run. A successful compound reply always
+ *    has at least one reply: if the first request cannot be run, the
+ *    compound itself fails.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsServerCompound(HgfsInputParam *input)  // IN: Input params
+{
+   HgfsInternalStatus status = HGFS_ERROR_SUCCESS;
+   uint32 numRequests;
+   const char *requests;
+   size_t requestsSize;
+   size_t requestsOffset = 0;
+   char *requestsCopy = NULL;
+   char *replies = NULL;
+   size_t repliesSize = 0;
+   size_t maxRepliesSize;
+   size_t replyOverhead;
+   uint32 numReplies = 0;
+   HgfsHandle lastHandle = HGFS_INVALID_HANDLE;
+   HgfsPacket packet;
+   size_t replyPayloadSize = 0;
+
+   HGFS_ASSERT_INPUT(input);
+
+   if (!HgfsUnpackCompoundRequest(input->payload, input->payloadSize,
+                                  input->op, &numRequests, &requests,
+                                  &requestsSize)) {
+      LOG(4, ("%s: Failed to unpack a valid packet -> PROTOCOL_ERROR.\n", __FUNCTION__));
+      status = HGFS_ERROR_PROTOCOL;
+      goto exit;
+   }
+
+   replyOverhead = sizeof (HgfsHeader) + offsetof(HgfsReplyCompoundV4, replies);
+   if (input->session->maxPacketSize <= replyOverhead) {
+      status = HGFS_ERROR_PROTOCOL;
+      goto exit;
+   }
+   maxRepliesSize = input->session->maxPacketSize - replyOverhead;
+
+   /*
+    * The reply may reuse the request buffer and handles are written into the
+    * requests, so run the requests from a copy.
+    */
+   requestsCopy = Util_SafeMalloc(requestsSize + 1);
+   memcpy(requestsCopy, requests, requestsSize);
+   replies = Util_SafeMalloc(maxRepliesSize);
+
+   while (numReplies < numRequests) {
+      char *entry = replies + repliesSize;
+      const char *request;
+      size_t requestSize;
+      size_t entrySize;
+      size_t replySize;
+      uint32 flags;
+      uint32 handleOffset;
+      HgfsHandle handle;
+
+      if (!HgfsUnpackCompoundEntry(requestsCopy + requestsOffset,
+                                   requestsSize - requestsOffset,
+                                   &flags, &handleOffset,
+                                   &request, &requestSize, &entrySize)) {
+         if (0 == numReplies) {
+            status = HGFS_ERROR_PROTOCOL;
+         }
+         break;
+      }
+      requestsOffset += entrySize;
+
+      /*
+       * The first request is always run, so that the client never gets a
+       * successful reply without progress and resends the same requests.
+       */
+      if (numReplies > 0 &&
+          maxRepliesSize - repliesSize <
+             sizeof (HgfsCompoundEntryV4) + HGFS_COMPOUND_MIN_REPLY_SPACE) {
+         LOG(4, ("%s: No room for reply %u of %u\n", __FUNCTION__,
+                 numReplies, numRequests));
+         break;
+      }
+      if (maxRepliesSize - repliesSize <
+             sizeof (HgfsCompoundEntryV4) + sizeof (HgfsHeader)) {
+         status = HGFS_ERROR_PROTOCOL;
+         break;
+      }
+
+      /* Reads which do not fit in the room left fail the validation. */
+      memset(&packet, 0, sizeof packet);
+      packet.metaPacketDataSize = requestSize;
+      packet.replyPacket = entry + sizeof (HgfsCompoundEntryV4);
+      packet.replyPacketSize = maxRepliesSize - repliesSize -
+                               sizeof (HgfsCompoundEntryV4);
+
+      if (!HgfsServerCompoundProcessRequest(input, (char *)request,
+                                            requestSize, flags, handleOffset,
+                                            lastHandle, &packet)) {
+         if (0 == numReplies) {
+            status = HGFS_ERROR_PROTOCOL;
+         }
+         break;
+      }
+
+      replySize = packet.replyPacketDataSize;
+      if (replySize < sizeof (HgfsHeader)) {
+         LOG(4, ("%s: Failed to reply to request %u\n", __FUNCTION__,
+                 numReplies));
+         if (0 == numReplies) {
+            status = HGFS_ERROR_INTERNAL;
+         }
+         break;
+      }
+      HgfsPackCompoundEntry(entry, replySize);
+      repliesSize += sizeof (HgfsCompoundEntryV4) + replySize;
+      numReplies++;
+
+      if (HgfsUnpackCompoundReplyHandle(packet.replyPacket, replySize,
+                                        &handle)) {
+         lastHandle = handle;
+      }
+      if (HGFS_STATUS_SUCCESS != ((HgfsHeader *)packet.replyPacket)->status) {
+         /* The requests which follow may depend on this one. */
+         break;
+      }
+   }
+
+   if (!HgfsPackCompoundReply(input->packet, input->request, input->op,
+                              numReplies, replies, repliesSize,
+                              &replyPayloadSize, input->session)) {
+      status = HGFS_ERROR_INTERNAL;
+   }
+
+exit:
+   free(requestsCopy);
+   free(replies);
+   HgfsServerCompleteRequest(status, replyPayloadSize, input);
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -6763,6 +10156,9 @@ HgfsSymlinkCreate(HgfsSessionInfo *session, // IN: session info,
       localTargetName[trgFileNameLength] = '\0';
 
       status = HgfsPlatformSymlinkCreate(localSymlinkName, localTargetName);
+      if (HGFS_ERROR_SUCCESS == status) {
+         HgfsNameCacheInvalidate(localSymlinkName);
+      }
    }
 
    free(localSymlinkName);
@@ -6903,6 +10299,8 @@ HgfsServerSearchOpen(HgfsInputParam *input)  // IN: Input params
  *
  * Side effects:
  *    Allcates locaFileName which must be freed by the caller.
+ *    On success with useHandle, the file descriptor is held in use and
+ *    must be released by the caller with HgfsReleaseFd.
  *
  *-----------------------------------------------------------------------------
  */
@@ -6923,10 +10321,12 @@ HgfsValidateRenameFile(Bool useHandle,            // IN:
    Bool sharedFolderOpen = FALSE;
    HgfsLockType serverLock = HGFS_LOCK_NONE;
    HgfsNameStatus nameStatus;
+   Bool fdHeld = FALSE;
 
 
    if (useHandle) {
       status = HgfsPlatformGetFd(fileHandle, session, FALSE, descr);
+      fdHeld = HGFS_ERROR_SUCCESS == status;
 
       if (HGFS_ERROR_SUCCESS != status) {
          LOG(4, ("%s: could not map cached handle %d, error %u\n",
@@ -6986,6 +10386,10 @@ HgfsValidateRenameFile(Bool useHandle,            // IN:
       }
    }
 
+   if (fdHeld && HGFS_ERROR_SUCCESS != status) {
+      HgfsReleaseFd(fileHandle, session);
+   }
+
    return status;
 }
 
@@ -7031,6 +10435,8 @@ HgfsServerRename(HgfsInputParam *input)  // IN: Input params
    uint32 newCaseFlags;
    HgfsShareInfo shareInfo;
    size_t replyPayloadSize = 0;
+   Bool srcFdHeld = FALSE;
+   Bool targetFdHeld = FALSE;
 
    HGFS_ASSERT_INPUT(input);
 
@@ -7049,6 +10455,7 @@ HgfsServerRename(HgfsInputParam *input)  // IN: Input params
                                       &utf8OldName,
                                       &utf8OldNameLen);
       if (HGFS_ERROR_SUCCESS == status) {
+         srcFdHeld = (hints & HGFS_RENAME_HINT_USE_SRCFILE_DESC) != 0;
          /*
           * Renaming a file requires both read and write permssions for the
           * original file.
@@ -7074,6 +10481,7 @@ HgfsServerRename(HgfsInputParam *input)  // IN: Input params
                                       &utf8NewName,
                                       &utf8NewNameLen);
             if (HGFS_ERROR_SUCCESS == status) {
+               targetFdHeld = (hints & HGFS_RENAME_HINT_USE_TARGETFILE_DESC) != 0;
                /*
                 * Renaming a file requires both read and write permssions for
                 * the target directory.
@@ -7102,6 +10510,8 @@ HgfsServerRename(HgfsInputParam *input)  // IN: Input params
       status = HgfsPlatformRename(utf8OldName, srcFileDesc, utf8NewName,
          targetFileDesc, hints);
       if (HGFS_ERROR_SUCCESS == status) {
+         HgfsNameCacheInvalidateTree(utf8OldName);
+         HgfsNameCacheInvalidateTree(utf8NewName);
          /* Update all file nodes that refer to this file to contain the new name. */
          HgfsUpdateNodeNames(utf8OldName, utf8NewName, input->session);
          if (!HgfsPackRenameReply(input->packet, input->request, input->op,
@@ -7111,6 +10521,12 @@ HgfsServerRename(HgfsInputParam *input)  // IN: Input params
       }
    }
 
+   if (srcFdHeld) {
+      HgfsReleaseFd(srcFile, input->session);
+   }
+   if (targetFdHeld) {
+      HgfsReleaseFd(targetFile, input->session);
+   }
    free(utf8OldName);
    free(utf8NewName);
 
@@ -7166,6 +10582,7 @@ HgfsServerCreateDir(HgfsInputParam *input)  // IN: Input params
          if (shareInfo.writePermissions) {
             status = HgfsPlatformCreateDir(&info, utf8Name);
             if (HGFS_ERROR_SUCCESS == status) {
+               HgfsNameCacheInvalidate(utf8Name);
                if (!HgfsPackCreateDirReply(input->packet, input->request, info.requestType,
                                            &replyPayloadSize, input->session)) {
                   status = HGFS_ERROR_PROTOCOL;
@@ -7255,6 +10672,9 @@ HgfsServerDeleteFile(HgfsInputParam *input)  // IN: Input params
                                &cpNameSize, &hints, &file, &caseFlags)) {
       if (hints & HGFS_DELETE_HINT_USE_FILE_DESC) {
          status = HgfsPlatformDeleteFileByHandle(file, input->session);
+         if (HGFS_ERROR_SUCCESS == status) {
+            HgfsNameCacheInvalidateHandle(file, input->session);
+         }
       } else {
          char *utf8Name = NULL;
          size_t utf8NameLen;
@@ -7285,6 +10705,9 @@ HgfsServerDeleteFile(HgfsInputParam *input)  // IN: Input params
             } else {
                LOG(4, ("%s: deleting \"%s\"\n", __FUNCTION__, utf8Name));
                status = HgfsPlatformDeleteFileByName(utf8Name);
+               if (HGFS_ERROR_SUCCESS == status) {
+                  HgfsNameCacheInvalidate(utf8Name);
+               }
             }
             free(utf8Name);
          } else {
@@ -7359,8 +10782,11 @@ HgfsServerDeleteDir(HgfsInputParam *input)  // IN: Input params
                if (HGFS_ERROR_SUCCESS != status) {
                   LOG(4, ("%s: error deleting directory %d: %d\n", __FUNCTION__,
                      file, status));
+               } else {
+                  HgfsNameCacheInvalidateHandle(file, input->session);
                }
             }
+            HgfsReleaseFd(file, input->session);
          } else {
             LOG(4, ("%s: could not map cached handle %u, error %u\n",
                __FUNCTION__, file, status));
@@ -7391,6 +10817,9 @@ HgfsServerDeleteDir(HgfsInputParam *input)  // IN: Input params
             } else {
                LOG(4, ("%s: removing \"%s\"\n", __FUNCTION__, utf8Name));
                status = HgfsPlatformDeleteDirByName(utf8Name);
+               if (HGFS_ERROR_SUCCESS == status) {
+                  HgfsNameCacheInvalidate(utf8Name);
+               }
             }
             free(utf8Name);
          } else {
@@ -7830,6 +11259,7 @@ HgfsServerGetattr(HgfsInputParam *input)  // IN: Input params
          status = HgfsPlatformGetFd(file, input->session, FALSE, &fd);
          if (HGFS_ERROR_SUCCESS == status) {
             status = HgfsPlatformGetattrFromFd(fd, input->session, &attr);
+            HgfsReleaseFd(file, input->session);
          } else {
             LOG(4, ("%s: Could not get file descriptor\n", __FUNCTION__));
          }
@@ -8199,6 +11629,11 @@ HgfsServerOpen(HgfsInputParam *input)  // IN: Input params
             if (status == HGFS_ERROR_SUCCESS) {
                ASSERT(newHandle >= 0);
 
+               if (openInfo.flags != HGFS_OPEN && openInfo.flags != HGFS_OPEN_EMPTY) {
+                  /* The file may have been created. */
+                  HgfsNameCacheInvalidate(openInfo.utf8Name);
+               }
+
                /*
                 * Open succeeded, so make new node and return its handle. If we fail,
                 * it's almost certainly an internal server error.
@@ -8647,6 +12082,7 @@ HgfsServerSearchRead(HgfsInputParam *input)  // IN: Input params
 
             free(search.utf8Dir);
             free(search.utf8ShareName);
+            HgfsPlatformScandirClose(search.dirStream);
 
          } else {
             LOG(4, ("%s: handle %u is invalid\n", __FUNCTION__, hgfsSearchHandle));
@@ -23,6 +23,7 @@
 #include "vm_basic_types.h"
 
 struct DirectoryEntry;
+struct HgfsDirStream;
 
 #ifndef _WIN32
    typedef int fileDesc;
@@ -39,6 +40,7 @@ struct DirectoryEntry;
 #include "vm_atomic.h"
 #include "userlock.h"
 #include "hgfsServer.h" // for the server public types
+#include "hgfsServerStats.h"
 
 #define HGFS_DEBUG_ASYNC   (0)
 
@@ -111,6 +113,20 @@ typedef struct HgfsShareInfo {
    HgfsSharedFolderHandle handle;
 } HgfsShareInfo;
 
+/*
+ * Open node cache counters of a session, for the whole session and for
+ * each share the session opened files on. The list is protected by the
+ * session's nodeArrayLock, the counters are updated atomically.
+ */
+typedef struct HgfsNodeCacheStats {
+   DblLnkLst_Links links;     /* Session's list of per share counters. */
+   char *shareName;           /* NULL for the session totals. */
+   Atomic_uint64 hits;        /* Lookups which found the file open. */
+   Atomic_uint64 misses;      /* Lookups which had to reopen the file. */
+   Atomic_uint64 evictions;   /* Files closed to make room in the cache. */
+   HgfsShareStats *server;    /* Share's counters over all sessions. */
+} HgfsNodeCacheStats;
+
 /*
  * This struct represents a file on the local filesystem that has been
  * opened by a remote client. We store the name of the local file and
@@ -120,7 +136,7 @@ typedef struct HgfsShareInfo {
  *
  * A file node object can only be in 1 of these 3 states:
  * 1) FILENODE_STATE_UNUSED: linked on the free list
- * 2) FILENODE_STATE_IN_USE_CACHED: Linked on the cached nodes list
+ * 2) FILENODE_STATE_IN_USE_CACHED: Linked on the cached or pinned nodes list
  * 3) FILENODE_STATE_IN_USE_NOT_CACHED: Linked on neither of the above two lists.
  */
 typedef struct HgfsFileNode {
@@ -173,8 +189,50 @@ typedef struct HgfsFileNode {
 
    /* Parameters associated with the share. */
    HgfsShareInfo shareInfo;
+
+   /* Open node cache counters of the node's share. */
+   HgfsNodeCacheStats *cacheStats;
+
+   /*
+    * Requests using the file descriptor, see HgfsHoldFd. The file is not
+    * closed to make room in the node cache while it is in use.
+    */
+   Atomic_uint32 useCount;
+
+   /*
+    * Set by the lookups finding the node cached since HgfsRemoveLruNode
+    * last passed it over, which gives it a second chance.
+    */
+   Atomic_uint32 referenced;
+
+   /*
+    * Read-ahead state, see HgfsServerReadAhead. Reads update it holding the
+    * nodeArrayLock for read and the node's lock.
+    */
+   MXUserExclLock *lock;
+   uint64 readAheadNext;     /* Offset a sequential read would start at. */
+   uint64 readAheadEnd;      /* End of the range hinted so far. */
+   uint64 readAheadTimeUS;   /* Time of the last read of the stream. */
+   uint32 readAheadWindow;   /* Size of the next hint, 0 if not streaming. */
+   uint32 readAheadCharged;  /* Hinted bytes charged to the global budget. */
+
+   /*
+    * Write-behind buffer, see HgfsServerWriteBehind. Allocated on the first
+    * buffered write and protected by the node's lock, which flushes hold
+    * without the nodeArrayLock.
+    */
+   struct HgfsWriteBehind *writeBehind;
+
+   /* Index of the next node in the same handle hash bucket. */
+   uint32 handleHashNext;
+
+   /* Index of the next node in the same file descriptor hash bucket. */
+   uint32 fdHashNext;
 } HgfsFileNode;
 
+/* Terminates the node index hash chains. */
+#define HGFS_NODE_INDEX_INVALID              ((uint32)~((uint32)0))
+
 
 /* HgfsFileNode flags. */
 
@@ -220,6 +278,12 @@ typedef struct HgfsSearch {
    /* Number of dents */
    uint32 numDents;
 
+   /*
+    * Open directory of a lazy search, NULL if all the entries were read
+    * when the search was created. See HgfsPlatformScandirOpen.
+    */
+   struct HgfsDirStream *dirStream;
+
    /*
     * What type of search is this (what objects does it track)? This is
     * important to know so we can do the right kind of stat operation later
@@ -276,13 +340,42 @@ typedef struct HgfsSessionInfo {
 
    Atomic_uint32 refCount;    /* Reference count for session. */
 
+   /* Number of requests queued to or running on the worker threads. */
+   Atomic_uint32 numAsyncRequests;
+
+   /*
+    * Nodes of this session having write-behind data. Read without the node
+    * array lock to skip flushing sessions which have none.
+    */
+   Atomic_uint32 numWriteBehindNodes;
+
+   /* Nodes of this session having a write-behind error not yet returned. */
+   Atomic_uint32 numWriteBehindErrors;
+
+   /* Links on the queue of the write-behind flusher, see HgfsWriteBehindQueue. */
+   DblLnkLst_Links writeBehindLinks;
+
+   /*
+    * Write-behind buffers of this session holding data, least recently
+    * filled first. Protected by the write-behind lock.
+    */
+   DblLnkLst_Links writeBehindNodes;
+
+   /* Time the read-ahead streams were last aged, see HgfsServerReadAheadAge. */
+   Atomic_uint64 readAheadAgedUS;
+
    /*
     ** START NODE ARRAY **************************************************
     *
-    * Lock for the following 6 fields: the node array,
+    * Lock for the following fields: the node array, its index,
     * counters and lists for this session.
+    *
+    * Lookups which do not modify any node or list take the lock for read
+    * so that requests on different handles can proceed in parallel. Note
+    * that checking the node cache also updates its LRU order, which needs
+    * the lock for write.
     */
-   MXUserExclLock *nodeArrayLock;
+   MXUserRWLock *nodeArrayLock;
 
    /* Open file nodes of this session. */
    HgfsFileNode *nodeArray;
@@ -290,26 +383,60 @@ typedef struct HgfsSessionInfo {
    /* Number of nodes in the nodeArray. */
    uint32 numNodes;
 
+   /*
+    * Hash buckets of in use nodes keyed by HGFS handle and by file
+    * descriptor. Buckets and chains hold nodeArray indices rather than
+    * pointers so that they remain valid when the nodeArray is reallocated.
+    */
+   uint32 *nodeHandleBuckets;
+   uint32 *nodeFdBuckets;
+
+   /* Number of buckets in each of the above, always a power of 2. */
+   uint32 numNodeBuckets;
+
    /* Free list of file nodes. LIFO to be cache-friendly. */
    DblLnkLst_Links nodeFreeList;
 
-   /* List of cached open nodes. */
+   /*
+    * List of cached open nodes, least recently added or referenced first:
+    * lookups only mark the nodes they find referenced, see HgfsIsCached.
+    */
    DblLnkLst_Links nodeCachedList;
 
+   /*
+    * Cached open nodes that could not be evicted when they reached the head
+    * of nodeCachedList: they have a server lock, a file context, were
+    * opened sequential or were in use by a request. They go back to
+    * nodeCachedList when it is empty, see HgfsRemoveLruNode.
+    */
+   DblLnkLst_Links nodePinnedList;
+
    /* Current number of open nodes. */
    unsigned int numCachedOpenNodes;
 
    /* Number of open nodes having server locks. */
    unsigned int numCachedLockedNodes;
+
+   /* Current bound on numCachedOpenNodes, see HgfsNodeCacheAdapt. */
+   uint32 maxCachedOpenNodes;
+
+   /* Cache lookups and misses since the bound was last adapted. */
+   Atomic_uint32 nodeCacheLookups;
+   Atomic_uint32 nodeCacheMisses;
+
+   /* Open node cache counters: session totals and per share list. */
+   HgfsNodeCacheStats nodeCacheStats;
+   DblLnkLst_Links nodeCacheShareStats;
    /** END NODE ARRAY ****************************************************/
 
    /*
     ** START SEARCH ARRAY ************************************************
     *
     * Lock for the following three fields: for the search array
-    * and it's counter and list, for this session.
+    * and it's counter and list, for this session. Taken for read by
+    * lookups which only copy search state.
     */
-   MXUserExclLock *searchArrayLock;
+   MXUserRWLock *searchArrayLock;
 
    /* Directory entry cache for this session. */
    HgfsSearch *searchArray;
@@ -545,6 +672,9 @@ HgfsServerRestartSearchVirtualDir(HgfsServerResEnumGetFunc getName,      // IN:
                                   HgfsServerResEnumExitFunc cleanupName, // IN: Cleanup function
                                   HgfsSessionInfo *session,              // IN: Session info
                                   HgfsHandle searchHandle);              // IN: search to restart
+HgfsInternalStatus
+HgfsServerRestartSearchRealDir(HgfsSessionInfo *session,               // IN: Session info
+                               HgfsHandle searchHandle);               // IN: search to restart
 
 
 void *
@@ -567,6 +697,14 @@ Bool
 HgfsIsCached(HgfsHandle handle,         // IN: Hgfs handle of the node
              HgfsSessionInfo *session); // IN: Session info
 
+Bool
+HgfsHoldFd(HgfsHandle handle,         // IN: Hgfs handle of the node
+           HgfsSessionInfo *session); // IN: Session info
+
+void
+HgfsReleaseFd(HgfsHandle handle,         // IN: Hgfs handle of the node
+              HgfsSessionInfo *session); // IN: Session info
+
 Bool
 HgfsIsServerLockAllowed(HgfsSessionInfo *session);  // IN: session info
 
@@ -715,6 +853,20 @@ HgfsPlatformScandir(char const *baseDir,             // IN: Directory to search
                     struct DirectoryEntry ***dents,  // OUT: Array of DirectoryEntrys
                     int *numDents);                  // OUT: Number of DirectoryEntrys
 HgfsInternalStatus
+HgfsPlatformScandirOpen(char const *baseDir,               // IN: Directory to search in
+                        size_t baseDirLen,                 // IN: Length of directory
+                        Bool followSymlinks,               // IN: followSymlinks config option
+                        struct HgfsDirStream **dirStream); // OUT: directory stream
+void
+HgfsPlatformScandirClose(struct HgfsDirStream *dirStream); // IN: directory stream
+HgfsInternalStatus
+HgfsPlatformScandirRewind(HgfsSearch *search);             // IN/OUT: lazy search
+HgfsInternalStatus
+HgfsPlatformScandirFinish(HgfsSearch *search);             // IN/OUT: lazy search
+void
+HgfsPlatformScandirDup(struct HgfsDirStream *dirStream,    // IN: directory stream
+                       struct HgfsDirStream **copy);       // OUT: copy or NULL
+HgfsInternalStatus
 HgfsPlatformScanvdir(HgfsServerResEnumGetFunc enumNamesGet,   // IN: Function to get name
                      HgfsServerResEnumInitFunc enumNamesInit, // IN: Setup function
                      HgfsServerResEnumExitFunc enumNamesExit, // IN: Cleanup function
@@ -757,6 +909,36 @@ HgfsPlatformWriteFile(fileDesc writeFile,          // IN: file descriptor
                       Bool writeAppend,            // IN: write is appended
                       const void *writeData,       // IN: data to be written
                       uint32 *writtenSize);        // OUT: byte length written
+void
+HgfsPlatformReadAhead(fileDesc readFile,           // IN: file descriptor
+                      uint64 offset,               // IN: start of the range
+                      uint32 length);              // IN: length of the range
+HgfsInternalStatus
+HgfsPlatformReadFileV(fileDesc readFile,           // IN: file descriptor
+                      HgfsSessionInfo *session,    // IN: session info
+                      uint64 offset,               // IN: file offset to read from
+                      uint32 requiredSize,         // IN: length of data to read
+                      HgfsVmxIov *iov,             // IN: buffers for the read data
+                      uint32 iovCount,             // IN: number of buffers
+                      uint32 *actualSize);         // OUT: actual length read
+HgfsInternalStatus
+HgfsPlatformWriteFileV(fileDesc writeFile,          // IN: file descriptor
+                       HgfsSessionInfo *session,    // IN: session info
+                       uint64 writeOffset,          // IN: file offset to write to
+                       uint32 writeDataSize,        // IN: length of data to write
+                       HgfsWriteFlags writeFlags,   // IN: write flags
+                       Bool writeSequential,        // IN: write is sequential
+                       Bool writeAppend,            // IN: write is appended
+                       HgfsVmxIov *iov,             // IN: buffers of the data
+                       uint32 iovCount,             // IN: number of buffers
+                       uint32 *writtenSize);        // OUT: byte length written
+HgfsInternalStatus
+HgfsPlatformCopyFileRange(fileDesc srcFd,       // IN: file to copy from
+                          uint64 srcOffset,     // IN: offset to copy from
+                          fileDesc dstFd,       // IN: file to copy to
+                          uint64 dstOffset,     // IN: offset to copy to
+                          uint64 length,        // IN: bytes to copy
+                          uint64 *copiedSize);  // OUT: bytes copied
 HgfsInternalStatus
 HgfsPlatformWriteWin32Stream(HgfsHandle file,           // IN: packet header
                              char *dataToWrite,         // IN: data to write
@@ -847,6 +1029,12 @@ HSPU_GetDataPacketBuf(HgfsPacket *packet,                   // IN/OUT: Hgfs Pack
                       MappingType mappingType,              // IN: Readable/ Writeable ?
                       HgfsServerChannelCallbacks *chanCb);  // IN: Channel callbacks
 
+HgfsVmxIov *
+HSPU_GetDataPacketIov(HgfsPacket *packet,                   // IN/OUT: Hgfs Packet
+                      MappingType mappingType,              // IN: Readable/ Writeable ?
+                      HgfsServerChannelCallbacks *chanCb,   // IN: Channel callbacks
+                      uint32 *iovCount);                    // OUT: mapped iov count
+
 void
 HSPU_SetDataPacketSize(HgfsPacket *packet,            // IN/OUT: Hgfs Packet
                        size_t dataSize);              // IN: data size
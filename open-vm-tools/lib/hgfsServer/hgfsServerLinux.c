@@ -44,6 +44,13 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <sys/resource.h> // for getrlimit
+#include <sys/statvfs.h>  // for fstatvfs
+#include <sys/uio.h>      // for preadv/pwritev
+#include <limits.h>       // for IOV_MAX
+#if defined(__linux__)
+#   include <sys/inotify.h> // for the attribute cache
+#   include <sys/ioctl.h>   // for FIONREAD
+#endif
 
 #if defined(__FreeBSD__)
 #   include <sys/param.h>
@@ -66,7 +73,12 @@
 #include "su.h"
 #include "codeset.h"
 #include "unicodeOperations.h"
+#include "unicodeTransforms.h"
 #include "userlock.h"
+#include "hashTable.h"
+#include "dbllnklst.h"
+#include "mutexRankLib.h"
+#include "hostinfo.h"
 
 #if defined(linux) && !defined(SYS_getdents64)
 /* For DT_UNKNOWN */
@@ -106,6 +118,38 @@ typedef struct DirectoryEntry {
 } DirectoryEntry;
 #endif
 
+#if defined(__APPLE__)
+typedef DIR *HgfsDirFd;
+#define HGFS_DIR_FD_INVALID NULL
+#else
+typedef int HgfsDirFd;
+#define HGFS_DIR_FD_INVALID (-1)
+#endif
+
+/*
+ * Open directory of a lazy search, see HgfsPlatformScandirOpen.
+ *
+ * The search's dents array only holds a window of the directory starting at
+ * baseIndex. Entries are read from the directory as the client asks for them
+ * and entries below the requested index are dropped when the window moves.
+ */
+typedef struct HgfsDirStream {
+   HgfsDirFd fd;
+   uint32 baseIndex;       /* Directory index of search->dents[0]. */
+   uint32 dentsCapacity;   /* Number of slots allocated in search->dents. */
+   Bool eof;               /* TRUE once the whole directory has been read. */
+
+   /*
+    * Looked up once for all the entries of a search read, see
+    * HgfsGetattrFromDirStream.
+    */
+   Bool permInfoValid;     /* TRUE once the fields below are set. */
+   Bool shareModeValid;    /* TRUE if the share mode could be looked up. */
+   Bool readOnlyShare;     /* Share is read only. */
+   Bool readOnlyFs;        /* Directory is on a read only file system. */
+   Bool ownerModeExact;    /* Owner mode bits decide the owner's access. */
+} HgfsDirStream;
+
 /*
  * ALLPERMS (mode 07777) and ACCESSPERMS (mode 0777) are not defined in the
  * Solaris version of <sys/stat.h>.
@@ -227,6 +271,20 @@ getdents_apple(DIR *fd,               // IN
 #define O_NOFOLLOW 0
 #endif
 
+/*
+ * Entries of the iovec array for vectored reads and writes kept on the
+ * stack. A maximum size packet spans fewer pages than this.
+ */
+#define HGFS_PLATFORM_IOVEC_STACK 32
+
+/*
+ * Bytes copied by a single copy file range request, the client issues
+ * further requests for the rest, and the buffer size used when the copy
+ * goes through user space.
+ */
+#define HGFS_COPY_FILE_RANGE_MAX     (64 * 1024 * 1024)
+#define HGFS_COPY_FILE_RANGE_CHUNK   (1024 * 1024)
+
 
 #if defined(sun) || defined(linux) || \
     (defined(__FreeBSD_version) && __FreeBSD_version < 490000)
@@ -304,6 +362,105 @@ static const int HgfsServerOpenFlags[] = {
 };
 
 
+/*
+ * Case insensitive lookup cache.
+ *
+ * Resolving a path on a case insensitive share means a search of the
+ * parent directory for every component. The cache keeps, for the most
+ * recently searched directories, a table of their entries keyed by the
+ * case folded name. A directory is identified by its device and inode and
+ * its entries are valid for as long as its modification time is unchanged.
+ *
+ * The directories are spread over shards by inode, each with its own lock
+ * and LRU list, so that lookups in different directories do not contend.
+ */
+
+#define HGFS_CASE_CACHE_SHARDS        16
+#define HGFS_CASE_CACHE_MAX_DIRS      256
+#define HGFS_CASE_CACHE_MAX_ENTRIES   (64 * 1024)
+
+/*
+ * A directory modified this recently (in 100ns units) is not cached: a
+ * change within the same modification time tick would go unnoticed.
+ */
+#define HGFS_CASE_CACHE_MIN_AGE       (2 * 10 * 1000 * 1000)
+
+typedef struct HgfsCaseDir {
+   DblLnkLst_Links links;        /* Link in the LRU list, most recent first */
+   char key[48];                 /* Device and inode of the directory */
+   uint64 writeTime;             /* Modification time of the entries */
+   HashTable *entries;           /* Folded name to the name on disk */
+} HgfsCaseDir;
+
+typedef struct HgfsCaseCacheShard {
+   MXUserExclLock *lock;
+   HashTable *dirs;              /* Key to HgfsCaseDir */
+   DblLnkLst_Links lru;
+   uint32 numDirs;
+} HgfsCaseCacheShard;
+
+static HgfsCaseCacheShard gHgfsCaseCache[HGFS_CASE_CACHE_SHARDS];
+
+#if defined(__linux__)
+/*
+ * Attribute cache.
+ *
+ * Keeps the attributes HgfsPlatformGetattrFromName returned for the most
+ * recently queried names, so that a getattr of an unchanged file does not
+ * stat, open and access check it again. Each cached name holds an inotify
+ * watch on its inode and the cache entries of a watch are dropped as soon
+ * as the inode is modified, its attributes change, or it is unlinked,
+ * replaced or moved. A lookup checks for pending events before it looks at
+ * the entries, so any change made before the lookup started is seen, and
+ * only takes the cache lock for write to read them when there are some.
+ * Lookups otherwise share the lock: the LRU order is kept approximately
+ * with a referenced flag, which gives an entry a second chance at eviction.
+ *
+ * Renames of parent directories or permission changes on them are not
+ * reported for the file itself and entries expire after a while for those.
+ * The access time is not watched: every read would break the entries of the
+ * file, and the access time only changes once a day with relatime.
+ */
+
+#define HGFS_ATTR_CACHE_MAX_ENTRIES   1024
+#define HGFS_ATTR_CACHE_TTL_US        (5 * 1000 * 1000)
+
+#define HGFS_ATTR_CACHE_EVENTS        (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+                                       IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                                       IN_MOVED_TO | IN_DELETE_SELF | \
+                                       IN_MOVE_SELF)
+
+/* Events on the entries of a watched directory that change it. */
+#define HGFS_ATTR_CACHE_DIR_EVENTS    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                                       IN_MOVED_TO)
+
+typedef struct HgfsAttrWatch {
+   int wd;                       /* inotify watch descriptor */
+   uint32 breaks;                /* Events that broke the watch so far */
+   uint32 pendingInserts;        /* Lookups between watch and insert */
+   Bool removed;                 /* The kernel removed the inotify watch */
+   DblLnkLst_Links entries;      /* Entries of the watched inode */
+} HgfsAttrWatch;
+
+typedef struct HgfsAttrEntry {
+   DblLnkLst_Links links;        /* Link in the LRU list */
+   DblLnkLst_Links watchLinks;   /* Link in the entries of the watch */
+   HgfsAttrWatch *watch;
+   char *key;                    /* Share mode and local name */
+   HgfsFileAttrInfo attr;
+   char *targetName;             /* Symlink target or NULL */
+   VmTimeType insertTimeUS;
+   Atomic_uint32 referenced;     /* Looked up since last passed over */
+} HgfsAttrEntry;
+
+static MXUserRWLock *gHgfsAttrCacheLock;
+static int gHgfsAttrCacheFd = -1;            /* inotify instance */
+static HashTable *gHgfsAttrCacheEntries;     /* Key to HgfsAttrEntry */
+static HashTable *gHgfsAttrCacheWatches;     /* wd to HgfsAttrWatch */
+static DblLnkLst_Links gHgfsAttrCacheLru;
+static uint32 gHgfsAttrCacheNumEntries;
+#endif
+
 /*
  * Server open mode, indexed by HgfsOpenMode.
  */
@@ -327,6 +484,8 @@ static int HgfsStat(const char* fileName,
 static int HgfsFStat(int fd,
                      struct stat *stats,
                      uint64 *creationTime);
+static HgfsInternalStatus HgfsPlatformScandirFill(HgfsSearch *search,
+                                                  uint32 index);
 
 static void HgfsGetSequentialOnlyFlagFromName(const char *fileName,
                                               Bool followSymlinks,
@@ -335,6 +494,12 @@ static void HgfsGetSequentialOnlyFlagFromName(const char *fileName,
 static void HgfsGetSequentialOnlyFlagFromFd(int fd,
                                             HgfsFileAttrInfo *attr);
 
+static void HgfsCaseCacheInit(void);
+static void HgfsCaseCacheExit(void);
+
+static void HgfsAttrCacheInit(void);
+static void HgfsAttrCacheExit(void);
+
 static int HgfsConvertComponentCase(char *currentComponent,
                                     const char *dirPath,
                                     const char **convertedComponent,
@@ -555,6 +720,8 @@ HgfsServerGetOpenFlags(HgfsOpenFlags flagsIn, // IN
 Bool
 HgfsPlatformInit(void)
 {
+   HgfsCaseCacheInit();
+   HgfsAttrCacheInit();
    return TRUE;
 }
 
@@ -578,6 +745,8 @@ HgfsPlatformInit(void)
 void
 HgfsPlatformDestroy(void)
 {
+   HgfsAttrCacheExit();
+   HgfsCaseCacheExit();
 }
 
 
@@ -735,6 +904,9 @@ HgfsCheckFileNode(char const *localName,      // IN
  *    correct write flags). Otherwise, it opens a new file, caches the node
  *    and returns the file desriptor.
  *
+ *    The file descriptor is held in use, see HgfsHoldFd, and the caller
+ *    must release it with HgfsReleaseFd once done with it.
+ *
  * Results:
  *    Zero on success. fd contains the opened file descriptor.
  *    Non-zero on error.
@@ -754,10 +926,19 @@ HgfsPlatformGetFd(HgfsHandle hgfsHandle,    // IN:  HGFS file handle
    int newFd = -1, openFlags = 0;
    HgfsFileNode node;
    HgfsInternalStatus status = 0;
+   Bool held;
 
    ASSERT(fd);
    ASSERT(session);
 
+   node.utf8Name = NULL;
+   held = HgfsHoldFd(hgfsHandle, session);
+   if (!held) {
+      LOG(4, ("%s: Invalid hgfs handle.\n", __FUNCTION__));
+      status = EBADF;
+      goto exit;
+   }
+
    /*
     * Use node copy convenience function to get the node information.
     * Note that we shouldn't keep this node around for too long because
@@ -768,7 +949,6 @@ HgfsPlatformGetFd(HgfsHandle hgfsHandle,    // IN:  HGFS file handle
     * path. Unfortuntely, even the fast path may need to look at the node's
     * append flag.
     */
-   node.utf8Name = NULL;
    if (!HgfsGetNodeCopy(hgfsHandle, session, TRUE, &node)) {
       /* XXX: Technically, this can also fail if we're out of memory. */
       LOG(4, ("%s: Invalid hgfs handle.\n", __FUNCTION__));
@@ -862,6 +1042,8 @@ HgfsPlatformGetFd(HgfsHandle hgfsHandle,    // IN:  HGFS file handle
   exit:
    if (status == 0) {
       *fd = newFd;
+   } else if (held) {
+      HgfsReleaseFd(hgfsHandle, session);
    }
    free(node.utf8Name);
    return status;
@@ -1399,78 +1581,209 @@ HgfsGetHiddenAttr(char const *fileName,         // IN:  Input filename
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsConvertComponentCase --
+ * HgfsCaseCacheInit --
  *
- *    Do a case insensitive search of a directory for the specified entry. If
- *    a matching entry is found, return it in the convertedComponent argument.
+ *    Set up the case insensitive lookup cache.
  *
  * Results:
- *    On Success:
- *    Returns 0 and the converted component name in the argument convertedComponent.
- *    The length for the convertedComponent is returned in convertedComponentSize.
+ *    None.
  *
- *    On Failure:
- *    Non-zero errno return, with convertedComponent and convertedComponentSize
- *    set to NULL and 0 respectively.
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsCaseCacheInit(void)
+{
+   uint32 i;
+
+   for (i = 0; i < HGFS_CASE_CACHE_SHARDS; i++) {
+      HgfsCaseCacheShard *shard = &gHgfsCaseCache[i];
+
+      shard->lock = MXUser_CreateExclLock("hgfsCaseCacheLock",
+                                          RANK_hgfsCaseCacheLock);
+      shard->dirs = HashTable_Alloc(HGFS_CASE_CACHE_MAX_DIRS /
+                                    HGFS_CASE_CACHE_SHARDS,
+                                    HASH_STRING_KEY, NULL);
+      DblLnkLst_Init(&shard->lru);
+      shard->numDirs = 0;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsCaseDirFree --
+ *
+ *    Free a cached directory. The caller has removed it from the cache.
+ *
+ * Results:
+ *    None.
  *
  * Side effects:
- *    On success, allocated memory is returned in convertedComponent and needs
- *    to be freed.
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsCaseDirFree(HgfsCaseDir *caseDir)  // IN: cached directory
+{
+   HashTable_Free(caseDir->entries);
+   free(caseDir);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsCaseDirRemove --
+ *
+ *    Remove a directory from its cache shard. Called with the shard's lock
+ *    held.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    The directory is freed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsCaseDirRemove(HgfsCaseCacheShard *shard,  // IN: shard of the directory
+                  HgfsCaseDir *caseDir)       // IN: cached directory
+{
+   ASSERT(MXUser_IsCurThreadHoldingExclLock(shard->lock));
+
+   HashTable_Delete(shard->dirs, caseDir->key);
+   DblLnkLst_Unlink1(&caseDir->links);
+   shard->numDirs--;
+   HgfsCaseDirFree(caseDir);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsCaseCacheExit --
+ *
+ *    Tear down the case insensitive lookup cache.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsCaseCacheExit(void)
+{
+   uint32 i;
+
+   for (i = 0; i < HGFS_CASE_CACHE_SHARDS; i++) {
+      HgfsCaseCacheShard *shard = &gHgfsCaseCache[i];
+
+      if (shard->lock == NULL) {
+         continue;
+      }
+
+      MXUser_AcquireExclLock(shard->lock);
+      while (DblLnkLst_IsLinked(&shard->lru)) {
+         HgfsCaseDirRemove(shard, DblLnkLst_Container(shard->lru.next,
+                                                      HgfsCaseDir, links));
+      }
+      MXUser_ReleaseExclLock(shard->lock);
+
+      HashTable_Free(shard->dirs);
+      shard->dirs = NULL;
+      MXUser_DestroyExclLock(shard->lock);
+      shard->lock = NULL;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsGetWriteTime --
+ *
+ *    Get the time of last data modification from the stat structure.
+ *
+ * Results:
+ *    The modification time in NT format.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static uint64
+HgfsGetWriteTime(const struct stat *stats)  // IN: stat information
+{
+#if defined(__FreeBSD__) || defined(__APPLE__)
+   return HgfsConvertTimeSpecToNtTime(&stats->st_mtimespec);
+#elif defined(linux) && \
+      !((__GLIBC__ == 2) && (__GLIBC_MINOR__ < 3) && !defined(__UCLIBC__))
+   return HgfsConvertTimeSpecToNtTime(&stats->st_mtim);
+#else
+   return HgfsConvertToNtTime(stats->st_mtime, 0);
+#endif
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsCaseDirRead --
+ *
+ *    Read all the entries of a directory into a table keyed by their case
+ *    folded names. When several entries fold to the same name the first one
+ *    read is kept, as a search of the directory would have returned it.
+ *
+ * Results:
+ *    0 and the table on success, errno otherwise.
+ *
+ * Side effects:
+ *    None.
  *
  *-----------------------------------------------------------------------------
  */
 
 static int
-HgfsConvertComponentCase(char *currentComponent,           // IN
-                         const char *dirPath,              // IN
-                         const char **convertedComponent,  // OUT
-                         size_t *convertedComponentSize)   // OUT
+HgfsCaseDirRead(const char *dirPath,   // IN: directory
+                HashTable **entries)   // OUT: folded name to name
 {
    struct dirent *dirent;
-   DIR *dir = NULL;
-   char *dentryName;
-   size_t dentryNameLen;
-   char *myConvertedComponent = NULL;
-   size_t myConvertedComponentSize;
-   int ret;
-
-   ASSERT(currentComponent);
-   ASSERT(dirPath);
-   ASSERT(convertedComponent);
-   ASSERT(convertedComponentSize);
+   DIR *dir;
+   char **names = NULL;
+   char **foldedNames = NULL;
+   uint32 numNames = 0;
+   uint32 maxNames = 0;
+   uint32 numBuckets;
+   uint32 i;
 
-   /* Open the specified directory. */
    dir = Posix_OpenDir(dirPath);
    if (!dir) {
-      ret = errno;
-      goto exit;
-   }
-
-   /*
-    * Unicode_CompareIgnoreCase crashes with invalid unicode strings,
-    * validate it before passing it to Unicode_* functions.
-    */
-   if (!Unicode_IsBufferValid(currentComponent, -1, STRING_ENCODING_UTF8)) {
-      /* Invalid unicode string, return failure. */
-      ret = EINVAL;
-      goto exit;
+      return errno;
    }
 
-   /*
-    * Read all of the directory entries. For each one, convert the name
-    * to lower case and then compare it to the lower case component.
-    */
    while ((dirent = readdir(dir))) {
+      char *dentryName = dirent->d_name;
+      size_t dentryNameLen = strlen(dentryName);
       char *dentryNameU;
-      int cmpResult;
-
-      dentryName = dirent->d_name;
-      dentryNameLen = strlen(dentryName);
 
       /*
-       * Unicode_CompareIgnoreCase crashes with invalid unicode strings,
-       * validate and convert it appropriately before passing it to Unicode_*
-       * functions.
+       * Unicode_FoldCase crashes with invalid unicode strings, validate and
+       * convert it appropriately before passing it to Unicode_* functions.
        */
 
       if (!Unicode_IsBufferValid(dentryName, dentryNameLen,
@@ -1479,115 +1792,288 @@ HgfsConvertComponentCase(char *currentComponent,           // IN
          continue;
       }
 
-      dentryNameU = Unicode_Alloc(dentryName, STRING_ENCODING_DEFAULT);
+      if (numNames == maxNames) {
+         maxNames = MAX(2 * maxNames, 64);
+         names = Util_SafeRealloc(names, maxNames * sizeof *names);
+         foldedNames = Util_SafeRealloc(foldedNames,
+                                        maxNames * sizeof *foldedNames);
+      }
 
-      cmpResult = Unicode_CompareIgnoreCase(currentComponent, dentryNameU);
+      dentryNameU = Unicode_Alloc(dentryName, STRING_ENCODING_DEFAULT);
+      foldedNames[numNames] = Unicode_FoldCase(dentryNameU);
       free(dentryNameU);
+      names[numNames] = Util_SafeStrdup(dentryName);
+      numNames++;
+   }
+   closedir(dir);
 
-      if (cmpResult == 0) {
-         /*
-          * The current directory entry is a case insensitive match to
-          * the specified component. Malloc and copy the current directory entry.
-          */
-         myConvertedComponentSize = dentryNameLen + 1;
-         myConvertedComponent = malloc(myConvertedComponentSize);
-         if (myConvertedComponent == NULL) {
-            ret = errno;
-            LOG(4, ("%s: failed to malloc myConvertedComponent.\n",
-                    __FUNCTION__));
-            goto exit;
-         }
-         Str_Strcpy(myConvertedComponent, dentryName, myConvertedComponentSize);
+   /* Size the table for about one entry per bucket. */
+   for (numBuckets = 16; numBuckets < numNames; numBuckets <<= 1) {
+   }
 
-         /* Success. Cleanup and exit. */
-         ret = 0;
-         *convertedComponentSize = myConvertedComponentSize;
-         *convertedComponent = myConvertedComponent;
-         goto exit;
+   *entries = HashTable_Alloc(numBuckets, HASH_STRING_KEY | HASH_FLAG_COPYKEY,
+                              free);
+   for (i = 0; i < numNames; i++) {
+      if (!HashTable_Insert(*entries, foldedNames[i], names[i])) {
+         free(names[i]);
       }
+      free(foldedNames[i]);
    }
+   free(names);
+   free(foldedNames);
 
-   /* We didn't find a match. Failure. */
-   ret = ENOENT;
-
-exit:
-   if (dir) {
-      closedir(dir);
-   }
-   if (ret) {
-      *convertedComponent = NULL;
-      *convertedComponentSize = 0;
-   }
-   return ret;
+   return 0;
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsConstructConvertedPath --
+ * HgfsCaseCacheInsert --
  *
- *    Expand the passed string and append the converted path.
+ *    Cache the entries of a directory, replacing any stale entries of the
+ *    same directory and evicting the least recently used directory of the
+ *    shard if it is full.
  *
  * Results:
- *    Returns 0 if successful, errno on failure. Note that this
- *    function cannot return ENOENT.
+ *    None.
  *
  * Side effects:
- *    Reallocs the path.
+ *    The cache owns the entries table.
  *
  *-----------------------------------------------------------------------------
  */
 
-static int
-HgfsConstructConvertedPath(char **path,                 // IN/OUT
-                           size_t *pathSize,            // IN/OUT
-                           char *convertedPath,         // IN
-                           size_t convertedPathSize)    // IN
+static void
+HgfsCaseCacheInsert(HgfsCaseCacheShard *shard,  // IN: shard of the directory
+                    const char *key,            // IN: device and inode
+                    uint64 writeTime,           // IN: modification time
+                    HashTable *entries)         // IN: folded name to name
 {
-   char *p;
-   size_t convertedPathLen = convertedPathSize - 1;
+   HgfsCaseDir *caseDir;
+   HgfsCaseDir *oldCaseDir;
 
-   ASSERT(path);
-   ASSERT(*path);
-   ASSERT(convertedPath);
-   ASSERT(pathSize);
+   caseDir = Util_SafeCalloc(1, sizeof *caseDir);
+   DblLnkLst_Init(&caseDir->links);
+   Str_Strcpy(caseDir->key, key, sizeof caseDir->key);
+   caseDir->writeTime = writeTime;
+   caseDir->entries = entries;
 
-   p = realloc(*path, *pathSize + convertedPathLen + sizeof (DIRSEPC));
-   if (!p) {
-      int error = errno;
-      LOG(4, ("%s: failed to realloc.\n", __FUNCTION__));
-      return error;
+   MXUser_AcquireExclLock(shard->lock);
+
+   if (HashTable_Lookup(shard->dirs, key, (void **)&oldCaseDir)) {
+      HgfsCaseDirRemove(shard, oldCaseDir);
+   }
+   if (shard->numDirs >= HGFS_CASE_CACHE_MAX_DIRS / HGFS_CASE_CACHE_SHARDS) {
+      HgfsCaseDirRemove(shard, DblLnkLst_Container(shard->lru.prev,
+                                                   HgfsCaseDir, links));
    }
 
-   *path = p;
-   *pathSize += convertedPathLen + sizeof (DIRSEPC);
+   HashTable_Insert(shard->dirs, caseDir->key, caseDir);
+   DblLnkLst_LinkFirst(&shard->lru, &caseDir->links);
+   shard->numDirs++;
 
-   /* Copy out the converted component to curDir, and free it. */
-   Str_Strncat(p, *pathSize, DIRSEPS, sizeof (DIRSEPS));
-   Str_Strncat(p, *pathSize, convertedPath, convertedPathLen);
-   return 0;
+   MXUser_ReleaseExclLock(shard->lock);
 }
 
 
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsCaseInsensitiveLookup --
+ * HgfsConvertComponentCase --
  *
- *    Do a case insensitive lookup for fileName. Each component past sharePath is
- *    looked-up case-insensitively. Expensive!
+ *    Do a case insensitive search of a directory for the specified entry. If
+ *    a matching entry is found, return it in the convertedComponent argument.
  *
- *    NOTE:
- *    shareName is always expected to be a prefix of fileName.
+ *    The directory entries are looked up in the case insensitive lookup
+ *    cache, and the directory is read and cached only if it is not there or
+ *    was modified since.
  *
  * Results:
- *    Returns 0 if successful and resolved path for fileName is returned in
- *    convertedFileName and its length (without nul) in convertedFileNameLength.
- *    Otherwise returns non-zero errno with convertedFileName and
- *    convertedFileNameLength set to NULL and 0 respectively.
+ *    On Success:
+ *    Returns 0 and the converted component name in the argument convertedComponent.
+ *    The length for the convertedComponent is returned in convertedComponentSize.
  *
- * Side effects:
+ *    On Failure:
+ *    Non-zero errno return, with convertedComponent and convertedComponentSize
+ *    set to NULL and 0 respectively.
+ *
+ * Side effects:
+ *    On success, allocated memory is returned in convertedComponent and needs
+ *    to be freed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+HgfsConvertComponentCase(char *currentComponent,           // IN
+                         const char *dirPath,              // IN
+                         const char **convertedComponent,  // OUT
+                         size_t *convertedComponentSize)   // OUT
+{
+   struct stat dirStat;
+   char key[48];
+   uint64 writeTime;
+   char *foldedComponent = NULL;
+   char *match = NULL;
+   HgfsCaseCacheShard *shard;
+   HgfsCaseDir *caseDir;
+   HashTable *entries = NULL;
+   Bool cached = FALSE;
+   int ret;
+
+   ASSERT(currentComponent);
+   ASSERT(dirPath);
+   ASSERT(convertedComponent);
+   ASSERT(convertedComponentSize);
+
+   /*
+    * Unicode_FoldCase crashes with invalid unicode strings,
+    * validate it before passing it to Unicode_* functions.
+    */
+   if (!Unicode_IsBufferValid(currentComponent, -1, STRING_ENCODING_UTF8)) {
+      /* Invalid unicode string, return failure. */
+      ret = EINVAL;
+      goto exit;
+   }
+
+   if (Posix_Stat(dirPath, &dirStat) != 0) {
+      ret = errno;
+      goto exit;
+   }
+   if (!S_ISDIR(dirStat.st_mode)) {
+      ret = ENOTDIR;
+      goto exit;
+   }
+
+   foldedComponent = Unicode_FoldCase(currentComponent);
+   Str_Sprintf(key, sizeof key, "%"FMT64"u:%"FMT64"u",
+               (uint64)dirStat.st_dev, (uint64)dirStat.st_ino);
+   writeTime = HgfsGetWriteTime(&dirStat);
+   shard = &gHgfsCaseCache[dirStat.st_ino % HGFS_CASE_CACHE_SHARDS];
+
+   MXUser_AcquireExclLock(shard->lock);
+   if (HashTable_Lookup(shard->dirs, key, (void **)&caseDir) &&
+       caseDir->writeTime == writeTime) {
+      char *name;
+
+      if (HashTable_Lookup(caseDir->entries, foldedComponent, (void **)&name)) {
+         match = Util_SafeStrdup(name);
+      }
+      DblLnkLst_Unlink1(&caseDir->links);
+      DblLnkLst_LinkFirst(&shard->lru, &caseDir->links);
+      cached = TRUE;
+   }
+   MXUser_ReleaseExclLock(shard->lock);
+
+   if (!cached) {
+      char *name;
+
+      ret = HgfsCaseDirRead(dirPath, &entries);
+      if (ret != 0) {
+         goto exit;
+      }
+
+      if (HashTable_Lookup(entries, foldedComponent, (void **)&name)) {
+         match = Util_SafeStrdup(name);
+      }
+
+      if (HashTable_GetNumElements(entries) <= HGFS_CASE_CACHE_MAX_ENTRIES &&
+          HgfsConvertToNtTime(time(NULL), 0) >
+             writeTime + HGFS_CASE_CACHE_MIN_AGE) {
+         HgfsCaseCacheInsert(shard, key, writeTime, entries);
+      } else {
+         HashTable_Free(entries);
+      }
+   }
+
+   if (match == NULL) {
+      /* We didn't find a match. Failure. */
+      ret = ENOENT;
+      goto exit;
+   }
+
+   /* Success. */
+   ret = 0;
+   *convertedComponentSize = strlen(match) + 1;
+   *convertedComponent = match;
+
+exit:
+   free(foldedComponent);
+   if (ret) {
+      *convertedComponent = NULL;
+      *convertedComponentSize = 0;
+   }
+   return ret;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsConstructConvertedPath --
+ *
+ *    Expand the passed string and append the converted path.
+ *
+ * Results:
+ *    Returns 0 if successful, errno on failure. Note that this
+ *    function cannot return ENOENT.
+ *
+ * Side effects:
+ *    Reallocs the path.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+HgfsConstructConvertedPath(char **path,                 // IN/OUT
+                           size_t *pathSize,            // IN/OUT
+                           char *convertedPath,         // IN
+                           size_t convertedPathSize)    // IN
+{
+   char *p;
+   size_t convertedPathLen = convertedPathSize - 1;
+
+   ASSERT(path);
+   ASSERT(*path);
+   ASSERT(convertedPath);
+   ASSERT(pathSize);
+
+   p = realloc(*path, *pathSize + convertedPathLen + sizeof (DIRSEPC));
+   if (!p) {
+      int error = errno;
+      LOG(4, ("%s: failed to realloc.\n", __FUNCTION__));
+      return error;
+   }
+
+   *path = p;
+   *pathSize += convertedPathLen + sizeof (DIRSEPC);
+
+   /* Copy out the converted component to curDir, and free it. */
+   Str_Strncat(p, *pathSize, DIRSEPS, sizeof (DIRSEPS));
+   Str_Strncat(p, *pathSize, convertedPath, convertedPathLen);
+   return 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsCaseInsensitiveLookup --
+ *
+ *    Do a case insensitive lookup for fileName. Each component past sharePath is
+ *    looked-up case-insensitively. Expensive!
+ *
+ *    NOTE:
+ *    shareName is always expected to be a prefix of fileName.
+ *
+ * Results:
+ *    Returns 0 if successful and resolved path for fileName is returned in
+ *    convertedFileName and its length (without nul) in convertedFileNameLength.
+ *    Otherwise returns non-zero errno with convertedFileName and
+ *    convertedFileNameLength set to NULL and 0 respectively.
+ *
+ * Side effects:
  *    On success, allocated memory is returned in convertedFileName and needs
  *    to be freed.
  *
@@ -2152,110 +2638,657 @@ HgfsGetSequentialOnlyFlagFromFd(int fd,                     // IN
 /*
  *-----------------------------------------------------------------------------
  *
- * HgfsPlatformGetattrFromName --
+ * HgfsAttrCacheInit --
  *
- *    Performs a stat operation on the given filename, and, if it is a symlink,
- *    allocates the target filename on behalf of the caller and performs a
- *    readlink to get it. If not a symlink, the targetName argument is
- *    untouched. Does necessary translation between Unix file stats and the
- *    HgfsFileAttrInfo formats.
- *    NOTE: The function is different from HgfsGetAttrFromId: this function returns
- *    effectve permissions while HgfsGetAttrFromId does not.
- *    The reason for this asymmetry is that effective permissions are needed
- *    to get a new handle. If the file is already opened then
- *    getting effective permissions does not have any value. However getting
- *    effective permissions would hurt perfomance and should be avoided.
+ *    Set up the attribute cache. The cache stays disabled if inotify is not
+ *    available.
  *
  * Results:
- *    Zero on success.
- *    Non-zero on failure.
+ *    None.
  *
  * Side effects:
- *    None
+ *    None.
  *
  *-----------------------------------------------------------------------------
  */
 
-HgfsInternalStatus
-HgfsPlatformGetattrFromName(char *fileName,                 // IN/OUT:  Input filename
-                            HgfsShareOptions configOptions, // IN: Share config options
-                            char *shareName,                // IN: Share name
-                            HgfsFileAttrInfo *attr,         // OUT: Struct to copy into
-                            char **targetName)              // OUT: Symlink target
+static void
+HgfsAttrCacheInit(void)
 {
-   HgfsInternalStatus status = 0;
-   struct stat stats;
-   int error;
-   char *myTargetName = NULL;
-   uint64 creationTime;
-   Bool followSymlinks;
+#if defined(__linux__)
+   gHgfsAttrCacheFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+   if (gHgfsAttrCacheFd < 0) {
+      LOG(4, ("%s: inotify_init1 failed, attribute cache disabled: %s\n",
+              __FUNCTION__, strerror(errno)));
+      return;
+   }
 
-   ASSERT(fileName);
-   ASSERT(attr);
+   gHgfsAttrCacheLock = MXUser_CreateRWLock("hgfsAttrCacheLock",
+                                            RANK_hgfsAttrCacheLock);
+   gHgfsAttrCacheEntries = HashTable_Alloc(HGFS_ATTR_CACHE_MAX_ENTRIES,
+                                           HASH_STRING_KEY, NULL);
+   gHgfsAttrCacheWatches = HashTable_Alloc(HGFS_ATTR_CACHE_MAX_ENTRIES,
+                                           HASH_INT_KEY, NULL);
+   DblLnkLst_Init(&gHgfsAttrCacheLru);
+   gHgfsAttrCacheNumEntries = 0;
+#endif
+}
 
-   LOG(4, ("%s: getting attrs for \"%s\"\n", __FUNCTION__, fileName));
-   followSymlinks = HgfsServerPolicy_IsShareOptionSet(configOptions,
-                                                      HGFS_SHARE_FOLLOW_SYMLINKS),
 
-   error = HgfsStat(fileName,
-                    followSymlinks,
-                    &stats,
-                    &creationTime);
-   if (error) {
-      status = errno;
-      LOG(4, ("%s: error stating file: %s\n", __FUNCTION__, strerror(status)));
-      goto exit;
-   }
+#if defined(__linux__)
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsAttrEntryRemove --
+ *
+ *    Remove an entry from the attribute cache. Called with the cache lock
+ *    held for write.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    The entry is freed. Its watch is left even if it has no entries left.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-   /*
-    * Deal with the file type returned from lstat(2). We currently support
-    * regular files, directories, and symlinks. On Mac OS, we'll additionally
-    * treat finder aliases as symlinks.
-    */
-   if (S_ISDIR(stats.st_mode)) {
-      attr->type = HGFS_FILE_TYPE_DIRECTORY;
-      LOG(4, ("%s: is a directory\n", __FUNCTION__));
-   } else if (S_ISLNK(stats.st_mode)) {
-      attr->type = HGFS_FILE_TYPE_SYMLINK;
-      LOG(4, ("%s: is a symlink\n", __FUNCTION__));
+static void
+HgfsAttrEntryRemove(HgfsAttrEntry *entry)  // IN: cached attributes
+{
+   ASSERT(MXUser_IsCurThreadHoldingRWLock(gHgfsAttrCacheLock,
+                                          MXUSER_RW_FOR_WRITE));
+
+   HashTable_Delete(gHgfsAttrCacheEntries, entry->key);
+   DblLnkLst_Unlink1(&entry->links);
+   DblLnkLst_Unlink1(&entry->watchLinks);
+   gHgfsAttrCacheNumEntries--;
+   free(entry->targetName);
+   free(entry->key);
+   free(entry);
+}
 
-      /*
-       * In the case of a symlink, we should populate targetName if the
-       * caller asked. Use st_size and readlink() to do so.
-       */
-      if (targetName != NULL) {
 
-         myTargetName = Posix_ReadLink(fileName);
-         if (myTargetName == NULL) {
-            error = errno;
-            LOG(4, ("%s: readlink returned wrong size\n", __FUNCTION__));
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsAttrWatchRelease --
+ *
+ *    Remove a watch that no entry and no lookup uses anymore. Called with the
+ *    cache lock held for write.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    The inotify watch is removed unless the kernel already did.
+ *
+ *-----------------------------------------------------------------------------
+ */
 
-            /*
-             * Because of an unavoidable race between the lstat(2) and the
-             * readlink(2), the symlink target may have lengthened and we may
-             * not have read the entire link. If that happens, just return
-             * "out of memory".
-             */
-            status = error ? error : ENOMEM;
-            goto exit;
-         }
-      }
-   } else {
-      /*
-       * Now is a good time to check if the file was an alias. If so, we'll
-       * treat it as a symlink.
-       *
-       * XXX: If HgfsGetattrResolveAlias fails, we'll treat the file as a
-       * regular file. This isn't completely correct (the function may have
-       * failed because we're out of memory), but it's better than having to
-       * call LScopyItemInfoForRef for each file, which may negatively affect
-       * performance. See:
-       *
-       * http://lists.apple.com/archives/carbon-development/2001/Nov/msg00007.html
-       */
+static void
+HgfsAttrWatchRelease(HgfsAttrWatch *watch)  // IN: watch
+{
+   ASSERT(MXUser_IsCurThreadHoldingRWLock(gHgfsAttrCacheLock,
+                                          MXUSER_RW_FOR_WRITE));
 
-      LOG(4, ("%s: NOT a directory or symlink\n", __FUNCTION__));
-      if (HgfsGetattrResolveAlias(fileName, &myTargetName)) {
+   if (DblLnkLst_IsLinked(&watch->entries) || watch->pendingInserts > 0) {
+      return;
+   }
+
+   if (!watch->removed) {
+      inotify_rm_watch(gHgfsAttrCacheFd, watch->wd);
+   }
+   HashTable_Delete(gHgfsAttrCacheWatches, (void *)(uintptr_t)watch->wd);
+   free(watch);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsAttrWatchBreak --
+ *
+ *    The watched inode changed: drop its cached attributes. Called with the
+ *    cache lock held for write.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Lookups in progress for the inode will not insert their attributes.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsAttrWatchBreak(HgfsAttrWatch *watch)  // IN: watch
+{
+   ASSERT(MXUser_IsCurThreadHoldingRWLock(gHgfsAttrCacheLock,
+                                          MXUSER_RW_FOR_WRITE));
+
+   watch->breaks++;
+   while (DblLnkLst_IsLinked(&watch->entries)) {
+      HgfsAttrEntryRemove(DblLnkLst_Container(watch->entries.next,
+                                              HgfsAttrEntry, watchLinks));
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsAttrCacheFlush --
+ *
+ *    Break all the watches, when change events were lost. Called with the
+ *    cache lock held for write.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    The watches no lookup uses are removed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsAttrCacheFlush(void)
+{
+   HgfsAttrWatch **watches;
+   size_t numWatches;
+   size_t i;
+
+   ASSERT(MXUser_IsCurThreadHoldingRWLock(gHgfsAttrCacheLock,
+                                          MXUSER_RW_FOR_WRITE));
+
+   HashTable_ToArray(gHgfsAttrCacheWatches, (void ***)&watches, &numWatches);
+   for (i = 0; i < numWatches; i++) {
+      HgfsAttrWatchBreak(watches[i]);
+      HgfsAttrWatchRelease(watches[i]);
+   }
+   free(watches);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsAttrCacheEventsPending --
+ *
+ *    Check if the inotify instance has events to read, without the cache
+ *    lock. The events of a change are queued by the system call which made
+ *    it, so a change made before the check is always seen.
+ *
+ * Results:
+ *    TRUE if there are events to read or the check failed, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsAttrCacheEventsPending(void)
+{
+   int pending = 0;
+
+   return ioctl(gHgfsAttrCacheFd, FIONREAD, &pending) != 0 || pending > 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsAttrCacheReadEvents --
+ *
+ *    Read the pending inotify events and break the watches they concern.
+ *    Called with the cache lock held for write.
+ *
+ *    Content changes of the entries of a watched directory are reported on
+ *    the directory watch too and do not change the directory: they are
+ *    ignored.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsAttrCacheReadEvents(void)
+{
+   char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+   ssize_t bytesRead;
+
+   ASSERT(MXUser_IsCurThreadHoldingRWLock(gHgfsAttrCacheLock,
+                                          MXUSER_RW_FOR_WRITE));
+
+   while ((bytesRead = read(gHgfsAttrCacheFd, buffer, sizeof buffer)) > 0) {
+      size_t offset = 0;
+
+      while (offset + sizeof (struct inotify_event) <= bytesRead) {
+         const struct inotify_event *event =
+            (const struct inotify_event *)(buffer + offset);
+         HgfsAttrWatch *watch;
+
+         offset += sizeof *event + event->len;
+
+         if (event->mask & IN_Q_OVERFLOW) {
+            LOG(4, ("%s: event queue overflow, flushing\n", __FUNCTION__));
+            HgfsAttrCacheFlush();
+            continue;
+         }
+
+         if (!HashTable_Lookup(gHgfsAttrCacheWatches,
+                               (void *)(uintptr_t)event->wd,
+                               (void **)&watch)) {
+            continue;
+         }
+
+         if (event->len > 0 && !(event->mask & HGFS_ATTR_CACHE_DIR_EVENTS)) {
+            continue;
+         }
+
+         if (event->mask & IN_IGNORED) {
+            /* The inode is gone, the kernel removed the watch. */
+            watch->removed = TRUE;
+         }
+         HgfsAttrWatchBreak(watch);
+         HgfsAttrWatchRelease(watch);
+      }
+   }
+}
+#endif
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsAttrCacheExit --
+ *
+ *    Tear down the attribute cache.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsAttrCacheExit(void)
+{
+#if defined(__linux__)
+   if (gHgfsAttrCacheLock == NULL) {
+      return;
+   }
+
+   MXUser_AcquireForWrite(gHgfsAttrCacheLock);
+   while (DblLnkLst_IsLinked(&gHgfsAttrCacheLru)) {
+      HgfsAttrEntryRemove(DblLnkLst_Container(gHgfsAttrCacheLru.next,
+                                              HgfsAttrEntry, links));
+   }
+   HgfsAttrCacheFlush();
+   MXUser_ReleaseRWLock(gHgfsAttrCacheLock);
+
+   /* No lookups are in progress, so all the watches were removed. */
+   ASSERT(HashTable_GetNumElements(gHgfsAttrCacheWatches) == 0);
+   HashTable_Free(gHgfsAttrCacheWatches);
+   gHgfsAttrCacheWatches = NULL;
+   HashTable_Free(gHgfsAttrCacheEntries);
+   gHgfsAttrCacheEntries = NULL;
+   close(gHgfsAttrCacheFd);
+   gHgfsAttrCacheFd = -1;
+   MXUser_DestroyRWLock(gHgfsAttrCacheLock);
+   gHgfsAttrCacheLock = NULL;
+#endif
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsAttrCacheLookup --
+ *
+ *    Look up the cached attributes of a name, once the pending change
+ *    events, if any, are processed.
+ *
+ * Results:
+ *    TRUE and the attributes, and an allocated copy of the symlink target if
+ *    asked for, if found and not expired. FALSE otherwise.
+ *
+ * Side effects:
+ *    The entry found is marked referenced. An expired entry is left for the
+ *    insert of the attributes looked up again to replace.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsAttrCacheLookup(const char *key,          // IN: share mode and name
+                    HgfsFileAttrInfo *attr,   // IN/OUT: attributes
+                    char **targetName)        // OUT: symlink target, optional
+{
+#if defined(__linux__)
+   HgfsAttrEntry *entry;
+   Bool found = FALSE;
+
+   if (gHgfsAttrCacheLock == NULL) {
+      return FALSE;
+   }
+
+   if (HgfsAttrCacheEventsPending()) {
+      MXUser_AcquireForWrite(gHgfsAttrCacheLock);
+      HgfsAttrCacheReadEvents();
+      MXUser_ReleaseRWLock(gHgfsAttrCacheLock);
+   }
+
+   MXUser_AcquireForRead(gHgfsAttrCacheLock);
+   if (HashTable_Lookup(gHgfsAttrCacheEntries, key, (void **)&entry) &&
+       Hostinfo_SystemTimerUS() - entry->insertTimeUS <=
+          HGFS_ATTR_CACHE_TTL_US) {
+      HgfsOp requestType = attr->requestType;
+
+      *attr = entry->attr;
+      attr->requestType = requestType;
+      if (targetName != NULL && entry->targetName != NULL) {
+         *targetName = Util_SafeStrdup(entry->targetName);
+      }
+      Atomic_Write32(&entry->referenced, TRUE);
+      found = TRUE;
+   }
+   MXUser_ReleaseRWLock(gHgfsAttrCacheLock);
+
+   return found;
+#else
+   return FALSE;
+#endif
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsAttrCacheWatch --
+ *
+ *    Watch the inode of a name before its attributes are looked up, so that
+ *    a change made while they are looked up prevents their insertion. Must be
+ *    followed by HgfsAttrCacheInsert.
+ *
+ * Results:
+ *    The watch descriptor and the current count of its breaks, or -1 if the
+ *    name cannot be watched.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+HgfsAttrCacheWatch(const char *fileName,   // IN: local name
+                   uint32 *breaks)         // OUT: breaks of the watch
+{
+#if defined(__linux__)
+   HgfsAttrWatch *watch;
+   int wd;
+
+   if (gHgfsAttrCacheLock == NULL) {
+      return -1;
+   }
+
+   MXUser_AcquireForWrite(gHgfsAttrCacheLock);
+   wd = inotify_add_watch(gHgfsAttrCacheFd, fileName,
+                          HGFS_ATTR_CACHE_EVENTS | IN_DONT_FOLLOW);
+   if (wd < 0) {
+      LOG(4, ("%s: cannot watch \"%s\": %s\n", __FUNCTION__, fileName,
+              strerror(errno)));
+   } else {
+      if (!HashTable_Lookup(gHgfsAttrCacheWatches, (void *)(uintptr_t)wd,
+                            (void **)&watch)) {
+         watch = Util_SafeCalloc(1, sizeof *watch);
+         watch->wd = wd;
+         DblLnkLst_Init(&watch->entries);
+         HashTable_Insert(gHgfsAttrCacheWatches, (void *)(uintptr_t)wd, watch);
+      }
+      watch->pendingInserts++;
+      *breaks = watch->breaks;
+   }
+   MXUser_ReleaseRWLock(gHgfsAttrCacheLock);
+
+   return wd;
+#else
+   return -1;
+#endif
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsAttrCacheInsert --
+ *
+ *    Cache the attributes looked up for a watched name, unless the watch
+ *    was broken since HgfsAttrCacheWatch. If the cache is full, the oldest
+ *    entry not referenced since it was last passed over is evicted, and the
+ *    referenced ones passed over go back to the front.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    The watch is removed if the attributes are not cached and no other
+ *    entry uses it.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsAttrCacheInsert(const char *key,                // IN: share mode and name
+                    int wd,                         // IN: watch of the name
+                    uint32 breaks,                  // IN: breaks at watch time
+                    const HgfsFileAttrInfo *attr,   // IN: attributes or NULL
+                    const char *targetName)         // IN: symlink target or NULL
+{
+#if defined(__linux__)
+   HgfsAttrWatch *watch;
+   HgfsAttrEntry *entry;
+
+   ASSERT(gHgfsAttrCacheLock != NULL);
+
+   MXUser_AcquireForWrite(gHgfsAttrCacheLock);
+   HgfsAttrCacheReadEvents();
+
+   /* The pending insert kept the watch, even if the kernel removed it. */
+   VERIFY(HashTable_Lookup(gHgfsAttrCacheWatches, (void *)(uintptr_t)wd,
+                           (void **)&watch));
+   watch->pendingInserts--;
+
+   if (attr != NULL && watch->breaks == breaks) {
+      if (HashTable_Lookup(gHgfsAttrCacheEntries, key, (void **)&entry)) {
+         HgfsAttrWatch *oldWatch = entry->watch;
+
+         HgfsAttrEntryRemove(entry);
+         if (oldWatch != watch) {
+            HgfsAttrWatchRelease(oldWatch);
+         }
+      }
+      while (gHgfsAttrCacheNumEntries >= HGFS_ATTR_CACHE_MAX_ENTRIES) {
+         HgfsAttrWatch *oldWatch;
+
+         entry = DblLnkLst_Container(gHgfsAttrCacheLru.prev, HgfsAttrEntry,
+                                     links);
+         if (Atomic_ReadWrite32(&entry->referenced, FALSE)) {
+            DblLnkLst_Unlink1(&entry->links);
+            DblLnkLst_LinkFirst(&gHgfsAttrCacheLru, &entry->links);
+            continue;
+         }
+         oldWatch = entry->watch;
+         HgfsAttrEntryRemove(entry);
+         if (oldWatch != watch) {
+            HgfsAttrWatchRelease(oldWatch);
+         }
+      }
+
+      entry = Util_SafeCalloc(1, sizeof *entry);
+      DblLnkLst_Init(&entry->links);
+      DblLnkLst_Init(&entry->watchLinks);
+      entry->watch = watch;
+      entry->key = Util_SafeStrdup(key);
+      entry->attr = *attr;
+      entry->targetName = targetName != NULL ? Util_SafeStrdup(targetName)
+                                             : NULL;
+      entry->insertTimeUS = Hostinfo_SystemTimerUS();
+
+      HashTable_Insert(gHgfsAttrCacheEntries, entry->key, entry);
+      DblLnkLst_LinkFirst(&gHgfsAttrCacheLru, &entry->links);
+      DblLnkLst_LinkLast(&watch->entries, &entry->watchLinks);
+      gHgfsAttrCacheNumEntries++;
+   } else {
+      HgfsAttrWatchRelease(watch);
+   }
+
+   MXUser_ReleaseRWLock(gHgfsAttrCacheLock);
+#endif
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformGetattrFromName --
+ *
+ *    Performs a stat operation on the given filename, and, if it is a symlink,
+ *    allocates the target filename on behalf of the caller and performs a
+ *    readlink to get it. If not a symlink, the targetName argument is
+ *    untouched. Does necessary translation between Unix file stats and the
+ *    HgfsFileAttrInfo formats.
+ *    NOTE: The function is different from HgfsGetAttrFromId: this function returns
+ *    effectve permissions while HgfsGetAttrFromId does not.
+ *    The reason for this asymmetry is that effective permissions are needed
+ *    to get a new handle. If the file is already opened then
+ *    getting effective permissions does not have any value. However getting
+ *    effective permissions would hurt perfomance and should be avoided.
+ *
+ *    The attributes are looked up in the attribute cache first, unless the
+ *    share follows symlinks: the watch of a name is on its own inode, and a
+ *    replaced symlink target would go unnoticed.
+ *
+ * Results:
+ *    Zero on success.
+ *    Non-zero on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsInternalStatus
+HgfsPlatformGetattrFromName(char *fileName,                 // IN/OUT:  Input filename
+                            HgfsShareOptions configOptions, // IN: Share config options
+                            char *shareName,                // IN: Share name
+                            HgfsFileAttrInfo *attr,         // OUT: Struct to copy into
+                            char **targetName)              // OUT: Symlink target
+{
+   HgfsInternalStatus status = 0;
+   struct stat stats;
+   int error;
+   char *myTargetName = NULL;
+   uint64 creationTime;
+   Bool followSymlinks;
+   HgfsOpenMode shareMode;
+   HgfsNameStatus shareModeStatus;
+   char *cacheKey = NULL;
+   int cacheWd = -1;
+   uint32 cacheBreaks = 0;
+
+   ASSERT(fileName);
+   ASSERT(attr);
+
+   LOG(4, ("%s: getting attrs for \"%s\"\n", __FUNCTION__, fileName));
+   followSymlinks = HgfsServerPolicy_IsShareOptionSet(configOptions,
+                                                      HGFS_SHARE_FOLLOW_SYMLINKS);
+   shareModeStatus = HgfsServerPolicy_GetShareMode(shareName, strlen(shareName),
+                                                   &shareMode);
+
+   if (!followSymlinks && shareModeStatus == HGFS_NAME_STATUS_COMPLETE) {
+      /* The effective permissions depend on the share mode. */
+      cacheKey = Str_SafeAsprintf(NULL, "%d:%s", shareMode, fileName);
+      if (HgfsAttrCacheLookup(cacheKey, attr, targetName)) {
+         LOG(4, ("%s: cached attrs for \"%s\"\n", __FUNCTION__, fileName));
+         free(cacheKey);
+         return 0;
+      }
+      cacheWd = HgfsAttrCacheWatch(fileName, &cacheBreaks);
+   }
+
+   error = HgfsStat(fileName,
+                    followSymlinks,
+                    &stats,
+                    &creationTime);
+   if (error) {
+      status = errno;
+      LOG(4, ("%s: error stating file: %s\n", __FUNCTION__, strerror(status)));
+      goto exit;
+   }
+
+   /*
+    * Deal with the file type returned from lstat(2). We currently support
+    * regular files, directories, and symlinks. On Mac OS, we'll additionally
+    * treat finder aliases as symlinks.
+    */
+   if (S_ISDIR(stats.st_mode)) {
+      attr->type = HGFS_FILE_TYPE_DIRECTORY;
+      LOG(4, ("%s: is a directory\n", __FUNCTION__));
+   } else if (S_ISLNK(stats.st_mode)) {
+      attr->type = HGFS_FILE_TYPE_SYMLINK;
+      LOG(4, ("%s: is a symlink\n", __FUNCTION__));
+
+      /*
+       * In the case of a symlink, we should populate targetName if the
+       * caller asked. Use st_size and readlink() to do so.
+       */
+      if (targetName != NULL) {
+
+         myTargetName = Posix_ReadLink(fileName);
+         if (myTargetName == NULL) {
+            error = errno;
+            LOG(4, ("%s: readlink returned wrong size\n", __FUNCTION__));
+
+            /*
+             * Because of an unavoidable race between the lstat(2) and the
+             * readlink(2), the symlink target may have lengthened and we may
+             * not have read the entire link. If that happens, just return
+             * "out of memory".
+             */
+            status = error ? error : ENOMEM;
+            goto exit;
+         }
+      }
+   } else {
+      /*
+       * Now is a good time to check if the file was an alias. If so, we'll
+       * treat it as a symlink.
+       *
+       * XXX: If HgfsGetattrResolveAlias fails, we'll treat the file as a
+       * regular file. This isn't completely correct (the function may have
+       * failed because we're out of memory), but it's better than having to
+       * call LScopyItemInfoForRef for each file, which may negatively affect
+       * performance. See:
+       *
+       * http://lists.apple.com/archives/carbon-development/2001/Nov/msg00007.html
+       */
+
+      LOG(4, ("%s: NOT a directory or symlink\n", __FUNCTION__));
+      if (HgfsGetattrResolveAlias(fileName, &myTargetName)) {
          LOG(4, ("%s: could not resolve file aliases\n", __FUNCTION__));
       }
       attr->type = HGFS_FILE_TYPE_REGULAR;
@@ -2339,12 +3372,9 @@ HgfsPlatformGetattrFromName(char *fileName,                 // IN/OUT:  Input fi
 
    /* Get effective permissions if we can */
    if (!(S_ISLNK(stats.st_mode))) {
-      HgfsOpenMode shareMode;
       uint32 permissions;
-      HgfsNameStatus nameStatus;
-      nameStatus = HgfsServerPolicy_GetShareMode(shareName, strlen(shareName),
-                                                 &shareMode);
-      if (nameStatus == HGFS_NAME_STATUS_COMPLETE &&
+
+      if (shareModeStatus == HGFS_NAME_STATUS_COMPLETE &&
           HgfsEffectivePermissions(fileName,
                                    shareMode == HGFS_OPEN_MODE_READ_ONLY,
                                    &permissions) == 0) {
@@ -2354,6 +3384,21 @@ HgfsPlatformGetattrFromName(char *fileName,                 // IN/OUT:  Input fi
    }
 
 exit:
+   if (cacheWd >= 0) {
+      const char *cacheTarget = NULL;
+
+      /* A symlink is only cached with its target. */
+      if (status == 0 && targetName != NULL) {
+         cacheTarget = *targetName;
+      }
+      HgfsAttrCacheInsert(cacheKey, cacheWd, cacheBreaks,
+                          (status == 0 &&
+                           (attr->type != HGFS_FILE_TYPE_SYMLINK ||
+                            cacheTarget != NULL)) ? attr : NULL,
+                          attr->type == HGFS_FILE_TYPE_SYMLINK ? cacheTarget
+                                                               : NULL);
+   }
+   free(cacheKey);
    free(myTargetName);
    return status;
 }
@@ -2872,7 +3917,7 @@ HgfsPlatformSetattrFromFd(HgfsHandle file,          // IN: file descriptor
       LOG(4, ("%s: error stating file %u: %s\n", __FUNCTION__,
               fd, strerror(error)));
       status = error;
-      goto exit;
+      goto release;
    }
 
    /*
@@ -2972,7 +4017,7 @@ HgfsPlatformSetattrFromFd(HgfsHandle file,          // IN: file descriptor
                     __FUNCTION__, fd));
             /* XXX: Linux kernel says both EPERM and EACCES are valid here. */
             status = EPERM;
-            goto exit;
+            goto release;
          }
          uid = Id_BeginSuperUser();
          switchToSuperUser = TRUE;
@@ -3012,6 +4057,9 @@ HgfsPlatformSetattrFromFd(HgfsHandle file,          // IN: file descriptor
       status = timesStatus;
    }
 
+release:
+   HgfsReleaseFd(file, session);
+
 exit:
    return status;
 }
@@ -3478,6 +4526,19 @@ HgfsPlatformGetDirEntry(HgfsSearch *search,               // IN: search
    DirectoryEntry *dent = NULL;
    HgfsInternalStatus status = HGFS_ERROR_SUCCESS;
 
+   if (NULL != search->dirStream) {
+      status = HgfsPlatformScandirFill(search, index);
+      if (HGFS_ERROR_SUCCESS != status) {
+         goto out;
+      }
+
+      /* The dents array starts at the stream's base index. */
+      if (index < search->dirStream->baseIndex) {
+         goto out;
+      }
+      index -= search->dirStream->baseIndex;
+   }
+
    if (index >= search->numDents) {
       goto out;
    }
@@ -3537,6 +4598,203 @@ out:
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsMayOverrideDac --
+ *
+ *    Check if the server process may bypass file permission checks, i.e.
+ *    has CAP_DAC_OVERRIDE or CAP_DAC_READ_SEARCH in its effective set.
+ *
+ * Results:
+ *    FALSE if it cannot, TRUE if it can or its capabilities are unknown.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsMayOverrideDac(void)
+{
+#if defined(__linux__)
+   /* Bits of CAP_DAC_OVERRIDE (1) and CAP_DAC_READ_SEARCH (2). */
+   const uint64 dacCaps = (CONST64U(1) << 1) | (CONST64U(1) << 2);
+   Bool mayOverride = TRUE;
+   char line[128];
+   FILE *status;
+
+   status = fopen("/proc/self/status", "r");
+   if (NULL == status) {
+      return TRUE;
+   }
+   while (fgets(line, sizeof line, status) != NULL) {
+      uint64 capEff;
+
+      if (sscanf(line, "CapEff: %"FMT64"x", &capEff) == 1) {
+         mayOverride = (capEff & dacCaps) != 0;
+         break;
+      }
+   }
+   fclose(status);
+   return mayOverride;
+#else
+   return TRUE;
+#endif
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsGetattrFromDirStream --
+ *
+ *    Get the attributes of a directory entry with a single fstatat relative
+ *    to the open directory. This is the search read equivalent of
+ *    HgfsPlatformGetattrFromName without the path walk and probes per entry:
+ *
+ *    - the hidden flag only depends on the name (no xattrs on Linux),
+ *    - only FIFOs and sockets are sequential only, other devices are probed,
+ *    - the read and execute permissions of files owned by the server's
+ *      user come from the owner mode bits unless the server may override
+ *      them, the share mode and read only file system check are looked up
+ *      once per search read.
+ *
+ * Results:
+ *    Zero on success.
+ *    Non-zero on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsInternalStatus
+HgfsGetattrFromDirStream(HgfsDirStream *stream,           // IN/OUT: open directory
+                         char const *name,                // IN: entry name
+                         HgfsShareOptions configOptions,  // IN: Share config options
+                         char const *shareName,           // IN: Share name
+                         HgfsFileAttrInfo *attr)          // OUT: Struct to copy into
+{
+#if defined(__APPLE__)
+   NOT_REACHED();
+   return EINVAL;
+#else
+   struct stat stats;
+   uint64 creationTime;
+   Bool followSymlinks;
+
+   followSymlinks = HgfsServerPolicy_IsShareOptionSet(configOptions,
+                                                      HGFS_SHARE_FOLLOW_SYMLINKS);
+
+   if (fstatat(stream->fd, name, &stats,
+               followSymlinks ? 0 : AT_SYMLINK_NOFOLLOW) < 0) {
+      HgfsInternalStatus status = errno;
+
+      LOG(4, ("%s: error stating \"%s\": %s\n", __FUNCTION__, name,
+              strerror(status)));
+      return status;
+   }
+   creationTime = HgfsGetCreationTime(&stats);
+
+   if (S_ISDIR(stats.st_mode)) {
+      attr->type = HGFS_FILE_TYPE_DIRECTORY;
+   } else if (S_ISLNK(stats.st_mode)) {
+      attr->type = HGFS_FILE_TYPE_SYMLINK;
+   } else {
+      attr->type = HGFS_FILE_TYPE_REGULAR;
+   }
+
+   HgfsStatToFileAttr(&stats, &creationTime, attr);
+
+   /* Same as HgfsGetHiddenAttr: dot files are hidden for Windows clients. */
+   if (name[0] == '.' && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+      attr->mask |= HGFS_ATTR_VALID_FLAGS;
+      attr->flags |= HGFS_ATTR_HIDDEN | HGFS_ATTR_HIDDEN_FORCED;
+   }
+
+   /* Same as HgfsGetSequentialOnlyFlagFromName without opening the file. */
+   if (S_ISFIFO(stats.st_mode) || S_ISSOCK(stats.st_mode)) {
+      attr->flags |= HGFS_ATTR_SEQUENTIAL_ONLY;
+   } else if (S_ISCHR(stats.st_mode) || S_ISBLK(stats.st_mode)) {
+      int openFlags;
+      int fd;
+
+      HgfsServerGetOpenFlags(0, &openFlags);
+      if (followSymlinks) {
+         openFlags &= ~O_NOFOLLOW;
+      }
+      fd = openat(stream->fd, name, openFlags | O_RDONLY);
+      if (fd >= 0) {
+         HgfsGetSequentialOnlyFlagFromFd(fd, attr);
+         close(fd);
+      }
+   }
+
+   /* Get effective permissions if we can */
+   if (S_ISLNK(stats.st_mode)) {
+      return 0;
+   }
+
+   if (!stream->permInfoValid) {
+      HgfsOpenMode shareMode = HGFS_OPEN_MODE_READ_ONLY;
+      struct statvfs vfsStats;
+
+      stream->shareModeValid =
+         HgfsServerPolicy_GetShareMode(shareName, strlen(shareName),
+                                       &shareMode) == HGFS_NAME_STATUS_COMPLETE;
+      stream->readOnlyShare = shareMode == HGFS_OPEN_MODE_READ_ONLY;
+      stream->readOnlyFs = fstatvfs(stream->fd, &vfsStats) == 0 &&
+                           (vfsStats.f_flag & ST_RDONLY) != 0;
+      stream->ownerModeExact = getuid() != 0 && !HgfsMayOverrideDac();
+      stream->permInfoValid = TRUE;
+   }
+
+   if (stream->shareModeValid) {
+      uint32 permissions = 0;
+
+      if (stream->ownerModeExact && stats.st_uid == getuid()) {
+         /*
+          * access(2) only checks the owner bits for the owner, which no
+          * capability of ours overrides. Write access can still be denied
+          * by the inode flags (immutable), which stat does not report, so
+          * it is only granted after asking.
+          */
+         if (stats.st_mode & S_IRUSR) {
+            permissions |= HGFS_PERM_READ;
+         }
+         if (stats.st_mode & S_IXUSR) {
+            permissions |= HGFS_PERM_EXEC;
+         }
+         if ((stats.st_mode & S_IWUSR) && !stream->readOnlyFs &&
+             faccessat(stream->fd, name, W_OK, 0) == 0) {
+            permissions |= HGFS_PERM_WRITE;
+         }
+      } else {
+         if (faccessat(stream->fd, name, R_OK, 0) == 0) {
+            permissions |= HGFS_PERM_READ;
+         }
+         if (faccessat(stream->fd, name, X_OK, 0) == 0) {
+            permissions |= HGFS_PERM_EXEC;
+         }
+         if (faccessat(stream->fd, name, W_OK, 0) == 0) {
+            permissions |= HGFS_PERM_WRITE;
+         }
+      }
+      if (stream->readOnlyShare) {
+         permissions &= ~HGFS_PERM_WRITE;
+      }
+      attr->mask |= HGFS_ATTR_VALID_EFFECTIVE_PERMS;
+      attr->effectivePerms = permissions;
+   }
+
+   return 0;
+#endif
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -3613,6 +4871,13 @@ HgfsPlatformSetDirEntry(HgfsSearch *search,              // IN: partially valid
                LOG(4, ("%s: Reusing existing oplocked handle "
                         "to avoid oplock break deadlock\n", __FUNCTION__));
                status = HgfsPlatformGetattrFromFd(fileDesc, session, entryAttr);
+            } else if (NULL != search->dirStream) {
+               /* Lazy search: stat relative to the open directory. */
+               status = HgfsGetattrFromDirStream(search->dirStream,
+                                                 dirEntry->d_name,
+                                                 configOptions,
+                                                 search->utf8ShareName,
+                                                 entryAttr);
             } else {
                status = HgfsPlatformGetattrFromName(fullName, configOptions,
                                                     search->utf8ShareName,
@@ -3726,6 +4991,204 @@ HgfsPlatformSetDirEntry(HgfsSearch *search,              // IN: partially valid
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformOpenDir --
+ *
+ *    Open a directory for enumeration with getdents. Symlinks are only
+ *    followed if the share allows it.
+ *
+ * Results:
+ *    Zero on success and the directory is returned in fd.
+ *    Non-zero on error.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsInternalStatus
+HgfsPlatformOpenDir(char const *baseDir,   // IN: Directory to open
+                    Bool followSymlinks,   // IN: followSymlinks config option
+                    HgfsDirFd *fd)         // OUT: open directory
+{
+   HgfsInternalStatus status = 0;
+#if defined(__APPLE__)
+   DIR *dir;
+
+   /*
+    * Since opendir does not support O_NOFOLLOW flag need to explicitly verify
+    * that we are not dealing with symlink if follow symlinks is
+    * not allowed.
+    */
+   if (!followSymlinks) {
+      struct stat st;
+      if (lstat(baseDir, &st) == -1) {
+         status = errno;
+         LOG(4, ("%s: error in lstat: %d (%s)\n", __FUNCTION__, status,
+                 strerror(status)));
+         goto exit;
+      }
+      if (S_ISLNK(st.st_mode)) {
+         status = EACCES;
+         LOG(4, ("%s: do not follow symlink\n", __FUNCTION__));
+         goto exit;
+      }
+   }
+   dir = Posix_OpenDir(baseDir);
+   if (NULL ==  dir) {
+      status = errno;
+      LOG(4, ("%s: error in opendir: %d (%s)\n", __FUNCTION__, status,
+              strerror(status)));
+      goto exit;
+   }
+   *fd = dir;
+#else
+   int openFlags = O_NONBLOCK | O_RDONLY | O_DIRECTORY | O_NOFOLLOW;
+   int result;
+
+   /* Follow symlinks if config option is set. */
+   if (followSymlinks) {
+      openFlags &= ~O_NOFOLLOW;
+   }
+
+   /* We want a directory. No FIFOs. Symlinks only if config option is set. */
+   result = Posix_Open(baseDir, openFlags);
+   if (result < 0) {
+      status = errno;
+      LOG(4, ("%s: error in open: %d (%s)\n", __FUNCTION__, status,
+              strerror(status)));
+      goto exit;
+   }
+   *fd = result;
+#endif
+
+  exit:
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformCloseDir --
+ *
+ *    Close a directory opened with HgfsPlatformOpenDir.
+ *
+ * Results:
+ *    Zero on success.
+ *    Non-zero on error.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsInternalStatus
+HgfsPlatformCloseDir(HgfsDirFd fd)  // IN: open directory
+{
+   HgfsInternalStatus status = 0;
+
+#if defined(__APPLE__)
+   if (closedir(fd) < 0) {
+#else
+   if (close(fd) < 0) {
+#endif
+      status = errno;
+      LOG(4, ("%s: error in close: %d (%s)\n", __FUNCTION__, status,
+              strerror(status)));
+   }
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformAddDents --
+ *
+ *    Append the dents in a buffer filled by getdents to a dents array.
+ *    Names that can't be converted to utf8 are skipped.
+ *
+ * Results:
+ *    Zero on success.
+ *    ENOMEM if the array could not be grown, the dents added so far are kept.
+ *
+ * Side effects:
+ *    Memory allocation. The names in the buffer are converted in place.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsInternalStatus
+HgfsPlatformAddDents(char *buffer,              // IN/OUT: getdents buffer
+                     size_t bufferSize,         // IN: valid bytes in buffer
+                     DirectoryEntry ***dents,   // IN/OUT: Array of DirectoryEntrys
+                     uint32 *numDents,          // IN/OUT: Number of DirectoryEntrys
+                     uint32 *capacity)          // IN/OUT: Slots allocated in dents
+{
+   size_t offset = 0;
+
+   while (offset < bufferSize) {
+      DirectoryEntry *newDent;
+      DirectoryEntry *myDent;
+
+      newDent = (DirectoryEntry *)(buffer + offset);
+
+      /* This dent had better fit in the actual space we've got left. */
+      ASSERT(newDent->d_reclen <= bufferSize - offset);
+
+      /* Make room for another dent pointer in the dents array. */
+      if (*numDents == *capacity) {
+         uint32 newCapacity = (0 == *capacity) ? 64 : *capacity * 2;
+         DirectoryEntry **newDents;
+
+         newDents = realloc(*dents, sizeof **dents * newCapacity);
+         if (newDents == NULL) {
+            return ENOMEM;
+         }
+         *dents = newDents;
+         *capacity = newCapacity;
+      }
+
+      /*
+       * Allocate the new dent and set it up. We do a straight memcpy of
+       * the entire record to avoid dealing with platform-specific fields.
+       */
+      myDent = malloc(newDent->d_reclen);
+      if (myDent == NULL) {
+         return ENOMEM;
+      }
+
+      if (HgfsConvertToUtf8FormC(newDent->d_name,
+                                 newDent->d_reclen - offsetof(DirectoryEntry, d_name))) {
+         memcpy(myDent, newDent, newDent->d_reclen);
+         (*dents)[(*numDents)++] = myDent;
+      } else {
+         /*
+          * XXX:
+          *    HGFS discards all file names that can't be converted to utf8.
+          *    It is not desirable since it causes many problems like
+          *    failure to delete directories which contain such files.
+          *    Need to change this to a more reasonable behavior, similar
+          *    to name escaping which is used to deal with illegal file names.
+          */
+         free(myDent);
+      }
+
+      /*
+       * Dent is done. Bump the offset to the batched buffer to process the
+       * next dent within it.
+       */
+      offset += newDent->d_reclen;
+   }
+   return 0;
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -3741,6 +5204,9 @@ HgfsPlatformSetDirEntry(HgfsSearch *search,              // IN: partially valid
  *    there is no similar API available. Thus on Mac OS readdir is used that
  *    returns one directory entry at a time.
  *
+ *    Searches of real directories use HgfsPlatformScandirOpen instead, which
+ *    reads the entries on demand.
+ *
  * Results:
  *    Zero on success. numDents contains the number of directory entries found.
  *    Non-zero on error.
@@ -3758,16 +5224,12 @@ HgfsPlatformScandir(char const *baseDir,            // IN: Directory to search i
                     struct DirectoryEntry ***dents, // OUT: Array of DirectoryEntrys
                     int *numDents)                  // OUT: Number of DirectoryEntrys
 {
-#if defined(__APPLE__)
-   DIR *fd = NULL;
-#else
-   int fd = -1;
-   int openFlags = O_NONBLOCK | O_RDONLY | O_DIRECTORY | O_NOFOLLOW;
-#endif
+   HgfsDirFd fd = HGFS_DIR_FD_INVALID;
    int result;
    DirectoryEntry **myDents = NULL;
-   int myNumDents = 0;
-   HgfsInternalStatus status = 0;
+   uint32 myNumDents = 0;
+   uint32 capacity = 0;
+   HgfsInternalStatus status;
 
    /*
     * XXX: glibc uses 8192 (BUFSIZ) when it can't get st_blksize from a stat.
@@ -3775,102 +5237,20 @@ HgfsPlatformScandir(char const *baseDir,            // IN: Directory to search i
     */
    char buffer[8192];
 
-#if defined(__APPLE__)
-   /*
-    * Since opendir does not support O_NOFOLLOW flag need to explicitly verify
-    * that we are not dealing with symlink if follow symlinks is
-    * not allowed.
-    */
-   if (!followSymlinks) {
-      struct stat st;
-      if (lstat(baseDir, &st) == -1) {
-         status = errno;
-         LOG(4, ("%s: error in lstat: %d (%s)\n", __FUNCTION__, status,
-                 strerror(status)));
-         goto exit;
-      }
-      if (S_ISLNK(st.st_mode)) {
-         status = EACCES;
-         LOG(4, ("%s: do not follow symlink\n", __FUNCTION__));
-         goto exit;
-      }
-   }
-   fd = Posix_OpenDir(baseDir);
-   if (NULL ==  fd) {
-      status = errno;
-      LOG(4, ("%s: error in opendir: %d (%s)\n", __FUNCTION__, status,
-              strerror(status)));
-      goto exit;
-   }
-#else
-   /* Follow symlinks if config option is set. */
-   if (followSymlinks) {
-      openFlags &= ~O_NOFOLLOW;
-   }
-
-   /* We want a directory. No FIFOs. Symlinks only if config option is set. */
-   result = Posix_Open(baseDir, openFlags);
-   if (result < 0) {
-      status = errno;
-      LOG(4, ("%s: error in open: %d (%s)\n", __FUNCTION__, status,
-              strerror(status)));
+   status = HgfsPlatformOpenDir(baseDir, followSymlinks, &fd);
+   if (status != 0) {
       goto exit;
    }
-   fd = result;
-#endif
 
    /*
     * Rather than read a single dent at a time, batch up multiple dents
     * in each call by using a buffer substantially larger than one dent.
     */
    while ((result = getdents(fd, (void *)buffer, sizeof buffer)) > 0) {
-      size_t offset = 0;
-      while (offset < result) {
-         DirectoryEntry *newDent, **newDents;
-
-         newDent = (DirectoryEntry *)(buffer + offset);
-
-         /* This dent had better fit in the actual space we've got left. */
-         ASSERT(newDent->d_reclen <= result - offset);
-
-         /* Add another dent pointer to the dents array. */
-         newDents = realloc(myDents, sizeof *myDents * (myNumDents + 1));
-         if (newDents == NULL) {
-            status = ENOMEM;
-            goto exit;
-         }
-         myDents = newDents;
-
-         /*
-          * Allocate the new dent and set it up. We do a straight memcpy of
-          * the entire record to avoid dealing with platform-specific fields.
-          */
-         myDents[myNumDents] = malloc(newDent->d_reclen);
-         if (myDents[myNumDents] == NULL) {
-            status = ENOMEM;
-            goto exit;
-         }
-
-         if (HgfsConvertToUtf8FormC(newDent->d_name,
-                                    newDent->d_reclen - offsetof(DirectoryEntry, d_name))) {
-            memcpy(myDents[myNumDents], newDent, newDent->d_reclen);
-            /*
-             * Dent is done. Bump the offset to the batched buffer to process the
-             * next dent within it.
-             */
-            myNumDents++;
-         } else {
-            /*
-             * XXX:
-             *    HGFS discards all file names that can't be converted to utf8.
-             *    It is not desirable since it causes many problems like
-             *    failure to delete directories which contain such files.
-             *    Need to change this to a more reasonable behavior, similar
-             *    to name escaping which is used to deal with illegal file names.
-             */
-            free(myDents[myNumDents]);
-         }
-         offset += newDent->d_reclen;
+      status = HgfsPlatformAddDents(buffer, result, &myDents, &myNumDents,
+                                    &capacity);
+      if (status != 0) {
+         goto exit;
       }
    }
 
@@ -3882,14 +5262,12 @@ HgfsPlatformScandir(char const *baseDir,            // IN: Directory to search i
    }
 
   exit:
-#if defined(__APPLE__)
-   if (NULL != fd && closedir(fd) < 0) {
-#else
-   if (fd != -1 && close(fd) < 0) {
-#endif
-      status = errno;
-      LOG(4, ("%s: error in close: %d (%s)\n", __FUNCTION__, status,
-              strerror(status)));
+   if (fd != HGFS_DIR_FD_INVALID) {
+      HgfsInternalStatus closeStatus = HgfsPlatformCloseDir(fd);
+
+      if (closeStatus != 0) {
+         status = closeStatus;
+      }
    }
 
    /*
@@ -3901,11 +5279,324 @@ HgfsPlatformScandir(char const *baseDir,            // IN: Directory to search i
       for (i = 0; i < myNumDents; i++) {
          free(myDents[i]);
       }
-      free(myDents);
-   } else {
-      *dents = myDents;
-      *numDents = myNumDents;
+      free(myDents);
+   } else {
+      *dents = myDents;
+      *numDents = myNumDents;
+   }
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformScandirOpen --
+ *
+ *    Open a directory for a lazy search. No entries are read here, they are
+ *    read in batches by HgfsPlatformGetDirEntry as the client asks for them,
+ *    so the first search read reply does not wait for the whole directory
+ *    and memory use does not grow with the size of the directory.
+ *
+ * Results:
+ *    Zero on success and the stream is returned in dirStream.
+ *    Non-zero on error.
+ *
+ * Side effects:
+ *    Memory allocation. The directory stays open until the stream is closed
+ *    with HgfsPlatformScandirClose.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsInternalStatus
+HgfsPlatformScandirOpen(char const *baseDir,                // IN: Directory to search in
+                        size_t baseDirLen,                  // IN: Ignored
+                        Bool followSymlinks,                // IN: followSymlinks config option
+                        struct HgfsDirStream **dirStream)   // OUT: directory stream
+{
+   HgfsDirFd fd = HGFS_DIR_FD_INVALID;
+   HgfsDirStream *stream;
+   HgfsInternalStatus status;
+
+   status = HgfsPlatformOpenDir(baseDir, followSymlinks, &fd);
+   if (status != 0) {
+      return status;
+   }
+
+   stream = Util_SafeCalloc(1, sizeof *stream);
+   stream->fd = fd;
+   *dirStream = stream;
+
+   return 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformScandirClose --
+ *
+ *    Close the directory of a lazy search. The dents are owned and freed by
+ *    the search.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    Memory is freed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsPlatformScandirClose(struct HgfsDirStream *dirStream)  // IN: directory stream
+{
+   if (NULL != dirStream) {
+      HgfsPlatformCloseDir(dirStream->fd);
+      free(dirStream);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformScandirDup --
+ *
+ *    Duplicate the directory of a lazy search for the search copy used by a
+ *    search read, so the entry attributes can be looked up relative to the
+ *    directory without the search lock held. The copy is only used for
+ *    attribute lookups, never to read entries.
+ *
+ *    On Mac OS the attributes need the full path (aliases, hidden flag) so
+ *    no copy is made.
+ *
+ *    Caller should hold the session's searchArrayLock.
+ *
+ * Results:
+ *    None. copy is NULL if the directory could not be duplicated, the
+ *    attributes are then looked up by name.
+ *
+ * Side effects:
+ *    Memory allocation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsPlatformScandirDup(struct HgfsDirStream *dirStream,  // IN: directory stream
+                       struct HgfsDirStream **copy)      // OUT: copy or NULL
+{
+#if defined(__APPLE__)
+   *copy = NULL;
+#else
+   HgfsDirStream *stream;
+   int fd;
+
+   *copy = NULL;
+
+   fd = dup(dirStream->fd);
+   if (fd < 0) {
+      LOG(4, ("%s: error in dup: %d (%s)\n", __FUNCTION__, errno,
+              strerror(errno)));
+      return;
+   }
+
+   stream = Util_SafeCalloc(1, sizeof *stream);
+   stream->fd = fd;
+   stream->eof = TRUE;
+   *copy = stream;
+#endif
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformScandirRewind --
+ *
+ *    Restart a lazy search from the first directory entry. The buffered
+ *    dents are freed and the directory is read again on the next request,
+ *    which also picks up any changes made to the directory in the meantime.
+ *
+ *    Caller should hold the session's searchArrayLock for write.
+ *
+ * Results:
+ *    Zero on success.
+ *    Non-zero on error.
+ *
+ * Side effects:
+ *    Memory is freed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsInternalStatus
+HgfsPlatformScandirRewind(HgfsSearch *search)  // IN/OUT: search
+{
+   HgfsDirStream *stream = search->dirStream;
+   uint32 i;
+
+   ASSERT(stream);
+
+   for (i = 0; i < search->numDents; i++) {
+      free(search->dents[i]);
+   }
+   search->numDents = 0;
+   stream->baseIndex = 0;
+   stream->eof = FALSE;
+
+#if defined(__APPLE__)
+   rewinddir(stream->fd);
+#else
+   if (lseek(stream->fd, 0, SEEK_SET) < 0) {
+      HgfsInternalStatus status = errno;
+
+      LOG(4, ("%s: error in lseek: %d (%s)\n", __FUNCTION__, status,
+              strerror(status)));
+      stream->eof = TRUE;
+      return status;
+   }
+#endif
+   return 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformScandirFill --
+ *
+ *    Make sure the dents window of a lazy search holds the entry at the
+ *    given directory index, reading more of the directory if needed.
+ *
+ *    Clients read a search in increasing index order, so when the window has
+ *    to move the entries below the requested index are dropped. Asking for
+ *    an index below the window rewinds the directory.
+ *
+ *    Caller should hold the session's searchArrayLock for write.
+ *
+ * Results:
+ *    HGFS_ERROR_SUCCESS or an appropriate error code. Reaching the end of the
+ *    directory is not an error, the index is then past the window.
+ *
+ * Side effects:
+ *    Memory allocation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsInternalStatus
+HgfsPlatformScandirFill(HgfsSearch *search,  // IN/OUT: search
+                        uint32 index)        // IN: directory index needed
+{
+   HgfsDirStream *stream = search->dirStream;
+   HgfsInternalStatus status = HGFS_ERROR_SUCCESS;
+   uint32 i;
+   char buffer[8192];
+
+   ASSERT(stream);
+
+   if (index < stream->baseIndex) {
+      LOG(4, ("%s: rewinding \"%s\" for index %u\n", __FUNCTION__,
+              search->utf8Dir, index));
+      status = HgfsPlatformScandirRewind(search);
+      if (HGFS_ERROR_SUCCESS != status) {
+         return status;
+      }
+   }
+
+   if (index - stream->baseIndex < search->numDents || stream->eof) {
+      return HGFS_ERROR_SUCCESS;
+   }
+
+   while (index - stream->baseIndex >= search->numDents) {
+      int result = getdents(stream->fd, (void *)buffer, sizeof buffer);
+
+      if (result < 0) {
+         status = errno;
+         LOG(4, ("%s: error in getdents: %d (%s)\n", __FUNCTION__, status,
+                 strerror(status)));
+         break;
+      }
+      if (result == 0) {
+         stream->eof = TRUE;
+         break;
+      }
+
+      /*
+       * Everything buffered is below the requested index, the client has
+       * already read it: drop it before adding the next batch.
+       */
+      if (search->numDents != 0) {
+         for (i = 0; i < search->numDents; i++) {
+            free(search->dents[i]);
+         }
+         stream->baseIndex += search->numDents;
+         search->numDents = 0;
+      }
+
+      status = HgfsPlatformAddDents(buffer, result, &search->dents,
+                                    &search->numDents, &stream->dentsCapacity);
+      if (HGFS_ERROR_SUCCESS != status) {
+         break;
+      }
+   }
+
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformScandirFinish --
+ *
+ *    Turn a lazy search into one which holds all its entries: the whole
+ *    directory is read again into the dents array and the directory stream
+ *    is closed, so directory indexes are dents indexes again.
+ *
+ *    Caller should hold the session's searchArrayLock for write.
+ *
+ * Results:
+ *    HGFS_ERROR_SUCCESS or an appropriate error code. The stream is closed
+ *    in either case, on error the search holds the entries read so far.
+ *
+ * Side effects:
+ *    Memory allocation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsInternalStatus
+HgfsPlatformScandirFinish(HgfsSearch *search)  // IN/OUT: search
+{
+   HgfsDirStream *stream = search->dirStream;
+   HgfsInternalStatus status;
+   char buffer[8192];
+
+   ASSERT(stream);
+
+   status = HgfsPlatformScandirRewind(search);
+   while (HGFS_ERROR_SUCCESS == status) {
+      int result = getdents(stream->fd, (void *)buffer, sizeof buffer);
+
+      if (result < 0) {
+         status = errno;
+         LOG(4, ("%s: error in getdents: %d (%s)\n", __FUNCTION__, status,
+                 strerror(status)));
+         break;
+      }
+      if (result == 0) {
+         break;
+      }
+      status = HgfsPlatformAddDents(buffer, result, &search->dents,
+                                    &search->numDents, &stream->dentsCapacity);
    }
+
+   HgfsPlatformScandirClose(stream);
+   search->dirStream = NULL;
    return status;
 }
 
@@ -4122,6 +5813,48 @@ exit:
  */
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformReadAhead --
+ *
+ *    Tells the host that a range of a file is about to be read, so that it
+ *    can start reading it into its page cache.
+ *
+ * Results:
+ *    None. This is only a hint, failures are ignored.
+ *
+ * Side effects:
+ *    I/O may be started on the file.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsPlatformReadAhead(fileDesc file,    // IN: file descriptor
+                      uint64 offset,    // IN: start of the range
+                      uint32 length)    // IN: length of the range
+{
+#if defined(__linux__)
+   int error = posix_fadvise(file, offset, length, POSIX_FADV_WILLNEED);
+
+   if (error != 0) {
+      LOG(4, ("%s: fadvise failed on fd %u: %s\n", __FUNCTION__, file,
+              strerror(error)));
+   }
+#elif defined(__APPLE__)
+   struct radvisory advice;
+
+   advice.ra_offset = offset;
+   advice.ra_count = length;
+   if (fcntl(file, F_RDADVISE, &advice) < 0) {
+      LOG(4, ("%s: F_RDADVISE failed on fd %u: %s\n", __FUNCTION__, file,
+              strerror(errno)));
+   }
+#endif
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -4329,6 +6062,399 @@ HgfsPlatformWriteFile(fileDesc writeFd,            // IN: file descriptor
 }
 
 
+#if defined(__linux__)
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformBuildIovec --
+ *
+ *    Describe the first size bytes of guest mappings with an iovec array
+ *    for readv/writev. Small arrays use the caller's storage.
+ *
+ * Results:
+ *    The number of iovec entries, at most IOV_MAX. *vec is to be freed by
+ *    the caller if it is not the caller's storage.
+ *
+ * Side effects:
+ *    May allocate memory.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+HgfsPlatformBuildIovec(HgfsVmxIov *iov,        // IN: guest mappings
+                       uint32 iovCount,        // IN: number of mappings
+                       uint32 size,            // IN: bytes to describe
+                       struct iovec *storage,  // IN: caller's storage
+                       uint32 storageCount,    // IN: entries in storage
+                       struct iovec **vec)     // OUT: iovec array
+{
+   uint32 i;
+
+   if (iovCount > IOV_MAX) {
+      /* The transfer is shortened, callers handle short reads and writes. */
+      iovCount = IOV_MAX;
+   }
+
+   *vec = (iovCount <= storageCount) ? storage
+                                     : Util_SafeMalloc(iovCount * sizeof **vec);
+
+   for (i = 0; i < iovCount && size > 0; i++) {
+      uint32 len = MIN(iov[i].len, size);
+
+      (*vec)[i].iov_base = iov[i].va;
+      (*vec)[i].iov_len = len;
+      size -= len;
+   }
+
+   return i;
+}
+#endif
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformReadFileV --
+ *
+ *    Reads data from a file directly into guest mappings, so that a
+ *    buffer spanning several mappings is not bounced through a contiguous
+ *    copy.
+ *
+ * Results:
+ *    Zero on success.
+ *    Non-zero on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsInternalStatus
+HgfsPlatformReadFileV(fileDesc file,               // IN: file descriptor
+                      HgfsSessionInfo *session,    // IN: session info
+                      uint64 offset,               // IN: file offset to read from
+                      uint32 requiredSize,         // IN: length of data to read
+                      HgfsVmxIov *iov,             // IN: buffers for the read data
+                      uint32 iovCount,             // IN: number of buffers
+                      uint32 *actualSize)          // OUT: actual length read
+{
+   HgfsInternalStatus status = 0;
+#if defined(__linux__)
+   struct iovec storage[HGFS_PLATFORM_IOVEC_STACK];
+   struct iovec *vec;
+   int vecCount;
+   ssize_t error;
+   HgfsHandle handle;
+   Bool sequentialOpen;
+
+   ASSERT(session);
+
+   LOG(4, ("%s: read fh %u, offset %"FMT64"u, count %u, %u buffers\n",
+           __FUNCTION__, file, offset, requiredSize, iovCount));
+
+   if (!HgfsFileDesc2Handle(file, session, &handle)) {
+      LOG(4, ("%s: Could not get file handle\n", __FUNCTION__));
+      return EBADF;
+   }
+
+   if (!HgfsHandleIsSequentialOpen(handle, session, &sequentialOpen)) {
+      LOG(4, ("%s: Could not get sequenial open status\n", __FUNCTION__));
+      return EBADF;
+   }
+
+   vecCount = HgfsPlatformBuildIovec(iov, iovCount, requiredSize, storage,
+                                     ARRAYSIZE(storage), &vec);
+   if (sequentialOpen) {
+      error = readv(file, vec, vecCount);
+   } else {
+      error = preadv(file, vec, vecCount, offset);
+   }
+   if (error < 0) {
+      status = errno;
+      LOG(4, ("%s: error reading from file: %s\n", __FUNCTION__,
+              strerror(status)));
+   } else {
+      LOG(4, ("%s: read %"FMTSZ"d bytes\n", __FUNCTION__, error));
+      *actualSize = error;
+   }
+   if (vec != storage) {
+      free(vec);
+   }
+#else
+   uint32 i;
+
+   /* Read the buffers in turn, stopping at the end of the file. */
+   *actualSize = 0;
+   for (i = 0; i < iovCount && *actualSize < requiredSize; i++) {
+      uint32 len = MIN(iov[i].len, requiredSize - *actualSize);
+      uint32 read;
+
+      status = HgfsPlatformReadFile(file, session, offset + *actualSize, len,
+                                    iov[i].va, &read);
+      if (status != 0) {
+         break;
+      }
+      *actualSize += read;
+      if (read < len) {
+         break;
+      }
+   }
+   if (*actualSize > 0) {
+      /* Report the data read before a failure. */
+      status = 0;
+   }
+#endif
+
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformWriteFileV --
+ *
+ *    Writes data to a file directly from guest mappings, so that a buffer
+ *    spanning several mappings is not bounced through a contiguous copy.
+ *
+ * Results:
+ *    Zero on success.
+ *    Non-zero on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsInternalStatus
+HgfsPlatformWriteFileV(fileDesc writeFd,            // IN: file descriptor
+                       HgfsSessionInfo *session,    // IN: session info
+                       uint64 writeOffset,          // IN: file offset to write to
+                       uint32 writeDataSize,        // IN: length of data to write
+                       HgfsWriteFlags writeFlags,   // IN: write flags
+                       Bool writeSequential,        // IN: write is sequential
+                       Bool writeAppend,            // IN: write is appended
+                       HgfsVmxIov *iov,             // IN: buffers of the data
+                       uint32 iovCount,             // IN: number of buffers
+                       uint32 *writtenSize)         // OUT: actual length written
+{
+   HgfsInternalStatus status = 0;
+#if defined(__linux__)
+   struct iovec storage[HGFS_PLATFORM_IOVEC_STACK];
+   struct iovec *vec;
+   int vecCount;
+   ssize_t error;
+
+   LOG(4, ("%s: write fh %u offset %"FMT64"u, count %u, %u buffers\n",
+           __FUNCTION__, writeFd, writeOffset, writeDataSize, iovCount));
+
+   if (!writeSequential) {
+      status = HgfsWriteCheckIORange(writeOffset, writeDataSize);
+      if (status != 0) {
+         return status;
+      }
+   }
+
+   vecCount = HgfsPlatformBuildIovec(iov, iovCount, writeDataSize, storage,
+                                     ARRAYSIZE(storage), &vec);
+   if (writeSequential) {
+      error = writev(writeFd, vec, vecCount);
+   } else {
+      error = pwritev(writeFd, vec, vecCount, writeOffset);
+   }
+   if (error < 0) {
+      status = errno;
+      LOG(4, ("%s: error writing to file: %s\n", __FUNCTION__,
+         strerror(status)));
+   } else {
+      *writtenSize = error;
+      LOG(4, ("%s: wrote %d bytes\n", __FUNCTION__, *writtenSize));
+   }
+   if (vec != storage) {
+      free(vec);
+   }
+#else
+   uint32 i;
+
+   /* Write the buffers in turn, stopping at a short write. */
+   *writtenSize = 0;
+   for (i = 0; i < iovCount && *writtenSize < writeDataSize; i++) {
+      uint32 len = MIN(iov[i].len, writeDataSize - *writtenSize);
+      uint32 written;
+
+      status = HgfsPlatformWriteFile(writeFd, session,
+                                     writeOffset + *writtenSize, len,
+                                     writeFlags, writeSequential, writeAppend,
+                                     iov[i].va, &written);
+      if (status != 0) {
+         break;
+      }
+      *writtenSize += written;
+      if (written < len) {
+         break;
+      }
+   }
+   if (*writtenSize > 0) {
+      /* Report the data written before a failure. */
+      status = 0;
+   }
+#endif
+
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPlatformCopyFileRange --
+ *
+ *    Copies a byte range from one file to another without moving the data
+ *    through user space where the host supports it: copy_file_range(2) on
+ *    Linux, which also shares the extents on file systems able to reflink.
+ *    Otherwise, or when the files are not on the same file system, the range
+ *    is copied with a chunked pread/pwrite loop.
+ *
+ *    As with copy_file_range(2), overlapping ranges of the same file are
+ *    rejected: the forward copy of the loop would overwrite source data
+ *    before reading it.
+ *
+ * Results:
+ *    Zero on success, with the number of bytes copied which is short at the
+ *    end of the source file.
+ *    EINVAL if the ranges overlap in the same file.
+ *    Non-zero on other failures.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsInternalStatus
+HgfsPlatformCopyFileRange(fileDesc srcFd,       // IN: file to copy from
+                          uint64 srcOffset,     // IN: offset to copy from
+                          fileDesc dstFd,       // IN: file to copy to
+                          uint64 dstOffset,     // IN: offset to copy to
+                          uint64 length,        // IN: bytes to copy
+                          uint64 *copiedSize)   // OUT: bytes copied
+{
+   HgfsInternalStatus status;
+   struct stat srcStat;
+   struct stat dstStat;
+   char *buf;
+
+   LOG(4, ("%s: copy fh %u offset %"FMT64"u to fh %u offset %"FMT64"u, "
+           "count %"FMT64"u\n", __FUNCTION__, srcFd, srcOffset, dstFd,
+           dstOffset, length));
+
+   *copiedSize = 0;
+   length = MIN(length, HGFS_COPY_FILE_RANGE_MAX);
+
+   status = HgfsWriteCheckIORange(dstOffset, (uint32)length);
+   if (status != 0) {
+      return status;
+   }
+
+   if (fstat(srcFd, &srcStat) < 0 || fstat(dstFd, &dstStat) < 0) {
+      status = errno;
+      LOG(4, ("%s: error getting file info: %s\n", __FUNCTION__,
+              strerror(status)));
+      return status;
+   }
+   if (srcStat.st_dev == dstStat.st_dev && srcStat.st_ino == dstStat.st_ino &&
+       srcOffset < (uint64)srcStat.st_size) {
+      /* Only the source bytes before the end of the file are copied. */
+      uint64 count = MIN(length, (uint64)srcStat.st_size - srcOffset);
+
+      if (srcOffset < dstOffset + count && dstOffset < srcOffset + count) {
+         LOG(4, ("%s: overlapping ranges of the same file\n", __FUNCTION__));
+         return EINVAL;
+      }
+   }
+
+#if defined(__linux__) && defined(SYS_copy_file_range)
+   while (*copiedSize < length) {
+      loff_t srcOff = srcOffset + *copiedSize;
+      loff_t dstOff = dstOffset + *copiedSize;
+      ssize_t copied;
+
+      copied = syscall(SYS_copy_file_range, srcFd, &srcOff, dstFd, &dstOff,
+                       (size_t)(length - *copiedSize), 0);
+      if (copied < 0) {
+         status = errno;
+         break;
+      }
+      if (copied == 0) {
+         /* End of the source file. */
+         return 0;
+      }
+      *copiedSize += copied;
+   }
+   if (status == 0 || *copiedSize > 0) {
+      /* Report the data copied before a failure. */
+      return 0;
+   }
+   if (status != ENOSYS && status != EXDEV && status != EOPNOTSUPP) {
+      LOG(4, ("%s: error copying file: %s\n", __FUNCTION__, strerror(status)));
+      return status;
+   }
+   LOG(4, ("%s: copy_file_range failed (%s), copying through a buffer\n",
+           __FUNCTION__, strerror(status)));
+   status = 0;
+#endif
+
+   buf = malloc(HGFS_COPY_FILE_RANGE_CHUNK);
+   if (buf == NULL) {
+      return ENOMEM;
+   }
+
+   while (*copiedSize < length) {
+      size_t chunk = MIN(length - *copiedSize, HGFS_COPY_FILE_RANGE_CHUNK);
+      ssize_t bytesRead;
+      ssize_t bytesWritten = 0;
+
+      bytesRead = pread(srcFd, buf, chunk, srcOffset + *copiedSize);
+      if (bytesRead < 0) {
+         status = errno;
+         break;
+      }
+      if (bytesRead == 0) {
+         /* End of the source file. */
+         break;
+      }
+
+      while (bytesWritten < bytesRead) {
+         ssize_t written = pwrite(dstFd, buf + bytesWritten,
+                                  bytesRead - bytesWritten,
+                                  dstOffset + *copiedSize + bytesWritten);
+         if (written < 0) {
+            status = errno;
+            break;
+         }
+         bytesWritten += written;
+      }
+      *copiedSize += bytesWritten;
+      if (bytesWritten < bytesRead) {
+         break;
+      }
+   }
+   free(buf);
+
+   if (*copiedSize > 0) {
+      /* Report the data copied before a failure. */
+      status = 0;
+   } else if (status != 0) {
+      LOG(4, ("%s: error copying file: %s\n", __FUNCTION__, strerror(status)));
+   }
+
+   return status;
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -4473,10 +6599,12 @@ HgfsPlatformRestartSearchDir(HgfsHandle handle,               // IN: search hand
                                                  session,
                                                  handle);
       break;
+   case DIRECTORY_SEARCH_TYPE_DIR:
+      /* Entries are files and subdirectories: rewind the directory. */
+      status = HgfsServerRestartSearchRealDir(session, handle);
+      break;
    case DIRECTORY_SEARCH_TYPE_OTHER:
       /* Entries of this type are unknown and not supported for this platform. */
-   case DIRECTORY_SEARCH_TYPE_DIR:
-      /* Entries are files and subdirectories: currently not implemented! */
    default:
       status = EINVAL;
       break;
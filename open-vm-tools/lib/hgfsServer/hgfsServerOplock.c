@@ -137,7 +137,7 @@ HgfsHandle2ServerLock(HgfsHandle handle,        // IN: Hgfs file handle
 
    ASSERT(lock);
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   MXUser_AcquireForRead(session->nodeArrayLock);
    fileNode = HgfsHandle2FileNode(handle, session);
    if (fileNode == NULL) {
       goto exit;
@@ -147,7 +147,7 @@ HgfsHandle2ServerLock(HgfsHandle handle,        // IN: Hgfs file handle
    found = TRUE;
 
 exit:
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
 
    return found;
 #else
@@ -192,7 +192,7 @@ HgfsFileHasServerLock(const char *utf8Name,             // IN: Name in UTF8
    ASSERT(session);
    ASSERT(session->nodeArray);
 
-   MXUser_AcquireExclLock(session->nodeArrayLock);
+   MXUser_AcquireForRead(session->nodeArrayLock);
 
    for (i = 0; i < session->numNodes; i++) {
       HgfsFileNode *existingFileNode = &session->nodeArray[i];
@@ -208,7 +208,7 @@ HgfsFileHasServerLock(const char *utf8Name,             // IN: Name in UTF8
       }
    }
 
-   MXUser_ReleaseExclLock(session->nodeArrayLock);
+   MXUser_ReleaseRWLock(session->nodeArrayLock);
 
    return found;
 #else
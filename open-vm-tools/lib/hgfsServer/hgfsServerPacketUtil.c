@@ -407,6 +407,80 @@ HSPU_GetDataPacketBuf(HgfsPacket *packet,                   // IN/OUT: Hgfs Pack
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HSPU_GetDataPacketIov --
+ *
+ *    Get the data packet of an hgfs packet as the array of its guest
+ *    mappings. Unlike HSPU_GetDataPacketBuf no contiguous buffer is ever
+ *    allocated: the caller does its I/O directly on the mappings, e.g. with
+ *    preadv/pwritev. The data packet must not also be got as a buffer.
+ *    Mappings are released by HSPU_PutDataPacketBuf.
+ *
+ * Results:
+ *    Pointer to the first mapped iov, NULL on failure.
+ *
+ * Side effects:
+ *    Guest mappings are established.
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsVmxIov *
+HSPU_GetDataPacketIov(HgfsPacket *packet,                   // IN/OUT: Hgfs Packet
+                      MappingType mappingType,              // IN: Writeable/Readable
+                      HgfsServerChannelCallbacks *chanCb,   // IN: Channel callbacks
+                      uint32 *iovCount)                     // OUT: mapped iov count
+{
+   HgfsChannelMapVirtAddrFunc mapVa;
+   uint32 iovMapped = 0;
+
+   ASSERT(packet->dataPacket == NULL);
+
+   *iovCount = 0;
+
+   if (packet->dataPacketSize == 0 || chanCb == NULL) {
+      return NULL;
+   }
+
+   if (mappingType == BUF_WRITEABLE ||
+       mappingType == BUF_READWRITEABLE) {
+      mapVa = chanCb->getWriteVa;
+   } else {
+      ASSERT(mappingType == BUF_READABLE);
+      mapVa = chanCb->getReadVa;
+   }
+
+   /* Looks like we are in the middle of poweroff. */
+   if (mapVa == NULL) {
+      return NULL;
+   }
+
+   if (!HSPUMapBuf(mapVa,
+                   chanCb->putVa,
+                   packet->dataPacketSize,
+                   packet->dataPacketIovIndex,
+                   packet->iovCount,
+                   packet->iov,
+                   &iovMapped)) {
+      /* Guest probably passed us bad physical address */
+      return NULL;
+   }
+
+   /*
+    * Record the mappings as a non allocated data packet so that
+    * HSPU_PutDataPacketBuf releases them without copying anything.
+    */
+   packet->dataMappingType = mappingType;
+   packet->dataPacket = packet->iov[packet->dataPacketIovIndex].va;
+   packet->dataPacketIsAllocated = FALSE;
+   packet->dataPacketMappedIov = iovMapped;
+
+   *iovCount = iovMapped;
+   return &packet->iov[packet->dataPacketIovIndex];
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
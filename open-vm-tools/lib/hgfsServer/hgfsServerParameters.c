@@ -123,6 +123,49 @@ static HgfsCapability hgfsDefaultCapabilityTable[] =
    {HGFS_OP_UNLOCK_BYTE_RANGE_V4,  HGFS_REQUEST_NOT_SUPPORTED},
    {HGFS_OP_QUERY_EAS_V4,          HGFS_REQUEST_NOT_SUPPORTED},
    {HGFS_OP_SET_EAS_V4,            HGFS_REQUEST_NOT_SUPPORTED},
+   {HGFS_OP_COPY_FILE_RANGE_V4,    HGFS_REQUEST_NOT_SUPPORTED},
+   {HGFS_OP_COMPOUND_V4,           HGFS_REQUEST_SUPPORTED},
+};
+
+/*
+ * Layout of the V3 operation arguments, indexed by opcode starting from
+ * HGFS_OP_OPEN_V3. The V3 and V4 headers both carry them, and
+ * HgfsUnpackPacketParams validates them in a single pass from this table:
+ * the fixed arguments must be present and the first file name, which the
+ * op unpack functions return pointers into, must lie within the payload.
+ * The sizes are those the op unpack functions require, so that the table
+ * never refuses a request they would accept. Any following name, or data,
+ * is validated by the op unpack function.
+ */
+#define HGFS_OP_ARGS_NO_NAME ((size_t)-1)
+#define HGFS_OP_ARGS(type, field) \
+   { sizeof (type), offsetof(type, field) }
+#define HGFS_OP_ARGS_FIXED(size) \
+   { size, HGFS_OP_ARGS_NO_NAME }
+
+static const struct {
+   size_t argsSize;     /* Size of the fixed arguments */
+   size_t nameOffset;   /* First HgfsFileNameV3, if any */
+} hgfsOpArgsLayoutV3[] = {
+   HGFS_OP_ARGS(HgfsRequestOpenV3, fileName),
+   HGFS_OP_ARGS_FIXED(sizeof (HgfsRequestReadV3)),
+   HGFS_OP_ARGS_FIXED(sizeof (HgfsRequestWriteV3)),
+   HGFS_OP_ARGS_FIXED(sizeof (HgfsRequestCloseV3)),
+   HGFS_OP_ARGS(HgfsRequestSearchOpenV3, dirName),
+   HGFS_OP_ARGS_FIXED(sizeof (HgfsRequestSearchReadV3)),
+   HGFS_OP_ARGS_FIXED(sizeof (HgfsRequestSearchCloseV3)),
+   HGFS_OP_ARGS(HgfsRequestGetattrV3, fileName),
+   HGFS_OP_ARGS(HgfsRequestSetattrV3, fileName),
+   HGFS_OP_ARGS(HgfsRequestCreateDirV3, fileName),
+   HGFS_OP_ARGS(HgfsRequestDeleteV3, fileName),
+   HGFS_OP_ARGS(HgfsRequestDeleteV3, fileName),
+   HGFS_OP_ARGS(HgfsRequestRenameV3, oldName),
+   HGFS_OP_ARGS(HgfsRequestQueryVolumeV3, fileName),
+   /* The target name follows the symlink name, only the latter is fixed. */
+   { offsetof(HgfsRequestSymlinkCreateV3, symlinkName.name),
+     offsetof(HgfsRequestSymlinkCreateV3, symlinkName) },
+   HGFS_OP_ARGS_FIXED(0), // Server lock change, not supported
+   HGFS_OP_ARGS_FIXED(sizeof (HgfsRequestWriteWin32StreamV3)),
 };
 
 
@@ -365,16 +408,77 @@ exit:
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsValidateOpArgsV3 --
+ *
+ *    Validate the arguments of a V3 operation, whichever header carries
+ *    them, against the layout table of the V3 operations.
+ *
+ * Results:
+ *    TRUE if the fixed arguments and the first file name are within the
+ *    payload, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsValidateOpArgsV3(HgfsOp op,              // IN: request opcode
+                     const void *payload,    // IN: op arguments
+                     size_t payloadSize)     // IN: op arguments size
+{
+   size_t argsSize;
+   size_t nameOffset;
+   const HgfsFileNameV3 *name;
+
+   ASSERT_ON_COMPILE(ARRAYSIZE(hgfsOpArgsLayoutV3) ==
+                     HGFS_OP_WRITE_WIN32_STREAM_V3 - HGFS_OP_OPEN_V3 + 1);
+   ASSERT(op >= HGFS_OP_OPEN_V3 && op <= HGFS_OP_WRITE_WIN32_STREAM_V3);
+
+   argsSize = hgfsOpArgsLayoutV3[op - HGFS_OP_OPEN_V3].argsSize;
+   nameOffset = hgfsOpArgsLayoutV3[op - HGFS_OP_OPEN_V3].nameOffset;
+
+   if (payloadSize < argsSize) {
+      LOG(4, ("%s: op %d arguments too small %"FMTSZ"u\n", __FUNCTION__, op,
+              payloadSize));
+      return FALSE;
+   }
+   if (HGFS_OP_ARGS_NO_NAME == nameOffset) {
+      return TRUE;
+   }
+
+   /*
+    * The name length is user-provided. The payload is known to hold the
+    * fixed arguments, which hold the name header, so this cannot wrap around.
+    */
+   name = (const HgfsFileNameV3 *)((const char *)payload + nameOffset);
+   if (0 == (name->flags & HGFS_FILE_NAME_USE_FILE_DESC) &&
+       name->length >
+          payloadSize - nameOffset - offsetof(HgfsFileNameV3, name)) {
+      LOG(4, ("%s: op %d name length %u beyond the packet\n", __FUNCTION__, op,
+              name->length));
+      return FALSE;
+   }
+   return TRUE;
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
  * HgfsUnpackPacketParams --
  *
  *    Takes the Hgfs packet and extracts the operation parameters.
- *    This validates the incoming packet as part of the processing.
+ *    This validates the incoming packet as part of the processing, and the
+ *    layout of the arguments of V3 operations.
  *
  * Results:
  *    HGFS_ERROR_SUCCESS if all the request parameters are successfully extracted.
+ *    HGFS_ERROR_PROTOCOL if the arguments of a V3 operation are malformed.
  *    HGFS_ERROR_INTERNAL if an error occurs without sufficient request data to be
  *    able to send a reply to the client.
  *    Any other appropriate error if the incoming packet has errors and there is
@@ -465,6 +569,12 @@ HgfsUnpackPacketParams(const void *packet,      // IN: HGFS packet
       unpackStatus = HGFS_ERROR_INTERNAL;
    }
 
+   if (HGFS_ERROR_SUCCESS == unpackStatus &&
+       *opcode >= HGFS_OP_OPEN_V3 && *opcode <= HGFS_OP_WRITE_WIN32_STREAM_V3 &&
+       !HgfsValidateOpArgsV3(*opcode, *payload, *payloadSize)) {
+      unpackStatus = HGFS_ERROR_PROTOCOL;
+   }
+
 exit:
    LOG(4, ("%s: unpacked request(op %d, id %u) -> %u.\n", __FUNCTION__,
            request->op, *requestId, unpackStatus));
@@ -3077,7 +3187,8 @@ HgfsPackSearchReadReplyRecordV1(HgfsFileAttrInfo *attr,     // IN: attr stucture
  *    packetIn to keep the code simple.
  *
  * Results:
- *    Always TRUE.
+ *    TRUE on success.
+ *    FALSE on failure.
  *
  * Side effects:
  *    None
@@ -3119,8 +3230,10 @@ HgfsUnpackSearchReadRequest(const void *packet,           // IN: request packet
    case HGFS_OP_SEARCH_READ_V4: {
       const HgfsRequestSearchReadV4 *request = packet;
 
-      /* Enforced by the dispatch function. */
-      ASSERT(packetSize >= sizeof *request);
+      if (packetSize < sizeof *request) {
+         LOG(4, ("%s: HGFS packet too small\n", __FUNCTION__));
+         return FALSE;
+      }
 
       if (0 != (request->flags & HGFS_SEARCH_READ_FID_OPEN_V4)) {
          /*
@@ -3147,8 +3260,10 @@ HgfsUnpackSearchReadRequest(const void *packet,           // IN: request packet
    case HGFS_OP_SEARCH_READ_V3: {
       const HgfsRequestSearchReadV3 *request = packet;
 
-      /* Enforced by the dispatch function. */
-      ASSERT(packetSize >= sizeof *request);
+      if (packetSize < sizeof *request) {
+         LOG(4, ("%s: HGFS packet too small\n", __FUNCTION__));
+         return FALSE;
+      }
 
       *hgfsSearchHandle = request->search;
       *startIndex = request->offset;
@@ -3765,8 +3880,8 @@ HgfsUnpackCreateDirPayloadV3(const HgfsRequestCreateDirV3 *requestV3, // IN: req
     */
 
    LOG(4, ("%s: HGFS_OP_CREATE_DIR_V3\n", __FUNCTION__));
-   ASSERT(payloadSize >= sizeof *requestV3);
-   if (requestV3->fileName.length > payloadSize - sizeof *requestV3) {
+   if (payloadSize < sizeof *requestV3 ||
+       requestV3->fileName.length > payloadSize - sizeof *requestV3) {
       /* The input packet is smaller than the request. */
       return FALSE;
    }
@@ -4554,6 +4669,337 @@ HgfsPackWriteReply(HgfsPacket *packet,           // IN/OUT: Hgfs Packet
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsUnpackCopyFileRangeRequest --
+ *
+ *    Unpack hgfs copy file range request.
+ *
+ * Results:
+ *    TRUE on success.
+ *    FALSE on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsUnpackCopyFileRangeRequest(const void *packet,     // IN: HGFS request
+                               size_t packetSize,      // IN: request packet size
+                               HgfsOp op,              // IN: request type
+                               HgfsHandle *srcFile,    // OUT: file to copy from
+                               uint64 *srcOffset,      // OUT: offset to copy from
+                               HgfsHandle *dstFile,    // OUT: file to copy to
+                               uint64 *dstOffset,      // OUT: offset to copy to
+                               uint64 *length)         // OUT: bytes to copy
+{
+   const HgfsRequestCopyFileRangeV4 *requestV4 = packet;
+
+   ASSERT(packet);
+
+   if (HGFS_OP_COPY_FILE_RANGE_V4 != op) {
+      NOT_REACHED();
+      return FALSE;
+   }
+
+   LOG(4, ("%s: HGFS_OP_COPY_FILE_RANGE_V4\n", __FUNCTION__));
+   if (packetSize < sizeof *requestV4) {
+      LOG(4, ("%s: HGFS packet too small\n", __FUNCTION__));
+      return FALSE;
+   }
+   if (0 != requestV4->flags) {
+      LOG(4, ("%s: unsupported flags %#x\n", __FUNCTION__, requestV4->flags));
+      return FALSE;
+   }
+
+   *srcFile = requestV4->srcFile;
+   *srcOffset = requestV4->srcOffset;
+   *dstFile = requestV4->dstFile;
+   *dstOffset = requestV4->dstOffset;
+   *length = requestV4->length;
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPackCopyFileRangeReply --
+ *
+ *    Pack hgfs copy file range reply to the HgfsReplyCopyFileRangeV4 structure.
+ *
+ * Results:
+ *    Always TRUE, FALSE if bad opcode.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsPackCopyFileRangeReply(HgfsPacket *packet,        // IN/OUT: Hgfs Packet
+                           const void *packetHeader,  // IN: packet header
+                           HgfsOp op,                 // IN: request type
+                           uint64 actualSize,         // IN: number of bytes copied
+                           size_t *payloadSize,       // OUT: size of packet
+                           HgfsSessionInfo *session)  // IN: Session info
+{
+   HgfsReplyCopyFileRangeV4 *reply;
+
+   HGFS_ASSERT_PACK_PARAMS;
+
+   *payloadSize = 0;
+
+   if (HGFS_OP_COPY_FILE_RANGE_V4 != op) {
+      NOT_REACHED();
+      return FALSE;
+   }
+
+   reply = HgfsAllocInitReply(packet, packetHeader, sizeof *reply, session);
+   reply->actualSize = actualSize;
+   reply->reserved = 0;
+   *payloadSize = sizeof *reply;
+
+   return TRUE;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsUnpackCompoundRequest --
+ *
+ *    Unpack hgfs compound request.
+ *
+ * Results:
+ *    TRUE on success.
+ *    FALSE on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsUnpackCompoundRequest(const void *packet,      // IN: HGFS request
+                          size_t packetSize,       // IN: request packet size
+                          HgfsOp op,               // IN: request type
+                          uint32 *numRequests,     // OUT: number of requests
+                          const char **requests,   // OUT: entries and packets
+                          size_t *requestsSize)    // OUT: size of the requests
+{
+   const HgfsRequestCompoundV4 *requestV4 = packet;
+
+   ASSERT(packet);
+
+   if (HGFS_OP_COMPOUND_V4 != op) {
+      NOT_REACHED();
+      return FALSE;
+   }
+
+   LOG(4, ("%s: HGFS_OP_COMPOUND_V4\n", __FUNCTION__));
+   if (packetSize < offsetof(HgfsRequestCompoundV4, requests)) {
+      LOG(4, ("%s: HGFS packet too small\n", __FUNCTION__));
+      return FALSE;
+   }
+   if (0 != requestV4->flags) {
+      LOG(4, ("%s: unsupported flags %#x\n", __FUNCTION__, requestV4->flags));
+      return FALSE;
+   }
+
+   *numRequests = requestV4->numRequests;
+   *requests = requestV4->requests;
+   *requestsSize = packetSize - offsetof(HgfsRequestCompoundV4, requests);
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsUnpackCompoundEntry --
+ *
+ *    Unpack the next request of a compound request, which is an entry
+ *    followed by a request packet.
+ *
+ * Results:
+ *    TRUE on success, and the size of the entry and packet.
+ *    FALSE if the request does not fit in the remaining size.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsUnpackCompoundEntry(const char *requests,     // IN: entries and packets
+                        size_t requestsSize,      // IN: size of the requests
+                        uint32 *flags,            // OUT: HGFS_COMPOUND_FLAG_xxx
+                        uint32 *handleOffset,     // OUT: handle offset
+                        const char **request,     // OUT: request packet
+                        size_t *requestSize,      // OUT: request packet size
+                        size_t *entrySize)        // OUT: entry and packet size
+{
+   const HgfsCompoundEntryV4 *entry = (const HgfsCompoundEntryV4 *)requests;
+
+   ASSERT(requests);
+
+   if (requestsSize < sizeof *entry ||
+       requestsSize - sizeof *entry < entry->packetSize) {
+      LOG(4, ("%s: HGFS packet too small\n", __FUNCTION__));
+      return FALSE;
+   }
+
+   *flags = entry->flags;
+   *handleOffset = entry->handleOffset;
+   *request = requests + sizeof *entry;
+   *requestSize = entry->packetSize;
+   *entrySize = sizeof *entry + entry->packetSize;
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPackCompoundEntry --
+ *
+ *    Pack the entry which precedes a reply packet in a compound reply.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsPackCompoundEntry(void *buffer,         // OUT: entry
+                      size_t replySize)     // IN: size of the reply packet
+{
+   HgfsCompoundEntryV4 *entry = buffer;
+
+   entry->flags = 0;
+   entry->handleOffset = 0;
+   entry->packetSize = (uint32)replySize;
+   entry->reserved = 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsPackCompoundReply --
+ *
+ *    Pack hgfs compound reply, copying the reply entries and packets.
+ *
+ * Results:
+ *    TRUE on success.
+ *    FALSE on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsPackCompoundReply(HgfsPacket *packet,        // IN/OUT: Hgfs Packet
+                      const void *packetHeader,  // IN: packet header
+                      HgfsOp op,                 // IN: request type
+                      uint32 numReplies,         // IN: number of replies
+                      const char *replies,       // IN: entries and packets
+                      size_t repliesSize,        // IN: size of the replies
+                      size_t *payloadSize,       // OUT: size of packet
+                      HgfsSessionInfo *session)  // IN: Session info
+{
+   HgfsReplyCompoundV4 *reply;
+   size_t replySize = offsetof(HgfsReplyCompoundV4, replies) + repliesSize;
+
+   HGFS_ASSERT_PACK_PARAMS;
+
+   *payloadSize = 0;
+
+   if (HGFS_OP_COMPOUND_V4 != op) {
+      NOT_REACHED();
+      return FALSE;
+   }
+
+   reply = HgfsAllocInitReply(packet, packetHeader, replySize, session);
+   reply->numReplies = numReplies;
+   reply->reserved = 0;
+   memcpy(reply->replies, replies, repliesSize);
+   *payloadSize = replySize;
+
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsUnpackCompoundReplyHandle --
+ *
+ *    Get the handle returned by a successful open or search open of a
+ *    compound request, for the requests which follow it.
+ *
+ * Results:
+ *    TRUE if the reply has a handle.
+ *    FALSE otherwise.
+ *
+ * Side effects:
+ *    None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsUnpackCompoundReplyHandle(const void *replyPacket,  // IN: reply packet
+                              size_t replyPacketSize,   // IN: reply packet size
+                              HgfsHandle *handle)       // OUT: returned handle
+{
+   const HgfsHeader *header = replyPacket;
+   const char *payload;
+   size_t payloadSize;
+
+   if (replyPacketSize < sizeof *header ||
+       header->headerSize > replyPacketSize ||
+       HGFS_STATUS_SUCCESS != header->status) {
+      return FALSE;
+   }
+
+   payload = (const char *)replyPacket + header->headerSize;
+   payloadSize = replyPacketSize - header->headerSize;
+
+   switch (header->op) {
+   case HGFS_OP_OPEN_V3:
+      if (payloadSize >= sizeof (HgfsReplyOpenV3)) {
+         *handle = ((const HgfsReplyOpenV3 *)payload)->file;
+         return TRUE;
+      }
+      break;
+   case HGFS_OP_SEARCH_OPEN_V3:
+      if (payloadSize >= sizeof (HgfsReplySearchOpenV3)) {
+         *handle = ((const HgfsReplySearchOpenV3 *)payload)->search;
+         return TRUE;
+      }
+      break;
+   default:
+      break;
+   }
+
+   return FALSE;
+}
+
+
+
 /*
  *-----------------------------------------------------------------------------
  *
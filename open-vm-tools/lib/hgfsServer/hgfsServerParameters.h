@@ -338,6 +338,53 @@ HgfsPackRemoveWatchReply(HgfsPacket *packet,           // IN/OUT: Hgfs Packet
                          HgfsOp     op,                // IN: operation code
                          size_t *payloadSize,          // OUT: size of packet
                          HgfsSessionInfo *session);    // IN: Session info
+Bool
+HgfsUnpackCopyFileRangeRequest(const void *packet,     // IN: HGFS request
+                               size_t packetSize,      // IN: request packet size
+                               HgfsOp op,              // IN: request type
+                               HgfsHandle *srcFile,    // OUT: file to copy from
+                               uint64 *srcOffset,      // OUT: offset to copy from
+                               HgfsHandle *dstFile,    // OUT: file to copy to
+                               uint64 *dstOffset,      // OUT: offset to copy to
+                               uint64 *length);        // OUT: bytes to copy
+Bool
+HgfsPackCopyFileRangeReply(HgfsPacket *packet,        // IN/OUT: Hgfs Packet
+                           const void *packetHeader,  // IN: packet header
+                           HgfsOp op,                 // IN: request type
+                           uint64 actualSize,         // IN: number of bytes copied
+                           size_t *payloadSize,       // OUT: size of packet
+                           HgfsSessionInfo *session); // IN: Session info
+Bool
+HgfsUnpackCompoundRequest(const void *packet,      // IN: HGFS request
+                          size_t packetSize,       // IN: request packet size
+                          HgfsOp op,               // IN: request type
+                          uint32 *numRequests,     // OUT: number of requests
+                          const char **requests,   // OUT: entries and packets
+                          size_t *requestsSize);   // OUT: size of the requests
+Bool
+HgfsUnpackCompoundEntry(const char *requests,     // IN: entries and packets
+                        size_t requestsSize,      // IN: size of the requests
+                        uint32 *flags,            // OUT: HGFS_COMPOUND_FLAG_xxx
+                        uint32 *handleOffset,     // OUT: handle offset
+                        const char **request,     // OUT: request packet
+                        size_t *requestSize,      // OUT: request packet size
+                        size_t *entrySize);       // OUT: entry and packet size
+void
+HgfsPackCompoundEntry(void *buffer,         // OUT: entry
+                      size_t replySize);    // IN: size of the reply packet
+Bool
+HgfsPackCompoundReply(HgfsPacket *packet,        // IN/OUT: Hgfs Packet
+                      const void *packetHeader,  // IN: packet header
+                      HgfsOp op,                 // IN: request type
+                      uint32 numReplies,         // IN: number of replies
+                      const char *replies,       // IN: entries and packets
+                      size_t repliesSize,        // IN: size of the replies
+                      size_t *payloadSize,       // OUT: size of packet
+                      HgfsSessionInfo *session); // IN: Session info
+Bool
+HgfsUnpackCompoundReplyHandle(const void *replyPacket,  // IN: reply packet
+                              size_t replyPacketSize,   // IN: reply packet size
+                              HgfsHandle *handle);      // OUT: returned handle
 size_t
 HgfsPackCalculateNotificationSize(char const *shareName, // IN: shared folder name
                                   char *fileName);       // IN: file name
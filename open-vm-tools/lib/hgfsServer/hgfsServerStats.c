@@ -0,0 +1,436 @@
+/*********************************************************
+ * Copyright (C) 2016 VMware, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * hgfsServerStats.c --
+ *
+ *	Per operation counters and histograms of the HGFS server.
+ *
+ *	Every request completed by the server is recorded: its count, errors,
+ *	bytes, and log2 histograms of its latency and of its request and reply
+ *	sizes. Recording is a handful of atomic increments without any lock,
+ *	so it is always on. The open node cache hits, misses and evictions of
+ *	each share are kept next to them. The counters are read through
+ *	HgfsServer_GetStats.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vmware.h"
+#include "vm_atomic.h"
+#include "dbllnklst.h"
+#include "dynbuf.h"
+#include "userlock.h"
+#include "util.h"
+#include "strutil.h"
+#include "hgfsServer.h"
+#include "hgfsServerStats.h"
+#include "mutexRankLib.h"
+
+#define LOGLEVEL_MODULE hgfs
+#include "loglevel_user.h"
+
+/*
+ * Histogram buckets: bucket i counts values v with 2^(i-1) <= v < 2^i,
+ * bucket 0 counts 0 and the last bucket everything above.
+ */
+#define HGFS_STATS_BUCKETS 32
+
+typedef struct HgfsStatsHisto {
+   Atomic_uint64 buckets[HGFS_STATS_BUCKETS];
+} HgfsStatsHisto;
+
+typedef struct HgfsOpStats {
+   Atomic_uint64 count;
+   Atomic_uint64 errors;          /* Requests not replied with success. */
+   Atomic_uint64 requestBytes;
+   Atomic_uint64 replyBytes;
+   Atomic_uint64 dataBytes;       /* Bytes in separate data buffers. */
+   Atomic_uint64 latencyUS;       /* Sum of the latencies. */
+   HgfsStatsHisto latency;        /* In microseconds. */
+   HgfsStatsHisto requestSize;
+   HgfsStatsHisto replySize;
+} HgfsOpStats;
+
+static HgfsOpStats gHgfsOpStats[HGFS_OP_MAX];
+
+struct HgfsShareStats {
+   DblLnkLst_Links links;         /* gHgfsShareStats list. */
+   char *shareName;
+   Atomic_uint64 nodeCache[HGFS_STATS_NODE_CACHE_EVICTION + 1];
+};
+
+/*
+ * Shares are only added to the list, under gHgfsShareStatsLock, and freed
+ * on exit: sessions keep pointers to their shares' counters.
+ */
+static Atomic_Ptr gHgfsShareStatsLockStorage;
+static DblLnkLst_Links gHgfsShareStats = { &gHgfsShareStats, &gHgfsShareStats };
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsStatsBucket --
+ *
+ *    Histogram bucket of a value.
+ *
+ * Results:
+ *    The number of significant bits of the value, capped to the last bucket.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static INLINE uint32
+HgfsStatsBucket(uint64 value)  // IN: sampled value
+{
+   uint32 bucket = 0;
+
+   while (value != 0 && bucket < HGFS_STATS_BUCKETS - 1) {
+      value >>= 1;
+      bucket++;
+   }
+   return bucket;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerStats_Record --
+ *
+ *    Record a completed request.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsServerStats_Record(HgfsOp op,                  // IN: request operation
+                       size_t requestSize,         // IN: request packet size
+                       size_t replySize,           // IN: reply packet size
+                       size_t dataSize,            // IN: separate data size
+                       HgfsInternalStatus status,  // IN: reply status
+                       uint64 latencyUS)           // IN: receive to reply time
+{
+   HgfsOpStats *stats;
+
+   if (op >= HGFS_OP_MAX) {
+      return;
+   }
+   stats = &gHgfsOpStats[op];
+
+   Atomic_Inc64(&stats->count);
+   if (status != HGFS_ERROR_SUCCESS) {
+      Atomic_Inc64(&stats->errors);
+   }
+   Atomic_Add64(&stats->requestBytes, requestSize);
+   Atomic_Add64(&stats->replyBytes, replySize);
+   Atomic_Add64(&stats->dataBytes, dataSize);
+   Atomic_Add64(&stats->latencyUS, latencyUS);
+   Atomic_Inc64(&stats->latency.buckets[HgfsStatsBucket(latencyUS)]);
+   Atomic_Inc64(&stats->requestSize.buckets[HgfsStatsBucket(requestSize)]);
+   Atomic_Inc64(&stats->replySize.buckets[HgfsStatsBucket(replySize)]);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsStatsShareLock --
+ *
+ *    Get the lock of the share counters list, creating it on first use.
+ *
+ * Results:
+ *    The lock.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static MXUserExclLock *
+HgfsStatsShareLock(void)
+{
+   return MXUser_CreateSingletonExclLock(&gHgfsShareStatsLockStorage,
+                                         "hgfsShareStatsLock",
+                                         RANK_hgfsStatsLock);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerStats_GetShare --
+ *
+ *    Find the open node cache counters of a share, adding them on the first
+ *    file opened on the share by any session.
+ *
+ * Results:
+ *    The share's counters, valid until HgfsServerStats_Exit.
+ *
+ * Side effects:
+ *    Memory may be allocated.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsShareStats *
+HgfsServerStats_GetShare(char const *shareName,  // IN: share name
+                         size_t shareNameLen)    // IN: share name length
+{
+   MXUserExclLock *lock = HgfsStatsShareLock();
+   HgfsShareStats *share;
+   DblLnkLst_Links *link;
+
+   MXUser_AcquireExclLock(lock);
+   DblLnkLst_ForEach(link, &gHgfsShareStats) {
+      share = DblLnkLst_Container(link, HgfsShareStats, links);
+      if (strncmp(share->shareName, shareName, shareNameLen) == 0 &&
+          share->shareName[shareNameLen] == '\0') {
+         goto exit;
+      }
+   }
+
+   share = Util_SafeCalloc(1, sizeof *share);
+   DblLnkLst_Init(&share->links);
+   share->shareName = Util_SafeMalloc(shareNameLen + 1);
+   memcpy(share->shareName, shareName, shareNameLen);
+   share->shareName[shareNameLen] = '\0';
+   DblLnkLst_LinkLast(&gHgfsShareStats, &share->links);
+
+exit:
+   MXUser_ReleaseExclLock(lock);
+   return share;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerStats_RecordNodeCache --
+ *
+ *    Record an open node cache hit, miss or eviction of a share.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsServerStats_RecordNodeCache(HgfsShareStats *share,          // IN: share
+                                HgfsStatsNodeCacheEvent event)  // IN: event
+{
+   Atomic_Inc64(&share->nodeCache[event]);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerStats_Exit --
+ *
+ *    Free the share counters. No session may be left.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsServerStats_Exit(void)
+{
+   MXUserExclLock *lock = HgfsStatsShareLock();
+   DblLnkLst_Links *link;
+   DblLnkLst_Links *nextLink;
+
+   MXUser_AcquireExclLock(lock);
+   DblLnkLst_ForEachSafe(link, nextLink, &gHgfsShareStats) {
+      HgfsShareStats *share = DblLnkLst_Container(link, HgfsShareStats, links);
+
+      DblLnkLst_Unlink1(&share->links);
+      free(share->shareName);
+      free(share);
+   }
+   MXUser_ReleaseExclLock(lock);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsStatsFormatHisto --
+ *
+ *    Append the non empty buckets of a histogram, as "bound:count" pairs
+ *    where bound is the exclusive upper bound of the bucket.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    The histogram is cleared if reset is set.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsStatsFormatHisto(DynBuf *buf,            // IN/OUT: output
+                     const char *name,       // IN: histogram name
+                     HgfsStatsHisto *histo,  // IN/OUT: histogram
+                     Bool reset)             // IN: clear the histogram
+{
+   uint32 i;
+
+   StrUtil_SafeDynBufPrintf(buf, "  %s", name);
+   for (i = 0; i < HGFS_STATS_BUCKETS; i++) {
+      uint64 count = Atomic_Read64(&histo->buckets[i]);
+
+      if (count != 0) {
+         StrUtil_SafeDynBufPrintf(buf, " %"FMT64"u:%"FMT64"u",
+                                  CONST64U(1) << i, count);
+         if (reset) {
+            Atomic_Add64(&histo->buckets[i], -count);
+         }
+      }
+   }
+   StrUtil_SafeDynBufPrintf(buf, "\n");
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsStatsReadCounter --
+ *
+ *    Read a counter, clearing it if asked to. Counts recorded concurrently
+ *    with the reset are kept for the next read.
+ *
+ * Results:
+ *    The counter value.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static uint64
+HgfsStatsReadCounter(Atomic_uint64 *counter,  // IN/OUT: counter
+                     Bool reset)              // IN: clear the counter
+{
+   uint64 value = Atomic_Read64(counter);
+
+   if (reset) {
+      Atomic_Add64(counter, -value);
+   }
+   return value;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsServerStats_Format --
+ *
+ *    Format the counters of all the operations which were requested. Each
+ *    operation has a line of counters (bytes and the average latency in
+ *    microseconds) followed by a line per histogram. A line per share
+ *    follows with its open node cache counters.
+ *
+ * Results:
+ *    NUL terminated text, to be freed by the caller.
+ *
+ * Side effects:
+ *    The counters are cleared if reset is set.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+char *
+HgfsServerStats_Format(Bool reset)  // IN: clear the counters
+{
+   MXUserExclLock *lock = HgfsStatsShareLock();
+   DynBuf buf;
+   HgfsOp op;
+   DblLnkLst_Links *link;
+
+   DynBuf_Init(&buf);
+
+   for (op = 0; op < HGFS_OP_MAX; op++) {
+      HgfsOpStats *stats = &gHgfsOpStats[op];
+      uint64 count;
+      uint64 latencyUS;
+
+      count = HgfsStatsReadCounter(&stats->count, reset);
+      if (count == 0) {
+         continue;
+      }
+      latencyUS = HgfsStatsReadCounter(&stats->latencyUS, reset);
+
+      StrUtil_SafeDynBufPrintf(&buf, "op %d count %"FMT64"u errors %"FMT64"u "
+                               "request %"FMT64"u reply %"FMT64"u "
+                               "data %"FMT64"u latency %"FMT64"u\n", op, count,
+                               HgfsStatsReadCounter(&stats->errors, reset),
+                               HgfsStatsReadCounter(&stats->requestBytes, reset),
+                               HgfsStatsReadCounter(&stats->replyBytes, reset),
+                               HgfsStatsReadCounter(&stats->dataBytes, reset),
+                               latencyUS / count);
+      HgfsStatsFormatHisto(&buf, "latency", &stats->latency, reset);
+      HgfsStatsFormatHisto(&buf, "request", &stats->requestSize, reset);
+      HgfsStatsFormatHisto(&buf, "reply", &stats->replySize, reset);
+   }
+
+   MXUser_AcquireExclLock(lock);
+   DblLnkLst_ForEach(link, &gHgfsShareStats) {
+      HgfsShareStats *share = DblLnkLst_Container(link, HgfsShareStats, links);
+      Atomic_uint64 *nodeCache = share->nodeCache;
+
+      StrUtil_SafeDynBufPrintf(&buf, "share \"%s\" node cache hits %"FMT64"u "
+                               "misses %"FMT64"u evictions %"FMT64"u\n",
+                               share->shareName,
+                               HgfsStatsReadCounter(
+                                  &nodeCache[HGFS_STATS_NODE_CACHE_HIT], reset),
+                               HgfsStatsReadCounter(
+                                  &nodeCache[HGFS_STATS_NODE_CACHE_MISS], reset),
+                               HgfsStatsReadCounter(
+                                  &nodeCache[HGFS_STATS_NODE_CACHE_EVICTION],
+                                  reset));
+   }
+   MXUser_ReleaseExclLock(lock);
+
+   DynBuf_Append(&buf, "", 1);
+   return DynBuf_Detach(&buf);
+}
@@ -0,0 +1,56 @@
+/*********************************************************
+ * Copyright (C) 2016 VMware, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+#ifndef _HGFS_SERVER_STATS_H
+#define _HGFS_SERVER_STATS_H
+
+/*
+ * hgfsServerStats.h --
+ *
+ *	Function definitions for the HGFS server per operation counters and
+ *	histograms.
+ */
+
+#include "vm_basic_types.h"
+#include "hgfsProto.h"
+#include "hgfsUtil.h"
+
+void HgfsServerStats_Record(HgfsOp op,
+                            size_t requestSize,
+                            size_t replySize,
+                            size_t dataSize,
+                            HgfsInternalStatus status,
+                            uint64 latencyUS);
+char *HgfsServerStats_Format(Bool reset);
+void HgfsServerStats_Exit(void);
+
+/* Open node cache counters of a share, summed over all the sessions. */
+typedef struct HgfsShareStats HgfsShareStats;
+
+typedef enum {
+   HGFS_STATS_NODE_CACHE_HIT,
+   HGFS_STATS_NODE_CACHE_MISS,
+   HGFS_STATS_NODE_CACHE_EVICTION,
+} HgfsStatsNodeCacheEvent;
+
+HgfsShareStats *HgfsServerStats_GetShare(char const *shareName,
+                                         size_t shareNameLen);
+void HgfsServerStats_RecordNodeCache(HgfsShareStats *share,
+                                     HgfsStatsNodeCacheEvent event);
+
+#endif // _HGFS_SERVER_STATS_H
@@ -0,0 +1,663 @@
+/*********************************************************
+ * Copyright (C) 2016 VMware, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * hgfsThreadpool.c --
+ *
+ *	A fixed size pool of worker threads used by the HGFS server to process
+ *	asynchronous requests off the channel's receive thread.
+ *
+ *	Work items are run in FIFO order. Items may carry order keys, e.g. the
+ *	handle of the file they work on: an item is not started while an
+ *	earlier item with one of its keys is queued or running, so the items
+ *	of a key run one at a time in queue order while items of other keys
+ *	pass them. The threads are only created when the first item is
+ *	queued, so channels which never process requests asynchronously (e.g.
+ *	the backdoor) do not pay for idle threads.
+ *
+ *	Timers run a work item once some delay after they are armed, on a
+ *	thread of their own which is also created when first needed. They do
+ *	not depend on the worker pool being active.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "vmware.h"
+#include "dbllnklst.h"
+#include "userlock.h"
+#include "mutexRankLib.h"
+#include "util.h"
+#include "hgfsThreadpool.h"
+
+#define LOGLEVEL_MODULE hgfs
+#include "loglevel_user.h"
+
+
+typedef struct HgfsThreadpoolItem {
+   DblLnkLst_Links links;
+   HgfsThreadpoolWorkItem workItem;
+   void *data;
+   uint64 keys[HGFS_THREADPOOL_NUM_KEYS];
+} HgfsThreadpoolItem;
+
+typedef struct HgfsThreadpoolState {
+   /* Lock for all the following fields. */
+   MXUserExclLock *lock;
+
+   /*
+    * Signalled when an item is queued, when an item with order keys is
+    * done, or when the pool is exiting.
+    */
+   MXUserCondVar *itemQueued;
+
+   /* Queue of pending work items. */
+   DblLnkLst_Links queue;
+
+   /* Order keys of the item each worker is running. */
+   uint64 (*runningKeys)[HGFS_THREADPOOL_NUM_KEYS];
+
+   /* Worker threads, numStarted of numThreads have been created. */
+   pthread_t *threads;
+   uint32 numThreads;
+   uint32 numStarted;
+
+   /* Set when the workers should exit once the queue is empty. */
+   Bool exiting;
+} HgfsThreadpoolState;
+
+static HgfsThreadpoolState gHgfsThreadpool;
+static Bool gHgfsThreadpoolActive = FALSE;
+
+struct HgfsThreadpoolTimer {
+   /* Lock for all the following fields. */
+   MXUserExclLock *lock;
+
+   /* Signalled when the timer is armed or destroyed. */
+   MXUserCondVar *changed;
+
+   HgfsThreadpoolWorkItem workItem;
+   void *data;
+   uint32 delayMsec;
+
+   /* Timer thread, valid if started. */
+   pthread_t thread;
+   Bool started;
+
+   /* Set when the work item should run, cleared before it runs. */
+   Bool armed;
+
+   /* Set when the thread should exit once the timer is disarmed. */
+   Bool exiting;
+};
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsThreadpoolHasKey --
+ *
+ *    Check if an order key is one of a set of keys.
+ *
+ * Results:
+ *    TRUE if it is.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsThreadpoolHasKey(const uint64 keys[HGFS_THREADPOOL_NUM_KEYS],  // IN
+                     uint64 key)                                   // IN
+{
+   uint32 i;
+
+   for (i = 0; i < HGFS_THREADPOOL_NUM_KEYS; i++) {
+      if (keys[i] == key) {
+         return TRUE;
+      }
+   }
+   return FALSE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsThreadpoolNextItem --
+ *
+ *    Find the first queued item which can be started: none of its order
+ *    keys is held by a running item or by an item queued before it.
+ *
+ *    The pool lock should be acquired prior to calling this function.
+ *
+ * Results:
+ *    The item, NULL if there is none.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsThreadpoolItem *
+HgfsThreadpoolNextItem(HgfsThreadpoolState *pool)  // IN: pool
+{
+   DblLnkLst_Links *link;
+
+   DblLnkLst_ForEach(link, &pool->queue) {
+      HgfsThreadpoolItem *item = DblLnkLst_Container(link, HgfsThreadpoolItem,
+                                                     links);
+      Bool blocked = FALSE;
+      uint32 i;
+
+      for (i = 0; i < HGFS_THREADPOOL_NUM_KEYS && !blocked; i++) {
+         uint64 key = item->keys[i];
+         DblLnkLst_Links *earlier;
+         uint32 worker;
+
+         if (key == HGFS_THREADPOOL_NO_KEY) {
+            continue;
+         }
+         for (worker = 0; worker < pool->numStarted && !blocked; worker++) {
+            blocked = HgfsThreadpoolHasKey(pool->runningKeys[worker], key);
+         }
+         for (earlier = pool->queue.next; earlier != link && !blocked;
+              earlier = earlier->next) {
+            blocked = HgfsThreadpoolHasKey(
+               DblLnkLst_Container(earlier, HgfsThreadpoolItem, links)->keys,
+               key);
+         }
+      }
+
+      if (!blocked) {
+         return item;
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsThreadpoolWorker --
+ *
+ *    Worker thread body: run queued items until the pool is exiting and the
+ *    queue is empty.
+ *
+ * Results:
+ *    NULL.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void *
+HgfsThreadpoolWorker(void *data)  // IN: worker index
+{
+   HgfsThreadpoolState *pool = &gHgfsThreadpool;
+   uint64 *runningKeys = pool->runningKeys[(uintptr_t)data];
+
+   MXUser_AcquireExclLock(pool->lock);
+
+   for (;;) {
+      HgfsThreadpoolItem *item;
+      uint32 i;
+
+      while ((item = HgfsThreadpoolNextItem(pool)) == NULL &&
+             (DblLnkLst_IsLinked(&pool->queue) || !pool->exiting)) {
+         MXUser_WaitCondVarExclLock(pool->lock, pool->itemQueued);
+      }
+
+      if (NULL == item) {
+         break;
+      }
+
+      DblLnkLst_Unlink1(&item->links);
+      memcpy(runningKeys, item->keys, sizeof item->keys);
+
+      MXUser_ReleaseExclLock(pool->lock);
+      item->workItem(item->data);
+      MXUser_AcquireExclLock(pool->lock);
+
+      /* Items of the same keys may be waiting for this one. */
+      for (i = 0; i < HGFS_THREADPOOL_NUM_KEYS; i++) {
+         if (runningKeys[i] != HGFS_THREADPOOL_NO_KEY) {
+            runningKeys[i] = HGFS_THREADPOOL_NO_KEY;
+            MXUser_BroadcastCondVar(pool->itemQueued);
+         }
+      }
+      free(item);
+   }
+
+   MXUser_ReleaseExclLock(pool->lock);
+
+   return NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsThreadpool_Init --
+ *
+ *    Initialize the worker pool. The threads are created on demand.
+ *
+ * Results:
+ *    TRUE on success, FALSE if numThreads is 0, i.e. no pool is wanted.
+ *
+ * Side effects:
+ *    Memory allocation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsThreadpool_Init(uint32 numThreads)  // IN: number of worker threads
+{
+   HgfsThreadpoolState *pool = &gHgfsThreadpool;
+
+   ASSERT(!gHgfsThreadpoolActive);
+
+   if (numThreads == 0) {
+      return FALSE;
+   }
+
+   pool->lock = MXUser_CreateExclLock("HgfsThreadpoolLock",
+                                      RANK_hgfsThreadpoolLock);
+   pool->itemQueued = MXUser_CreateCondVarExclLock(pool->lock);
+   DblLnkLst_Init(&pool->queue);
+   pool->threads = Util_SafeCalloc(numThreads, sizeof *pool->threads);
+   pool->runningKeys = Util_SafeMalloc(numThreads * sizeof *pool->runningKeys);
+   memset(pool->runningKeys, 0xff, numThreads * sizeof *pool->runningKeys);
+   pool->numThreads = numThreads;
+   pool->numStarted = 0;
+   pool->exiting = FALSE;
+
+   gHgfsThreadpoolActive = TRUE;
+   LOG(4, ("%s: pool of %u threads\n", __FUNCTION__, numThreads));
+
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsThreadpool_Exit --
+ *
+ *    Tear down the worker pool. Items still queued are run before the
+ *    workers exit.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Waits for all worker threads to terminate.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsThreadpool_Exit(void)
+{
+   HgfsThreadpoolState *pool = &gHgfsThreadpool;
+   uint32 i;
+
+   if (!gHgfsThreadpoolActive) {
+      return;
+   }
+
+   MXUser_AcquireExclLock(pool->lock);
+   pool->exiting = TRUE;
+   MXUser_BroadcastCondVar(pool->itemQueued);
+   MXUser_ReleaseExclLock(pool->lock);
+
+   for (i = 0; i < pool->numStarted; i++) {
+      pthread_join(pool->threads[i], NULL);
+   }
+
+   ASSERT(!DblLnkLst_IsLinked(&pool->queue));
+
+   gHgfsThreadpoolActive = FALSE;
+   free(pool->threads);
+   pool->threads = NULL;
+   free(pool->runningKeys);
+   pool->runningKeys = NULL;
+   pool->numThreads = 0;
+   pool->numStarted = 0;
+   MXUser_DestroyCondVar(pool->itemQueued);
+   MXUser_DestroyExclLock(pool->lock);
+   pool->itemQueued = NULL;
+   pool->lock = NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsThreadpool_IsActive --
+ *
+ *    Check if the worker pool is initialized.
+ *
+ * Results:
+ *    TRUE if work items can be queued, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsThreadpool_IsActive(void)
+{
+   return gHgfsThreadpoolActive;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsThreadpool_QueueWorkItem --
+ *
+ *    Queue a work item to be run by one of the worker threads. A new worker
+ *    is started if not all of them are running yet.
+ *
+ * Results:
+ *    TRUE if the item was queued. FALSE if no worker thread could be
+ *    started, the caller should then run the item itself.
+ *
+ * Side effects:
+ *    May create a thread.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsThreadpool_QueueWorkItem(HgfsThreadpoolWorkItem workItem, // IN: function
+                             void *data)                      // IN: its argument
+{
+   return HgfsThreadpool_QueueOrderedWorkItem(workItem, data,
+                                              HGFS_THREADPOOL_NO_KEY,
+                                              HGFS_THREADPOOL_NO_KEY);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsThreadpool_QueueOrderedWorkItem --
+ *
+ *    Queue a work item which is run after the items queued before it with
+ *    the same order keys are done.
+ *
+ * Results:
+ *    TRUE if the item was queued. FALSE if no worker thread could be
+ *    started, the caller should then run the item itself.
+ *
+ * Side effects:
+ *    May create a thread.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsThreadpool_QueueOrderedWorkItem(HgfsThreadpoolWorkItem workItem, // IN: function
+                                    void *data,                      // IN: its argument
+                                    uint64 key1,                     // IN: order key
+                                    uint64 key2)                     // IN: order key
+{
+   HgfsThreadpoolState *pool = &gHgfsThreadpool;
+   HgfsThreadpoolItem *item;
+   Bool queued = FALSE;
+
+   ASSERT(gHgfsThreadpoolActive);
+   ASSERT(workItem);
+
+   item = Util_SafeMalloc(sizeof *item);
+   DblLnkLst_Init(&item->links);
+   item->workItem = workItem;
+   item->data = data;
+   item->keys[0] = key1;
+   item->keys[1] = key2;
+
+   MXUser_AcquireExclLock(pool->lock);
+
+   if (pool->exiting) {
+      goto exit;
+   }
+
+   if (pool->numStarted < pool->numThreads) {
+      int error = pthread_create(&pool->threads[pool->numStarted], NULL,
+                                 HgfsThreadpoolWorker,
+                                 (void *)(uintptr_t)pool->numStarted);
+
+      if (error == 0) {
+         pool->numStarted++;
+      } else {
+         LOG(4, ("%s: could not start worker: %d\n", __FUNCTION__, error));
+      }
+   }
+
+   if (pool->numStarted == 0) {
+      goto exit;
+   }
+
+   DblLnkLst_LinkLast(&pool->queue, &item->links);
+   MXUser_SignalCondVar(pool->itemQueued);
+   queued = TRUE;
+
+exit:
+   MXUser_ReleaseExclLock(pool->lock);
+
+   if (!queued) {
+      free(item);
+   }
+
+   return queued;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsThreadpoolTimerThread --
+ *
+ *    Timer thread body: run the work item delayMsec after the timer is
+ *    armed, until the timer is destroyed.
+ *
+ * Results:
+ *    NULL.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void *
+HgfsThreadpoolTimerThread(void *data)  // IN: timer
+{
+   HgfsThreadpoolTimer *timer = data;
+
+   MXUser_AcquireExclLock(timer->lock);
+
+   for (;;) {
+      while (!timer->armed && !timer->exiting) {
+         MXUser_WaitCondVarExclLock(timer->lock, timer->changed);
+      }
+
+      if (timer->exiting) {
+         break;
+      }
+
+      MXUser_TimedWaitCondVarExclLock(timer->lock, timer->changed,
+                                      timer->delayMsec);
+
+      /* Destroying the timer disarms it and runs the work item itself. */
+      if (!timer->armed) {
+         continue;
+      }
+      timer->armed = FALSE;
+
+      MXUser_ReleaseExclLock(timer->lock);
+      timer->workItem(timer->data);
+      MXUser_AcquireExclLock(timer->lock);
+   }
+
+   MXUser_ReleaseExclLock(timer->lock);
+
+   return NULL;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsThreadpool_CreateTimer --
+ *
+ *    Create a disarmed timer running workItem delayMsec after it is armed.
+ *
+ * Results:
+ *    The timer.
+ *
+ * Side effects:
+ *    Memory allocation.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+HgfsThreadpoolTimer *
+HgfsThreadpool_CreateTimer(HgfsThreadpoolWorkItem workItem, // IN: function
+                           void *data,                      // IN: its argument
+                           uint32 delayMsec)                // IN: delay
+{
+   HgfsThreadpoolTimer *timer;
+
+   ASSERT(workItem);
+
+   timer = Util_SafeCalloc(1, sizeof *timer);
+   timer->lock = MXUser_CreateExclLock("HgfsThreadpoolTimerLock",
+                                       RANK_hgfsThreadpoolLock);
+   timer->changed = MXUser_CreateCondVarExclLock(timer->lock);
+   timer->workItem = workItem;
+   timer->data = data;
+   timer->delayMsec = delayMsec;
+
+   return timer;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsThreadpool_DestroyTimer --
+ *
+ *    Destroy a timer. If it is armed its work item is run first, without
+ *    waiting for the delay.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Waits for the timer thread to terminate.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsThreadpool_DestroyTimer(HgfsThreadpoolTimer *timer)  // IN: timer
+{
+   Bool started;
+   Bool armed;
+
+   if (NULL == timer) {
+      return;
+   }
+
+   MXUser_AcquireExclLock(timer->lock);
+   timer->exiting = TRUE;
+   started = timer->started;
+   armed = timer->armed;
+   timer->armed = FALSE;
+   MXUser_BroadcastCondVar(timer->changed);
+   MXUser_ReleaseExclLock(timer->lock);
+
+   if (started) {
+      pthread_join(timer->thread, NULL);
+   }
+
+   if (armed) {
+      timer->workItem(timer->data);
+   }
+
+   MXUser_DestroyCondVar(timer->changed);
+   MXUser_DestroyExclLock(timer->lock);
+   free(timer);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsThreadpool_ArmTimer --
+ *
+ *    Arm a timer, starting its thread if needed. Arming an armed timer does
+ *    not postpone it.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    May create a thread. If no thread can be created the work item runs
+ *    when the timer is destroyed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+HgfsThreadpool_ArmTimer(HgfsThreadpoolTimer *timer)  // IN: timer
+{
+   ASSERT(timer);
+
+   MXUser_AcquireExclLock(timer->lock);
+
+   if (!timer->exiting && !timer->armed) {
+      if (!timer->started) {
+         int error = pthread_create(&timer->thread, NULL,
+                                    HgfsThreadpoolTimerThread, timer);
+
+         if (error == 0) {
+            timer->started = TRUE;
+         } else {
+            LOG(4, ("%s: could not start timer: %d\n", __FUNCTION__, error));
+         }
+      }
+      timer->armed = TRUE;
+      MXUser_SignalCondVar(timer->changed);
+   }
+
+   MXUser_ReleaseExclLock(timer->lock);
+}
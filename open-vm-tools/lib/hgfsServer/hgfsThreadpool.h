@@ -0,0 +1,59 @@
+/*********************************************************
+ * Copyright (C) 2016 VMware, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+#ifndef _HGFS_THREADPOOL_H
+#define _HGFS_THREADPOOL_H
+
+/*
+ * hgfsThreadpool.h --
+ *
+ *	Function definitions for the HGFS server worker threads which process
+ *	asynchronous requests.
+ */
+
+#include "vm_basic_types.h"
+
+typedef void (*HgfsThreadpoolWorkItem)(void *data);
+
+Bool HgfsThreadpool_Init(uint32 numThreads);
+void HgfsThreadpool_Exit(void);
+Bool HgfsThreadpool_IsActive(void);
+Bool HgfsThreadpool_QueueWorkItem(HgfsThreadpoolWorkItem workItem,
+                                  void *data);
+
+/*
+ * Work items sharing an order key are run one at a time, in the order they
+ * were queued. HGFS_THREADPOOL_NO_KEY orders nothing.
+ */
+#define HGFS_THREADPOOL_NO_KEY    CONST64U(0xffffffffffffffff)
+#define HGFS_THREADPOOL_NUM_KEYS  2
+
+Bool HgfsThreadpool_QueueOrderedWorkItem(HgfsThreadpoolWorkItem workItem,
+                                         void *data,
+                                         uint64 key1,
+                                         uint64 key2);
+
+typedef struct HgfsThreadpoolTimer HgfsThreadpoolTimer;
+
+HgfsThreadpoolTimer *HgfsThreadpool_CreateTimer(HgfsThreadpoolWorkItem workItem,
+                                                void *data,
+                                                uint32 delayMsec);
+void HgfsThreadpool_DestroyTimer(HgfsThreadpoolTimer *timer);
+void HgfsThreadpool_ArmTimer(HgfsThreadpoolTimer *timer);
+
+#endif // _HGFS_THREADPOOL_H
@@ -106,9 +106,18 @@ static HgfsChannelData gHgfsChannels[] = {
    { "guest", &gGuestBackdoorOps, 0, NULL, NULL, {0} },
 };
 
+/*
+ * No change notification: the server only offers it on shared memory
+ * channels and the backdoor channel is not one, so the notification
+ * thread would run for nothing.
+ */
 static HgfsServerConfig gHgfsGuestCfgSettings = {
    (HGFS_CONFIG_SHARE_ALL_HOST_DRIVES_ENABLED | HGFS_CONFIG_VOL_INFO_MIN),
-   HGFS_MAX_CACHED_FILENODES
+   HGFS_MAX_CACHED_FILENODES,
+   HGFS_DEFAULT_WORKER_THREADS,
+   HGFS_DEFAULT_MAX_ASYNC_REQUESTS,
+   HGFS_DEFAULT_MAX_READ_AHEAD_BYTES,
+   HGFS_DEFAULT_MAX_WRITE_BEHIND_BYTES
 };
 
 /* HGFS server info state. Referenced by each separate channel that uses it. */
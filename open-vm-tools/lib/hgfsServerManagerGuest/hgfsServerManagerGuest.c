@@ -29,6 +29,7 @@
 #include "hgfsServerPolicy.h"
 #include "hgfsChannelGuestInt.h"
 #include "hgfsServerManager.h"
+#include "hgfsServer.h"
 #include "vm_basic_defs.h"
 #include "vm_assert.h"
 #include "hgfs.h"
@@ -145,6 +146,29 @@ HgfsServerManager_InvalidateInactiveSessions(HgfsServerMgrData *mgrData)  // IN:
 }
 
 
+/*
+ *----------------------------------------------------------------------------
+ *
+ * HgfsServerManager_GetStats --
+ *
+ *    Returns the per operation request statistics of the HGFS server.
+ *
+ * Results:
+ *    NUL terminated text, to be freed by the caller.
+ *
+ * Side effects:
+ *    The statistics are cleared if reset is set.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+char *
+HgfsServerManager_GetStats(Bool reset)  // IN: clear the statistics
+{
+   return HgfsServer_GetStats(reset);
+}
+
+
 /*
  *----------------------------------------------------------------------------
  *
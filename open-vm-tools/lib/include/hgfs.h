@@ -246,4 +246,13 @@ typedef enum {
  */
 #define HGFS_CLIENT_CMD_LEN HGFS_SYNC_REQREP_CLIENT_CMD_LEN
 
+/*
+ * Command returning the per operation request counters and latency
+ * histograms of the guest HGFS server, as text. An argument of "reset"
+ * clears them once returned. Only the host sends it, the guest finds the
+ * same text in the tools log when vmtoolsd dumps its state (SIGUSR1).
+ */
+#define HGFS_STATS_CMD "hgfs.stats"
+#define HGFS_STATS_RESET_ARG "reset"
+
 #endif // _HGFS_H_
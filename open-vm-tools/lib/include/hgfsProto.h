@@ -146,6 +146,8 @@ typedef enum {
    HGFS_OP_UNLOCK_BYTE_RANGE_V4,  /* Release byte range lock. */
    HGFS_OP_QUERY_EAS_V4,          /* Query extended attributes. */
    HGFS_OP_SET_EAS_V4,            /* Add or modify extended attributes. */
+   HGFS_OP_COPY_FILE_RANGE_V4,    /* Copy a byte range between open files. */
+   HGFS_OP_COMPOUND_V4,           /* Run several requests in order. */
 
    HGFS_OP_MAX,                   /* Dummy op, must be last in enum */
    HGFS_OP_NEW_HEADER = 0xff,     /* Header op, must be unique, distinguishes packet headers. */
@@ -2684,4 +2686,89 @@ struct HgfsReplyDeleteFileV4 {
 #include "vmware_pack_end.h"
 HgfsReplyDeleteFileV4;
 
+/*
+ * Copies a byte range of an open file into another open file on the host,
+ * without the data being transferred to and from the client. The copy may
+ * be short, actualSize is the number of bytes copied and 0 means the
+ * source offset is at or past its end of file.
+ */
+
+typedef
+#include "vmware_pack_begin.h"
+struct HgfsRequestCopyFileRangeV4 {
+   HgfsHandle srcFile;        /* Opaque file ID of the file to copy from */
+   HgfsHandle dstFile;        /* Opaque file ID of the file to copy to */
+   uint64 srcOffset;
+   uint64 dstOffset;
+   uint64 length;             /* Number of bytes to copy */
+   uint32 flags;              /* Reserved for future use, must be 0 */
+   uint64 reserved;           /* Reserved for future use */
+}
+#include "vmware_pack_end.h"
+HgfsRequestCopyFileRangeV4;
+
+typedef
+#include "vmware_pack_begin.h"
+struct HgfsReplyCopyFileRangeV4 {
+   uint64 actualSize;         /* Number of bytes copied */
+   uint64 reserved;           /* Reserved for future use */
+}
+#include "vmware_pack_end.h"
+HgfsReplyCopyFileRangeV4;
+
+/*
+ * A compound request runs several requests in one round trip. Each request
+ * is a complete V4 request packet (header and payload) of the same session,
+ * preceded by an HgfsCompoundEntryV4. The server runs them in order and
+ * returns their reply packets the same way in the compound reply.
+ *
+ * The server stops at the first request which fails, and when the compound
+ * reply has no room left for the next reply (reads must fit in the reply),
+ * so numReplies may be less than numRequests: the client sends the
+ * remaining requests again. A successful compound reply has at least one
+ * reply; if the first request cannot be run the compound request fails.
+ *
+ * With HGFS_COMPOUND_FLAG_USE_HANDLE the server replaces the handle at
+ * handleOffset in the request payload with the handle returned by the last
+ * open or search open of the compound, e.g. open, getattr, read and close
+ * of a file.
+ *
+ * Requests with data packets, session requests and compound requests cannot
+ * be part of a compound request.
+ */
+
+#define HGFS_COMPOUND_FLAG_USE_HANDLE     (1 << 0)
+
+typedef
+#include "vmware_pack_begin.h"
+struct HgfsCompoundEntryV4 {
+   uint32 flags;              /* HGFS_COMPOUND_FLAG_xxx, 0 in replies */
+   uint32 handleOffset;       /* Payload offset of the handle to replace */
+   uint32 packetSize;         /* Size of the following packet */
+   uint32 reserved;           /* Reserved for future use */
+}
+#include "vmware_pack_end.h"
+HgfsCompoundEntryV4;
+
+typedef
+#include "vmware_pack_begin.h"
+struct HgfsRequestCompoundV4 {
+   uint32 numRequests;        /* Number of requests that follow */
+   uint32 flags;              /* Reserved for future use, must be 0 */
+   uint64 reserved;           /* Reserved for future use */
+   char requests[1];          /* Entries and request packets */
+}
+#include "vmware_pack_end.h"
+HgfsRequestCompoundV4;
+
+typedef
+#include "vmware_pack_begin.h"
+struct HgfsReplyCompoundV4 {
+   uint32 numReplies;         /* Number of replies that follow */
+   uint32 reserved;           /* Reserved for future use */
+   char replies[1];           /* Entries and reply packets */
+}
+#include "vmware_pack_end.h"
+HgfsReplyCompoundV4;
+
 #endif /* _HGFS_PROTO_H_ */
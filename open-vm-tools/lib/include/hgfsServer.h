@@ -110,6 +110,22 @@ typedef struct HgfsServerChannelData {
 /* Default maximum number of open nodes. */
 #define HGFS_MAX_CACHED_FILENODES   30
 
+/* Default number of worker threads processing asynchronous requests. */
+#define HGFS_DEFAULT_WORKER_THREADS       4
+
+/* Default maximum number of asynchronous requests in flight per session. */
+#define HGFS_DEFAULT_MAX_ASYNC_REQUESTS   32
+
+/* Default bound on the bytes read ahead of all readers. */
+#define HGFS_DEFAULT_MAX_READ_AHEAD_BYTES (16 * 1024 * 1024)
+
+/*
+ * Default size of the write-behind buffer of a file, 0 disables it. The
+ * guest tools keep the default, write-behind is only used by servers
+ * configured with a size, such as hgfsBench --write-behind.
+ */
+#define HGFS_DEFAULT_MAX_WRITE_BEHIND_BYTES 0
+
 typedef uint32 HgfsConfigFlags;
 #define HGFS_CONFIG_USE_HOST_TIME                    (1 << 0)
 #define HGFS_CONFIG_NOTIFY_ENABLED                   (1 << 1)
@@ -120,6 +136,10 @@ typedef uint32 HgfsConfigFlags;
 typedef struct HgfsServerConfig {
    HgfsConfigFlags flags;
    uint32 maxCachedOpenNodes;
+   uint32 numWorkerThreads;      /* 0 processes all requests on the receive thread */
+   uint32 maxAsyncRequests;      /* Per session bound on requests in flight */
+   uint32 maxReadAheadBytes;     /* Global read-ahead bound, 0 disables it */
+   uint32 maxWriteBehindBytes;   /* Per file write coalescing bound, 0 disables it */
 }HgfsServerConfig;
 
 /*
@@ -206,6 +226,8 @@ Bool HgfsServer_ShareAccessCheck(HgfsOpenMode accessMode,
 uint32 HgfsServer_GetHandleCounter(void);
 void HgfsServer_SetHandleCounter(uint32 newHandleCounter);
 
+char *HgfsServer_GetStats(Bool reset);
+
 
 void HgfsServer_Quiesce(Bool freeze);
 
@@ -61,6 +61,7 @@ Bool HgfsServerManager_ProcessPacket(HgfsServerMgrData *mgrData,
                                      char *packetOut,
                                      size_t *packetOutSize);
 uint32 HgfsServerManager_InvalidateInactiveSessions(HgfsServerMgrData *mgrData);
+char *HgfsServerManager_GetStats(Bool reset);
 #endif
 
 #endif // _HGFS_SERVER_MANAGER_H_
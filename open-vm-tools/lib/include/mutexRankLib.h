@@ -54,11 +54,19 @@
  * hgfs locks
  */
 #define RANK_hgfsSessionArrayLock    (RANK_libLockBase + 0x4010)
+#define RANK_hgfsNotifyDeliveryLock  (RANK_libLockBase + 0x4020)
 #define RANK_hgfsSharedFolders       (RANK_libLockBase + 0x4030)
 #define RANK_hgfsNotifyLock          (RANK_libLockBase + 0x4040)
 #define RANK_hgfsFileIOLock          (RANK_libLockBase + 0x4050)
 #define RANK_hgfsSearchArrayLock     (RANK_libLockBase + 0x4060)
 #define RANK_hgfsNodeArrayLock       (RANK_libLockBase + 0x4070)
+#define RANK_hgfsFileNodeLock        (RANK_libLockBase + 0x4078)
+#define RANK_hgfsThreadpoolLock      (RANK_libLockBase + 0x4080)
+#define RANK_hgfsNameCacheLock       (RANK_libLockBase + 0x4090)
+#define RANK_hgfsCaseCacheLock       (RANK_libLockBase + 0x40a0)
+#define RANK_hgfsAttrCacheLock       (RANK_libLockBase + 0x40b0)
+#define RANK_hgfsWriteBehindLock     (RANK_libLockBase + 0x40c0)
+#define RANK_hgfsStatsLock           (RANK_libLockBase + 0x40d0)
 
 /*
  * vigor (must be < VMDB range and < disklib, see bug 741290)
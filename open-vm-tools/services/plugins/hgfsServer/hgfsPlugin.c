@@ -98,6 +98,68 @@ HgfsServerRpcDispatch(RpcInData *data)
 }
 
 
+/**
+ * Returns the request statistics of the hgfs server. This is a TCLO command,
+ * only the host can send it: in the guest the statistics are logged when
+ * the service dumps its state, see HgfsServerDumpState.
+ *
+ * @param[in]  data  RPC request data.
+ *
+ * @return TRUE.
+ */
+
+static gboolean
+HgfsServerRpcStats(RpcInData *data)
+{
+   const char *args = data->args;
+   size_t argsSize = data->argsSize;
+   const size_t resetSize = sizeof HGFS_STATS_RESET_ARG - 1;
+   Bool reset;
+   size_t i;
+   char *stats;
+
+   /* The arguments follow a space and are not NUL terminated. */
+   while (argsSize > 0 && *args == ' ') {
+      args++;
+      argsSize--;
+   }
+   reset = argsSize >= resetSize &&
+           memcmp(args, HGFS_STATS_RESET_ARG, resetSize) == 0;
+
+   /* Only trailing spaces or NULs may follow, "resetx" is not a reset. */
+   for (i = resetSize; reset && i < argsSize; i++) {
+      reset = args[i] == ' ' || args[i] == '\0';
+   }
+   stats = HgfsServerManager_GetStats(reset);
+
+   data->result = stats;
+   data->resultLen = strlen(stats);
+   data->freeResult = TRUE;
+   return TRUE;
+}
+
+
+/**
+ * Logs the request statistics of the hgfs server, without clearing them.
+ *
+ * @param[in]  src      The source object.
+ * @param[in]  ctx      Unused.
+ * @param[in]  data     Unused.
+ */
+
+static void
+HgfsServerDumpState(gpointer src,
+                    ToolsAppCtx *ctx,
+                    gpointer data)
+{
+   char *stats = HgfsServerManager_GetStats(FALSE);
+
+   ToolsCore_LogState(TOOLS_STATE_LOG_PLUGIN, "HGFS server statistics:\n%s",
+                      stats);
+   free(stats);
+}
+
+
 /**
  * Sends the HGFS capability to the VMX.
  *
@@ -272,11 +334,13 @@ ToolsOnLoad(ToolsAppCtx *ctx)
 
    {
       RpcChannelCallback rpcs[] = {
-         { HGFS_SYNC_REQREP_CMD, HgfsServerRpcDispatch, mgrData, NULL, NULL, 0 }
+         { HGFS_SYNC_REQREP_CMD, HgfsServerRpcDispatch, mgrData, NULL, NULL, 0 },
+         { HGFS_STATS_CMD, HgfsServerRpcStats, mgrData, NULL, NULL, 0 }
       };
       ToolsPluginSignalCb sigs[] = {
          { TOOLS_CORE_SIG_CAPABILITIES, HgfsServerCapReg, &regData },
-         { TOOLS_CORE_SIG_SHUTDOWN, HgfsServerShutdown, &regData }
+         { TOOLS_CORE_SIG_SHUTDOWN, HgfsServerShutdown, &regData },
+         { TOOLS_CORE_SIG_DUMP_STATE, HgfsServerDumpState, NULL }
       };
       ToolsAppReg regs[] = {
          { TOOLS_APP_GUESTRPC, VMTools_WrapArray(rpcs, sizeof *rpcs, ARRAYSIZE(rpcs)) },
@@ -0,0 +1,3315 @@
+/*********************************************************
+ * Copyright (C) 2016 VMware, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * hgfsBench.c --
+ *
+ *	End to end benchmark of the HGFS server.
+ *
+ *	Drives the server in process through the loopback channel with V4
+ *	session requests, against a temporary directory of files, and reports
+ *	for each workload the number of requests, requests per second, data
+ *	MB per second and the request latency percentiles.
+ *
+ *	The workloads run a fixed number of passes over the same files, so
+ *	runs with the same options can be compared. With --scale they run
+ *	once for each number of worker threads, doubling up to --threads, to
+ *	compare the throughput as the server runs more requests together.
+ *
+ *	With --check the regression checks run instead of the workloads. Each
+ *	check drives the server through the same channel and verifies the
+ *	replies, and the program fails if any check fails.
+ */
+
+#define G_LOG_DOMAIN "hgfsBench"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <glib.h>
+
+#include "vmware.h"
+#include "util.h"
+#include "str.h"
+#include "hostinfo.h"
+#include "cpName.h"
+#include "hgfs.h"
+#include "hgfsProto.h"
+#include "hgfsServer.h"
+#include "hgfsServerPolicy.h"
+#include "hgfsChannelLoopback.h"
+
+typedef struct HgfsBenchStats {
+   const char *name;
+   uint64 numRequests;
+   uint64 numErrors;
+   uint64 numBytes;              /* File data read or written */
+   uint64 *latenciesNS;          /* Of every request */
+   size_t maxLatencies;
+   VmTimeType elapsedNS;         /* Less the time the workload set up for */
+   VmTimeType firstEntryNS;      /* Of a listing, 0 if not measured */
+   long maxRssKB;                /* Peak RSS after that listing */
+   long rssGrowthKB;             /* Growth of the peak RSS over it */
+} HgfsBenchStats;
+
+typedef Bool (*HgfsBenchWorkloadFunc)(HgfsBenchStats *stats);
+
+typedef struct HgfsBenchWorkload {
+   const char *name;
+   HgfsBenchWorkloadFunc run;
+} HgfsBenchWorkload;
+
+typedef struct HgfsBenchCompound {
+   char *entries;                /* Entries and request packets */
+   size_t size;                  /* Size of the entries */
+   uint32 numEntries;
+} HgfsBenchCompound;
+
+typedef Bool (*HgfsBenchCheckFunc)(void);
+
+typedef struct HgfsBenchCheck {
+   const char *name;
+   HgfsBenchCheckFunc run;
+} HgfsBenchCheck;
+
+/*
+ * Packet slots of the connection. The workloads use the first one, the
+ * checks may have a request outstanding in each.
+ */
+#define HGFS_BENCH_SLOTS 8
+
+/*
+ * Reads of the compound workload, small enough for the room the server
+ * keeps for each reply of a compound request.
+ */
+#define HGFS_BENCH_COMPOUND_IO_SIZE 4096
+
+/*
+ * Directory of the list workload, by default with more entries than one
+ * getdents batch of the server holds. Run -w list -l 500000 to see the
+ * server list a very large directory.
+ */
+#define HGFS_BENCH_LIST_DIR      "list"
+#define HGFS_BENCH_LIST_ENTRIES  4096
+
+/*
+ * Handles of the lookup workload, opened over the files of the share. With
+ * --cached-nodes at least as large they all stay open in the server, and
+ * the requests on them measure finding the node of a handle among them.
+ */
+#define HGFS_BENCH_LOOKUP_HANDLES   10000
+#define HGFS_BENCH_LOOKUP_STRIDE    7919    /* Prime, visits every handle. */
+
+static HgfsLoopbackConn *gConn = NULL;
+static char *gBuffers[HGFS_BENCH_SLOTS];
+static char *gBuffer = NULL;
+static size_t gBufferSize = 0;
+static uint64 gSessionId = HGFS_INVALID_SESSION_ID;
+static uint32 gRequestId = 0;
+static char *gShareDir = NULL;
+
+/* Options. */
+static gint gNumFiles = 64;
+static gint gFileSize = 64 * 1024;
+static gint gIoSize = 32 * 1024;
+static gint gPasses = 8;
+static gint gNumThreads = 0;
+static gboolean gAsync = FALSE;
+static gboolean gScale = FALSE;
+static gint gWriteBehind = HGFS_DEFAULT_MAX_WRITE_BEHIND_BYTES;
+static gint gCachedNodes = HGFS_MAX_CACHED_FILENODES;
+static gint gListEntries = HGFS_BENCH_LIST_ENTRIES;
+static gchar *gParentDir = NULL;
+static gchar *gWorkloads = NULL;
+static gboolean gCheck = FALSE;
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchPayload --
+ *
+ *    Get the payload of the request packet, which follows the header.
+ *
+ * Results:
+ *    The payload.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void *
+HgfsBenchPayload(void)
+{
+   return gBuffer + sizeof (HgfsHeader);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchSlotPayload --
+ *
+ *    Get the payload of the request packet of a slot.
+ *
+ * Results:
+ *    The payload.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void *
+HgfsBenchSlotPayload(uint32 slot)   // IN: packet slot
+{
+   return gBuffers[slot] + sizeof (HgfsHeader);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchInitHeader --
+ *
+ *    Fill in a request header of the session.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsBenchInitHeader(HgfsHeader *header,    // OUT: request header
+                    HgfsOp op,             // IN: request op
+                    size_t payloadSize)    // IN: request payload size
+{
+   memset(header, 0, sizeof *header);
+   header->version = HGFS_HEADER_VERSION;
+   header->dummy = HGFS_OP_NEW_HEADER;
+   header->packetSize = sizeof *header + payloadSize;
+   header->headerSize = sizeof *header;
+   header->requestId = gRequestId++;
+   header->op = op;
+   header->flags = HGFS_PACKET_FLAG_REQUEST;
+   header->sessionId = gSessionId;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchPrepareHeader --
+ *
+ *    Fill in the header of the request whose payload is in the packet
+ *    buffer of a slot.
+ *
+ * Results:
+ *    The header.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsHeader *
+HgfsBenchPrepareHeader(uint32 slot,          // IN: packet slot
+                       HgfsOp op,            // IN: request op
+                       size_t payloadSize)   // IN: request payload size
+{
+   HgfsHeader *header = (HgfsHeader *)gBuffers[slot];
+
+   HgfsBenchInitHeader(header, op, payloadSize);
+   return header;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchSubmit --
+ *
+ *    Send the request whose payload is in the packet buffer of a slot,
+ *    without waiting for the reply.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsBenchSubmit(uint32 slot,          // IN: packet slot
+                HgfsOp op,            // IN: request op
+                size_t payloadSize)   // IN: request payload size
+{
+   HgfsHeader *header = HgfsBenchPrepareHeader(slot, op, payloadSize);
+
+   HgfsLoopback_Submit(gConn, slot, header->packetSize);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchWait --
+ *
+ *    Wait for the reply to the request submitted in a slot.
+ *
+ * Results:
+ *    The status of the reply, and the reply payload.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsStatus
+HgfsBenchWait(uint32 slot,           // IN: packet slot
+              const void **reply,    // OUT: reply payload, optional
+              size_t *replySize)     // OUT: reply payload size, optional
+{
+   const HgfsHeader *header = (const HgfsHeader *)gBuffers[slot];
+   size_t packetSize;
+
+   if (!HgfsLoopback_Wait(gConn, slot, &packetSize) ||
+       packetSize < sizeof *header) {
+      return HGFS_STATUS_PROTOCOL_ERROR;
+   }
+
+   if (NULL != reply) {
+      *reply = gBuffers[slot] + sizeof *header;
+      *replySize = packetSize - sizeof *header;
+   }
+   return header->status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchRecord --
+ *
+ *    Record the latency and status of a request in the workload statistics.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsBenchRecord(HgfsBenchStats *stats,    // IN/OUT: workload statistics
+                VmTimeType latencyNS,     // IN: request latency
+                HgfsStatus status)        // IN: reply status
+{
+   if (stats->numRequests == stats->maxLatencies) {
+      stats->maxLatencies = MAX(2 * stats->maxLatencies, 1024);
+      stats->latenciesNS = Util_SafeRealloc(stats->latenciesNS,
+                                            stats->maxLatencies *
+                                            sizeof *stats->latenciesNS);
+   }
+   stats->latenciesNS[stats->numRequests++] = latencyNS;
+   if (HGFS_STATUS_SUCCESS != status) {
+      stats->numErrors++;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchSend --
+ *
+ *    Send the request whose payload is in the packet buffer and record its
+ *    latency.
+ *
+ * Results:
+ *    The status of the reply, and the reply payload.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static HgfsStatus
+HgfsBenchSend(HgfsOp op,                  // IN: request op
+              size_t payloadSize,         // IN: request payload size
+              HgfsBenchStats *stats,      // IN/OUT: workload statistics
+              const void **reply,         // OUT: reply payload, optional
+              size_t *replySize)          // OUT: reply payload size, optional
+{
+   HgfsHeader *header = HgfsBenchPrepareHeader(0, op, payloadSize);
+   size_t packetSize;
+   VmTimeType startNS;
+   VmTimeType latencyNS;
+   HgfsStatus status;
+
+   startNS = Hostinfo_SystemTimerNS();
+   if (!HgfsLoopback_Dispatch(gConn, 0, header->packetSize, &packetSize) ||
+       packetSize < sizeof *header) {
+      status = HGFS_STATUS_PROTOCOL_ERROR;
+   } else {
+      status = header->status;
+   }
+   latencyNS = Hostinfo_SystemTimerNS() - startNS;
+
+   if (NULL != stats) {
+      HgfsBenchRecord(stats, latencyNS, status);
+   }
+
+   if (NULL != reply) {
+      *reply = gBuffer + sizeof *header;
+      *replySize = packetSize - sizeof *header;
+   }
+   return status;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchPackName --
+ *
+ *    Pack the name of a file of the share as the root share CPName.
+ *
+ * Results:
+ *    The size of the name on success, -1 if it does not fit.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+HgfsBenchPackName(HgfsFileNameV3 *fileName,   // OUT: name
+                  const char *fileBaseName,   // IN: file in the share, or NULL
+                  size_t nameSize)            // IN: room for the name
+{
+   char path[PATH_MAX];
+   int result;
+
+   Str_Sprintf(path, sizeof path, "/%s%s%s%s", HGFS_SERVER_POLICY_ROOT_SHARE_NAME,
+               gShareDir, fileBaseName != NULL ? "/" : "",
+               fileBaseName != NULL ? fileBaseName : "");
+
+   result = CPName_ConvertTo(path, nameSize, fileName->name);
+   if (result < 0) {
+      return -1;
+   }
+
+   fileName->length = result;
+   fileName->flags = 0;
+   fileName->caseType = HGFS_FILE_NAME_CASE_SENSITIVE;
+   fileName->fid = HGFS_INVALID_HANDLE;
+   return result;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchFileName --
+ *
+ *    Get the name of a file of the share.
+ *
+ * Results:
+ *    The name, in a static buffer.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static const char *
+HgfsBenchFileName(int index)   // IN: file index
+{
+   static char name[32];
+
+   Str_Sprintf(name, sizeof name, "file%06d", index);
+   return name;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchCreateSession --
+ *
+ *    Create the HGFS session used by the requests.
+ *
+ * Results:
+ *    TRUE on success, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsBenchCreateSession(void)
+{
+   HgfsRequestCreateSessionV4 *request = HgfsBenchPayload();
+   const HgfsReplyCreateSessionV4 *reply;
+   size_t replySize;
+
+   memset(request, 0, sizeof *request);
+   request->numCapabilities = 0;
+   request->maxPacketSize = HGFS_LARGE_PACKET_MAX;
+
+   if (HgfsBenchSend(HGFS_OP_CREATE_SESSION_V4, sizeof *request, NULL,
+                     (const void **)&reply, &replySize) != HGFS_STATUS_SUCCESS ||
+       replySize < offsetof(HgfsReplyCreateSessionV4, capabilities)) {
+      return FALSE;
+   }
+
+   gSessionId = reply->sessionId;
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchDestroySession --
+ *
+ *    Destroy the HGFS session.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsBenchDestroySession(void)
+{
+   HgfsRequestDestroySessionV4 *request = HgfsBenchPayload();
+
+   memset(request, 0, sizeof *request);
+   HgfsBenchSend(HGFS_OP_DESTROY_SESSION_V4, sizeof *request, NULL, NULL, NULL);
+   gSessionId = HGFS_INVALID_SESSION_ID;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchPackOpen --
+ *
+ *    Pack an open request of a file of the share in the packet buffer.
+ *
+ * Results:
+ *    The size of the request payload on success, -1 if it does not fit.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+HgfsBenchPackOpen(const char *fileBaseName,   // IN: file in the share
+                  HgfsOpenMode mode,          // IN: access mode
+                  HgfsOpenFlags flags)        // IN: open flags
+{
+   HgfsRequestOpenV3 *request = HgfsBenchPayload();
+   int nameSize;
+
+   memset(request, 0, sizeof *request);
+   request->mask = HGFS_OPEN_VALID_MODE | HGFS_OPEN_VALID_FLAGS |
+                   HGFS_OPEN_VALID_OWNER_PERMS | HGFS_OPEN_VALID_FILE_NAME;
+   request->mode = mode;
+   request->flags = flags;
+   request->ownerPerms = HGFS_PERM_READ | HGFS_PERM_WRITE;
+   request->desiredLock = HGFS_LOCK_NONE;
+
+   nameSize = HgfsBenchPackName(&request->fileName, fileBaseName,
+                                gBufferSize - sizeof (HgfsHeader) -
+                                sizeof *request);
+   return nameSize < 0 ? -1 : sizeof *request + nameSize;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchOpen --
+ *
+ *    Open a file of the share.
+ *
+ * Results:
+ *    TRUE and the handle on success, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsBenchOpen(const char *fileBaseName,   // IN: file in the share
+              HgfsOpenMode mode,          // IN: access mode
+              HgfsOpenFlags flags,        // IN: open flags
+              HgfsBenchStats *stats,      // IN/OUT: workload statistics
+              HgfsHandle *handle)         // OUT: file handle
+{
+   const HgfsReplyOpenV3 *reply;
+   size_t replySize;
+   int requestSize;
+
+   requestSize = HgfsBenchPackOpen(fileBaseName, mode, flags);
+   if (requestSize < 0 ||
+       HgfsBenchSend(HGFS_OP_OPEN_V3, requestSize, stats,
+                     (const void **)&reply, &replySize) != HGFS_STATUS_SUCCESS ||
+       replySize < sizeof *reply) {
+      return FALSE;
+   }
+
+   *handle = reply->file;
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchClose --
+ *
+ *    Close a file handle.
+ *
+ * Results:
+ *    TRUE on success, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsBenchClose(HgfsHandle handle,        // IN: file handle
+               HgfsBenchStats *stats)    // IN/OUT: workload statistics
+{
+   HgfsRequestCloseV3 *request = HgfsBenchPayload();
+
+   memset(request, 0, sizeof *request);
+   request->file = handle;
+
+   return HgfsBenchSend(HGFS_OP_CLOSE_V3, sizeof *request, stats,
+                        NULL, NULL) == HGFS_STATUS_SUCCESS;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchReadFile --
+ *
+ *    Read a whole file in requests of the I/O size.
+ *
+ * Results:
+ *    TRUE on success, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsBenchReadFile(HgfsHandle handle,        // IN: file handle
+                  HgfsBenchStats *stats)    // IN/OUT: workload statistics
+{
+   uint64 offset = 0;
+
+   while (offset < gFileSize) {
+      HgfsRequestReadV3 *request = HgfsBenchPayload();
+      const HgfsReplyReadV3 *reply;
+      size_t replySize;
+
+      memset(request, 0, sizeof *request);
+      request->file = handle;
+      request->offset = offset;
+      request->requiredSize = MIN(gIoSize, gFileSize - offset);
+
+      if (HgfsBenchSend(HGFS_OP_READ_V3, sizeof *request, stats,
+                        (const void **)&reply, &replySize) !=
+             HGFS_STATUS_SUCCESS ||
+          replySize < offsetof(HgfsReplyReadV3, payload) ||
+          0 == reply->actualSize) {
+         return FALSE;
+      }
+      offset += reply->actualSize;
+      stats->numBytes += reply->actualSize;
+   }
+
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchWriteFile --
+ *
+ *    Write a whole file in requests of the I/O size.
+ *
+ * Results:
+ *    TRUE on success, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsBenchWriteFile(HgfsHandle handle,        // IN: file handle
+                   HgfsBenchStats *stats)    // IN/OUT: workload statistics
+{
+   uint64 offset = 0;
+
+   while (offset < gFileSize) {
+      HgfsRequestWriteV3 *request = HgfsBenchPayload();
+      const HgfsReplyWriteV3 *reply;
+      size_t replySize;
+      uint32 writeSize = MIN(gIoSize, gFileSize - offset);
+
+      memset(request, 0, offsetof(HgfsRequestWriteV3, payload));
+      request->file = handle;
+      request->offset = offset;
+      request->requiredSize = writeSize;
+      memset(request->payload, 'h', writeSize);
+
+      if (HgfsBenchSend(HGFS_OP_WRITE_V3,
+                        offsetof(HgfsRequestWriteV3, payload) + writeSize,
+                        stats, (const void **)&reply, &replySize) !=
+             HGFS_STATUS_SUCCESS ||
+          replySize < sizeof *reply ||
+          0 == reply->actualSize) {
+         return FALSE;
+      }
+      offset += reply->actualSize;
+      stats->numBytes += reply->actualSize;
+   }
+
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchCompoundAdd --
+ *
+ *    Add a request to a compound request.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsBenchCompoundAdd(HgfsBenchCompound *compound,   // IN/OUT: compound request
+                     HgfsOp op,                     // IN: request op
+                     const void *payload,           // IN: request payload
+                     size_t payloadSize,            // IN: request payload size
+                     uint32 flags,                  // IN: HGFS_COMPOUND_FLAG_xxx
+                     uint32 handleOffset)           // IN: payload handle offset
+{
+   size_t packetSize = sizeof (HgfsHeader) + payloadSize;
+   HgfsCompoundEntryV4 *entry;
+
+   compound->entries = Util_SafeRealloc(compound->entries, compound->size +
+                                        sizeof *entry + packetSize);
+   entry = (HgfsCompoundEntryV4 *)(compound->entries + compound->size);
+   entry->flags = flags;
+   entry->handleOffset = handleOffset;
+   entry->packetSize = packetSize;
+   entry->reserved = 0;
+   HgfsBenchInitHeader((HgfsHeader *)(entry + 1), op, payloadSize);
+   memcpy((char *)(entry + 1) + sizeof (HgfsHeader), payload, payloadSize);
+
+   compound->size += sizeof *entry + packetSize;
+   compound->numEntries++;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchCompoundSetHandle --
+ *
+ *    Write the handle into the requests of a compound request from an
+ *    offset on which use the handle of the last open, as the server only
+ *    passes it on within one compound request.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsBenchCompoundSetHandle(HgfsBenchCompound *compound,   // IN/OUT: compound
+                           size_t offset,                 // IN: first entry
+                           HgfsHandle handle)             // IN: file handle
+{
+   while (offset < compound->size) {
+      HgfsCompoundEntryV4 *entry =
+         (HgfsCompoundEntryV4 *)(compound->entries + offset);
+
+      if (0 != (entry->flags & HGFS_COMPOUND_FLAG_USE_HANDLE)) {
+         memcpy((char *)(entry + 1) + sizeof (HgfsHeader) + entry->handleOffset,
+                &handle, sizeof handle);
+         entry->flags &= ~HGFS_COMPOUND_FLAG_USE_HANDLE;
+      }
+      offset += sizeof *entry + entry->packetSize;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchCompoundSend --
+ *
+ *    Send the requests of a compound request, as many as fit in one packet
+ *    at a time, and send again the requests the server did not run for
+ *    lack of room in the reply.
+ *
+ * Results:
+ *    TRUE if every request succeeded, FALSE otherwise. The handle of the
+ *    last open which was not closed, HGFS_INVALID_HANDLE if none.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsBenchCompoundSend(HgfsBenchCompound *compound,   // IN/OUT: compound request
+                      HgfsBenchStats *stats,         // IN/OUT: workload statistics
+                      HgfsHandle *handle)            // OUT: open file handle
+{
+   HgfsRequestCompoundV4 *request = HgfsBenchPayload();
+   size_t maxSize = gBufferSize - sizeof (HgfsHeader) -
+                    offsetof(HgfsRequestCompoundV4, requests);
+   size_t offset = 0;
+   uint32 numDone = 0;
+
+   *handle = HGFS_INVALID_HANDLE;
+
+   while (numDone < compound->numEntries) {
+      const HgfsReplyCompoundV4 *reply;
+      size_t replySize;
+      size_t replyOffset;
+      size_t size = 0;
+      uint32 numRequests = 0;
+      uint32 i;
+
+      while (numDone + numRequests < compound->numEntries) {
+         const HgfsCompoundEntryV4 *entry = (const HgfsCompoundEntryV4 *)
+            (compound->entries + offset + size);
+
+         if (size + sizeof *entry + entry->packetSize > maxSize) {
+            break;
+         }
+         size += sizeof *entry + entry->packetSize;
+         numRequests++;
+      }
+      if (0 == numRequests) {
+         return FALSE;
+      }
+
+      memset(request, 0, offsetof(HgfsRequestCompoundV4, requests));
+      request->numRequests = numRequests;
+      memcpy(request->requests, compound->entries + offset, size);
+
+      /*
+       * A successful reply without any reply to a request would have the
+       * same requests sent again forever.
+       */
+      if (HgfsBenchSend(HGFS_OP_COMPOUND_V4,
+                        offsetof(HgfsRequestCompoundV4, requests) + size,
+                        stats, (const void **)&reply, &replySize) !=
+             HGFS_STATUS_SUCCESS ||
+          replySize < offsetof(HgfsReplyCompoundV4, replies) ||
+          0 == reply->numReplies ||
+          reply->numReplies > numRequests) {
+         return FALSE;
+      }
+
+      replyOffset = offsetof(HgfsReplyCompoundV4, replies);
+      for (i = 0; i < reply->numReplies; i++) {
+         const HgfsCompoundEntryV4 *replyEntry = (const HgfsCompoundEntryV4 *)
+            ((const char *)reply + replyOffset);
+         const HgfsCompoundEntryV4 *entry = (const HgfsCompoundEntryV4 *)
+            (compound->entries + offset);
+         const HgfsHeader *header = (const HgfsHeader *)(replyEntry + 1);
+         const char *payload = (const char *)(header + 1);
+         size_t payloadSize;
+
+         if (replySize - replyOffset < sizeof *replyEntry ||
+             replySize - replyOffset - sizeof *replyEntry <
+                replyEntry->packetSize ||
+             replyEntry->packetSize < sizeof *header ||
+             HGFS_STATUS_SUCCESS != header->status) {
+            return FALSE;
+         }
+         payloadSize = replyEntry->packetSize - sizeof *header;
+
+         switch (header->op) {
+         case HGFS_OP_OPEN_V3:
+            if (payloadSize < sizeof (HgfsReplyOpenV3)) {
+               return FALSE;
+            }
+            *handle = ((const HgfsReplyOpenV3 *)payload)->file;
+            break;
+         case HGFS_OP_READ_V3: {
+               const HgfsReplyReadV3 *readReply =
+                  (const HgfsReplyReadV3 *)payload;
+
+               if (payloadSize < offsetof(HgfsReplyReadV3, payload) ||
+                   0 == readReply->actualSize) {
+                  return FALSE;
+               }
+               stats->numBytes += readReply->actualSize;
+            }
+            break;
+         case HGFS_OP_CLOSE_V3:
+            *handle = HGFS_INVALID_HANDLE;
+            break;
+         default:
+            break;
+         }
+
+         replyOffset += sizeof *replyEntry + replyEntry->packetSize;
+         offset += sizeof *entry + entry->packetSize;
+         numDone++;
+      }
+
+      if (HGFS_INVALID_HANDLE != *handle) {
+         HgfsBenchCompoundSetHandle(compound, offset, *handle);
+      }
+   }
+
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchReadAt --
+ *
+ *    Read from a file with one request.
+ *
+ * Results:
+ *    TRUE and the size read on success, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsBenchReadAt(HgfsHandle handle,     // IN: file handle
+                uint64 offset,         // IN: file offset
+                void *data,            // OUT: data read
+                uint32 size,           // IN: size to read
+                uint32 *actualSize)    // OUT: size read
+{
+   HgfsRequestReadV3 *request = HgfsBenchPayload();
+   const HgfsReplyReadV3 *reply;
+   size_t replySize;
+
+   memset(request, 0, sizeof *request);
+   request->file = handle;
+   request->offset = offset;
+   request->requiredSize = size;
+
+   if (HgfsBenchSend(HGFS_OP_READ_V3, sizeof *request, NULL,
+                     (const void **)&reply, &replySize) !=
+          HGFS_STATUS_SUCCESS ||
+       replySize < offsetof(HgfsReplyReadV3, payload) ||
+       reply->actualSize > size ||
+       replySize < offsetof(HgfsReplyReadV3, payload) + reply->actualSize) {
+      return FALSE;
+   }
+
+   memcpy(data, reply->payload, reply->actualSize);
+   *actualSize = reply->actualSize;
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchWriteAt --
+ *
+ *    Write to a file with one request.
+ *
+ * Results:
+ *    TRUE if all the data was written, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsBenchWriteAt(HgfsHandle handle,     // IN: file handle
+                 uint64 offset,         // IN: file offset
+                 const void *data,      // IN: data to write
+                 uint32 size)           // IN: size to write
+{
+   HgfsRequestWriteV3 *request = HgfsBenchPayload();
+   const HgfsReplyWriteV3 *reply;
+   size_t replySize;
+
+   memset(request, 0, offsetof(HgfsRequestWriteV3, payload));
+   request->file = handle;
+   request->offset = offset;
+   request->requiredSize = size;
+   memcpy(request->payload, data, size);
+
+   return HgfsBenchSend(HGFS_OP_WRITE_V3,
+                        offsetof(HgfsRequestWriteV3, payload) + size, NULL,
+                        (const void **)&reply, &replySize) ==
+             HGFS_STATUS_SUCCESS &&
+          replySize >= sizeof *reply &&
+          reply->actualSize == size;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchGetattr --
+ *
+ *    Get the attributes of a file of the share by name.
+ *
+ * Results:
+ *    TRUE on success, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsBenchGetattr(const char *fileBaseName,   // IN: file in the share
+                 HgfsBenchStats *stats)      // IN/OUT: workload statistics
+{
+   HgfsRequestGetattrV3 *request = HgfsBenchPayload();
+   int nameSize;
+
+   memset(request, 0, sizeof *request);
+   nameSize = HgfsBenchPackName(&request->fileName, fileBaseName,
+                                gBufferSize - sizeof (HgfsHeader) -
+                                sizeof *request);
+
+   return nameSize >= 0 &&
+          HgfsBenchSend(HGFS_OP_GETATTR_V3, sizeof *request + nameSize, stats,
+                        NULL, NULL) == HGFS_STATUS_SUCCESS;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchSearchDir --
+ *
+ *    List a directory of the share: open a search, read its entries one at
+ *    a time and close it.
+ *
+ * Results:
+ *    TRUE on success, FALSE otherwise, the number of entries read and the
+ *    time from the search open to the first entry.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsBenchSearchDir(const char *dirBaseName,  // IN: directory, NULL for the share
+                   HgfsBenchStats *stats,    // IN/OUT: workload statistics
+                   uint32 *numEntries,       // OUT: entries read, optional
+                   VmTimeType *firstEntryNS) // OUT: open to first entry, optional
+{
+   HgfsRequestSearchOpenV3 *openRequest = HgfsBenchPayload();
+   const HgfsReplySearchOpenV3 *openReply;
+   size_t replySize;
+   HgfsHandle search;
+   VmTimeType startNS = Hostinfo_SystemTimerNS();
+   uint32 offset;
+   int nameSize;
+   Bool success = TRUE;
+
+   memset(openRequest, 0, sizeof *openRequest);
+   nameSize = HgfsBenchPackName(&openRequest->dirName, dirBaseName,
+                                gBufferSize - sizeof (HgfsHeader) -
+                                sizeof *openRequest);
+   if (nameSize < 0 ||
+       HgfsBenchSend(HGFS_OP_SEARCH_OPEN_V3, sizeof *openRequest + nameSize,
+                     stats, (const void **)&openReply, &replySize) !=
+          HGFS_STATUS_SUCCESS ||
+       replySize < sizeof *openReply) {
+      return FALSE;
+   }
+   search = openReply->search;
+
+   for (offset = 0; ; offset++) {
+      HgfsRequestSearchReadV3 *readRequest = HgfsBenchPayload();
+      const HgfsReplySearchReadV3 *readReply;
+
+      memset(readRequest, 0, sizeof *readRequest);
+      readRequest->search = search;
+      readRequest->offset = offset;
+
+      if (HgfsBenchSend(HGFS_OP_SEARCH_READ_V3, sizeof *readRequest, stats,
+                        (const void **)&readReply, &replySize) !=
+             HGFS_STATUS_SUCCESS ||
+          replySize < offsetof(HgfsReplySearchReadV3, payload)) {
+         success = FALSE;
+         break;
+      }
+      if (0 == offset && NULL != firstEntryNS) {
+         *firstEntryNS = Hostinfo_SystemTimerNS() - startNS;
+      }
+      /* The end of the directory is a record without a name. */
+      if (0 == readReply->count ||
+          0 == ((const HgfsDirEntry *)readReply->payload)->fileName.length) {
+         break;
+      }
+   }
+   if (NULL != numEntries) {
+      *numEntries = offset;
+   }
+
+   {
+      HgfsRequestSearchCloseV3 *closeRequest = HgfsBenchPayload();
+
+      memset(closeRequest, 0, sizeof *closeRequest);
+      closeRequest->search = search;
+      if (HgfsBenchSend(HGFS_OP_SEARCH_CLOSE_V3, sizeof *closeRequest, stats,
+                        NULL, NULL) != HGFS_STATUS_SUCCESS) {
+         success = FALSE;
+      }
+   }
+
+   return success;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchListPath --
+ *
+ *    Get the local path of the list directory or of one of its entries.
+ *
+ * Results:
+ *    The path, to be freed by the caller.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static char *
+HgfsBenchListPath(int index)   // IN: entry index, -1 for the directory
+{
+   if (index < 0) {
+      return Str_SafeAsprintf(NULL, "%s/%s", gShareDir, HGFS_BENCH_LIST_DIR);
+   }
+   return Str_SafeAsprintf(NULL, "%s/%s/entry%06d", gShareDir,
+                           HGFS_BENCH_LIST_DIR, index);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchMakeListDir --
+ *
+ *    Create the list directory and its empty files locally, if not done
+ *    yet. Its entries are only listed, creating them through the server
+ *    would not measure anything the create workload does not.
+ *
+ * Results:
+ *    TRUE on success, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsBenchMakeListDir(void)
+{
+   static Bool made = FALSE;
+   char *path;
+   int i;
+
+   if (made) {
+      return TRUE;
+   }
+
+   path = HgfsBenchListPath(-1);
+   if (mkdir(path, 0700) != 0) {
+      fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+      free(path);
+      return FALSE;
+   }
+   free(path);
+
+   for (i = 0; i < gListEntries; i++) {
+      int fd;
+
+      path = HgfsBenchListPath(i);
+      fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+      if (fd < 0) {
+         fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+         free(path);
+         return FALSE;
+      }
+      close(fd);
+      free(path);
+   }
+
+   made = TRUE;
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Workloads --
+ *
+ *    Each workload runs its requests over all the files of the share.
+ *
+ * Results:
+ *    TRUE on success, FALSE if a request failed.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsBenchCreate(HgfsBenchStats *stats)    // IN/OUT: workload statistics
+{
+   int i;
+
+   for (i = 0; i < gNumFiles; i++) {
+      HgfsHandle handle;
+
+      if (!HgfsBenchOpen(HgfsBenchFileName(i), HGFS_OPEN_MODE_WRITE_ONLY,
+                         HGFS_OPEN_CREATE_EMPTY, stats, &handle)) {
+         return FALSE;
+      }
+      if (!HgfsBenchWriteFile(handle, stats) ||
+          !HgfsBenchClose(handle, stats)) {
+         return FALSE;
+      }
+   }
+   return TRUE;
+}
+
+
+static Bool
+HgfsBenchOpenClose(HgfsBenchStats *stats)    // IN/OUT: workload statistics
+{
+   int pass;
+   int i;
+
+   for (pass = 0; pass < gPasses; pass++) {
+      for (i = 0; i < gNumFiles; i++) {
+         HgfsHandle handle;
+
+         if (!HgfsBenchOpen(HgfsBenchFileName(i), HGFS_OPEN_MODE_READ_ONLY,
+                            HGFS_OPEN, stats, &handle) ||
+             !HgfsBenchClose(handle, stats)) {
+            return FALSE;
+         }
+      }
+   }
+   return TRUE;
+}
+
+
+static Bool
+HgfsBenchGetattrAll(HgfsBenchStats *stats)    // IN/OUT: workload statistics
+{
+   int pass;
+   int i;
+
+   for (pass = 0; pass < gPasses; pass++) {
+      for (i = 0; i < gNumFiles; i++) {
+         if (!HgfsBenchGetattr(HgfsBenchFileName(i), stats)) {
+            return FALSE;
+         }
+      }
+   }
+   return TRUE;
+}
+
+
+static Bool
+HgfsBenchRead(HgfsBenchStats *stats)    // IN/OUT: workload statistics
+{
+   int pass;
+   int i;
+
+   for (pass = 0; pass < gPasses; pass++) {
+      for (i = 0; i < gNumFiles; i++) {
+         HgfsHandle handle;
+         Bool success;
+
+         if (!HgfsBenchOpen(HgfsBenchFileName(i), HGFS_OPEN_MODE_READ_ONLY,
+                            HGFS_OPEN, NULL, &handle)) {
+            return FALSE;
+         }
+         success = HgfsBenchReadFile(handle, stats);
+         if (!HgfsBenchClose(handle, NULL) || !success) {
+            return FALSE;
+         }
+      }
+   }
+   return TRUE;
+}
+
+
+static Bool
+HgfsBenchWrite(HgfsBenchStats *stats)    // IN/OUT: workload statistics
+{
+   int pass;
+   int i;
+
+   for (pass = 0; pass < gPasses; pass++) {
+      for (i = 0; i < gNumFiles; i++) {
+         HgfsHandle handle;
+         Bool success;
+
+         if (!HgfsBenchOpen(HgfsBenchFileName(i), HGFS_OPEN_MODE_WRITE_ONLY,
+                            HGFS_OPEN, NULL, &handle)) {
+            return FALSE;
+         }
+         success = HgfsBenchWriteFile(handle, stats);
+         if (!HgfsBenchClose(handle, NULL) || !success) {
+            return FALSE;
+         }
+      }
+   }
+   return TRUE;
+}
+
+
+static Bool
+HgfsBenchSearch(HgfsBenchStats *stats)    // IN/OUT: workload statistics
+{
+   int pass;
+
+   for (pass = 0; pass < gPasses; pass++) {
+      if (!HgfsBenchSearchDir(NULL, stats, NULL, NULL)) {
+         return FALSE;
+      }
+   }
+   return TRUE;
+}
+
+
+static Bool
+HgfsBenchList(HgfsBenchStats *stats)    // IN/OUT: workload statistics
+{
+   VmTimeType startNS = Hostinfo_SystemTimerNS();
+   struct rusage usage;
+   int pass;
+
+   /*
+    * A first listing, whose requests are not recorded, gives the time to
+    * the first entry and the growth of the peak RSS while the server lists
+    * the directory: nothing else allocates meanwhile. The growth only
+    * shows once the peak is past that of the workloads run before, run
+    * -w list alone to compare servers.
+    */
+   if (!HgfsBenchMakeListDir() ||
+       getrusage(RUSAGE_SELF, &usage) != 0) {
+      return FALSE;
+   }
+   stats->rssGrowthKB = -usage.ru_maxrss;
+   if (!HgfsBenchSearchDir(HGFS_BENCH_LIST_DIR, NULL, NULL,
+                           &stats->firstEntryNS) ||
+       getrusage(RUSAGE_SELF, &usage) != 0) {
+      return FALSE;
+   }
+   stats->maxRssKB = usage.ru_maxrss;
+   stats->rssGrowthKB += usage.ru_maxrss;
+   stats->elapsedNS = startNS - Hostinfo_SystemTimerNS();
+
+   for (pass = 0; pass < gPasses; pass++) {
+      if (!HgfsBenchSearchDir(HGFS_BENCH_LIST_DIR, stats, NULL, NULL)) {
+         return FALSE;
+      }
+   }
+   return TRUE;
+}
+
+
+static Bool
+HgfsBenchMix(HgfsBenchStats *stats)    // IN/OUT: workload statistics
+{
+   int pass;
+   int i;
+
+   /* What a small file reader does: open, stat, read it all and close. */
+   for (pass = 0; pass < gPasses; pass++) {
+      for (i = 0; i < gNumFiles; i++) {
+         HgfsHandle handle;
+         Bool success;
+
+         if (!HgfsBenchOpen(HgfsBenchFileName(i), HGFS_OPEN_MODE_READ_ONLY,
+                            HGFS_OPEN, stats, &handle)) {
+            return FALSE;
+         }
+         success = HgfsBenchGetattr(HgfsBenchFileName(i), stats) &&
+                   HgfsBenchReadFile(handle, stats);
+         if (!HgfsBenchClose(handle, stats) || !success) {
+            return FALSE;
+         }
+      }
+   }
+   return TRUE;
+}
+
+
+static Bool
+HgfsBenchCompoundRead(HgfsBenchStats *stats)    // IN/OUT: workload statistics
+{
+   int pass;
+   int i;
+
+   /*
+    * The open, reads and close of a file in compound requests. The reads
+    * of a file do not all fit in one reply, so the server replies to part
+    * of the requests and the rest are sent again.
+    */
+   for (pass = 0; pass < gPasses; pass++) {
+      for (i = 0; i < gNumFiles; i++) {
+         HgfsBenchCompound compound = { NULL, 0, 0 };
+         HgfsRequestReadV3 readRequest;
+         HgfsRequestCloseV3 closeRequest;
+         HgfsHandle handle;
+         uint64 offset;
+         int requestSize;
+         Bool success;
+
+         requestSize = HgfsBenchPackOpen(HgfsBenchFileName(i),
+                                         HGFS_OPEN_MODE_READ_ONLY, HGFS_OPEN);
+         if (requestSize < 0) {
+            return FALSE;
+         }
+         HgfsBenchCompoundAdd(&compound, HGFS_OP_OPEN_V3, HgfsBenchPayload(),
+                              requestSize, 0, 0);
+
+         for (offset = 0; offset < gFileSize;
+              offset += HGFS_BENCH_COMPOUND_IO_SIZE) {
+            memset(&readRequest, 0, sizeof readRequest);
+            readRequest.offset = offset;
+            readRequest.requiredSize = MIN(HGFS_BENCH_COMPOUND_IO_SIZE,
+                                           gFileSize - offset);
+            HgfsBenchCompoundAdd(&compound, HGFS_OP_READ_V3, &readRequest,
+                                 sizeof readRequest,
+                                 HGFS_COMPOUND_FLAG_USE_HANDLE,
+                                 offsetof(HgfsRequestReadV3, file));
+         }
+
+         memset(&closeRequest, 0, sizeof closeRequest);
+         HgfsBenchCompoundAdd(&compound, HGFS_OP_CLOSE_V3, &closeRequest,
+                              sizeof closeRequest,
+                              HGFS_COMPOUND_FLAG_USE_HANDLE,
+                              offsetof(HgfsRequestCloseV3, file));
+
+         success = HgfsBenchCompoundSend(&compound, stats, &handle);
+         free(compound.entries);
+         if (HGFS_INVALID_HANDLE != handle) {
+            HgfsBenchClose(handle, NULL);
+            success = FALSE;
+         }
+         if (!success) {
+            return FALSE;
+         }
+      }
+   }
+   return TRUE;
+}
+
+
+static Bool
+HgfsBenchParallelRead(HgfsBenchStats *stats)    // IN/OUT: workload statistics
+{
+   HgfsHandle *handles = Util_SafeCalloc(gNumFiles, sizeof *handles);
+   VmTimeType startNS[HGFS_BENCH_SLOTS];
+   Bool success = TRUE;
+   int numOpen;
+   int pass;
+   int i;
+
+   /*
+    * Reads of the open files with a request outstanding in every slot, each
+    * on another file, so that with --async the worker threads serve them
+    * together. The files stay open and the reads hit the node cache: this
+    * is how the per-read path scales with the worker threads, see --scale.
+    */
+   for (numOpen = 0; numOpen < gNumFiles; numOpen++) {
+      if (!HgfsBenchOpen(HgfsBenchFileName(numOpen), HGFS_OPEN_MODE_READ_ONLY,
+                         HGFS_OPEN, NULL, &handles[numOpen])) {
+         success = FALSE;
+         break;
+      }
+   }
+
+   for (pass = 0; pass < gPasses && success; pass++) {
+      for (i = 0; i < numOpen && success; i += HGFS_BENCH_SLOTS) {
+         uint32 numSlots = MIN(HGFS_BENCH_SLOTS, numOpen - i);
+         uint64 offset;
+
+         for (offset = 0; offset < gFileSize && success; offset += gIoSize) {
+            uint32 slot;
+
+            for (slot = 0; slot < numSlots; slot++) {
+               HgfsRequestReadV3 *request = HgfsBenchSlotPayload(slot);
+
+               memset(request, 0, sizeof *request);
+               request->file = handles[i + slot];
+               request->offset = offset;
+               request->requiredSize = MIN(gIoSize, gFileSize - offset);
+               startNS[slot] = Hostinfo_SystemTimerNS();
+               HgfsBenchSubmit(slot, HGFS_OP_READ_V3, sizeof *request);
+            }
+
+            for (slot = 0; slot < numSlots; slot++) {
+               const HgfsReplyReadV3 *reply;
+               size_t replySize;
+               HgfsStatus status;
+
+               status = HgfsBenchWait(slot, (const void **)&reply, &replySize);
+               HgfsBenchRecord(stats, Hostinfo_SystemTimerNS() - startNS[slot],
+                               status);
+               if (HGFS_STATUS_SUCCESS != status ||
+                   replySize < offsetof(HgfsReplyReadV3, payload) ||
+                   0 == reply->actualSize) {
+                  success = FALSE;
+               } else {
+                  stats->numBytes += reply->actualSize;
+               }
+            }
+         }
+      }
+   }
+
+   for (i = 0; i < numOpen; i++) {
+      if (!HgfsBenchClose(handles[i], NULL)) {
+         success = FALSE;
+      }
+   }
+   free(handles);
+   return success;
+}
+
+
+static Bool
+HgfsBenchLookup(HgfsBenchStats *stats)    // IN/OUT: workload statistics
+{
+   HgfsHandle *handles = Util_SafeCalloc(HGFS_BENCH_LOOKUP_HANDLES,
+                                         sizeof *handles);
+   Bool success = TRUE;
+   int numOpen;
+   int pass;
+   int i;
+
+   /*
+    * Getattr by handle, which finds the node of the handle and then the
+    * node of its file descriptor, over many open handles visited out of
+    * order.
+    */
+   for (numOpen = 0; numOpen < HGFS_BENCH_LOOKUP_HANDLES; numOpen++) {
+      if (!HgfsBenchOpen(HgfsBenchFileName(numOpen % gNumFiles),
+                         HGFS_OPEN_MODE_READ_ONLY, HGFS_OPEN, NULL,
+                         &handles[numOpen])) {
+         success = FALSE;
+         break;
+      }
+   }
+
+   for (pass = 0; pass < gPasses && success; pass++) {
+      int index = 0;
+
+      for (i = 0; i < numOpen && success; i++) {
+         HgfsRequestGetattrV3 *request = HgfsBenchPayload();
+
+         index = (index + HGFS_BENCH_LOOKUP_STRIDE) % numOpen;
+         memset(request, 0, sizeof *request);
+         request->hints = HGFS_ATTR_HINT_USE_FILE_DESC;
+         request->fileName.flags = HGFS_FILE_NAME_USE_FILE_DESC;
+         request->fileName.fid = handles[index];
+         success = HgfsBenchSend(HGFS_OP_GETATTR_V3, sizeof *request, stats,
+                                 NULL, NULL) == HGFS_STATUS_SUCCESS;
+      }
+   }
+
+   for (i = 0; i < numOpen; i++) {
+      if (!HgfsBenchClose(handles[i], NULL)) {
+         success = FALSE;
+      }
+   }
+   free(handles);
+   return success;
+}
+
+
+static const HgfsBenchWorkload gHgfsBenchWorkloads[] = {
+   { "create",  HgfsBenchCreate },
+   { "open",    HgfsBenchOpenClose },
+   { "getattr", HgfsBenchGetattrAll },
+   { "read",    HgfsBenchRead },
+   { "write",   HgfsBenchWrite },
+   { "search",  HgfsBenchSearch },
+   { "list",    HgfsBenchList },
+   { "mix",     HgfsBenchMix },
+   { "compound", HgfsBenchCompoundRead },
+   { "parallel", HgfsBenchParallelRead },
+   { "lookup",  HgfsBenchLookup },
+};
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchCheckPath --
+ *
+ *    Get the local path of a file created by a check.
+ *
+ * Results:
+ *    The path, to be freed by the caller.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static char *
+HgfsBenchCheckPath(const char *fileBaseName)   // IN: file in the share
+{
+   return Str_SafeAsprintf(NULL, "%s/%s", gShareDir, fileBaseName);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchCheckFileName --
+ *
+ *    Get the name of a file created by a check, distinct from the files
+ *    of the workloads.
+ *
+ * Results:
+ *    The name, in a static buffer.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static const char *
+HgfsBenchCheckFileName(int index)   // IN: file index
+{
+   static char name[32];
+
+   Str_Sprintf(name, sizeof name, "check%06d", index);
+   return name;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchCheckReadValue --
+ *
+ *    Read the value a check wrote at the start of a file.
+ *
+ * Results:
+ *    TRUE if the file holds the value, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsBenchCheckReadValue(HgfsHandle handle,   // IN: file handle
+                        uint32 value)        // IN: expected value
+{
+   uint32 data;
+   uint32 actualSize;
+
+   return HgfsBenchReadAt(handle, 0, &data, sizeof data, &actualSize) &&
+          actualSize == sizeof data &&
+          data == value;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * Checks --
+ *
+ *    Each check runs requests against files of its own and verifies the
+ *    replies.
+ *
+ * Results:
+ *    TRUE if the check passed, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+/*
+ * More handles than the initial node array and the open node cache hold,
+ * so the handle and file descriptor indices are rebuilt as the node array
+ * grows and nodes are closed and reopened behind their handles.
+ */
+#define HGFS_BENCH_CHECK_HANDLES 1000
+
+static Bool
+HgfsBenchCheckHandles(void)
+{
+   HgfsHandle *handles = Util_SafeCalloc(HGFS_BENCH_CHECK_HANDLES,
+                                         sizeof *handles);
+   Bool success = TRUE;
+   uint32 data;
+   uint32 actualSize;
+   int numOpen;
+   int i;
+
+   for (numOpen = 0;
+        numOpen < HGFS_BENCH_CHECK_HANDLES && success;
+        numOpen++) {
+      uint32 value = numOpen;
+
+      success = HgfsBenchOpen(HgfsBenchCheckFileName(numOpen),
+                              HGFS_OPEN_MODE_READ_WRITE,
+                              HGFS_OPEN_CREATE_EMPTY, NULL,
+                              &handles[numOpen]) &&
+                HgfsBenchWriteAt(handles[numOpen], 0, &value, sizeof value);
+   }
+
+   /* Every handle still reaches its own file, in any order. */
+   for (i = numOpen - 1; i >= 0 && success; i--) {
+      success = HgfsBenchCheckReadValue(handles[i], i);
+   }
+
+   /* Closed handles fail, the others are not disturbed. */
+   for (i = 1; i < numOpen && success; i += 2) {
+      success = HgfsBenchClose(handles[i], NULL);
+   }
+   for (i = 0; i < numOpen && success; i++) {
+      success = i % 2 == 0 ? HgfsBenchCheckReadValue(handles[i], i)
+                           : !HgfsBenchReadAt(handles[i], 0, &data,
+                                              sizeof data, &actualSize);
+   }
+
+   /* Reopened files get working handles from the freed nodes. */
+   for (i = 1; i < numOpen && success; i += 2) {
+      success = HgfsBenchOpen(HgfsBenchCheckFileName(i),
+                              HGFS_OPEN_MODE_READ_ONLY, HGFS_OPEN, NULL,
+                              &handles[i]) &&
+                HgfsBenchCheckReadValue(handles[i], i);
+   }
+
+   for (i = 0; i < numOpen; i++) {
+      char *path = HgfsBenchCheckPath(HgfsBenchCheckFileName(i));
+
+      if (success || i % 2 == 0) {
+         HgfsBenchClose(handles[i], NULL);
+      }
+      unlink(path);
+      free(path);
+   }
+   free(handles);
+   return success;
+}
+
+
+/*
+ * Requests on different files of one session outstanding together, which
+ * the worker threads of an asynchronous connection run concurrently:
+ * reads and writes through handles, getattrs by name and opens take the
+ * node array lock shared or exclusive, search reads the search array lock.
+ */
+#define HGFS_BENCH_CHECK_CONCURRENT_ROUNDS 500
+
+static Bool
+HgfsBenchCheckConcurrent(void)
+{
+   HgfsHandle handles[HGFS_BENCH_SLOTS];
+   HgfsHandle opened[HGFS_BENCH_SLOTS];
+   HgfsHandle search = HGFS_INVALID_HANDLE;
+   Bool success = TRUE;
+   uint32 numOpen;
+   uint32 round;
+   uint32 slot;
+
+   for (numOpen = 0; numOpen < HGFS_BENCH_SLOTS && success; numOpen++) {
+      uint32 value = numOpen;
+
+      success = HgfsBenchOpen(HgfsBenchCheckFileName(numOpen),
+                              HGFS_OPEN_MODE_READ_WRITE,
+                              HGFS_OPEN_CREATE_EMPTY, NULL,
+                              &handles[numOpen]) &&
+                HgfsBenchWriteAt(handles[numOpen], 0, &value, sizeof value);
+   }
+
+   if (success) {
+      HgfsRequestSearchOpenV3 *request = HgfsBenchPayload();
+      const HgfsReplySearchOpenV3 *reply;
+      size_t replySize;
+      int nameSize;
+
+      memset(request, 0, sizeof *request);
+      nameSize = HgfsBenchPackName(&request->dirName, NULL,
+                                   gBufferSize - sizeof (HgfsHeader) -
+                                   sizeof *request);
+      success = nameSize >= 0 &&
+                HgfsBenchSend(HGFS_OP_SEARCH_OPEN_V3,
+                              sizeof *request + nameSize, NULL,
+                              (const void **)&reply, &replySize) ==
+                   HGFS_STATUS_SUCCESS &&
+                replySize >= sizeof *reply;
+      if (success) {
+         search = reply->search;
+      }
+   }
+
+   for (round = 0;
+        round < HGFS_BENCH_CHECK_CONCURRENT_ROUNDS && success;
+        round++) {
+      /* Slot 0 lists the directory, the others work on their own file. */
+      for (slot = 0; slot < HGFS_BENCH_SLOTS; slot++) {
+         uint32 kind = (round + slot) % 4;
+
+         opened[slot] = HGFS_INVALID_HANDLE;
+         if (0 == slot) {
+            HgfsRequestSearchReadV3 *request = HgfsBenchSlotPayload(slot);
+
+            memset(request, 0, sizeof *request);
+            request->search = search;
+            request->offset = round % (HGFS_BENCH_SLOTS + 2);
+            HgfsBenchSubmit(slot, HGFS_OP_SEARCH_READ_V3, sizeof *request);
+         } else if (0 == kind) {
+            HgfsRequestReadV3 *request = HgfsBenchSlotPayload(slot);
+
+            memset(request, 0, sizeof *request);
+            request->file = handles[slot];
+            request->requiredSize = sizeof (uint32);
+            HgfsBenchSubmit(slot, HGFS_OP_READ_V3, sizeof *request);
+         } else if (1 == kind) {
+            HgfsRequestWriteV3 *request = HgfsBenchSlotPayload(slot);
+
+            memset(request, 0, offsetof(HgfsRequestWriteV3, payload));
+            request->file = handles[slot];
+            request->requiredSize = sizeof slot;
+            memcpy(request->payload, &slot, sizeof slot);
+            HgfsBenchSubmit(slot, HGFS_OP_WRITE_V3,
+                            offsetof(HgfsRequestWriteV3, payload) +
+                            sizeof slot);
+         } else if (2 == kind) {
+            HgfsRequestGetattrV3 *request = HgfsBenchSlotPayload(slot);
+            int nameSize;
+
+            memset(request, 0, sizeof *request);
+            nameSize = HgfsBenchPackName(&request->fileName,
+                                         HgfsBenchCheckFileName(slot),
+                                         gBufferSize - sizeof (HgfsHeader) -
+                                         sizeof *request);
+            HgfsBenchSubmit(slot, HGFS_OP_GETATTR_V3,
+                            sizeof *request + MAX(nameSize, 0));
+         } else {
+            HgfsRequestOpenV3 *request = HgfsBenchSlotPayload(slot);
+            int nameSize;
+
+            memset(request, 0, sizeof *request);
+            request->mask = HGFS_OPEN_VALID_MODE | HGFS_OPEN_VALID_FLAGS |
+                            HGFS_OPEN_VALID_FILE_NAME;
+            request->mode = HGFS_OPEN_MODE_READ_ONLY;
+            request->flags = HGFS_OPEN;
+            nameSize = HgfsBenchPackName(&request->fileName,
+                                         HgfsBenchCheckFileName(slot),
+                                         gBufferSize - sizeof (HgfsHeader) -
+                                         sizeof *request);
+            HgfsBenchSubmit(slot, HGFS_OP_OPEN_V3,
+                            sizeof *request + MAX(nameSize, 0));
+         }
+      }
+
+      for (slot = 0; slot < HGFS_BENCH_SLOTS; slot++) {
+         uint32 kind = (round + slot) % 4;
+         const void *reply;
+         size_t replySize;
+
+         if (HgfsBenchWait(slot, &reply, &replySize) != HGFS_STATUS_SUCCESS) {
+            success = FALSE;
+         } else if (0 != slot && 0 == kind) {
+            const HgfsReplyReadV3 *readReply = reply;
+
+            success = success &&
+                      replySize >= offsetof(HgfsReplyReadV3, payload) +
+                                   sizeof slot &&
+                      readReply->actualSize == sizeof slot &&
+                      memcmp(readReply->payload, &slot, sizeof slot) == 0;
+         } else if (0 != slot && 3 == kind) {
+            const HgfsReplyOpenV3 *openReply = reply;
+
+            if (replySize >= sizeof *openReply) {
+               opened[slot] = openReply->file;
+            } else {
+               success = FALSE;
+            }
+         }
+      }
+
+      for (slot = 0; slot < HGFS_BENCH_SLOTS; slot++) {
+         if (HGFS_INVALID_HANDLE != opened[slot]) {
+            success = HgfsBenchCheckReadValue(opened[slot], slot) &&
+                      HgfsBenchClose(opened[slot], NULL) && success;
+         }
+      }
+   }
+
+   if (HGFS_INVALID_HANDLE != search) {
+      HgfsRequestSearchCloseV3 *request = HgfsBenchPayload();
+
+      memset(request, 0, sizeof *request);
+      request->search = search;
+      success = HgfsBenchSend(HGFS_OP_SEARCH_CLOSE_V3, sizeof *request, NULL,
+                              NULL, NULL) == HGFS_STATUS_SUCCESS && success;
+   }
+
+   for (slot = 0; slot < numOpen; slot++) {
+      char *path = HgfsBenchCheckPath(HgfsBenchCheckFileName(slot));
+
+      HgfsBenchClose(handles[slot], NULL);
+      unlink(path);
+      free(path);
+   }
+   return success;
+}
+
+
+/*
+ * Reads and writes outstanding together on more handles than the open node
+ * cache holds, even once the server grew it to its bound of 1024 nodes.
+ * With --async and worker threads, a request reopening its file makes room
+ * in the cache while requests of other handles read and write theirs:
+ * every read must still return the data of its own file.
+ */
+#define HGFS_BENCH_CHECK_EVICTION_HANDLES  1200
+#define HGFS_BENCH_CHECK_EVICTION_ROUNDS   2000
+#define HGFS_BENCH_CHECK_EVICTION_IO_SIZE  (16 * 1024)
+
+static Bool
+HgfsBenchCheckEviction(void)
+{
+   HgfsHandle handles[HGFS_BENCH_CHECK_EVICTION_HANDLES];
+   uint32 *data = Util_SafeMalloc(HGFS_BENCH_CHECK_EVICTION_IO_SIZE);
+   uint32 numWords = HGFS_BENCH_CHECK_EVICTION_IO_SIZE / sizeof *data;
+   Bool success = TRUE;
+   uint32 numOpen;
+   uint32 round;
+   uint32 slot;
+   uint32 i;
+
+   for (numOpen = 0;
+        numOpen < HGFS_BENCH_CHECK_EVICTION_HANDLES && success;
+        numOpen++) {
+      for (i = 0; i < numWords; i++) {
+         data[i] = numOpen;
+      }
+      success = HgfsBenchOpen(HgfsBenchCheckFileName(numOpen),
+                              HGFS_OPEN_MODE_READ_WRITE,
+                              HGFS_OPEN_CREATE_EMPTY, NULL,
+                              &handles[numOpen]) &&
+                HgfsBenchWriteAt(handles[numOpen], 0, data,
+                                 HGFS_BENCH_CHECK_EVICTION_IO_SIZE);
+   }
+
+   for (round = 0;
+        round < HGFS_BENCH_CHECK_EVICTION_ROUNDS && success;
+        round++) {
+      /* Slots go over the handles in strides, so most reopen their file. */
+      for (slot = 0; slot < HGFS_BENCH_SLOTS; slot++) {
+         uint32 file = (round * HGFS_BENCH_SLOTS + slot * 17) % numOpen;
+
+         if (slot % 2 == 0) {
+            HgfsRequestReadV3 *request = HgfsBenchSlotPayload(slot);
+
+            memset(request, 0, sizeof *request);
+            request->file = handles[file];
+            request->requiredSize = HGFS_BENCH_CHECK_EVICTION_IO_SIZE;
+            HgfsBenchSubmit(slot, HGFS_OP_READ_V3, sizeof *request);
+         } else {
+            HgfsRequestWriteV3 *request = HgfsBenchSlotPayload(slot);
+            uint32 *payload = (uint32 *)request->payload;
+
+            memset(request, 0, offsetof(HgfsRequestWriteV3, payload));
+            request->file = handles[file];
+            request->requiredSize = HGFS_BENCH_CHECK_EVICTION_IO_SIZE;
+            for (i = 0; i < numWords; i++) {
+               payload[i] = file;
+            }
+            HgfsBenchSubmit(slot, HGFS_OP_WRITE_V3,
+                            offsetof(HgfsRequestWriteV3, payload) +
+                            HGFS_BENCH_CHECK_EVICTION_IO_SIZE);
+         }
+      }
+
+      for (slot = 0; slot < HGFS_BENCH_SLOTS; slot++) {
+         uint32 file = (round * HGFS_BENCH_SLOTS + slot * 17) % numOpen;
+         const HgfsReplyReadV3 *reply;
+         size_t replySize;
+
+         if (HgfsBenchWait(slot, (const void **)&reply, &replySize) !=
+             HGFS_STATUS_SUCCESS) {
+            success = FALSE;
+         } else if (slot % 2 == 0) {
+            const uint32 *payload = (const uint32 *)reply->payload;
+
+            if (replySize < offsetof(HgfsReplyReadV3, payload) +
+                            HGFS_BENCH_CHECK_EVICTION_IO_SIZE ||
+                reply->actualSize != HGFS_BENCH_CHECK_EVICTION_IO_SIZE) {
+               success = FALSE;
+            }
+            for (i = 0; i < numWords && success; i++) {
+               success = payload[i] == file;
+            }
+         }
+      }
+   }
+
+   for (i = 0; i < numOpen; i++) {
+      char *path = HgfsBenchCheckPath(HgfsBenchCheckFileName(i));
+
+      HgfsBenchClose(handles[i], NULL);
+      unlink(path);
+      free(path);
+   }
+   free(data);
+   return success;
+}
+
+
+/*
+ * Writes to one handle outstanding together, followed by a read of it:
+ * the requests of a handle run in the order they were sent, so the read
+ * returns the value of the last write.
+ */
+#define HGFS_BENCH_CHECK_ORDERING_ROUNDS 500
+
+static Bool
+HgfsBenchCheckOrdering(void)
+{
+   HgfsHandle handle;
+   Bool success;
+   uint32 round;
+   uint32 slot;
+   char *path;
+
+   success = HgfsBenchOpen(HgfsBenchCheckFileName(0),
+                           HGFS_OPEN_MODE_READ_WRITE, HGFS_OPEN_CREATE_EMPTY,
+                           NULL, &handle);
+   if (!success) {
+      return FALSE;
+   }
+
+   for (round = 0;
+        round < HGFS_BENCH_CHECK_ORDERING_ROUNDS && success;
+        round++) {
+      uint32 last = round * HGFS_BENCH_SLOTS + HGFS_BENCH_SLOTS - 2;
+
+      for (slot = 0; slot < HGFS_BENCH_SLOTS - 1; slot++) {
+         HgfsRequestWriteV3 *request = HgfsBenchSlotPayload(slot);
+         uint32 value = round * HGFS_BENCH_SLOTS + slot;
+
+         memset(request, 0, offsetof(HgfsRequestWriteV3, payload));
+         request->file = handle;
+         request->requiredSize = sizeof value;
+         memcpy(request->payload, &value, sizeof value);
+         HgfsBenchSubmit(slot, HGFS_OP_WRITE_V3,
+                         offsetof(HgfsRequestWriteV3, payload) +
+                         sizeof value);
+      }
+      {
+         HgfsRequestReadV3 *request = HgfsBenchSlotPayload(slot);
+
+         memset(request, 0, sizeof *request);
+         request->file = handle;
+         request->requiredSize = sizeof last;
+         HgfsBenchSubmit(slot, HGFS_OP_READ_V3, sizeof *request);
+      }
+
+      for (slot = 0; slot < HGFS_BENCH_SLOTS; slot++) {
+         const HgfsReplyReadV3 *reply;
+         size_t replySize;
+
+         if (HgfsBenchWait(slot, (const void **)&reply, &replySize) !=
+             HGFS_STATUS_SUCCESS) {
+            success = FALSE;
+         } else if (HGFS_BENCH_SLOTS - 1 == slot) {
+            success = success &&
+                      replySize >= offsetof(HgfsReplyReadV3, payload) +
+                                   sizeof last &&
+                      reply->actualSize == sizeof last &&
+                      memcmp(reply->payload, &last, sizeof last) == 0;
+         }
+      }
+   }
+
+   path = HgfsBenchCheckPath(HgfsBenchCheckFileName(0));
+   HgfsBenchClose(handle, NULL);
+   unlink(path);
+   free(path);
+   return success;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchCheckSearchRead --
+ *
+ *    Read the name of the entry at an offset of a search.
+ *
+ * Results:
+ *    TRUE on success, FALSE otherwise. The name is empty past the end of
+ *    the directory.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsBenchCheckSearchRead(HgfsHandle search,    // IN: search handle
+                         uint32 offset,        // IN: entry offset
+                         char *name,           // OUT: entry name
+                         size_t nameSize)      // IN: room for the name
+{
+   HgfsRequestSearchReadV3 *request = HgfsBenchPayload();
+   const HgfsReplySearchReadV3 *reply;
+   const HgfsDirEntry *entry;
+   size_t replySize;
+
+   memset(request, 0, sizeof *request);
+   request->search = search;
+   request->offset = offset;
+
+   if (HgfsBenchSend(HGFS_OP_SEARCH_READ_V3, sizeof *request, NULL,
+                     (const void **)&reply, &replySize) !=
+          HGFS_STATUS_SUCCESS ||
+       replySize < offsetof(HgfsReplySearchReadV3, payload)) {
+      return FALSE;
+   }
+
+   name[0] = '\0';
+   if (0 == reply->count) {
+      return TRUE;
+   }
+   entry = (const HgfsDirEntry *)reply->payload;
+   if (replySize < offsetof(HgfsReplySearchReadV3, payload) +
+                   sizeof *entry + entry->fileName.length ||
+       entry->fileName.length >= nameSize) {
+      return FALSE;
+   }
+   memcpy(name, entry->fileName.name, entry->fileName.length);
+   name[entry->fileName.length] = '\0';
+   return TRUE;
+}
+
+
+/*
+ * A directory larger than one getdents batch of the server, listed in
+ * order, then with reads that go back and forth and so rewind it: every
+ * entry is listed once and offsets keep their entries across a rewind.
+ */
+static Bool
+HgfsBenchCheckListing(void)
+{
+   const uint32 middle = gListEntries / 2;
+   HgfsRequestSearchOpenV3 *request;
+   const HgfsReplySearchOpenV3 *reply;
+   HgfsHandle search = HGFS_INVALID_HANDLE;
+   char first[PATH_MAX];
+   char again[PATH_MAX];
+   size_t replySize;
+   uint32 numEntries;
+   uint32 offset;
+   int nameSize;
+   Bool success;
+
+   /* The entries and "." and "..". */
+   success = HgfsBenchMakeListDir() &&
+             HgfsBenchSearchDir(HGFS_BENCH_LIST_DIR, NULL, &numEntries,
+                                NULL) &&
+             numEntries == gListEntries + 2;
+
+   if (success) {
+      request = HgfsBenchPayload();
+      memset(request, 0, sizeof *request);
+      nameSize = HgfsBenchPackName(&request->dirName, HGFS_BENCH_LIST_DIR,
+                                   gBufferSize - sizeof (HgfsHeader) -
+                                   sizeof *request);
+      success = nameSize >= 0 &&
+                HgfsBenchSend(HGFS_OP_SEARCH_OPEN_V3,
+                              sizeof *request + nameSize, NULL,
+                              (const void **)&reply, &replySize) ==
+                   HGFS_STATUS_SUCCESS &&
+                replySize >= sizeof *reply;
+      if (success) {
+         search = reply->search;
+      }
+   }
+
+   /* Past the first batch, back to the start and forward again. */
+   success = success &&
+             HgfsBenchCheckSearchRead(search, middle, first, sizeof first) &&
+             first[0] != '\0' &&
+             HgfsBenchCheckSearchRead(search, 1, again, sizeof again) &&
+             again[0] != '\0' &&
+             HgfsBenchCheckSearchRead(search, middle, again, sizeof again) &&
+             strcmp(first, again) == 0;
+
+   /* The rest of the directory, up to its end. */
+   for (offset = middle + 1; success; offset++) {
+      success = HgfsBenchCheckSearchRead(search, offset, again, sizeof again);
+      if (again[0] == '\0') {
+         break;
+      }
+   }
+   success = success && offset == gListEntries + 2;
+
+   if (HGFS_INVALID_HANDLE != search) {
+      HgfsRequestSearchCloseV3 *closeRequest = HgfsBenchPayload();
+
+      memset(closeRequest, 0, sizeof *closeRequest);
+      closeRequest->search = search;
+      success = HgfsBenchSend(HGFS_OP_SEARCH_CLOSE_V3, sizeof *closeRequest,
+                              NULL, NULL, NULL) == HGFS_STATUS_SUCCESS &&
+                success;
+   }
+   return success;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchCheckCreateFile --
+ *
+ *    Create an empty file locally, behind the server's back.
+ *
+ * Results:
+ *    TRUE on success, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsBenchCheckCreateFile(const char *fileBaseName)   // IN: file in the share
+{
+   char *path = HgfsBenchCheckPath(fileBaseName);
+   int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+   free(path);
+   if (fd < 0) {
+      return FALSE;
+   }
+   close(fd);
+   return TRUE;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchCheckWaitCreated --
+ *
+ *    Wait for the next file creation notification of a watch.
+ *
+ * Results:
+ *    TRUE if it came and is for the file, FALSE otherwise.
+ *
+ * Side effects:
+ *    Other notifications of the watch are skipped.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsBenchCheckWaitCreated(HgfsSubscriberHandle watchId,  // IN: watch
+                          const char *cpName,            // IN: expected name
+                          size_t cpNameSize)             // IN: its size
+{
+   char packet[HGFS_PACKET_MAX];
+   size_t packetSize;
+
+   while (HgfsLoopback_WaitNotification(gConn, 5000, packet, sizeof packet,
+                                        &packetSize)) {
+      const HgfsRequestNotifyV4 *notify =
+         (const HgfsRequestNotifyV4 *)(packet + sizeof (HgfsHeader));
+      const HgfsNotifyEventV4 *event = &notify->events[0];
+
+      if (packetSize < sizeof (HgfsHeader) + sizeof *notify ||
+          notify->watchId != watchId || notify->count != 1 ||
+          0 == (event->mask & HGFS_NOTIFY_CREATE_FILE)) {
+         continue;
+      }
+      /* The name starts with the share name. */
+      return event->fileName.length > cpNameSize &&
+             packetSize >= sizeof (HgfsHeader) + sizeof *notify +
+                           event->fileName.length &&
+             memcmp(event->fileName.name + event->fileName.length - cpNameSize,
+                    cpName, cpNameSize) == 0 &&
+             '\0' == event->fileName.name[event->fileName.length -
+                                          cpNameSize - 1];
+   }
+   return FALSE;
+}
+
+
+/*
+ * A recursive watch on a directory whose subdirectory is renamed, then
+ * moved out of the watched directory: files created in it are reported
+ * under its new name, and no longer at all once it is moved out.
+ */
+static Bool
+HgfsBenchCheckNotify(void)
+{
+   static const char *dirs[] = {
+      "notify", "notify/a", "notify/b", "notifyout",
+   };
+   static const char *files[] = {
+      "notify/b/f", "notifyout/g", "notify/h", "notifyout/f",
+   };
+   HgfsSubscriberHandle watchId = HGFS_INVALID_SUBSCRIBER_HANDLE;
+   char *oldPath;
+   char *newPath;
+   Bool success;
+   uint32 i;
+
+   for (i = 0; i < 2; i++) {
+      char *path = HgfsBenchCheckPath(dirs[i]);
+
+      success = mkdir(path, 0700) == 0;
+      free(path);
+      if (!success) {
+         break;
+      }
+   }
+
+   if (success) {
+      HgfsRequestSetWatchV4 *request = HgfsBenchPayload();
+      const HgfsReplySetWatchV4 *reply;
+      size_t replySize;
+      int nameSize;
+
+      memset(request, 0, sizeof *request);
+      request->events = HGFS_NOTIFY_CREATE_FILE;
+      request->flags = HGFS_NOTIFY_FLAG_WATCH_TREE;
+      nameSize = HgfsBenchPackName(&request->fileName, dirs[0],
+                                   gBufferSize - sizeof (HgfsHeader) -
+                                   sizeof *request);
+      success = nameSize >= 0 &&
+                HgfsBenchSend(HGFS_OP_SET_WATCH_V4, sizeof *request + nameSize,
+                              NULL, (const void **)&reply, &replySize) ==
+                   HGFS_STATUS_SUCCESS &&
+                replySize >= sizeof *reply;
+      if (success) {
+         watchId = reply->watchId;
+      }
+   }
+
+   /* Renamed inside the watched directory. */
+   oldPath = HgfsBenchCheckPath(dirs[1]);
+   newPath = HgfsBenchCheckPath(dirs[2]);
+   success = success && rename(oldPath, newPath) == 0 &&
+             HgfsBenchCheckCreateFile(files[0]) &&
+             HgfsBenchCheckWaitCreated(watchId, "b\0f", 3);
+   free(oldPath);
+
+   /* Moved out: the next creation reported is the one still inside. */
+   oldPath = newPath;
+   newPath = HgfsBenchCheckPath(dirs[3]);
+   success = success && rename(oldPath, newPath) == 0 &&
+             HgfsBenchCheckCreateFile(files[1]) &&
+             HgfsBenchCheckCreateFile(files[2]) &&
+             HgfsBenchCheckWaitCreated(watchId, "h", 1);
+   free(oldPath);
+   free(newPath);
+
+   if (HGFS_INVALID_SUBSCRIBER_HANDLE != watchId) {
+      HgfsRequestRemoveWatchV4 *request = HgfsBenchPayload();
+
+      request->watchId = watchId;
+      success = HgfsBenchSend(HGFS_OP_REMOVE_WATCH_V4, sizeof *request, NULL,
+                              NULL, NULL) == HGFS_STATUS_SUCCESS && success;
+   }
+
+   /* The first file moved out with its directory. */
+   for (i = 1; i < ARRAYSIZE(files); i++) {
+      char *path = HgfsBenchCheckPath(files[i]);
+
+      unlink(path);
+      free(path);
+   }
+   for (i = ARRAYSIZE(dirs); i > 0; i--) {
+      char *path = HgfsBenchCheckPath(dirs[i - 1]);
+
+      rmdir(path);
+      free(path);
+   }
+   return success;
+}
+
+
+/*
+ * Copies within one file: a copy to a range of its own that does not
+ * overlap the source is done, one that overlaps it is refused and leaves
+ * the file as it was.
+ */
+#define HGFS_BENCH_CHECK_COPY_BLOCK   (16 * 1024)
+#define HGFS_BENCH_CHECK_COPY_BLOCKS  4
+
+static Bool
+HgfsBenchCheckCopy(HgfsHandle handle,   // IN: file handle
+                   uint64 srcOffset,    // IN: offset to copy from
+                   uint64 dstOffset,    // IN: offset to copy to
+                   uint64 length)       // IN: bytes to copy
+{
+   HgfsRequestCopyFileRangeV4 *request = HgfsBenchPayload();
+   const HgfsReplyCopyFileRangeV4 *reply;
+   size_t replySize;
+
+   memset(request, 0, sizeof *request);
+   request->srcFile = handle;
+   request->dstFile = handle;
+   request->srcOffset = srcOffset;
+   request->dstOffset = dstOffset;
+   request->length = length;
+
+   return HgfsBenchSend(HGFS_OP_COPY_FILE_RANGE_V4, sizeof *request, NULL,
+                        (const void **)&reply, &replySize) ==
+             HGFS_STATUS_SUCCESS &&
+          replySize >= sizeof *reply &&
+          reply->actualSize == length;
+}
+
+
+static Bool
+HgfsBenchCheckCopyRange(void)
+{
+   uint32 *data = Util_SafeMalloc(HGFS_BENCH_CHECK_COPY_BLOCK);
+   uint32 *readData = Util_SafeMalloc(HGFS_BENCH_CHECK_COPY_BLOCK);
+   uint32 numWords = HGFS_BENCH_CHECK_COPY_BLOCK / sizeof *data;
+   HgfsHandle handle;
+   Bool success;
+   uint32 block;
+   uint32 actualSize;
+   uint32 i;
+   char *path;
+
+   success = HgfsBenchOpen(HgfsBenchCheckFileName(0),
+                           HGFS_OPEN_MODE_READ_WRITE, HGFS_OPEN_CREATE_EMPTY,
+                           NULL, &handle);
+   if (!success) {
+      goto exit;
+   }
+
+   for (block = 0; block < HGFS_BENCH_CHECK_COPY_BLOCKS && success; block++) {
+      for (i = 0; i < numWords; i++) {
+         data[i] = block * numWords + i;
+      }
+      success = HgfsBenchWriteAt(handle, block * HGFS_BENCH_CHECK_COPY_BLOCK,
+                                 data, HGFS_BENCH_CHECK_COPY_BLOCK);
+   }
+
+   /* The first block copied past the end, then half the file onto itself. */
+   success = success &&
+             HgfsBenchCheckCopy(handle, 0,
+                                HGFS_BENCH_CHECK_COPY_BLOCKS *
+                                HGFS_BENCH_CHECK_COPY_BLOCK,
+                                HGFS_BENCH_CHECK_COPY_BLOCK) &&
+             !HgfsBenchCheckCopy(handle, 0, HGFS_BENCH_CHECK_COPY_BLOCK / 4,
+                                 HGFS_BENCH_CHECK_COPY_BLOCKS / 2 *
+                                 HGFS_BENCH_CHECK_COPY_BLOCK);
+
+   for (block = 0; block <= HGFS_BENCH_CHECK_COPY_BLOCKS && success; block++) {
+      uint32 value = block % HGFS_BENCH_CHECK_COPY_BLOCKS * numWords;
+
+      success = HgfsBenchReadAt(handle, block * HGFS_BENCH_CHECK_COPY_BLOCK,
+                                readData, HGFS_BENCH_CHECK_COPY_BLOCK,
+                                &actualSize) &&
+                actualSize == HGFS_BENCH_CHECK_COPY_BLOCK;
+      for (i = 0; i < numWords && success; i++) {
+         success = readData[i] == value + i;
+      }
+   }
+
+   path = HgfsBenchCheckPath(HgfsBenchCheckFileName(0));
+   HgfsBenchClose(handle, NULL);
+   unlink(path);
+   free(path);
+
+exit:
+   free(data);
+   free(readData);
+   return success;
+}
+
+
+/*
+ * A write the host refuses, as it would end past the largest file offset,
+ * fails once: its own reply fails without write-behind, otherwise the next
+ * request on its handle fails and a request on another handle does not.
+ */
+#define HGFS_BENCH_CHECK_WRITE_BEHIND_BAD_OFFSET (MAX_INT64 - 8)
+
+static Bool
+HgfsBenchCheckWriteBehind(void)
+{
+   static const char data[] = "write-behind";
+   char readData[sizeof data];
+   HgfsHandle handles[2];
+   uint32 actualSize;
+   Bool writeFailed;
+   Bool success;
+   int i;
+
+   for (i = 0; i < ARRAYSIZE(handles); i++) {
+      if (!HgfsBenchOpen(HgfsBenchCheckFileName(i), HGFS_OPEN_MODE_READ_WRITE,
+                         HGFS_OPEN_CREATE_EMPTY, NULL, &handles[i])) {
+         success = FALSE;
+         goto exit;
+      }
+   }
+
+   success = HgfsBenchWriteAt(handles[0], 0, data, sizeof data) &&
+             HgfsBenchWriteAt(handles[1], 0, data, sizeof data);
+   writeFailed = !HgfsBenchWriteAt(handles[0],
+                                   HGFS_BENCH_CHECK_WRITE_BEHIND_BAD_OFFSET,
+                                   data, sizeof data);
+
+   /* The other handle first: its data is flushed and it has no error. */
+   success = success &&
+             HgfsBenchReadAt(handles[1], 0, readData, sizeof readData,
+                             &actualSize) &&
+             actualSize == sizeof data &&
+             memcmp(readData, data, sizeof data) == 0;
+
+   if (success && !writeFailed) {
+      success = !HgfsBenchReadAt(handles[0], 0, readData, sizeof readData,
+                                 &actualSize);
+   }
+
+   success = success &&
+             HgfsBenchReadAt(handles[0], 0, readData, sizeof readData,
+                             &actualSize) &&
+             actualSize == sizeof data &&
+             memcmp(readData, data, sizeof data) == 0;
+
+exit:
+   while (--i >= 0) {
+      char *path = HgfsBenchCheckPath(HgfsBenchCheckFileName(i));
+
+      success = HgfsBenchClose(handles[i], NULL) && success;
+      unlink(path);
+      free(path);
+   }
+
+   return success;
+}
+
+
+/*
+ * V3 requests with their fixed arguments cut short, or with a first name
+ * running past the payload, are refused with a protocol error, while well
+ * formed requests of the smallest size get through. A read reply, whose
+ * buffer is not zeroed, holds clean arguments and the data read. The table
+ * gives the layout the server must enforce at the least.
+ */
+#define HGFS_BENCH_CHECK_ARGS_NO_NAME ((size_t)-1)
+
+static const struct {
+   HgfsOp op;
+   size_t argsSize;        /* Size of the fixed arguments */
+   size_t nameOffset;      /* First HgfsFileNameV3, if any */
+} gHgfsBenchCheckArgs[] = {
+   { HGFS_OP_OPEN_V3, offsetof(HgfsRequestOpenV3, fileName.name),
+     offsetof(HgfsRequestOpenV3, fileName) },
+   { HGFS_OP_READ_V3, sizeof (HgfsRequestReadV3),
+     HGFS_BENCH_CHECK_ARGS_NO_NAME },
+   { HGFS_OP_WRITE_V3, sizeof (HgfsRequestWriteV3),   // With a byte of data
+     HGFS_BENCH_CHECK_ARGS_NO_NAME },
+   { HGFS_OP_CLOSE_V3, sizeof (HgfsRequestCloseV3),
+     HGFS_BENCH_CHECK_ARGS_NO_NAME },
+   { HGFS_OP_SEARCH_OPEN_V3, offsetof(HgfsRequestSearchOpenV3, dirName.name),
+     offsetof(HgfsRequestSearchOpenV3, dirName) },
+   { HGFS_OP_SEARCH_READ_V3, sizeof (HgfsRequestSearchReadV3),
+     HGFS_BENCH_CHECK_ARGS_NO_NAME },
+   { HGFS_OP_SEARCH_CLOSE_V3, sizeof (HgfsRequestSearchCloseV3),
+     HGFS_BENCH_CHECK_ARGS_NO_NAME },
+   { HGFS_OP_GETATTR_V3, offsetof(HgfsRequestGetattrV3, fileName.name),
+     offsetof(HgfsRequestGetattrV3, fileName) },
+   { HGFS_OP_SETATTR_V3, offsetof(HgfsRequestSetattrV3, fileName.name),
+     offsetof(HgfsRequestSetattrV3, fileName) },
+   { HGFS_OP_CREATE_DIR_V3, offsetof(HgfsRequestCreateDirV3, fileName.name),
+     offsetof(HgfsRequestCreateDirV3, fileName) },
+   { HGFS_OP_DELETE_FILE_V3, offsetof(HgfsRequestDeleteV3, fileName.name),
+     offsetof(HgfsRequestDeleteV3, fileName) },
+   { HGFS_OP_DELETE_DIR_V3, offsetof(HgfsRequestDeleteV3, fileName.name),
+     offsetof(HgfsRequestDeleteV3, fileName) },
+   { HGFS_OP_RENAME_V3, offsetof(HgfsRequestRenameV3, oldName.name),
+     offsetof(HgfsRequestRenameV3, oldName) },
+   { HGFS_OP_QUERY_VOLUME_INFO_V3,
+     offsetof(HgfsRequestQueryVolumeV3, fileName.name),
+     offsetof(HgfsRequestQueryVolumeV3, fileName) },
+   { HGFS_OP_CREATE_SYMLINK_V3,
+     offsetof(HgfsRequestSymlinkCreateV3, symlinkName.name),
+     offsetof(HgfsRequestSymlinkCreateV3, symlinkName) },
+};
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchCheckArgsPack --
+ *
+ *    Pack the smallest well formed request of an op of the arguments check
+ *    table: no handle, and names of a file which does not exist.
+ *
+ * Results:
+ *    The size of the request.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static size_t
+HgfsBenchCheckArgsPack(uint32 entry)   // IN: arguments check table entry
+{
+   HgfsOp op = gHgfsBenchCheckArgs[entry].op;
+   size_t size = gHgfsBenchCheckArgs[entry].argsSize;
+   size_t nameOffset = gHgfsBenchCheckArgs[entry].nameOffset;
+   char *payload = HgfsBenchPayload();
+   HgfsFileNameV3 *name;
+   int nameSize;
+
+   memset(payload, 0, size);
+   if (HGFS_BENCH_CHECK_ARGS_NO_NAME == nameOffset) {
+      /* The handle is the first argument of all the ops without a name. */
+      *(HgfsHandle *)payload = HGFS_INVALID_HANDLE;
+      return size;
+   }
+
+   if (HGFS_OP_OPEN_V3 == op) {
+      HgfsRequestOpenV3 *request = (HgfsRequestOpenV3 *)payload;
+
+      request->mask = HGFS_OPEN_VALID_MODE | HGFS_OPEN_VALID_FLAGS |
+                      HGFS_OPEN_VALID_FILE_NAME;
+      request->mode = HGFS_OPEN_MODE_READ_ONLY;
+      request->flags = HGFS_OPEN;
+   } else if (HGFS_OP_CREATE_DIR_V3 == op) {
+      HgfsRequestCreateDirV3 *request = (HgfsRequestCreateDirV3 *)payload;
+
+      request->mask = HGFS_CREATE_DIR_VALID_FILE_NAME;
+   }
+
+   name = (HgfsFileNameV3 *)(payload + nameOffset);
+   nameSize = HgfsBenchPackName(name, "noSuchDir/noSuchFile",
+                                gBufferSize - sizeof (HgfsHeader) - size);
+   ASSERT(nameSize >= 0);
+   size += nameSize + 1;
+
+   if (HGFS_OP_RENAME_V3 == op || HGFS_OP_CREATE_SYMLINK_V3 == op) {
+      name = (HgfsFileNameV3 *)(name->name + nameSize + 1);
+      memset(name, 0, sizeof *name);
+      nameSize = HgfsBenchPackName(name, "noSuchDir/noSuchTarget",
+                                   gBufferSize - sizeof (HgfsHeader) - size -
+                                   sizeof *name);
+      ASSERT(nameSize >= 0);
+      size += sizeof *name + nameSize;
+   }
+   return size;
+}
+
+
+static Bool
+HgfsBenchCheckArgs(void)
+{
+   static const char data[] = "args";
+   HgfsRequestReadV3 *request;
+   const HgfsReplyReadV3 *reply;
+   size_t replySize;
+   HgfsHandle handle;
+   Bool success = TRUE;
+   char *path;
+   uint32 i;
+
+   for (i = 0; i < ARRAYSIZE(gHgfsBenchCheckArgs) && success; i++) {
+      HgfsOp op = gHgfsBenchCheckArgs[i].op;
+      size_t argsSize = gHgfsBenchCheckArgs[i].argsSize;
+      size_t nameOffset = gHgfsBenchCheckArgs[i].nameOffset;
+
+      memset(HgfsBenchPayload(), 0, argsSize);
+      success = HgfsBenchSend(op, argsSize - 1, NULL, NULL, NULL) ==
+                   HGFS_STATUS_PROTOCOL_ERROR;
+      if (success && HGFS_BENCH_CHECK_ARGS_NO_NAME != nameOffset) {
+         HgfsFileNameV3 *name =
+            (HgfsFileNameV3 *)((char *)HgfsBenchPayload() + nameOffset);
+
+         memset(HgfsBenchPayload(), 0, argsSize);
+         name->length = 1;
+         success = HgfsBenchSend(op, argsSize, NULL, NULL, NULL) ==
+                      HGFS_STATUS_PROTOCOL_ERROR;
+      }
+      if (!success) {
+         fprintf(stderr, "Malformed op %d request not refused\n", op);
+         break;
+      }
+
+      success = HgfsBenchSend(op, HgfsBenchCheckArgsPack(i), NULL, NULL,
+                              NULL) != HGFS_STATUS_PROTOCOL_ERROR;
+      if (!success) {
+         fprintf(stderr, "Well formed op %d request refused\n", op);
+      }
+   }
+
+   if (!success ||
+       !HgfsBenchOpen(HgfsBenchCheckFileName(0), HGFS_OPEN_MODE_READ_WRITE,
+                      HGFS_OPEN_CREATE_EMPTY, NULL, &handle)) {
+      return FALSE;
+   }
+
+   /* Read past the end into a buffer full of garbage. */
+   success = HgfsBenchWriteAt(handle, 0, data, sizeof data);
+   if (success) {
+      memset(gBuffer, 0xaa, gBufferSize);
+      request = HgfsBenchPayload();
+      memset(request, 0, sizeof *request);
+      request->file = handle;
+      request->requiredSize = 2 * sizeof data;
+      success = HgfsBenchSend(HGFS_OP_READ_V3, sizeof *request, NULL,
+                              (const void **)&reply, &replySize) ==
+                   HGFS_STATUS_SUCCESS &&
+                replySize == sizeof *reply + sizeof data &&
+                reply->actualSize == sizeof data &&
+                reply->reserved == 0 &&
+                memcmp(reply->payload, data, sizeof data) == 0;
+   }
+
+   path = HgfsBenchCheckPath(HgfsBenchCheckFileName(0));
+   HgfsBenchClose(handle, NULL);
+   unlink(path);
+   free(path);
+   return success;
+}
+
+
+/*
+ * Random V3 requests, of random sizes around their fixed arguments, with
+ * random first name lengths and flags. The server must survive them all and
+ * refuse those which do not hold the layout of the arguments check table.
+ */
+#define HGFS_BENCH_CHECK_FUZZ         200000
+#define HGFS_BENCH_CHECK_FUZZ_EXTRA   64
+
+static Bool
+HgfsBenchCheckFuzz(void)
+{
+   GRand *rand = g_rand_new_with_seed(1);
+   Bool success = TRUE;
+   uint32 i;
+
+   for (i = 0; i < HGFS_BENCH_CHECK_FUZZ && success; i++) {
+      uint32 entry = g_rand_int_range(rand, 0, ARRAYSIZE(gHgfsBenchCheckArgs));
+      HgfsOp op = gHgfsBenchCheckArgs[entry].op;
+      size_t argsSize = gHgfsBenchCheckArgs[entry].argsSize;
+      size_t nameOffset = gHgfsBenchCheckArgs[entry].nameOffset;
+      size_t size = g_rand_int_range(rand, 0,
+                                     argsSize + HGFS_BENCH_CHECK_FUZZ_EXTRA);
+      char *payload = HgfsBenchPayload();
+      Bool malformed = size < argsSize;
+      size_t j;
+
+      for (j = 0; j < size; j++) {
+         payload[j] = g_rand_int(rand);
+      }
+
+      if (!malformed && HGFS_BENCH_CHECK_ARGS_NO_NAME != nameOffset) {
+         HgfsFileNameV3 *name = (HgfsFileNameV3 *)(payload + nameOffset);
+
+         /* Mostly names ending around the end of the payload. */
+         name->length = g_rand_int_range(rand, 0, 2 * (size - argsSize) + 2);
+         if (0 != (g_rand_int(rand) & 1)) {
+            name->flags &= ~HGFS_FILE_NAME_USE_FILE_DESC;
+         }
+         malformed = 0 == (name->flags & HGFS_FILE_NAME_USE_FILE_DESC) &&
+                     name->length > size - argsSize;
+      }
+
+      if (HgfsBenchSend(op, size, NULL, NULL, NULL) !=
+             HGFS_STATUS_PROTOCOL_ERROR && malformed) {
+         fprintf(stderr, "Random op %d request of %"FMTSZ"u bytes not "
+                 "refused\n", op, size);
+         success = FALSE;
+      }
+   }
+
+   g_rand_free(rand);
+   return success;
+}
+
+
+static const HgfsBenchCheck gHgfsBenchChecks[] = {
+   { "handles",     HgfsBenchCheckHandles },
+   { "concurrent",  HgfsBenchCheckConcurrent },
+   { "eviction",    HgfsBenchCheckEviction },
+   { "ordering",    HgfsBenchCheckOrdering },
+   { "listing",     HgfsBenchCheckListing },
+   { "notify",      HgfsBenchCheckNotify },
+   { "copyrange",   HgfsBenchCheckCopyRange },
+   { "writebehind", HgfsBenchCheckWriteBehind },
+   { "args",        HgfsBenchCheckArgs },
+   { "fuzz",        HgfsBenchCheckFuzz },
+};
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchCompareLatency --
+ *
+ *    qsort comparison of latencies.
+ *
+ * Results:
+ *    <0, 0 or >0.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+HgfsBenchCompareLatency(const void *a,   // IN
+                        const void *b)   // IN
+{
+   uint64 latencyA = *(const uint64 *)a;
+   uint64 latencyB = *(const uint64 *)b;
+
+   return latencyA < latencyB ? -1 : latencyA > latencyB;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchPercentileUS --
+ *
+ *    Get a latency percentile of the sorted latencies.
+ *
+ * Results:
+ *    The latency in microseconds.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static double
+HgfsBenchPercentileUS(const HgfsBenchStats *stats,   // IN: sorted latencies
+                      double percentile)             // IN: 0 to 100
+{
+   size_t index;
+
+   if (0 == stats->numRequests) {
+      return 0;
+   }
+   index = (size_t)(percentile / 100 * (stats->numRequests - 1) + 0.5);
+   return stats->latenciesNS[index] / 1000.0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchReport --
+ *
+ *    Print the results of a workload.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    The latencies are sorted.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsBenchReport(HgfsBenchStats *stats)   // IN/OUT: workload statistics
+{
+   double seconds = MAX(stats->elapsedNS, 1) / 1e9;
+
+   qsort(stats->latenciesNS, stats->numRequests, sizeof *stats->latenciesNS,
+         HgfsBenchCompareLatency);
+
+   printf("%-8s %10"FMT64"u %6"FMT64"u %12.0f %9.2f %9.1f %9.1f %9.1f %9.1f\n",
+          stats->name, stats->numRequests, stats->numErrors,
+          stats->numRequests / seconds,
+          stats->numBytes / seconds / (1024 * 1024),
+          HgfsBenchPercentileUS(stats, 50),
+          HgfsBenchPercentileUS(stats, 90),
+          HgfsBenchPercentileUS(stats, 99),
+          HgfsBenchPercentileUS(stats, 100));
+   if (0 != stats->firstEntryNS) {
+      printf("%-8s first entry after %.1f us, peak RSS %ld KB (+%ld KB)\n",
+             "", stats->firstEntryNS / 1e3, stats->maxRssKB,
+             stats->rssGrowthKB);
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchRunWorkload --
+ *
+ *    Run and report a workload if it was selected.
+ *
+ * Results:
+ *    TRUE on success, FALSE if a request failed.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsBenchRunWorkload(const HgfsBenchWorkload *workload,   // IN: workload
+                     Bool selected)                       // IN: report it
+{
+   HgfsBenchStats stats;
+   VmTimeType startNS;
+   Bool success;
+
+   memset(&stats, 0, sizeof stats);
+   stats.name = workload->name;
+
+   startNS = Hostinfo_SystemTimerNS();
+   success = workload->run(&stats);
+   stats.elapsedNS += Hostinfo_SystemTimerNS() - startNS;
+
+   if (!success) {
+      fprintf(stderr, "%s: request failed\n", workload->name);
+   } else if (selected) {
+      HgfsBenchReport(&stats);
+   }
+
+   free(stats.latenciesNS);
+   return success;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchIsSelected --
+ *
+ *    Check if a workload is in the comma separated list of workloads.
+ *
+ * Results:
+ *    TRUE if it is, or if no list was given.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsBenchIsSelected(const char *name)   // IN: workload name
+{
+   gchar **names;
+   Bool selected = FALSE;
+   int i;
+
+   if (NULL == gWorkloads) {
+      return TRUE;
+   }
+
+   names = g_strsplit(gWorkloads, ",", -1);
+   for (i = 0; names[i] != NULL; i++) {
+      if (strcmp(names[i], name) == 0) {
+         selected = TRUE;
+      }
+   }
+   g_strfreev(names);
+   return selected;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchRunChecks --
+ *
+ *    Run and report the selected checks.
+ *
+ * Results:
+ *    TRUE if they all passed, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsBenchRunChecks(void)
+{
+   Bool success = TRUE;
+   uint32 i;
+
+   for (i = 0; i < ARRAYSIZE(gHgfsBenchChecks); i++) {
+      const HgfsBenchCheck *check = &gHgfsBenchChecks[i];
+
+      if (HgfsBenchIsSelected(check->name)) {
+         Bool passed = check->run();
+
+         printf("%-12s %s\n", check->name, passed ? "passed" : "FAILED");
+         success = success && passed;
+      }
+   }
+   return success;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchCleanup --
+ *
+ *    Remove the files and the share directory.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+HgfsBenchCleanup(void)
+{
+   int i;
+
+   for (i = 0; i < gNumFiles; i++) {
+      char *path = Str_SafeAsprintf(NULL, "%s/%s", gShareDir,
+                                    HgfsBenchFileName(i));
+
+      unlink(path);
+      free(path);
+   }
+   for (i = 0; i < gListEntries; i++) {
+      char *path = HgfsBenchListPath(i);
+
+      unlink(path);
+      free(path);
+   }
+   {
+      char *path = HgfsBenchListPath(-1);
+
+      rmdir(path);
+      free(path);
+   }
+   rmdir(gShareDir);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsBenchRunServer --
+ *
+ *    Start the server, run the selected workloads or checks against it in
+ *    a new session and stop it.
+ *
+ * Results:
+ *    EXIT_SUCCESS on success, EXIT_FAILURE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+HgfsBenchRunServer(HgfsServerConfig *config)   // IN: server settings
+{
+   int result = EXIT_FAILURE;
+   uint32 i;
+
+   if (!HgfsLoopback_Init(config)) {
+      fprintf(stderr, "Cannot initialize the HGFS server\n");
+      return EXIT_FAILURE;
+   }
+
+   /* Change notification is only offered on shared memory channels. */
+   gConn = HgfsLoopback_Connect(HGFS_CHANNEL_SHARED_MEM |
+                                (gAsync ? HGFS_CHANNEL_ASYNC : 0),
+                                HGFS_BENCH_SLOTS);
+   if (NULL == gConn) {
+      fprintf(stderr, "Cannot connect to the HGFS server\n");
+      goto exitServer;
+   }
+   for (i = 0; i < HGFS_BENCH_SLOTS; i++) {
+      gBuffers[i] = HgfsLoopback_GetBuffer(gConn, i, &gBufferSize);
+   }
+   gBuffer = gBuffers[0];
+
+   if (!HgfsBenchCreateSession()) {
+      fprintf(stderr, "Cannot create an HGFS session\n");
+      goto exitConn;
+   }
+
+   printf("%d files of %d bytes, %d byte I/O, %d passes, %u threads%s\n",
+          gNumFiles, gFileSize, gIoSize, gPasses, config->numWorkerThreads,
+          gAsync ? ", async" : "");
+   if (gCheck) {
+      printf("%-12s %s\n", "check", "result");
+   } else {
+      printf("%-8s %10s %6s %12s %9s %9s %9s %9s %9s\n", "workload",
+             "requests", "errors", "requests/s", "MB/s", "p50 us", "p90 us",
+             "p99 us", "max us");
+   }
+
+   /* The files are always created first, as the other workloads use them. */
+   result = EXIT_SUCCESS;
+   for (i = 0; i < ARRAYSIZE(gHgfsBenchWorkloads); i++) {
+      const HgfsBenchWorkload *workload = &gHgfsBenchWorkloads[i];
+      Bool selected = !gCheck && HgfsBenchIsSelected(workload->name);
+
+      if ((selected || workload->run == HgfsBenchCreate) &&
+          !HgfsBenchRunWorkload(workload, selected)) {
+         result = EXIT_FAILURE;
+         break;
+      }
+   }
+
+   if (gCheck && result == EXIT_SUCCESS && !HgfsBenchRunChecks()) {
+      result = EXIT_FAILURE;
+   }
+
+   HgfsBenchDestroySession();
+exitConn:
+   HgfsLoopback_Disconnect(gConn);
+   gConn = NULL;
+exitServer:
+   HgfsLoopback_Exit();
+   return result;
+}
+
+
+int
+main(int argc,       // IN
+     char *argv[])   // IN
+{
+   GOptionEntry entries[] = {
+      { "files", 'n', 0, G_OPTION_ARG_INT, &gNumFiles,
+        "Number of files", "<count>" },
+      { "size", 's', 0, G_OPTION_ARG_INT, &gFileSize,
+        "Size of each file in bytes", "<bytes>" },
+      { "io-size", 'i', 0, G_OPTION_ARG_INT, &gIoSize,
+        "Size of the read and write requests", "<bytes>" },
+      { "passes", 'p', 0, G_OPTION_ARG_INT, &gPasses,
+        "Passes over the files of each workload", "<count>" },
+      { "threads", 't', 0, G_OPTION_ARG_INT, &gNumThreads,
+        "Server worker threads", "<count>" },
+      { "async", 'a', 0, G_OPTION_ARG_NONE, &gAsync,
+        "Let the server process requests on its worker threads", NULL },
+      { "scale", 'S', 0, G_OPTION_ARG_NONE, &gScale,
+        "Run once with each of 1, 2, 4... worker threads up to --threads, "
+        "to compare the throughput", NULL },
+      { "write-behind", 'b', 0, G_OPTION_ARG_INT, &gWriteBehind,
+        "Server write-behind buffer size per file, 0 to disable", "<bytes>" },
+      { "cached-nodes", 'm', 0, G_OPTION_ARG_INT, &gCachedNodes,
+        "Server open file cache size, at least", "<count>" },
+      { "list-entries", 'l', 0, G_OPTION_ARG_INT, &gListEntries,
+        "Entries of the directory of the list workload", "<count>" },
+      { "dir", 'd', 0, G_OPTION_ARG_FILENAME, &gParentDir,
+        "Directory to create the temporary share in", "<path>" },
+      { "workloads", 'w', 0, G_OPTION_ARG_STRING, &gWorkloads,
+        "Workloads to report: create,open,getattr,read,write,search,list,mix,"
+        "compound,parallel,lookup, "
+        "or checks to run: handles,concurrent,eviction,ordering,listing,"
+        "notify,copyrange,writebehind,args,fuzz",
+        "<list>" },
+      { "check", 'c', 0, G_OPTION_ARG_NONE, &gCheck,
+        "Run the regression checks instead of the workloads", NULL },
+      { NULL }
+   };
+   HgfsServerConfig config = {
+      HGFS_CONFIG_SHARE_ALL_HOST_DRIVES_ENABLED | HGFS_CONFIG_VOL_INFO_MIN,
+      HGFS_MAX_CACHED_FILENODES,
+      0,
+      HGFS_DEFAULT_MAX_ASYNC_REQUESTS,
+      HGFS_DEFAULT_MAX_READ_AHEAD_BYTES,
+      HGFS_DEFAULT_MAX_WRITE_BEHIND_BYTES
+   };
+   GOptionContext *optCtx;
+   GError *gErr = NULL;
+   int result;
+
+   optCtx = g_option_context_new("- benchmark the HGFS server");
+   g_option_context_add_main_entries(optCtx, entries, NULL);
+   if (!g_option_context_parse(optCtx, &argc, &argv, &gErr)) {
+      fprintf(stderr, "%s\n", gErr->message);
+      g_error_free(gErr);
+      g_option_context_free(optCtx);
+      return EXIT_FAILURE;
+   }
+   g_option_context_free(optCtx);
+
+   if (gNumFiles <= 0 || gFileSize <= 0 || gPasses <= 0 || gNumThreads < 0 ||
+       gWriteBehind < 0 || gCachedNodes <= 0 || gListEntries <= 0 ||
+       gIoSize <= 0 || gIoSize > HGFS_LARGE_IO_MAX) {
+      fprintf(stderr, "Invalid option value, the I/O size is at most %u.\n",
+              HGFS_LARGE_IO_MAX);
+      return EXIT_FAILURE;
+   }
+   if (gScale && (!gAsync || gNumThreads == 0)) {
+      fprintf(stderr, "--scale needs --async and --threads.\n");
+      return EXIT_FAILURE;
+   }
+
+   gShareDir = Str_SafeAsprintf(NULL, "%s/hgfsBench.XXXXXX",
+                                gParentDir != NULL ? gParentDir
+                                                   : g_get_tmp_dir());
+   if (NULL == mkdtemp(gShareDir)) {
+      fprintf(stderr, "Cannot create %s: %s\n", gShareDir, strerror(errno));
+      return EXIT_FAILURE;
+   }
+
+   config.maxCachedOpenNodes = gCachedNodes;
+   config.maxWriteBehindBytes = gWriteBehind;
+   if (gCheck) {
+      config.flags |= HGFS_CONFIG_NOTIFY_ENABLED;
+   }
+   if (gScale) {
+      /* Each run starts a server with twice the worker threads. */
+      uint32 numThreads;
+
+      result = EXIT_SUCCESS;
+      for (numThreads = 1;
+           numThreads <= gNumThreads && result == EXIT_SUCCESS;
+           numThreads *= 2) {
+         config.numWorkerThreads = numThreads;
+         result = HgfsBenchRunServer(&config);
+      }
+   } else {
+      config.numWorkerThreads = gNumThreads;
+      result = HgfsBenchRunServer(&config);
+   }
+
+   HgfsBenchCleanup();
+   free(gShareDir);
+   return result;
+}
@@ -0,0 +1,592 @@
+/*********************************************************
+ * Copyright (C) 2016 VMware, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * hgfsChannelLoopback.c --
+ *
+ *	In-process loopback channel to the HGFS server.
+ *
+ *	The channel hands the server packets the way a shared memory channel
+ *	does: the packet buffer is described by page sized iovs whose
+ *	"physical" addresses are the buffer addresses, and the server maps
+ *	them through the getReadVa/getWriteVa/putVa callbacks. The reply is
+ *	copied back into the packet buffer when the server sends it, which
+ *	may be from a worker thread when the connection is asynchronous.
+ *
+ *	A connection has several packet slots, each with its own buffer, so a
+ *	client can have several requests outstanding on an asynchronous
+ *	connection, as a guest with a queue of requests does. Packets the
+ *	server sends on its own, i.e. change notifications, are queued on the
+ *	connection until the client takes them.
+ *
+ *	The server serves the guest policy "root" share, the root of the
+ *	file system.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "vmware.h"
+#include "util.h"
+#include "userlock.h"
+#include "dbllnklst.h"
+#include "hostinfo.h"
+#include "hgfs.h"
+#include "hgfsServer.h"
+#include "hgfsServerPolicy.h"
+#include "hgfsChannelLoopback.h"
+
+typedef struct HgfsLoopbackNotification {
+   DblLnkLst_Links links;
+   size_t size;
+   char packet[1];            /* Header and notification request */
+} HgfsLoopbackNotification;
+
+typedef struct HgfsLoopbackSlot {
+   char *buffer;              /* Page aligned packet buffer */
+   HgfsPacket *packet;        /* With one iov per page of the buffer */
+   Bool replied;
+   size_t replySize;
+} HgfsLoopbackSlot;
+
+struct HgfsLoopbackConn {
+   HgfsServerChannelCallbacks channelCbTable;
+   HgfsServerChannelData channelData;
+   void *serverSession;       /* Transport session of the server */
+   size_t bufferSize;
+   uint32 numIovs;
+   HgfsLoopbackSlot *slots;
+   uint32 numSlots;
+   MXUserExclLock *lock;      /* Protects replied, replySize, notifications */
+   MXUserCondVar *replyVar;   /* Signaled when a reply or notification is sent */
+   DblLnkLst_Links notifications; /* HgfsLoopbackNotification queue */
+};
+
+static HgfsServerCallbacks *gHgfsLoopbackServerCb = NULL;
+static HgfsServerMgrCallbacks gHgfsLoopbackMgrCb;
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * HgfsLoopbackGetVa --
+ *
+ *    Map a loopback "physical" address, which is the virtual address of the
+ *    packet buffer.
+ *
+ * Results:
+ *    The virtual address, which is also the mapping context.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void *
+HgfsLoopbackGetVa(uint64 pa,        // IN: buffer address
+                  uint32 size,      // IN: size to map
+                  void **context)   // OUT: mapping context
+{
+   /* The server takes a NULL context for a buffer that was not mapped. */
+   *context = (void *)(uintptr_t)pa;
+   return (void *)(uintptr_t)pa;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * HgfsLoopbackPutVa --
+ *
+ *    Unmap a loopback address, nothing to do.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+HgfsLoopbackPutVa(void **context)   // IN/OUT: mapping context
+{
+   *context = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * HgfsLoopbackSend --
+ *
+ *    Send a packet to the client: copy the reply into the packet buffer and
+ *    wake up the client waiting for it. Packets sent by the server itself,
+ *    e.g. change notifications, are queued.
+ *
+ * Results:
+ *    TRUE.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+HgfsLoopbackSend(void *opaqueConn,         // IN: connection
+                 HgfsPacket *packet,       // IN/OUT: packet
+                 HgfsSendFlags flags)      // IN: send flags
+{
+   HgfsLoopbackConn *conn = opaqueConn;
+   HgfsLoopbackSlot *slot = NULL;
+   HgfsLoopbackNotification *notification = NULL;
+   size_t replySize = 0;
+
+   if (0 != (packet->state & HGFS_STATE_CLIENT_REQUEST)) {
+      uint32 i;
+
+      for (i = 0; i < conn->numSlots; i++) {
+         if (conn->slots[i].packet == packet) {
+            slot = &conn->slots[i];
+         }
+      }
+      ASSERT(NULL != slot);
+      replySize = MIN(packet->replyPacketDataSize, conn->bufferSize);
+      if (packet->replyPacket != slot->buffer) {
+         memmove(slot->buffer, packet->replyPacket, replySize);
+      }
+   } else {
+      notification = Util_SafeMalloc(offsetof(HgfsLoopbackNotification,
+                                              packet) +
+                                     packet->metaPacketDataSize);
+      DblLnkLst_Init(&notification->links);
+      notification->size = packet->metaPacketDataSize;
+      memcpy(notification->packet, packet->metaPacket, notification->size);
+   }
+
+   if (0 == (flags & HGFS_SEND_NO_COMPLETE)) {
+      gHgfsLoopbackServerCb->session.sendComplete(packet, conn->serverSession);
+   }
+
+   MXUser_AcquireExclLock(conn->lock);
+   if (NULL != slot) {
+      slot->replySize = replySize;
+      slot->replied = TRUE;
+   } else {
+      DblLnkLst_LinkLast(&conn->notifications, &notification->links);
+   }
+   MXUser_BroadcastCondVar(conn->replyVar);
+   MXUser_ReleaseExclLock(conn->lock);
+
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * HgfsLoopback_Init --
+ *
+ *    Initialize the guest share policy and the HGFS server.
+ *
+ * Results:
+ *    TRUE on success, FALSE otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsLoopback_Init(HgfsServerConfig *config)   // IN: server settings
+{
+   memset(&gHgfsLoopbackMgrCb, 0, sizeof gHgfsLoopbackMgrCb);
+
+   if (!HgfsServerPolicy_Init(NULL, NULL, &gHgfsLoopbackMgrCb.enumResources)) {
+      return FALSE;
+   }
+
+   if (!HgfsServer_InitState(&gHgfsLoopbackServerCb, config,
+                             &gHgfsLoopbackMgrCb)) {
+      HgfsServerPolicy_Cleanup();
+      gHgfsLoopbackServerCb = NULL;
+      return FALSE;
+   }
+
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * HgfsLoopback_Exit --
+ *
+ *    Tear down the HGFS server and the share policy.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+HgfsLoopback_Exit(void)
+{
+   if (NULL != gHgfsLoopbackServerCb) {
+      HgfsServer_ExitState();
+      HgfsServerPolicy_Cleanup();
+      gHgfsLoopbackServerCb = NULL;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * HgfsLoopback_Connect --
+ *
+ *    Connect a new transport session to the server, with numSlots packet
+ *    slots.
+ *
+ * Results:
+ *    The connection, or NULL if the server refused it.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+HgfsLoopbackConn *
+HgfsLoopback_Connect(HgfsChannelFlags flags,   // IN: HGFS_CHANNEL_xxx
+                     uint32 numSlots)          // IN: outstanding requests
+{
+   HgfsLoopbackConn *conn;
+   uint32 slot;
+   uint32 i;
+
+   ASSERT(NULL != gHgfsLoopbackServerCb);
+   ASSERT(numSlots > 0);
+
+   conn = Util_SafeCalloc(1, sizeof *conn);
+   conn->bufferSize = ROUNDUP(HGFS_LARGE_PACKET_MAX, PAGE_SIZE);
+   conn->numIovs = conn->bufferSize / PAGE_SIZE;
+   conn->slots = Util_SafeCalloc(numSlots, sizeof *conn->slots);
+   conn->numSlots = numSlots;
+   DblLnkLst_Init(&conn->notifications);
+
+   for (slot = 0; slot < numSlots; slot++) {
+      HgfsLoopbackSlot *loopbackSlot = &conn->slots[slot];
+
+      if (0 != posix_memalign((void **)&loopbackSlot->buffer, PAGE_SIZE,
+                              conn->bufferSize)) {
+         loopbackSlot->buffer = NULL;
+         HgfsLoopback_Disconnect(conn);
+         return NULL;
+      }
+      loopbackSlot->packet =
+         Util_SafeCalloc(1, offsetof(HgfsPacket, iov) +
+                            conn->numIovs * sizeof (HgfsVmxIov));
+      for (i = 0; i < conn->numIovs; i++) {
+         loopbackSlot->packet->iov[i].pa =
+            (uintptr_t)(loopbackSlot->buffer + i * PAGE_SIZE);
+         loopbackSlot->packet->iov[i].len = PAGE_SIZE;
+      }
+   }
+
+   conn->lock = MXUser_CreateExclLock("hgfsLoopbackLock", RANK_UNRANKED);
+   conn->replyVar = MXUser_CreateCondVarExclLock(conn->lock);
+
+   conn->channelCbTable.getReadVa = HgfsLoopbackGetVa;
+   conn->channelCbTable.getWriteVa = HgfsLoopbackGetVa;
+   conn->channelCbTable.putVa = HgfsLoopbackPutVa;
+   conn->channelCbTable.send = HgfsLoopbackSend;
+   conn->channelData.flags = flags;
+   conn->channelData.maxPacketSize = HGFS_LARGE_PACKET_MAX;
+
+   if (!gHgfsLoopbackServerCb->session.connect(conn, &conn->channelCbTable,
+                                               &conn->channelData,
+                                               &conn->serverSession)) {
+      conn->serverSession = NULL;
+      HgfsLoopback_Disconnect(conn);
+      return NULL;
+   }
+
+   return conn;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * HgfsLoopback_Disconnect --
+ *
+ *    Disconnect and close the transport session and free the connection.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    The server closes the handles still opened by the connection.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+HgfsLoopback_Disconnect(HgfsLoopbackConn *conn)   // IN: connection
+{
+   DblLnkLst_Links *link, *nextLink;
+   uint32 slot;
+
+   if (NULL != conn->serverSession) {
+      gHgfsLoopbackServerCb->session.disconnect(conn->serverSession);
+      gHgfsLoopbackServerCb->session.close(conn->serverSession);
+   }
+
+   DblLnkLst_ForEachSafe(link, nextLink, &conn->notifications) {
+      DblLnkLst_Unlink1(link);
+      free(DblLnkLst_Container(link, HgfsLoopbackNotification, links));
+   }
+
+   if (NULL != conn->replyVar) {
+      MXUser_DestroyCondVar(conn->replyVar);
+   }
+   if (NULL != conn->lock) {
+      MXUser_DestroyExclLock(conn->lock);
+   }
+   for (slot = 0; slot < conn->numSlots; slot++) {
+      free(conn->slots[slot].packet);
+      free(conn->slots[slot].buffer);
+   }
+   free(conn->slots);
+   free(conn);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * HgfsLoopback_GetBuffer --
+ *
+ *    Get the packet buffer of a slot of a connection, where the client
+ *    writes its request and finds the reply.
+ *
+ * Results:
+ *    The buffer and its size.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+char *
+HgfsLoopback_GetBuffer(HgfsLoopbackConn *conn,   // IN: connection
+                       uint32 slot,              // IN: packet slot
+                       size_t *bufferSize)       // OUT: buffer size
+{
+   ASSERT(slot < conn->numSlots);
+
+   *bufferSize = conn->bufferSize;
+   return conn->slots[slot].buffer;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * HgfsLoopback_Submit --
+ *
+ *    Send the request in the packet buffer of a slot to the server, without
+ *    waiting for its reply on an asynchronous connection.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+HgfsLoopback_Submit(HgfsLoopbackConn *conn,   // IN: connection
+                    uint32 slot,              // IN: packet slot
+                    size_t requestSize)       // IN: request size
+{
+   HgfsLoopbackSlot *loopbackSlot = &conn->slots[slot];
+   HgfsPacket *packet = loopbackSlot->packet;
+   uint32 i;
+
+   ASSERT(slot < conn->numSlots);
+   ASSERT(requestSize <= conn->bufferSize);
+
+   /* Reset the packet, keeping the iov addresses. */
+   memset(packet, 0, offsetof(HgfsPacket, iov));
+   for (i = 0; i < conn->numIovs; i++) {
+      packet->iov[i].va = NULL;
+      packet->iov[i].context = NULL;
+   }
+   packet->iovCount = conn->numIovs;
+   packet->metaPacketSize = conn->bufferSize;
+   packet->metaPacketDataSize = requestSize;
+   packet->state = HGFS_STATE_CLIENT_REQUEST;
+
+   MXUser_AcquireExclLock(conn->lock);
+   loopbackSlot->replied = FALSE;
+   MXUser_ReleaseExclLock(conn->lock);
+
+   gHgfsLoopbackServerCb->session.receive(packet, conn->serverSession);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * HgfsLoopback_Wait --
+ *
+ *    Wait for the reply to the request submitted in a slot, which replaces
+ *    it in the packet buffer.
+ *
+ * Results:
+ *    TRUE and the size of the reply, or FALSE if the server dropped the
+ *    request.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsLoopback_Wait(HgfsLoopbackConn *conn,   // IN: connection
+                  uint32 slot,              // IN: packet slot
+                  size_t *replySize)        // OUT: reply size
+{
+   HgfsLoopbackSlot *loopbackSlot = &conn->slots[slot];
+   Bool replied;
+
+   ASSERT(slot < conn->numSlots);
+
+   MXUser_AcquireExclLock(conn->lock);
+   if (0 != (conn->channelData.flags & HGFS_CHANNEL_ASYNC)) {
+      while (!loopbackSlot->replied) {
+         MXUser_WaitCondVarExclLock(conn->lock, conn->replyVar);
+      }
+   }
+
+   /* Without an asynchronous channel the reply was sent by the submit. */
+   replied = loopbackSlot->replied;
+   *replySize = loopbackSlot->replySize;
+   MXUser_ReleaseExclLock(conn->lock);
+
+   return replied;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * HgfsLoopback_Dispatch --
+ *
+ *    Send the request in the packet buffer of a slot to the server and wait
+ *    for its reply, which replaces it in the packet buffer.
+ *
+ * Results:
+ *    TRUE and the size of the reply, or FALSE if the server dropped the
+ *    request.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsLoopback_Dispatch(HgfsLoopbackConn *conn,   // IN: connection
+                      uint32 slot,              // IN: packet slot
+                      size_t requestSize,       // IN: request size
+                      size_t *replySize)        // OUT: reply size
+{
+   HgfsLoopback_Submit(conn, slot, requestSize);
+   return HgfsLoopback_Wait(conn, slot, replySize);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * HgfsLoopback_WaitNotification --
+ *
+ *    Take the oldest packet the server sent on its own, waiting for one for
+ *    up to a timeout.
+ *
+ * Results:
+ *    TRUE and the packet, truncated to the buffer, and its size, or FALSE
+ *    if none came in time.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+HgfsLoopback_WaitNotification(HgfsLoopbackConn *conn,  // IN: connection
+                              uint32 timeoutMs,        // IN: longest wait
+                              void *buffer,            // OUT: packet
+                              size_t bufferSize,       // IN: room for it
+                              size_t *packetSize)      // OUT: packet size
+{
+   HgfsLoopbackNotification *notification = NULL;
+   VmTimeType deadline = Hostinfo_SystemTimerMS() + timeoutMs;
+
+   MXUser_AcquireExclLock(conn->lock);
+   for (;;) {
+      VmTimeType now = Hostinfo_SystemTimerMS();
+
+      if (DblLnkLst_IsLinked(&conn->notifications)) {
+         notification = DblLnkLst_Container(conn->notifications.next,
+                                            HgfsLoopbackNotification, links);
+         DblLnkLst_Unlink1(&notification->links);
+         break;
+      }
+      if (now >= deadline) {
+         break;
+      }
+      MXUser_TimedWaitCondVarExclLock(conn->lock, conn->replyVar,
+                                      (uint32)(deadline - now));
+   }
+   MXUser_ReleaseExclLock(conn->lock);
+
+   if (NULL == notification) {
+      return FALSE;
+   }
+   *packetSize = MIN(notification->size, bufferSize);
+   memcpy(buffer, notification->packet, *packetSize);
+   free(notification);
+   return TRUE;
+}
@@ -0,0 +1,59 @@
+/*********************************************************
+ * Copyright (C) 2016 VMware, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+#ifndef _HGFS_CHANNEL_LOOPBACK_H
+#define _HGFS_CHANNEL_LOOPBACK_H
+
+/*
+ * hgfsChannelLoopback.h --
+ *
+ *	In-process loopback channel to the HGFS server.
+ */
+
+#include "vm_basic_types.h"
+#include "hgfsServer.h"
+
+typedef struct HgfsLoopbackConn HgfsLoopbackConn;
+
+Bool HgfsLoopback_Init(HgfsServerConfig *config);
+void HgfsLoopback_Exit(void);
+
+HgfsLoopbackConn *HgfsLoopback_Connect(HgfsChannelFlags flags,
+                                       uint32 numSlots);
+void HgfsLoopback_Disconnect(HgfsLoopbackConn *conn);
+
+char *HgfsLoopback_GetBuffer(HgfsLoopbackConn *conn,
+                             uint32 slot,
+                             size_t *bufferSize);
+void HgfsLoopback_Submit(HgfsLoopbackConn *conn,
+                         uint32 slot,
+                         size_t requestSize);
+Bool HgfsLoopback_Wait(HgfsLoopbackConn *conn,
+                       uint32 slot,
+                       size_t *replySize);
+Bool HgfsLoopback_Dispatch(HgfsLoopbackConn *conn,
+                           uint32 slot,
+                           size_t requestSize,
+                           size_t *replySize);
+Bool HgfsLoopback_WaitNotification(HgfsLoopbackConn *conn,
+                                   uint32 timeoutMs,
+                                   void *buffer,
+                                   size_t bufferSize,
+                                   size_t *packetSize);
+
+#endif // _HGFS_CHANNEL_LOOPBACK_H
@@ -0,0 +1,204 @@
+/*********************************************************
+ * Copyright (C) 2016 VMware, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * testHgfsNames.c --
+ *
+ *	Test of the CP name conversion and escaping routines of lib/hgfs,
+ *	which scan names with the library string routines, against byte by
+ *	byte reference versions on random names made of separators, NULs,
+ *	escape, substitute and illegal characters and dots.
+ *
+ *	The names come from a fixed seed, so every run checks the same ones.
+ *	The program fails on the first name converted differently.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include "vmware.h"
+#include "cpName.h"
+#include "cpNameUtil.h"
+#include "hgfsEscape.h"
+
+#define TEST_HGFS_NAMES      2000000
+#define TEST_HGFS_NAME_MAX   24
+
+
+/* CPName_GetComponent, byte by byte. */
+static int
+RefGetComponent(char const *begin,   // IN: start of the name
+                char const *end,     // IN: end of the name
+                char const **next)   // OUT: next component
+{
+   char const *walk;
+
+   for (walk = begin; walk != end && *walk != '\0'; walk++) {
+   }
+   if (walk == end) {
+      *next = end;
+      return walk - begin;
+   }
+   if (walk == begin) {
+      return -1;
+   }
+   *next = walk + 1;
+   while (*next != end && **next == '\0') {
+      (*next)++;
+   }
+   return *next == end ? -1 : walk - begin;
+}
+
+
+/* CPName_ConvertTo, byte by byte. */
+static int
+RefConvertTo(char const *nameIn,   // IN: name to convert
+             size_t bufOutSize,    // IN: size of the output buffer
+             char *bufOut)         // OUT: CP name
+{
+   size_t i = 0;
+   size_t length;
+
+   while (*nameIn == '/') {
+      nameIn++;
+   }
+   while (*nameIn != '\0' && i < bufOutSize) {
+      if (*nameIn == '/') {
+         bufOut[i++] = '\0';
+         while (*nameIn == '/') {
+            nameIn++;
+         }
+      } else {
+         bufOut[i++] = *nameIn++;
+      }
+   }
+   if (i == bufOutSize) {
+      return -1;
+   }
+   bufOut[i] = '\0';
+
+   for (length = i; length > 0 && bufOut[length - 1] == '\0'; length--) {
+   }
+   return HgfsEscape_Undo(bufOut, length);
+}
+
+
+/* HgfsEscape_Do of a Linux name, byte by byte. */
+static int
+RefEscape(char const *name,   // IN: name without NULs
+          uint32 size,        // IN: size of the name
+          char *bufOut)       // OUT: escaped name, NUL terminated
+{
+   uint32 numEscaped = 0;
+   uint32 i;
+   int j = 0;
+
+   /*
+    * The Linux escaping: '/' is illegal, and an escape character after a
+    * substitute one would be unescaped.
+    */
+   for (i = 0; i < size; i++) {
+      if (name[i] == '/') {
+         bufOut[j++] = '!';
+         bufOut[j++] = '%';
+         numEscaped++;
+      } else if (name[i] == '%' && i > 0 &&
+                 (name[i - 1] == '!' ||
+                  (i > 1 && name[i - 1] == ']' &&
+                   (name[i - 2] == ']' || name[i - 2] == '!')))) {
+         bufOut[j++] = ']';
+         bufOut[j++] = '%';
+         numEscaped++;
+      } else {
+         bufOut[j++] = name[i];
+      }
+   }
+   bufOut[j] = '\0';
+   return numEscaped;
+}
+
+
+int
+main(int argc,       // IN
+     char *argv[])   // IN
+{
+   static const char chars[] = "ab/%]!\0.";
+   GRand *rand = g_rand_new_with_seed(1);
+   Bool success = TRUE;
+   int n;
+
+   for (n = 0; n < TEST_HGFS_NAMES && success; n++) {
+      char name[TEST_HGFS_NAME_MAX + 1];
+      char localName[TEST_HGFS_NAME_MAX + 1];
+      char out[4 * TEST_HGFS_NAME_MAX];
+      char refOut[4 * TEST_HGFS_NAME_MAX];
+      uint32 size = g_rand_int_range(rand, 1, TEST_HGFS_NAME_MAX + 1);
+      size_t outSize = g_rand_int_range(rand, 0, 2 * TEST_HGFS_NAME_MAX);
+      char const *next = NULL;
+      char const *refNext = NULL;
+      int result;
+      int refResult;
+      uint32 i;
+
+      for (i = 0; i < size; i++) {
+         name[i] = chars[g_rand_int_range(rand, 0, sizeof chars - 1)];
+      }
+      name[size] = '\0';
+
+      /* Components of a CP name. */
+      result = CPName_GetComponent(name, name + size, &next);
+      refResult = RefGetComponent(name, name + size, &refNext);
+      success = result == refResult && (result < 0 || next == refNext);
+
+      /* A local name, NULs read as separators, to a CP name. */
+      memcpy(localName, name, size + 1);
+      CPNameUtil_CharReplace(localName, size, '\0', '/');
+      for (i = 0; i < size; i++) {
+         success = success &&
+                   localName[i] == (name[i] == '\0' ? '/' : name[i]);
+      }
+      result = CPName_ConvertTo(localName, outSize, out);
+      refResult = RefConvertTo(localName, outSize, refOut);
+      success = success && result == refResult &&
+                (result < 0 || memcmp(out, refOut, result) == 0);
+
+      /* A component, NULs dropped, escaped. */
+      for (i = 0; i < size && name[i] != '\0'; i++) {
+      }
+      if (i > 0) {
+         refResult = RefEscape(name, i, refOut);
+         result = HgfsEscape_GetSize(name, i);
+         success = success &&
+                   result == (refResult == 0 ? 0 : refResult + (int)i);
+         result = HgfsEscape_Do(name, i, sizeof out, out);
+         success = success && result == strlen(refOut) &&
+                   strcmp(out, refOut) == 0;
+      }
+
+      if (!success) {
+         fprintf(stderr, "Name %d of size %u converted differently\n", n,
+                 size);
+      }
+   }
+
+   g_rand_free(rand);
+   printf("%d names %s\n", n, success ? "passed" : "FAILED");
+   return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
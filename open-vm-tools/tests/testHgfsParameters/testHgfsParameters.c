@@ -0,0 +1,553 @@
+/*********************************************************
+ * Copyright (C) 2016 VMware, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * testHgfsParameters.c --
+ *
+ *	Round-trip test of the V3 request unpacking of lib/hgfsServer.
+ *	Requests of every supported V3 op are packed with random arguments
+ *	behind a V3 or V4 header. HgfsUnpackPacketParams, which validates
+ *	them from its layout table, and then the op unpack function must
+ *	accept them and return the arguments as packed, with the names
+ *	pointing into the packet.
+ *
+ *	The same requests, cut short or with a random first name length,
+ *	check the layout table against the op unpack functions: it must
+ *	refuse every request whose fixed arguments or first name do not fit
+ *	in the payload, and never one that the op unpack function accepts.
+ *
+ *	The requests come from a fixed seed, so every run checks the same
+ *	ones. The program fails on the first request unpacked differently.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include "vmware.h"
+#include "hgfsProto.h"
+#include "hgfsServerParameters.h"
+
+#define TEST_HGFS_REQUESTS      200000
+#define TEST_HGFS_NAME_MAX      48
+#define TEST_HGFS_DATA_MAX      48
+#define TEST_HGFS_PACKET_SIZE   1024
+
+#define TEST_HGFS_NO_NAME       ((size_t)-1)
+
+/*
+ * The layout the test packs: the fixed arguments, up to the characters of
+ * the first name if there is one, and where that name is. Any request
+ * smaller, or whose first name runs past the payload, is malformed.
+ */
+static const struct {
+   HgfsOp op;
+   size_t argsSize;        /* Size of the fixed arguments */
+   size_t nameOffset;      /* First HgfsFileNameV3, if any */
+   Bool useHandle;         /* Whether the first name may be a handle */
+} gTestOps[] = {
+   { HGFS_OP_OPEN_V3, offsetof(HgfsRequestOpenV3, fileName.name),
+     offsetof(HgfsRequestOpenV3, fileName), FALSE },
+   { HGFS_OP_READ_V3, sizeof (HgfsRequestReadV3), TEST_HGFS_NO_NAME, FALSE },
+   { HGFS_OP_WRITE_V3, sizeof (HgfsRequestWriteV3), TEST_HGFS_NO_NAME, FALSE },
+   { HGFS_OP_CLOSE_V3, sizeof (HgfsRequestCloseV3), TEST_HGFS_NO_NAME, FALSE },
+   { HGFS_OP_SEARCH_OPEN_V3, offsetof(HgfsRequestSearchOpenV3, dirName.name),
+     offsetof(HgfsRequestSearchOpenV3, dirName), FALSE },
+   { HGFS_OP_SEARCH_READ_V3, sizeof (HgfsRequestSearchReadV3),
+     TEST_HGFS_NO_NAME, FALSE },
+   { HGFS_OP_SEARCH_CLOSE_V3, sizeof (HgfsRequestSearchCloseV3),
+     TEST_HGFS_NO_NAME, FALSE },
+   { HGFS_OP_GETATTR_V3, offsetof(HgfsRequestGetattrV3, fileName.name),
+     offsetof(HgfsRequestGetattrV3, fileName), TRUE },
+   { HGFS_OP_SETATTR_V3, offsetof(HgfsRequestSetattrV3, fileName.name),
+     offsetof(HgfsRequestSetattrV3, fileName), TRUE },
+   { HGFS_OP_CREATE_DIR_V3, offsetof(HgfsRequestCreateDirV3, fileName.name),
+     offsetof(HgfsRequestCreateDirV3, fileName), FALSE },
+   { HGFS_OP_DELETE_FILE_V3, offsetof(HgfsRequestDeleteV3, fileName.name),
+     offsetof(HgfsRequestDeleteV3, fileName), TRUE },
+   { HGFS_OP_DELETE_DIR_V3, offsetof(HgfsRequestDeleteV3, fileName.name),
+     offsetof(HgfsRequestDeleteV3, fileName), TRUE },
+   { HGFS_OP_RENAME_V3, offsetof(HgfsRequestRenameV3, oldName.name),
+     offsetof(HgfsRequestRenameV3, oldName), TRUE },
+   { HGFS_OP_QUERY_VOLUME_INFO_V3,
+     offsetof(HgfsRequestQueryVolumeV3, fileName.name),
+     offsetof(HgfsRequestQueryVolumeV3, fileName), TRUE },
+   { HGFS_OP_CREATE_SYMLINK_V3,
+     offsetof(HgfsRequestSymlinkCreateV3, symlinkName.name),
+     offsetof(HgfsRequestSymlinkCreateV3, symlinkName), FALSE },
+   { HGFS_OP_WRITE_WIN32_STREAM_V3, sizeof (HgfsRequestWriteWin32StreamV3),
+     TEST_HGFS_NO_NAME, FALSE },
+};
+
+/* The arguments of a request, as packed and as unpacked. */
+typedef struct {
+   HgfsHandle file;        /* Handle, or handle of the first name */
+   const char *name;       /* First name */
+   size_t nameSize;
+   uint32 caseFlags;
+   HgfsHandle targetFile;  /* Second name of a rename or symlink */
+   const char *targetName;
+   size_t targetNameSize;
+   uint64 offset;          /* Read, write and search read */
+   size_t size;
+   const void *data;       /* Write data */
+} TestArgs;
+
+
+/* Pack a name, or a handle, and what the op unpack functions return of it. */
+static size_t
+TestPackName(GRand *rand,             // IN: random generator
+             HgfsFileNameV3 *name,    // OUT: packed name
+             Bool useHandle,          // IN: pack a handle
+             HgfsHandle *file,        // OUT: unpacked handle
+             const char **cpName,     // OUT: unpacked name
+             size_t *cpNameSize,      // OUT: unpacked name size
+             uint32 *caseFlags)       // OUT: unpacked case flags
+{
+   uint32 i;
+
+   name->caseType = g_rand_int_range(rand, 0, 3);
+   name->fid = g_rand_int(rand);
+   if (useHandle) {
+      name->flags = HGFS_FILE_NAME_USE_FILE_DESC;
+      name->length = 0;
+      name->name[0] = '\0';
+      *file = name->fid;
+      *cpName = NULL;
+      *cpNameSize = 0;
+      *caseFlags = HGFS_FILE_NAME_DEFAULT_CASE;
+      return offsetof(HgfsFileNameV3, name) + 1;
+   }
+
+   name->flags = 0;
+   name->length = g_rand_int_range(rand, 0, TEST_HGFS_NAME_MAX);
+   for (i = 0; i < name->length; i++) {
+      name->name[i] = g_rand_int(rand);
+   }
+   name->name[name->length] = '\0';
+   *file = HGFS_INVALID_HANDLE;
+   *cpName = name->name;
+   *cpNameSize = name->length;
+   *caseFlags = name->caseType;
+   return offsetof(HgfsFileNameV3, name) + name->length + 1;
+}
+
+
+/* Pack a well formed request with random arguments. */
+static size_t
+TestPack(GRand *rand,        // IN: random generator
+         uint32 entry,       // IN: op table entry
+         char *payload,      // OUT: request arguments
+         TestArgs *args)     // OUT: arguments the op unpack must return
+{
+   HgfsOp op = gTestOps[entry].op;
+   size_t nameOffset = gTestOps[entry].nameOffset;
+   size_t size = gTestOps[entry].argsSize;
+   uint32 i;
+
+   memset(args, 0, sizeof *args);
+   args->file = HGFS_INVALID_HANDLE;
+   args->targetFile = HGFS_INVALID_HANDLE;
+   for (i = 0; i < TEST_HGFS_PACKET_SIZE - sizeof (HgfsHeader); i++) {
+      payload[i] = g_rand_int(rand);
+   }
+
+   if (TEST_HGFS_NO_NAME != nameOffset) {
+      HgfsFileNameV3 *name = (HgfsFileNameV3 *)(payload + nameOffset);
+      Bool useHandle = gTestOps[entry].useHandle &&
+                       0 != (g_rand_int(rand) & 1);
+
+      size = nameOffset + TestPackName(rand, name, useHandle, &args->file,
+                                       &args->name, &args->nameSize,
+                                       &args->caseFlags);
+      if (HGFS_OP_RENAME_V3 == op || HGFS_OP_CREATE_SYMLINK_V3 == op) {
+         Bool useTargetHandle = HGFS_OP_RENAME_V3 == op &&
+                                0 != (g_rand_int(rand) & 1);
+         uint32 caseFlags;
+
+         size += TestPackName(rand, (HgfsFileNameV3 *)(payload + size),
+                              useTargetHandle,
+                              &args->targetFile, &args->targetName,
+                              &args->targetNameSize, &caseFlags);
+      }
+   }
+
+   switch (op) {
+   case HGFS_OP_OPEN_V3:
+      ((HgfsRequestOpenV3 *)payload)->mask |= HGFS_OPEN_VALID_FILE_NAME;
+      break;
+
+   case HGFS_OP_CREATE_DIR_V3:
+      ((HgfsRequestCreateDirV3 *)payload)->mask |=
+         HGFS_CREATE_DIR_VALID_FILE_NAME;
+      break;
+
+   case HGFS_OP_READ_V3: {
+      HgfsRequestReadV3 *request = (HgfsRequestReadV3 *)payload;
+
+      args->file = request->file;
+      args->offset = request->offset;
+      args->size = request->requiredSize;
+      break;
+   }
+
+   case HGFS_OP_WRITE_V3: {
+      HgfsRequestWriteV3 *request = (HgfsRequestWriteV3 *)payload;
+
+      request->requiredSize = g_rand_int_range(rand, 0, TEST_HGFS_DATA_MAX);
+      args->file = request->file;
+      args->offset = request->offset;
+      args->size = request->requiredSize;
+      args->data = request->payload;
+      size = offsetof(HgfsRequestWriteV3, payload) +
+             MAX(request->requiredSize, 1);
+      break;
+   }
+
+   case HGFS_OP_CLOSE_V3:
+      args->file = ((HgfsRequestCloseV3 *)payload)->file;
+      break;
+
+   case HGFS_OP_SEARCH_READ_V3: {
+      HgfsRequestSearchReadV3 *request = (HgfsRequestSearchReadV3 *)payload;
+
+      args->file = request->search;
+      args->offset = request->offset;
+      break;
+   }
+
+   case HGFS_OP_SEARCH_CLOSE_V3:
+      args->file = ((HgfsRequestSearchCloseV3 *)payload)->search;
+      break;
+
+   case HGFS_OP_WRITE_WIN32_STREAM_V3: {
+      HgfsRequestWriteWin32StreamV3 *request =
+         (HgfsRequestWriteWin32StreamV3 *)payload;
+
+      request->requiredSize = g_rand_int_range(rand, 0, TEST_HGFS_DATA_MAX);
+      args->file = request->file;
+      args->size = request->requiredSize;
+      args->data = request->payload;
+      size += request->requiredSize;
+      break;
+   }
+
+   default:
+      break;
+   }
+
+   return size;
+}
+
+
+/* Unpack a request with the op unpack function. */
+static Bool
+TestUnpack(HgfsOp op,             // IN: request op
+           const void *payload,   // IN: request arguments
+           size_t payloadSize,    // IN: request arguments size
+           TestArgs *args)        // OUT: unpacked arguments
+{
+   HgfsFileAttrInfo attr;
+   HgfsAttrHint attrHints;
+   uint32 caseFlags;
+   Bool useHandle;
+   Bool result;
+
+   memset(args, 0, sizeof *args);
+   args->file = HGFS_INVALID_HANDLE;
+   args->targetFile = HGFS_INVALID_HANDLE;
+
+   switch (op) {
+   case HGFS_OP_OPEN_V3: {
+      HgfsFileOpenInfo info;
+
+      result = HgfsUnpackOpenRequest(payload, payloadSize, op, &info);
+      args->name = info.cpName;
+      args->nameSize = info.cpNameSize;
+      args->caseFlags = info.caseFlags;
+      break;
+   }
+
+   case HGFS_OP_READ_V3: {
+      uint32 length;
+
+      result = HgfsUnpackReadRequest(payload, payloadSize, op, &args->file,
+                                     &args->offset, &length);
+      args->size = length;
+      break;
+   }
+
+   case HGFS_OP_WRITE_V3: {
+      HgfsWriteFlags flags;
+      uint32 length;
+
+      result = HgfsUnpackWriteRequest(payload, payloadSize, op, &args->file,
+                                      &args->offset, &length, &flags,
+                                      &args->data);
+      args->size = length;
+      break;
+   }
+
+   case HGFS_OP_CLOSE_V3:
+      result = HgfsUnpackCloseRequest(payload, payloadSize, op, &args->file);
+      break;
+
+   case HGFS_OP_SEARCH_OPEN_V3:
+      result = HgfsUnpackSearchOpenRequest(payload, payloadSize, op,
+                                           &args->name, &args->nameSize,
+                                           &args->caseFlags);
+      break;
+
+   case HGFS_OP_SEARCH_READ_V3: {
+      HgfsSearchReadInfo info;
+      size_t baseReplySize;
+      size_t inlineReplyDataSize;
+
+      result = HgfsUnpackSearchReadRequest(payload, payloadSize, op, &info,
+                                           &baseReplySize,
+                                           &inlineReplyDataSize,
+                                           &args->file);
+      args->offset = info.startIndex;
+      break;
+   }
+
+   case HGFS_OP_SEARCH_CLOSE_V3:
+      result = HgfsUnpackSearchCloseRequest(payload, payloadSize, op,
+                                            &args->file);
+      break;
+
+   case HGFS_OP_GETATTR_V3:
+      result = HgfsUnpackGetattrRequest(payload, payloadSize, op, &attr,
+                                        &attrHints, &args->name,
+                                        &args->nameSize, &args->file,
+                                        &args->caseFlags);
+      break;
+
+   case HGFS_OP_SETATTR_V3:
+      result = HgfsUnpackSetattrRequest(payload, payloadSize, op, &attr,
+                                        &attrHints, &args->name,
+                                        &args->nameSize, &args->file,
+                                        &args->caseFlags);
+      break;
+
+   case HGFS_OP_CREATE_DIR_V3: {
+      HgfsCreateDirInfo info;
+
+      result = HgfsUnpackCreateDirRequest(payload, payloadSize, op, &info);
+      args->name = info.cpName;
+      args->nameSize = info.cpNameSize;
+      args->caseFlags = info.caseFlags;
+      break;
+   }
+
+   case HGFS_OP_DELETE_FILE_V3:
+   case HGFS_OP_DELETE_DIR_V3: {
+      HgfsDeleteHint hints;
+
+      result = HgfsUnpackDeleteRequest(payload, payloadSize, op, &args->name,
+                                       &args->nameSize, &hints, &args->file,
+                                       &args->caseFlags);
+      break;
+   }
+
+   case HGFS_OP_RENAME_V3: {
+      HgfsRenameHint hints;
+
+      result = HgfsUnpackRenameRequest(payload, payloadSize, op, &args->name,
+                                       &args->nameSize, &args->targetName,
+                                       &args->targetNameSize, &hints,
+                                       &args->file, &args->targetFile,
+                                       &args->caseFlags, &caseFlags);
+      break;
+   }
+
+   case HGFS_OP_QUERY_VOLUME_INFO_V3:
+      result = HgfsUnpackQueryVolumeRequest(payload, payloadSize, op,
+                                            &useHandle, &args->name,
+                                            &args->nameSize,
+                                            &args->caseFlags, &args->file);
+      break;
+
+   case HGFS_OP_CREATE_SYMLINK_V3: {
+      HgfsHandle file;
+
+      result = HgfsUnpackSymlinkCreateRequest(payload, payloadSize, op,
+                                              &useHandle, &args->name,
+                                              &args->nameSize,
+                                              &args->caseFlags, &file,
+                                              &useHandle, &args->targetName,
+                                              &args->targetNameSize,
+                                              &caseFlags, &file);
+      break;
+   }
+
+   case HGFS_OP_WRITE_WIN32_STREAM_V3: {
+      const char *data;
+      Bool doSecurity;
+
+      result = HgfsUnpackWriteWin32StreamRequest(payload, payloadSize, op,
+                                                 &args->file, &data,
+                                                 &args->size, &doSecurity);
+      args->data = data;
+      break;
+   }
+
+   default:
+      NOT_REACHED();
+   }
+
+   return result;
+}
+
+
+/* Put a request behind a V3 or V4 header, unpack the header. */
+static HgfsInternalStatus
+TestUnpackPacket(char *packet,            // IN/OUT: packet, payload set
+                 Bool headerV4,           // IN: V4 header
+                 HgfsOp op,               // IN: request op
+                 size_t payloadSize,      // IN: request arguments size
+                 const void **payload,    // OUT: unpacked arguments
+                 size_t *unpackedSize)    // OUT: unpacked arguments size
+{
+   HgfsInternalStatus status;
+   Bool sessionEnabled;
+   uint64 sessionId;
+   uint32 requestId;
+   HgfsOp opcode;
+   size_t packetSize;
+
+   if (headerV4) {
+      HgfsHeader *header = (HgfsHeader *)packet;
+
+      packetSize = sizeof *header + payloadSize;
+      memset(header, 0, sizeof *header);
+      header->version = HGFS_HEADER_VERSION;
+      header->dummy = HGFS_OP_NEW_HEADER;
+      header->packetSize = packetSize;
+      header->headerSize = sizeof *header;
+      header->op = op;
+      header->flags = HGFS_PACKET_FLAG_REQUEST;
+   } else {
+      HgfsRequest *header = (HgfsRequest *)(packet + sizeof (HgfsHeader) -
+                                            sizeof *header);
+
+      packet = (char *)header;
+      packetSize = sizeof *header + payloadSize;
+      header->id = 0;
+      header->op = op;
+   }
+
+   status = HgfsUnpackPacketParams(packet, packetSize, &sessionEnabled,
+                                   &sessionId, &requestId, &opcode,
+                                   unpackedSize, payload);
+   if (HGFS_ERROR_SUCCESS == status && opcode != op) {
+      status = HGFS_ERROR_INTERNAL;
+   }
+   return status;
+}
+
+
+static Bool
+TestArgsEqual(const TestArgs *args1,   // IN
+              const TestArgs *args2)   // IN
+{
+   return args1->file == args2->file &&
+          args1->name == args2->name &&
+          args1->nameSize == args2->nameSize &&
+          args1->caseFlags == args2->caseFlags &&
+          args1->targetFile == args2->targetFile &&
+          args1->targetName == args2->targetName &&
+          args1->targetNameSize == args2->targetNameSize &&
+          args1->offset == args2->offset &&
+          args1->size == args2->size &&
+          args1->data == args2->data;
+}
+
+
+int
+main(int argc,       // IN
+     char *argv[])   // IN
+{
+   static char packet[TEST_HGFS_PACKET_SIZE];
+   char *payload = packet + sizeof (HgfsHeader);
+   GRand *rand = g_rand_new_with_seed(1);
+   Bool success = TRUE;
+   int n;
+
+   for (n = 0; n < TEST_HGFS_REQUESTS && success; n++) {
+      uint32 entry = g_rand_int_range(rand, 0, ARRAYSIZE(gTestOps));
+      HgfsOp op = gTestOps[entry].op;
+      size_t argsSize = gTestOps[entry].argsSize;
+      size_t nameOffset = gTestOps[entry].nameOffset;
+      Bool headerV4 = 0 != (g_rand_int(rand) & 1);
+      HgfsInternalStatus status;
+      TestArgs packed;
+      TestArgs unpacked;
+      const void *unpackedPayload;
+      size_t unpackedSize;
+      size_t size;
+      Bool malformed;
+      Bool accepted;
+
+      /* A well formed request round trips. */
+      size = TestPack(rand, entry, payload, &packed);
+      status = TestUnpackPacket(packet, headerV4, op, size, &unpackedPayload,
+                                &unpackedSize);
+      success = HGFS_ERROR_SUCCESS == status &&
+                unpackedPayload == payload && unpackedSize == size &&
+                TestUnpack(op, unpackedPayload, unpackedSize, &unpacked) &&
+                TestArgsEqual(&packed, &unpacked);
+      if (!success) {
+         fprintf(stderr, "Request %d, op %d of %"FMTSZ"u bytes, not unpacked "
+                 "as packed\n", n, op, size);
+         break;
+      }
+
+      /* The same request cut short, or with a random first name length. */
+      size = g_rand_int_range(rand, 0, size + 1);
+      malformed = size < argsSize;
+      if (!malformed && TEST_HGFS_NO_NAME != nameOffset) {
+         HgfsFileNameV3 *name = (HgfsFileNameV3 *)(payload + nameOffset);
+
+         if (0 != (g_rand_int(rand) & 1)) {
+            name->length = g_rand_int_range(rand, 0,
+                                            2 * (size - argsSize) + 2);
+         }
+         malformed = 0 == (name->flags & HGFS_FILE_NAME_USE_FILE_DESC) &&
+                     name->length > size - argsSize;
+      }
+
+      accepted = TestUnpack(op, payload, size, &unpacked);
+      status = TestUnpackPacket(packet, headerV4, op, size, &unpackedPayload,
+                                &unpackedSize);
+      if (malformed && HGFS_ERROR_PROTOCOL != status) {
+         fprintf(stderr, "Request %d, op %d of %"FMTSZ"u bytes, malformed "
+                 "but not refused\n", n, op, size);
+         success = FALSE;
+      } else if (accepted && HGFS_ERROR_SUCCESS != status) {
+         fprintf(stderr, "Request %d, op %d of %"FMTSZ"u bytes, refused but "
+                 "unpacked by the op\n", n, op, size);
+         success = FALSE;
+      }
+   }
+
+   g_rand_free(rand);
+   printf("%d requests %s\n", n, success ? "passed" : "FAILED");
+   return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -34,7 +34,21 @@
 #include "transport.h"
 #include "vm_assert.h"
 
+/*
+ * A backdoor RPC blocks until its reply, so each request in flight needs
+ * its own backdoor connection. They are opened on demand, up to the
+ * transport window of requests, and kept idle between requests.
+ */
+typedef struct HgfsBdConnections {
+   RpcOut *idle[HGFS_TRANSPORT_MAX_REQUESTS];  /* Connections not sending. */
+   uint32 numIdle;
+   uint32 numOpen;
+   Bool openFailed;                /* Do not open more connections. */
+   pthread_cond_t idleCond;        /* Signaled when a connection is idle. */
+} HgfsBdConnections;
+
 static HgfsTransportChannel bdChannel;
+static HgfsBdConnections bdConnections;
 
 
 /*
@@ -64,15 +78,23 @@ HgfsBdChannelOpen(HgfsTransportChannel *channel) // IN: Channel
    case HGFS_CHANNEL_CONNECTED:
       LOG(8, ("Backdoor already connected.\n"));
       break;
-   case HGFS_CHANNEL_NOTCONNECTED:
-      if (HgfsBd_OpenBackdoor((RpcOut **)&channel->priv)) {
+   case HGFS_CHANNEL_NOTCONNECTED: {
+      HgfsBdConnections *conns = channel->priv;
+      RpcOut *out = NULL;
+
+      ASSERT(conns->numOpen == 0);
+      if (HgfsBd_OpenBackdoor(&out)) {
          LOG(8, ("Backdoor opened and connected.\n"));
+         ASSERT(out != NULL);
+         conns->idle[0] = out;
+         conns->numIdle = conns->numOpen = 1;
+         conns->openFailed = FALSE;
          channel->status = HGFS_CHANNEL_CONNECTED;
-         ASSERT(channel->priv != NULL);
       } else {
          LOG(8, ("ERROR: Backdoor cannot connect.\n"));
       }
       break;
+   }
    default:
       ASSERT(0); /* Not reached. */
       LOG(2, ("ERROR: Backdoor status %d is unknown resetting.\n",
@@ -105,9 +127,14 @@ static void
 HgfsBdChannelCloseInt(HgfsTransportChannel *channel) // IN: Channel
 {
    if (channel->status == HGFS_CHANNEL_CONNECTED) {
-      ASSERT(channel->priv != NULL);
-      HgfsBd_CloseBackdoor((RpcOut **)&channel->priv);
-      ASSERT(channel->priv == NULL);
+      HgfsBdConnections *conns = channel->priv;
+
+      /* The transport closes the channel with no request in flight. */
+      ASSERT(conns->numIdle == conns->numOpen);
+      while (conns->numIdle > 0) {
+         HgfsBd_CloseBackdoor(&conns->idle[--conns->numIdle]);
+      }
+      conns->numOpen = 0;
       channel->status = HGFS_CHANNEL_NOTCONNECTED;
    }
    LOG(8, ("Backdoor closed.\n"));
@@ -145,13 +172,13 @@ HgfsBdChannelClose(HgfsTransportChannel *channel) // IN: Channel
  *
  * HgfsBdChannelSend --
  *
- *     Send a request via backdoor.
+ *     Send a request via backdoor and complete it with the reply.
  *
  * Results:
  *     0 on success, negative error on failure.
  *
  * Side effects:
- *     None
+ *     May open another backdoor connection, or wait for an idle one.
  *
  *----------------------------------------------------------------------
  */
@@ -160,12 +187,14 @@ static int
 HgfsBdChannelSend(HgfsTransportChannel *channel, // IN: Channel
                   HgfsReq *req)                  // IN: request to send
 {
+   HgfsBdConnections *conns = channel->priv;
    char const *replyPacket = NULL;
    size_t payloadSize;
+   RpcOut *out = NULL;
    int ret;
 
    ASSERT(req);
-   ASSERT(req->state == HGFS_REQ_STATE_UNSENT);
+   ASSERT(req->state == HGFS_REQ_STATE_SUBMITTED);
    ASSERT(req->payloadSize <= HGFS_LARGE_PACKET_MAX);
 
    pthread_mutex_lock(&channel->connLock);
@@ -176,20 +205,50 @@ HgfsBdChannelSend(HgfsTransportChannel *channel, // IN: Channel
       return -ENOTCONN;
    }
 
+   /* Get an idle connection, or open one for this request. */
+   while (out == NULL) {
+      if (conns->numIdle > 0) {
+         out = conns->idle[--conns->numIdle];
+      } else if (!conns->openFailed &&
+                 conns->numOpen < ARRAYSIZE(conns->idle)) {
+         conns->numOpen++;
+         pthread_mutex_unlock(&channel->connLock);
+         if (!HgfsBd_OpenBackdoor(&out)) {
+            out = NULL;
+         }
+         pthread_mutex_lock(&channel->connLock);
+         if (out == NULL) {
+            LOG(4, ("Cannot open backdoor connection %u.\n", conns->numOpen));
+            conns->numOpen--;
+            conns->openFailed = TRUE;
+         }
+      } else {
+         pthread_cond_wait(&conns->idleCond, &channel->connLock);
+      }
+   }
+
+   pthread_mutex_unlock(&channel->connLock);
+
    payloadSize = req->payloadSize;
    LOG(8, ("Backdoor sending.\n"));
-   ret = HgfsBd_Dispatch(channel->priv, HGFS_REQ_PAYLOAD(req), &payloadSize,
+   ret = HgfsBd_Dispatch(out, HGFS_REQ_PAYLOAD(req), &payloadSize,
                          &replyPacket);
    if (ret == 0) {
       LOG(8, ("Backdoor reply received.\n"));
-      /* Request sent successfully. Copy the reply and wake the client. */
+      /* Request sent successfully. Hand the reply to its request. */
       ASSERT(replyPacket);
-      HgfsCompleteReq(req, replyPacket, payloadSize);
+      HgfsTransportProcessPacket((char *)replyPacket, payloadSize);
+      if (req->state != HGFS_REQ_STATE_COMPLETED) {
+         ret = -EPROTO;
+      }
    } else {
       /* Map rpc failure to EIO. */
       ret = -EIO;
    }
 
+   pthread_mutex_lock(&channel->connLock);
+   conns->idle[conns->numIdle++] = out;
+   pthread_cond_signal(&conns->idleCond);
    pthread_mutex_unlock(&channel->connLock);
 
    return ret;
@@ -219,6 +278,7 @@ HgfsBdChannelExit(HgfsTransportChannel *channel)  // IN
    HgfsBdChannelCloseInt(channel);
    channel->status = HGFS_CHANNEL_UNINITIALIZED;
    pthread_mutex_unlock(&channel->connLock);
+   pthread_cond_destroy(&((HgfsBdConnections *)channel->priv)->idleCond);
 }
 
 
@@ -247,7 +307,9 @@ HgfsBdChannelInit(void)
    bdChannel.ops.send = HgfsBdChannelSend;
    bdChannel.ops.recv = NULL;
    bdChannel.ops.exit = HgfsBdChannelExit;
-   bdChannel.priv = NULL;
+   bdChannel.priv = &bdConnections;
+   bdConnections.numIdle = bdConnections.numOpen = 0;
+   pthread_cond_init(&bdConnections.idleCond, NULL);
    pthread_mutex_init(&bdChannel.connLock, NULL);
    bdChannel.status = HGFS_CHANNEL_NOTCONNECTED;
    return &bdChannel;
@@ -19,85 +19,83 @@
 /*
  * cache.c --
  *
- * Module-specific components of the vmhgfs driver.
+ * Attribute cache of the vmhgfs driver.
+ *
+ * Attributes are cached by absolute path, and so is the fact that a path
+ * does not exist, as build tools probe many missing paths. The cache is
+ * split into shards by path hash, each with its own lock, bounded number
+ * of entries and least recently used list. Entries expire after the
+ * attribute timeout, or the entry timeout for missing paths, which are
+ * the same timeouts handed to the kernel.
  */
 #include "module.h"
-#if !defined(__FreeBSD__) && !defined(__SOLARIS__)
-#include <glib.h>
-#endif
-
-/*
- * We make the default attribute cache timeout 1 second which is the same
- * as the FUSE driver.
- * This can be overridden with the mount option attr_timeout=T
- */
-#define CACHE_TIMEOUT HGFS_DEFAULT_TTL
-#define CACHE_PURGE_TIME 10
-#define CACHE_PURGE_SLEEP_TIME 30
-#define HASH_THRESHOLD_SIZE (2046 * 4)
-#define HASH_PURGE_SIZE (HASH_THRESHOLD_SIZE / 2)
+#include <time.h>
 #include "cache.h"
 
+#define CACHE_SHARDS 16
+#define CACHE_MAX_ENTRIES (2046 * 4)
+#define CACHE_SHARD_ENTRIES (CACHE_MAX_ENTRIES / CACHE_SHARDS)
+#define CACHE_SHARD_BUCKETS 128   /* Power of two. */
+
 /*
  * HgfsAttrCache, holds an entry for each path
  */
 
 typedef struct HgfsAttrCache {
-   HgfsAttrInfo attr; /* Attribute of a file or directory */
-   uint64 changeTime; /* time the attribute was last updated */
-   struct list_head list; /* used in linked list implementation */
-   char path[0];      /* path of the file corresponding the the attr */
+   HgfsAttrInfo attr;       /* Attribute of a file or directory */
+   Bool negative;           /* The path does not exist, attr is unused */
+   uint64 expireTime;       /* Monotonic time in ms the entry expires */
+   uint32 hash;             /* Hash of the path */
+   struct list_head bucket; /* Entries with the same hash bucket */
+   struct list_head lru;    /* Entries of the shard, most recent first */
+   char path[0];            /* path of the file corresponding the the attr */
 } HgfsAttrCache;
 
+typedef struct HgfsAttrCacheShard {
+   pthread_mutex_t lock;
+   struct list_head buckets[CACHE_SHARD_BUCKETS];
+   struct list_head lru;
+   uint32 numEntries;
+} HgfsAttrCacheShard;
 
-/* Head of the list */
-struct HgfsAttrCache attrList;
-
-/*Lock for accessing the attribute cache*/
-static pthread_mutex_t HgfsAttrCacheLock = PTHREAD_MUTEX_INITIALIZER;
-
-/*
- * Lists are used to manage attribute cache in Solaris and FreeBSD,
- * HashTables are used in Linux. HashTables perform better and hence
- * once newer version of glib with hash tables are packaged for Solaris
- * and FreeBSD, this section will go away.
- */
+static HgfsAttrCacheShard attrCache[CACHE_SHARDS];
 
-#if defined(__FreeBSD__) || defined(__SOLARIS__)
 
 /*
  *----------------------------------------------------------------------
  *
- * HgfsInitCache
+ * HgfsCacheNow
  *
- *    Initializes the list attrList to cache attributes.
+ *    Get the current monotonic time.
  *
  * Results:
- *    None
+ *    Time in milliseconds.
  *
  * Side effects:
  *    None
  *
  *----------------------------------------------------------------------
- *
  */
 
-void
-HgfsInitCache()
+static uint64
+HgfsCacheNow(void)
 {
-   INIT_LIST_HEAD(&attrList.list);
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * HgfsGetAttrCache
+ * HgfsCacheHash
  *
- *    Retrieves the attr from the list for a given path.
+ *    FNV-1a hash of a path.
  *
  * Results:
- *    0 on success else -1 on error
+ *    The hash.
  *
  * Side effects:
  *    None
@@ -105,47 +103,51 @@ HgfsInitCache()
  *----------------------------------------------------------------------
  */
 
-int
-HgfsGetAttrCache(const char* path,   //IN: Path of file or directory
-                 HgfsAttrInfo *attr) //IN: Attribute for a given path
+static uint32
+HgfsCacheHash(const char *path)  //IN: Path of file or directory
 {
-   HgfsAttrCache *tmp;
-   int res = -1;
-   int diff;
+   uint32 hash = 2166136261U;
 
-   pthread_mutex_lock(&HgfsAttrCacheLock);
-
-   attrList.changeTime = HGFS_GET_TIME(time(NULL));
-   list_for_each_entry(tmp, &attrList.list, list) {
-      LOG(4, ("tmp->path = %d\n", tmp->path));
-      if (strcmp(path, tmp->path) == 0) {
-         LOG(4, ("cache hit. path = %s\n", tmp->path));
+   while (*path != '\0') {
+      hash ^= (unsigned char)*path++;
+      hash *= 16777619U;
+   }
+   return hash;
+}
 
-         diff = (HGFS_GET_TIME(time(NULL)) - tmp->changeTime) / 10000000;
 
-         LOG(4, ("time since last updated is %d seconds\n", diff));
-         if (diff <= CACHE_TIMEOUT) {
-            *attr = tmp->attr;
-            res = 0;
-         }
-         break;
-      }
-   }
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsCacheShard
+ *
+ *    Get the shard caching the paths of a hash.
+ *
+ * Results:
+ *    The shard.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
 
-   pthread_mutex_unlock(&HgfsAttrCacheLock);
-   return res;
+static INLINE HgfsAttrCacheShard *
+HgfsCacheShard(uint32 hash)  //IN: Hash of the path
+{
+   return &attrCache[hash % CACHE_SHARDS];
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * HgfsSetAttrCache
+ * HgfsCacheFind
  *
- *    Updates the list with the given (key, attr)pair.
+ *    Find the entry of a path in its shard. The shard lock must be held.
  *
  * Results:
- *    0 on success else negative value on error
+ *    The entry, or NULL if the path is not cached.
  *
  * Side effects:
  *    None
@@ -153,88 +155,61 @@ HgfsGetAttrCache(const char* path,   //IN: Path of file or directory
  *----------------------------------------------------------------------
  */
 
-int
-HgfsSetAttrCache(const char* path,   //IN: Path of file or directory
-                 HgfsAttrInfo *attr) //IN: Attribute for a given path
+static HgfsAttrCache *
+HgfsCacheFind(HgfsAttrCacheShard *shard,  //IN: Shard of the path
+              uint32 hash,                //IN: Hash of the path
+              const char *path)           //IN: Path of file or directory
 {
+   struct list_head *bucket;
    HgfsAttrCache *tmp;
-   int res = 0;
-
-   pthread_mutex_lock(&HgfsAttrCacheLock);
 
-   attrList.changeTime = HGFS_GET_TIME(time(NULL));
-   list_for_each_entry (tmp, &attrList.list, list) {
-      if (strcmp(path, tmp->path) == 0) {
-         tmp->attr = *attr;
-         tmp->changeTime = HGFS_GET_TIME(time(NULL));
-         LOG(4, ("cache entry updated. path = %s\n", tmp->path));
-         goto out;
+   bucket = &shard->buckets[(hash / CACHE_SHARDS) % CACHE_SHARD_BUCKETS];
+   list_for_each_entry(tmp, bucket, bucket) {
+      if (tmp->hash == hash && strcmp(path, tmp->path) == 0) {
+         return tmp;
       }
    }
-
-   tmp = malloc(sizeof(HgfsAttrCache) + strlen(path) + 1);
-   if (tmp == NULL) {
-      res = -ENOMEM;
-      goto out;
-   }
-   INIT_LIST_HEAD(&tmp->list);
-   Str_Strcpy(tmp->path, path, strlen(path) + 1);
-   tmp->attr = *attr;
-   tmp->changeTime = HGFS_GET_TIME(time(NULL));
-   list_add(&tmp->list, &attrList.list);
-   LOG(4, ("cache entry added. path = %s\n", tmp->path));
-
-out:
-   pthread_mutex_unlock(&HgfsAttrCacheLock);
-   return res;
+   return NULL;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * HgfsInvalidateAttrCache
+ * HgfsCacheRemove
  *
- *    Invalidate the attribute list entry for a given path.
+ *    Remove an entry from its shard. The shard lock must be held.
  *
  * Results:
  *    None
  *
  * Side effects:
- *    None
+ *    The entry is freed.
  *
  *----------------------------------------------------------------------
  */
 
-void
-HgfsInvalidateAttrCache(const char* path)      //IN: Path to file
+static void
+HgfsCacheRemove(HgfsAttrCacheShard *shard,  //IN: Shard of the entry
+                HgfsAttrCache *entry)       //IN: Entry to remove
 {
-   HgfsAttrCache *tmp;
-
-   pthread_mutex_lock(&HgfsAttrCacheLock);
-
-   list_for_each_entry (tmp, &attrList.list, list) {
-      if (strcmp(path, tmp->path) == 0) {
-         list_del(&tmp->list);
-         free(tmp);
-         break;
-      }
-   }
-
-   pthread_mutex_unlock(&HgfsAttrCacheLock);
+   list_del(&entry->bucket);
+   list_del(&entry->lru);
+   shard->numEntries--;
+   free(entry);
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * HgfsPurgeCache:
+ * HgfsCacheInsert
  *
- *    This routine is called by an independent thread to purge the cache,
- *    deletion is based on time of last update.
+ *    Cache the attributes of a path, or that it does not exist. The
+ *    least recently used entry of the shard is evicted when it is full.
  *
  * Results:
- *    None
+ *    0 on success else negative value on error
  *
  * Side effects:
  *    None
@@ -242,57 +217,92 @@ HgfsInvalidateAttrCache(const char* path)      //IN: Path to file
  *----------------------------------------------------------------------
  */
 
-void*
-HgfsPurgeCache(void* unused) //IN: Thread argument
+static int
+HgfsCacheInsert(const char *path,          //IN: Path of file or directory
+                const HgfsAttrInfo *attr,  //IN: Attribute, NULL if missing
+                double timeout)            //IN: Seconds to keep the entry
 {
+   uint32 hash = HgfsCacheHash(path);
+   HgfsAttrCacheShard *shard = HgfsCacheShard(hash);
    HgfsAttrCache *tmp;
-   HgfsAttrCache *prev;
-   int diff;
+   size_t pathLen;
+   int res = 0;
 
-   while (1)
-   {
-      sleep(CACHE_PURGE_SLEEP_TIME);
+   if (timeout <= 0) {
+      /* Caching is disabled, but never leave a stale entry. */
+      HgfsInvalidateAttrCache(path);
+      return 0;
+   }
 
-      pthread_mutex_lock(&HgfsAttrCacheLock);
+   pthread_mutex_lock(&shard->lock);
 
-      list_for_each_entry_safe (tmp, prev, &attrList.list, list) {
-         diff = (HGFS_GET_TIME(time(NULL)) - tmp->changeTime) / 10000000;
-         if (diff > CACHE_PURGE_TIME) {
-            list_del (&tmp->list);
-            free (tmp);
-         }
+   tmp = HgfsCacheFind(shard, hash, path);
+   if (tmp == NULL) {
+      if (shard->numEntries >= CACHE_SHARD_ENTRIES) {
+         HgfsCacheRemove(shard,
+                         list_entry(shard->lru.prev, HgfsAttrCache, lru));
       }
 
-      pthread_mutex_unlock(&HgfsAttrCacheLock);
+      pathLen = strlen(path);
+      tmp = malloc(sizeof(HgfsAttrCache) + pathLen + 1);
+      if (tmp == NULL) {
+         res = -ENOMEM;
+         goto out;
+      }
+      memcpy(tmp->path, path, pathLen + 1);
+      tmp->hash = hash;
+      list_add(&tmp->bucket,
+               &shard->buckets[(hash / CACHE_SHARDS) % CACHE_SHARD_BUCKETS]);
+      list_add(&tmp->lru, &shard->lru);
+      shard->numEntries++;
+      LOG(4, ("cache entry added. path = %s\n", tmp->path));
+   } else {
+      list_move(&tmp->lru, &shard->lru);
+      LOG(4, ("cache entry updated. path = %s\n", tmp->path));
    }
-   return 0;
-}
 
-#else
+   tmp->negative = attr == NULL;
+   if (attr != NULL) {
+      tmp->attr = *attr;
+   }
+   tmp->expireTime = HgfsCacheNow() + (uint64)(timeout * 1000);
 
+out:
+   pthread_mutex_unlock(&shard->lock);
+   return res;
+}
 
-GHashTable *g_hash_table;
 
 /*
  *----------------------------------------------------------------------
  *
  * HgfsInitCache
  *
- *    Creates a hash table with string as a key.
+ *    Initializes the shards of the attribute cache.
  *
  * Results:
  *    None
  *
  * Side effects:
  *    None
- *----------------------------------------------------------------------
  *
+ *----------------------------------------------------------------------
  */
 
 void
-HgfsInitCache()
+HgfsInitCache(void)
 {
-   g_hash_table = g_hash_table_new(g_str_hash, g_str_equal);
+   unsigned int i;
+   unsigned int j;
+
+   for (i = 0; i < CACHE_SHARDS; i++) {
+      pthread_mutex_init(&attrCache[i].lock, NULL);
+      for (j = 0; j < CACHE_SHARD_BUCKETS; j++) {
+         INIT_LIST_HEAD(&attrCache[i].buckets[j]);
+      }
+      INIT_LIST_HEAD(&attrCache[i].lru);
+      attrCache[i].numEntries = 0;
+   }
 }
 
 
@@ -301,40 +311,47 @@ HgfsInitCache()
  *
  * HgfsGetAttrCache
  *
- *    Retrieves the attr from the HashTable for a given path.
+ *    Retrieves the attr from the cache for a given path.
  *
  * Results:
- *    0 on success else -1 on error
+ *    0 on success, -ENOENT if the path is cached as missing, else
+ *    HGFS_ATTR_CACHE_MISS.
  *
  * Side effects:
- *    None
+ *    An expired entry is removed.
  *
  *----------------------------------------------------------------------
  */
 
 int
 HgfsGetAttrCache(const char* path,   //IN: Path of file or directory
-                 HgfsAttrInfo *attr) //IN: Attribute for a given path
+                 HgfsAttrInfo *attr) //OUT: Attribute for a given path
 {
+   uint32 hash = HgfsCacheHash(path);
+   HgfsAttrCacheShard *shard = HgfsCacheShard(hash);
    HgfsAttrCache *tmp;
-   int res = -1;
-   int diff;
+   int res = HGFS_ATTR_CACHE_MISS;
 
-   pthread_mutex_lock(&HgfsAttrCacheLock);
+   pthread_mutex_lock(&shard->lock);
 
-   tmp = (HgfsAttrCache *)g_hash_table_lookup(g_hash_table, path);
+   tmp = HgfsCacheFind(shard, hash, path);
    if (tmp != NULL) {
-      LOG(4, ("cache hit. path = %s\n", tmp->path));
-
-      diff = (HGFS_GET_TIME(time(NULL)) - tmp->changeTime) / 10000000;
-      LOG(4, ("time since last updated is %d seconds\n", diff));
-      if ( diff <= CACHE_TIMEOUT ) {
-         *attr = tmp->attr;
-         res = 0;
+      if (HgfsCacheNow() >= tmp->expireTime) {
+         LOG(4, ("cache entry expired. path = %s\n", tmp->path));
+         HgfsCacheRemove(shard, tmp);
+      } else {
+         LOG(4, ("cache hit. path = %s\n", tmp->path));
+         list_move(&tmp->lru, &shard->lru);
+         if (tmp->negative) {
+            res = -ENOENT;
+         } else {
+            *attr = tmp->attr;
+            res = 0;
+         }
       }
    }
 
-   pthread_mutex_unlock(&HgfsAttrCacheLock);
+   pthread_mutex_unlock(&shard->lock);
    return res;
 }
 
@@ -344,7 +361,7 @@ HgfsGetAttrCache(const char* path,   //IN: Path of file or directory
  *
  * HgfsSetAttrCache
  *
- *    Updates the HashTable with the given (key, attr) pair.
+ *    Updates the cache with the given (key, attr) pair.
  *
  * Results:
  *    0 on success else negative value on error
@@ -359,33 +376,30 @@ int
 HgfsSetAttrCache(const char* path,         //IN: Path of file or directory
                  HgfsAttrInfo *attr)       //IN: Attribute for a given path
 {
-   HgfsAttrCache *tmp;
-   int res = 0;
-
-   pthread_mutex_lock(&HgfsAttrCacheLock);
-
-   tmp = (HgfsAttrCache *)g_hash_table_lookup(g_hash_table, path);
-   if (tmp != NULL) {
-      tmp->attr = *attr;
-      tmp->changeTime = HGFS_GET_TIME(time(NULL));
-      goto out;
-   }
-
-   tmp = malloc(sizeof(HgfsAttrCache) + strlen(path) + 1);
-   if (tmp == NULL) {
-      return -ENOMEM;
-      goto out;
-   }
+   return HgfsCacheInsert(path, attr, gState->attrTimeout);
+}
 
-   Str_Strcpy(tmp->path, path, strlen(path) + 1);
-   tmp->attr = *attr;
-   tmp->changeTime = HGFS_GET_TIME(time(NULL));
 
-   g_hash_table_insert(g_hash_table, (gpointer)tmp->path, (gpointer)tmp);
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsSetNegativeAttrCache
+ *
+ *    Records in the cache that a path does not exist.
+ *
+ * Results:
+ *    0 on success else negative value on error
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
 
-out:
-   pthread_mutex_unlock(&HgfsAttrCacheLock);
-   return res;
+int
+HgfsSetNegativeAttrCache(const char* path)  //IN: Path of file or directory
+{
+   return HgfsCacheInsert(path, NULL, gState->entryTimeout);
 }
 
 
@@ -394,7 +408,7 @@ out:
  *
  * HgfsInvalidateAttrCache
  *
- *    Invalidate the HashTable entry for a path.
+ *    Invalidate the cache entry for a path.
  *
  * Results:
  *    None
@@ -408,24 +422,26 @@ out:
 void
 HgfsInvalidateAttrCache(const char* path)      //IN: Path to file
 {
+   uint32 hash = HgfsCacheHash(path);
+   HgfsAttrCacheShard *shard = HgfsCacheShard(hash);
    HgfsAttrCache *tmp;
 
-   pthread_mutex_lock(&HgfsAttrCacheLock);
-   tmp = (HgfsAttrCache *)g_hash_table_lookup(g_hash_table, path);
+   pthread_mutex_lock(&shard->lock);
+   tmp = HgfsCacheFind(shard, hash, path);
    if (tmp != NULL) {
-      tmp->changeTime = 0;
+      HgfsCacheRemove(shard, tmp);
    }
-   pthread_mutex_unlock(&HgfsAttrCacheLock);
+   pthread_mutex_unlock(&shard->lock);
 }
 
+
 /*
  *----------------------------------------------------------------------
  *
- * HgfsPurgeCache
+ * HgfsInvalidateAttrCacheTree
  *
- *    This routine is called by an independent thread to purge the cache,
- *    for performance reasons, the deletion is done in random based
- *    on the order of iteration.
+ *    Invalidate the cache entries for a path and everything below it,
+ *    after a directory is renamed or removed.
  *
  * Results:
  *    None
@@ -436,28 +452,29 @@ HgfsInvalidateAttrCache(const char* path)      //IN: Path to file
  *----------------------------------------------------------------------
  */
 
-void*
-HgfsPurgeCache(void* unused)      //IN: Thread argument
+void
+HgfsInvalidateAttrCacheTree(const char* path)  //IN: Path to file or dir
 {
-   gpointer key, value;
-   GHashTableIter iter;
+   size_t pathLen = strlen(path);
+   HgfsAttrCache *tmp;
+   HgfsAttrCache *next;
+   unsigned int i;
 
-   while (1) {
-      sleep(CACHE_PURGE_SLEEP_TIME);
+   /* A trailing separator, as in the root path, is part of the prefix. */
+   if (pathLen > 0 && path[pathLen - 1] == '/') {
+      pathLen--;
+   }
 
-      pthread_mutex_lock(&HgfsAttrCacheLock);
+   for (i = 0; i < CACHE_SHARDS; i++) {
+      HgfsAttrCacheShard *shard = &attrCache[i];
 
-      if (g_hash_table_size(g_hash_table) >= HASH_THRESHOLD_SIZE) {
-         g_hash_table_iter_init(&iter, g_hash_table);
-         while (g_hash_table_iter_next(&iter, &key, &value) &&
-               (g_hash_table_size(g_hash_table) >= HASH_PURGE_SIZE)) {
-            g_hash_table_iter_remove(&iter);
-            free(value);
+      pthread_mutex_lock(&shard->lock);
+      list_for_each_entry_safe(tmp, next, &shard->lru, lru) {
+         if (strncmp(tmp->path, path, pathLen) == 0 &&
+             (tmp->path[pathLen] == '\0' || tmp->path[pathLen] == '/')) {
+            HgfsCacheRemove(shard, tmp);
          }
       }
-
-      pthread_mutex_unlock(&HgfsAttrCacheLock);
+      pthread_mutex_unlock(&shard->lock);
    }
-   return 0;
 }
-#endif
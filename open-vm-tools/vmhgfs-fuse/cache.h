@@ -25,10 +25,14 @@
 #ifndef _HGFS_DRIVER_CACHE_H_
 #define _HGFS_DRIVER_CACHE_H_
 
+/* HgfsGetAttrCache result when the path is not cached. */
+#define HGFS_ATTR_CACHE_MISS 1
+
 int HgfsGetAttrCache(const char* path, HgfsAttrInfo *attr);
 int HgfsSetAttrCache(const char* path, HgfsAttrInfo *attr);
-void HgfsInitCache();
-void* HgfsPurgeCache(void*);
+int HgfsSetNegativeAttrCache(const char* path);
+void HgfsInitCache(void);
 void HgfsInvalidateAttrCache(const char* path);
+void HgfsInvalidateAttrCacheTree(const char* path);
 
 #endif
@@ -78,6 +78,12 @@ const struct fuse_opt vmhgfsOpts[] = {
      /* We will change the default value, unless it is specified explicitly. */
      FUSE_OPT_KEY("big_writes",     KEY_BIG_WRITES),
      FUSE_OPT_KEY("nobig_writes",   KEY_NO_BIG_WRITES),
+     VMHGFS_OPT("lowlevel",         lowLevel, TRUE),
+     /* Consumed here as the low-level API does not parse them. */
+     VMHGFS_OPT("entry_timeout=%lf", entryTimeout, 0),
+     VMHGFS_OPT("attr_timeout=%lf", attrTimeout, 0),
+     VMHGFS_OPT("max_requests=%i",  maxRequests, 0),
+     VMHGFS_OPT("pagecache",        pageCache, TRUE),
 
      FUSE_OPT_KEY("-V",             KEY_VERSION),
      FUSE_OPT_KEY("--version",      KEY_VERSION),
@@ -121,11 +127,16 @@ Usage(char *prog_name)  // IN
            "                           1 - system OS version is not supported for HGFS FUSE\n"
            "                           2 - system needs FUSE packages for HGFS FUSE\n"
            "\n"
-#ifdef VMX86_DEVEL
            "vmhgfs options:\n"
+           "    -o lowlevel            use the inode based FUSE low-level API\n"
+           "    -o entry_timeout=T     cache timeout for names (1.0s)\n"
+           "    -o attr_timeout=T      cache timeout for attributes (1.0s)\n"
+           "    -o max_requests=N      maximum HGFS requests in flight (4)\n"
+           "    -o pagecache           keep cached pages of unchanged files\n"
+#ifdef VMX86_DEVEL
            "    -l   --loglevel NUM    set loglevel=NUM only available in debug build.\n"
-           "\n"
 #endif
+           "\n"
            , prog_name, prog_name, prog_name);
 }
 
@@ -502,12 +513,47 @@ vmhgfsPreprocessArgs(struct fuse_args *outargs)    // IN/OUT
 #else
    config.addBigWrites = TRUE;
 #endif
+   config.lowLevel = FALSE;
+   config.entryTimeout = HGFS_DEFAULT_TTL;
+   config.attrTimeout = HGFS_DEFAULT_TTL;
+   config.maxRequests = HGFS_TRANSPORT_DEFAULT_REQUESTS;
+   config.pageCache = FALSE;
 
    res = fuse_opt_parse(outargs, &config, vmhgfsOpts, vmhgfsOptProc);
    if (res != 0) {
       goto exit;
    }
 
+   gState->lowLevel = config.lowLevel;
+   gState->entryTimeout = config.entryTimeout;
+   gState->attrTimeout = config.attrTimeout;
+   gState->maxRequests = MAX(config.maxRequests, 1);
+   gState->pageCache = config.pageCache;
+
+   if (!gState->lowLevel) {
+      char opt[64];
+
+      /* Hand the timeouts back to the high-level library. */
+      Str_Sprintf(opt, sizeof opt, "-oentry_timeout=%g", config.entryTimeout);
+      res = fuse_opt_add_arg(outargs, opt);
+      if (res != 0) {
+         goto exit;
+      }
+      Str_Sprintf(opt, sizeof opt, "-oattr_timeout=%g", config.attrTimeout);
+      res = fuse_opt_add_arg(outargs, opt);
+      if (res != 0) {
+         goto exit;
+      }
+
+      /* The library compares mtime and size on open for us. */
+      if (config.pageCache) {
+         res = fuse_opt_add_arg(outargs, "-oauto_cache");
+         if (res != 0) {
+            goto exit;
+         }
+      }
+   }
+
 #ifdef VMX86_DEVEL
    LOGLEVEL_THRESHOLD = config.logLevel;
 #endif
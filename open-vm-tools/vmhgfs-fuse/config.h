@@ -32,6 +32,11 @@ struct vmhgfsConfig {
 #endif
    int addBigWrites;
    int addAllowOther;
+   int lowLevel;
+   double entryTimeout;
+   double attrTimeout;
+   int maxRequests;
+   int pageCache;
 };
 
 int vmhgfsOptProc(void *data, const char *arg,
@@ -22,6 +22,7 @@
  * File operations for the hgfs driver.
  */
 #include "module.h"
+#include "cache.h"
 
 
 #define HGFS_CREATE_DIR_MASK (HGFS_CREATE_DIR_VALID_FILE_NAME | \
@@ -217,6 +218,136 @@ out:
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsDirClose --
+ *
+ *    Close a search handle opened by HgfsDirOpen.
+ *
+ * Results:
+ *    Returns zero on success, or negative error on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+HgfsDirClose(HgfsHandle handle)     // IN: Handle to the dir
+{
+   HgfsReq *req;
+   int result;
+   HgfsOp opUsed;
+   HgfsStatus replyStatus;
+
+   LOG(6, ("Entry(handle = %u)\n", handle));
+
+   req = HgfsGetNewRequest();
+   if (!req) {
+      LOG(4, ("Out of memory while getting new request.\n"));
+      result = -ENOMEM;
+      goto out;
+   }
+
+retry:
+   opUsed = hgfsVersionSearchClose;
+   if (opUsed == HGFS_OP_SEARCH_CLOSE_V3) {
+      HgfsRequestSearchCloseV3 *requestV3 = HgfsGetRequestPayload(req);
+
+      requestV3->search = handle;
+      requestV3->reserved = 0;
+      req->payloadSize = sizeof(*requestV3) + HgfsGetRequestHeaderSize();
+
+   } else {
+      HgfsRequestSearchClose *request;
+
+      request = (HgfsRequestSearchClose *)(HGFS_REQ_PAYLOAD(req));
+      request->search = handle;
+      req->payloadSize = sizeof *request;
+   }
+
+   /* Fill in header here as payloadSize needs to be there. */
+   HgfsPackHeader(req, opUsed);
+
+   /* Send the request and process the reply. */
+   result = HgfsSendRequest(req);
+   if (result == 0) {
+      replyStatus = HgfsGetReplyStatus(req);
+      result = HgfsStatusConvertToLinux(replyStatus);
+
+      switch (result) {
+      case 0:
+         LOG(6, ("Closed search handle %u\n", handle));
+         break;
+      case -EPROTO:
+         /* Retry with older version(s). Set globally. */
+         if (opUsed == HGFS_OP_SEARCH_CLOSE_V3) {
+            LOG(4, ("Version 3 not supported. Falling back to version 1.\n"));
+            hgfsVersionSearchClose = HGFS_OP_SEARCH_CLOSE;
+            goto retry;
+         }
+         LOG(4, ("Server returned error: %d, opUsed = %d\n", result, opUsed));
+         break;
+      default:
+         LOG(4, ("Server returned error: %d\n", result));
+         break;
+      }
+   } else if (result == -EIO) {
+      LOG(4, ("Timed out. error: %d\n", result));
+   } else if (result == -EPROTO) {
+      LOG(4, ("Server returned error: %d\n", result));
+   } else {
+      LOG(4, ("Unknown error: %d\n", result));
+   }
+
+out:
+   HgfsFreeRequest(req);
+   LOG(6, ("Exit(%d)\n", result));
+   return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsReadDirCacheAttr --
+ *
+ *    Add the attributes of a directory entry to the attribute cache.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsReadDirCacheAttr(const char *dirPath,  // IN: Path of the dir
+                     const char *name,     // IN: Escaped entry name
+                     HgfsAttrInfo *attr)   // IN: Entry attributes
+{
+   size_t dirPathLen = strlen(dirPath);
+   char *path;
+
+   /* The root of the share may end with a separator. */
+   if (dirPathLen > 0 && dirPath[dirPathLen - 1] == '/') {
+      dirPathLen--;
+   }
+
+   path = Str_Asprintf(NULL, "%.*s/%s", (int)dirPathLen, dirPath, name);
+   if (path == NULL) {
+      return;
+   }
+
+   HgfsSetAttrCache(path, attr);
+   free(path);
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -230,17 +361,22 @@ out:
  *    server, while for V3 we may have multiple directory entries. The
  *    number of entries can be read from the reply packet.
  *
+ *    The attributes of each entry are added to the attribute cache, so
+ *    listing a directory with its attributes (ls -l, find) does not
+ *    need a getattr round trip per entry.
+ *
  * Results:
  *    0 on success, anything else on failure.
  *
  * Side effects:
- *    None
+ *    The attribute cache is updated.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-HgfsReadDirFromReply(uint32 *f_pos,     // IN/OUT: Offset
+HgfsReadDirFromReply(const char *dirPath, // IN: Path of the dir or NULL
+                     uint32 *f_pos,     // IN/OUT: Offset
                      void *vfsDirent,   // OUT: Buffer to copy dentries into
                      fuse_fill_dir_t filldir, // IN:  Filler function
                      HgfsReq *req,      // IN:  The request containing reply
@@ -249,7 +385,7 @@ HgfsReadDirFromReply(uint32 *f_pos,     // IN/OUT: Offset
                                         //      more entries
 {
    uint32 replyCount;
-   HgfsAttrInfo attr;
+   HgfsAttrInfo attr = {0};
    HgfsDirEntry *hgfsDirent = NULL; /* Only for V3. */
    char *escName = NULL;            /* Buffer for escaped version of name */
    size_t escNameLength = NAME_MAX + 1;
@@ -371,6 +507,11 @@ HgfsReadDirFromReply(uint32 *f_pos,     // IN/OUT: Offset
       /* Reuse fileNameLength to store the filename length after escape. */
       fileNameLength = result;
 
+      if (dirPath != NULL &&
+          strcmp(escName, ".") != 0 && strcmp(escName, "..") != 0) {
+         HgfsReadDirCacheAttr(dirPath, escName, &attr);
+      }
+
       /* Assign the correct dentry type. */
       switch (attr.type) {
       case HGFS_FILE_TYPE_SYMLINK:
@@ -547,13 +688,14 @@ HgfsRequestDirEntries(HgfsHandle searchHandle, // IN: Handle to dir
  *    means it succeeded).
  *
  * Side effects:
- *    None
+ *    The attributes of the entries are cached if the path is given.
  *
  *----------------------------------------------------------------------
  */
 
 int
 HgfsReaddir(HgfsHandle handle,        // IN:  Directory handle to read from
+            const char *path,         // IN:  Path of the dir or NULL
             void *dirent,             // OUT: Buffer to copy dentries into
             fuse_fill_dir_t filldir)  // IN:  Filler function
 {
@@ -581,8 +723,8 @@ HgfsReaddir(HgfsHandle handle,        // IN:  Directory handle to read from
          break;
       }
 
-      result = HgfsReadDirFromReply(&f_pos, dirent, filldir, request, opUsed,
-                                    &done);
+      result = HgfsReadDirFromReply(path, &f_pos, dirent, filldir, request,
+                                    opUsed, &done);
 
       LOG(4, ("f_pos = %d\n", f_pos));
       if (result == -ENAMETOOLONG) {
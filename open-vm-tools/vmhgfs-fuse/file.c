@@ -894,6 +894,159 @@ out:
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * HgfsDoCopyFileRange --
+ *
+ *    Send a copy file range request to the server, which copies the data
+ *    between the two open files on the host.
+ *
+ * Results:
+ *    Returns the number of bytes copied on success, or an error on failure.
+ *
+ * Side effects:
+ *    None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static ssize_t
+HgfsDoCopyFileRange(HgfsHandle srcHandle,   // IN: Handle of the source file
+                    loff_t srcOffset,       // IN: Offset to copy from
+                    HgfsHandle dstHandle,   // IN: Handle of the target file
+                    loff_t dstOffset,       // IN: Offset to copy to
+                    size_t count)           // IN: Number of bytes to copy
+{
+   HgfsReq *req;
+   ssize_t result = 0;
+   HgfsRequestCopyFileRangeV4 *request;
+   HgfsStatus replyStatus;
+
+   req = HgfsGetNewRequest();
+   if (!req) {
+      LOG(4, ("Out of memory while getting new request\n"));
+      result = -ENOMEM;
+      goto out;
+   }
+
+   request = HgfsGetRequestPayload(req);
+   request->srcFile = srcHandle;
+   request->dstFile = dstHandle;
+   request->srcOffset = srcOffset;
+   request->dstOffset = dstOffset;
+   request->length = count;
+   request->flags = 0;
+   request->reserved = 0;
+   req->payloadSize = sizeof *request + HgfsGetRequestHeaderSize();
+
+   /* Fill in header here as payloadSize needs to be there. */
+   HgfsPackHeader(req, HGFS_OP_COPY_FILE_RANGE_V4);
+
+   /* Send the request and process the reply. */
+   result = HgfsSendRequest(req);
+   if (result == 0) {
+      /* Get the reply. */
+      replyStatus = HgfsGetReplyStatus(req);
+      result = HgfsStatusConvertToLinux(replyStatus);
+
+      switch (result) {
+      case 0: {
+         HgfsReplyCopyFileRangeV4 *reply = HgfsGetReplyPayload(req);
+
+         LOG(6, ("copied %"FMT64"u bytes\n", reply->actualSize));
+         result = MIN(reply->actualSize, count);
+         break;
+      }
+      case -EPROTO:
+         /* The server does not support it after all, copy in the guest. */
+         LOG(4, ("Copy file range not supported.\n"));
+         gState->copyFileRangeSupported = FALSE;
+         result = -EOPNOTSUPP;
+         break;
+
+      default:
+         LOG(4, ("Server returned error: %"FMTSZ"d\n", result));
+         break;
+      }
+   } else if (result == -EIO) {
+      LOG(8, ("Timed out. error: %"FMTSZ"d\n", result));
+   } else if (result == -EPROTO) {
+      LOG(4, ("Server returned error: %"FMTSZ"d\n", result));
+   } else {
+      LOG(4, ("Unknown error: %"FMTSZ"d\n", result));
+   }
+
+out:
+   HgfsFreeRequest(req);
+   return result;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsCopyFileRange --
+ *
+ *    Called whenever a process copies a range of a file in our filesystem
+ *    to another one, e.g. with copy_file_range(2). The data does not go
+ *    through the guest.
+ *
+ * Results:
+ *    Returns the number of bytes copied on success, or an error on
+ *    failure. -EOPNOTSUPP makes the caller copy the data itself.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+ssize_t
+HgfsCopyFileRange(struct fuse_file_info *fiIn,   // IN: Source file info
+                  loff_t offsetIn,               // IN: Offset to copy from
+                  struct fuse_file_info *fiOut,  // IN: Target file info
+                  loff_t offsetOut,              // IN: Offset to copy to
+                  size_t count)                  // IN: Number of bytes to copy
+{
+   ssize_t result;
+   size_t remainingCount = count;
+
+   ASSERT(NULL != fiIn);
+   ASSERT(NULL != fiOut);
+
+   LOG(6, ("Entry(0x%"FMT64"x @ 0x%"FMT64"x -> 0x%"FMT64"x @ 0x%"FMT64"x, "
+           "0x%"FMTSZ"x bytes)\n",
+           fiIn->fh, offsetIn, fiOut->fh, offsetOut, count));
+
+   if (!gState->copyFileRangeSupported) {
+      result = -EOPNOTSUPP;
+      goto out;
+   }
+
+   do {
+      result = HgfsDoCopyFileRange(fiIn->fh, offsetIn, fiOut->fh, offsetOut,
+                                   remainingCount);
+      if (result < 0) {
+         LOG(4, ("Error: DoCopyFileRange -> %"FMTSZ"d\n", result));
+         break;
+      }
+      remainingCount -= result;
+      offsetIn += result;
+      offsetOut += result;
+   } while ((result > 0) && (remainingCount > 0));
+
+   /* Report a partial copy rather than the error which stopped it. */
+   if (result >= 0 || remainingCount < count) {
+      result = count - remainingCount;
+   }
+
+out:
+   LOG(6, ("Exit(0x%"FMTSZ"x)\n", result));
+   return result;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -37,6 +37,8 @@ typedef struct HgfsFuseState {
    Bool sessionEnabled;
    uint64 sessionId;
    uint8 headerVersion;
+   /* The server copies file ranges with HGFS_OP_COPY_FILE_RANGE_V4. */
+   Bool copyFileRangeSupported;
    /*
     * When mount a subdirectory of hgfs shared directory, basePath holds
     * the prefix to the root. e.g. 'mount.vmhgfs .host:/shared/sub /hgfs',
@@ -44,6 +46,15 @@ typedef struct HgfsFuseState {
     */
    char *basePath;
    size_t basePathLen;
+   /* Serve the mount with the inode based FUSE low-level API. */
+   Bool lowLevel;
+   /* Kernel cache timeouts for names and attributes, in seconds. */
+   double entryTimeout;
+   double attrTimeout;
+   /* Most requests sent to the host without waiting for a reply. */
+   uint32 maxRequests;
+   /* Keep the kernel page cache of unchanged files across opens. */
+   Bool pageCache;
 
    GKeyFile *conf;
 
@@ -685,6 +685,130 @@ HgfsCalcBlockSize(uint64 tsize)
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsAttrToStat --
+ *
+ *    Populate a struct stat from the HGFS attributes of a file.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+HgfsAttrToStat(const HgfsAttrInfo *attr,  // IN: HGFS attributes
+               struct stat *stbuf)        // OUT: stat to fill
+{
+   uint32 d_type;
+
+   memset(stbuf, 0, sizeof *stbuf);
+
+   if (attr->mask & HGFS_ATTR_VALID_SPECIAL_PERMS) {
+      stbuf->st_mode |= (attr->specialPerms << 9);
+   }
+   if (attr->mask & HGFS_ATTR_VALID_OWNER_PERMS) {
+      stbuf->st_mode |= (attr->ownerPerms << 6);
+   }
+   if (attr->mask & HGFS_ATTR_VALID_GROUP_PERMS) {
+      stbuf->st_mode |= (attr->groupPerms << 3);
+   }
+   if (attr->mask & HGFS_ATTR_VALID_OTHER_PERMS) {
+      stbuf->st_mode |= (attr->otherPerms);
+   }
+
+   /* Mask the access mode. */
+   switch (attr->type) {
+   case HGFS_FILE_TYPE_SYMLINK:
+      d_type = DT_LNK;
+      break;
+
+   case HGFS_FILE_TYPE_REGULAR:
+      d_type = DT_REG;
+      break;
+
+   case HGFS_FILE_TYPE_DIRECTORY:
+      d_type = DT_DIR;
+      break;
+
+   default:
+      d_type = DT_UNKNOWN;
+      break;
+   }
+
+   stbuf->st_mode |= d_type << 12;
+   stbuf->st_blksize = HGFS_BLOCKSIZE;
+   stbuf->st_blocks = HgfsCalcBlockSize(attr->size);
+   stbuf->st_size = attr->size;
+   stbuf->st_ino = attr->hostFileId;
+   stbuf->st_nlink = 1;
+   stbuf->st_uid = attr->userId;
+   stbuf->st_gid = attr->groupId;
+   stbuf->st_rdev = 0;
+
+   if (attr->mask & HGFS_ATTR_VALID_ACCESS_TIME) {
+      HGFS_SET_TIME(stbuf->st_atime, attr->accessTime);
+   }
+   if (attr->mask & HGFS_ATTR_VALID_WRITE_TIME) {
+      HGFS_SET_TIME(stbuf->st_mtime, attr->writeTime);
+   }
+   if (attr->mask & HGFS_ATTR_VALID_CHANGE_TIME) {
+      HGFS_SET_TIME(stbuf->st_ctime, attr->attrChangeTime);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsAttrCheckAccess --
+ *
+ *    Check the access mask of an access(2) call against the HGFS
+ *    attributes of a file.
+ *
+ * Results:
+ *    Returns zero if access is granted, -EACCES otherwise.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+HgfsAttrCheckAccess(const HgfsAttrInfo *attr,  // IN: HGFS attributes
+                    int mask)                  // IN: access mask
+{
+   uint32 effectivePermissions;
+
+   if (mask == F_OK) {
+      return 0;  /* assume the attr retrieval did the validation */
+   }
+
+   if (attr->mask & HGFS_ATTR_VALID_EFFECTIVE_PERMS) {
+      effectivePermissions = attr->effectivePerms;
+   } else {
+      /*
+       * If the server did not return actual effective permissions then
+       * need to calculate ourselves. However we should avoid unnecessary
+       * denial of access so perform optimistic permissions calculation.
+       * It is safe since host enforces necessary restrictions regardless of
+       * the client's decisions.
+       */
+      effectivePermissions = (attr->ownerPerms |
+                              attr->groupPerms |
+                              attr->otherPerms);
+   }
+
+   return ((effectivePermissions & mask) != mask) ? -EACCES : 0;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -75,6 +75,13 @@ HgfsWrite(struct fuse_file_info *fi,
           size_t count,
           loff_t offset);
 
+ssize_t
+HgfsCopyFileRange(struct fuse_file_info *fiIn,
+                  loff_t offsetIn,
+                  struct fuse_file_info *fiOut,
+                  loff_t offsetOut,
+                  size_t count);
+
 int
 HgfsRename(const char* from, const char* to);
 
@@ -119,8 +126,12 @@ HgfsGetOpenMode(uint32 flags);
 int
 HgfsDirOpen(const char* path, HgfsHandle* handle);
 
+int
+HgfsDirClose(HgfsHandle handle);
+
 int
 HgfsReaddir(HgfsHandle handle,
+            const char *path,
             void *dirent,
             fuse_fill_dir_t filldir);
 
@@ -142,4 +153,12 @@ HgfsResetOps(void);
 unsigned long
 HgfsCalcBlockSize(uint64 tsize);
 
+void
+HgfsAttrToStat(const HgfsAttrInfo *attr,
+               struct stat *stbuf);
+
+int
+HgfsAttrCheckAccess(const HgfsAttrInfo *attr,
+                    int mask);
+
 #endif // _HGFS_DRIVER_FSUTIL_H_
@@ -0,0 +1,2086 @@
+/*********************************************************
+ * Copyright (C) 2016 VMware, Inc. All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation version 2.1 and no later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the Lesser GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin St, Fifth Floor, Boston, MA  02110-1301 USA.
+ *
+ *********************************************************/
+
+/*
+ * lowlevel.c --
+ *
+ * Entry points for the inode based FUSE low-level API of HGFS.
+ *
+ * The kernel names files by node ids, which we map to inodes recording
+ * the parent and name of the file. The HGFS path of a file is rebuilt
+ * from the chain of parents, so a rename only updates the renamed inode.
+ * An inode lives as long as the kernel remembers it (its lookup count is
+ * not zero) or it has children in the table.
+ *
+ * With -o pagecache the kernel keeps the pages of a file across opens
+ * while its write time and size are unchanged, and the pages are dropped
+ * when a lookup or getattr finds the file changed on the host.
+ */
+
+#include "module.h"
+#include <pthread.h>
+#include <fuse_lowlevel.h>
+#include <glib.h>
+#include "cache.h"
+#include "file.h"
+#include "lowlevel.h"
+
+typedef struct HgfsInode {
+   fuse_ino_t ino;
+   struct HgfsInode *parent;  /* Referenced parent, NULL for the root */
+   char *name;                /* Name in the parent directory */
+   uint64 nlookup;            /* Lookups not yet forgotten by the kernel */
+   uint32 refCount;           /* One for nlookup, one per child */
+   Bool unlinked;             /* Removed from the name table */
+   Bool cacheValid;           /* The kernel may cache pages of the file */
+   uint64 cacheWriteTime;     /* Write time and size the pages are of */
+   uint64 cacheSize;
+} HgfsInode;
+
+/* State of an open directory, filled on the first readdir. */
+typedef struct HgfsLowLevelDir {
+   HgfsHandle handle;         /* Search handle */
+   fuse_req_t req;            /* Request being filled */
+   char *buf;                 /* Entries added with fuse_add_direntry */
+   size_t size;
+   size_t allocated;
+   Bool filled;
+   int error;
+} HgfsLowLevelDir;
+
+/* Lock for the inode tables. */
+static pthread_mutex_t gInodeLock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *gInodeTable;      /* ino -> HgfsInode */
+static GHashTable *gInodeNameTable;  /* (parent, name) -> HgfsInode */
+static HgfsInode gRootInode;
+static fuse_ino_t gNextIno = FUSE_ROOT_ID + 1;
+
+/* Channel of the mount, for cache invalidation notifications. */
+static struct fuse_chan *gChannel;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsInodeNameHash --
+ *
+ *    Hash an inode by its parent and name.
+ *
+ * Results:
+ *    The hash value.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static guint
+HgfsInodeNameHash(gconstpointer key)  // IN: inode
+{
+   const HgfsInode *inode = key;
+
+   return g_str_hash(inode->name) ^ (guint)(inode->parent->ino * 31);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsInodeNameEqual --
+ *
+ *    Compare two inodes by parent and name.
+ *
+ * Results:
+ *    TRUE if both name the same file, FALSE otherwise.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static gboolean
+HgfsInodeNameEqual(gconstpointer a,  // IN: inode
+                   gconstpointer b)  // IN: inode
+{
+   const HgfsInode *inodeA = a;
+   const HgfsInode *inodeB = b;
+
+   return inodeA->parent == inodeB->parent &&
+          strcmp(inodeA->name, inodeB->name) == 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsInodeFindLocked --
+ *
+ *    Find the inode of a node id. The caller holds gInodeLock.
+ *
+ * Results:
+ *    The inode, or NULL if the kernel passed a stale node id.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static HgfsInode *
+HgfsInodeFindLocked(fuse_ino_t ino)  // IN: node id
+{
+   return g_hash_table_lookup(gInodeTable, (gpointer)(uintptr_t)ino);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsInodeUnrefLocked --
+ *
+ *    Drop a reference on an inode. The caller holds gInodeLock.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    Unreferenced inodes are freed, dropping the reference they hold
+ *    on their parent.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsInodeUnrefLocked(HgfsInode *inode)  // IN: inode
+{
+   while (inode != NULL && --inode->refCount == 0) {
+      HgfsInode *parent = inode->parent;
+
+      ASSERT(inode != &gRootInode);
+      ASSERT(inode->nlookup == 0);
+      LOG(6, ("Free inode %lu (%s)\n", inode->ino, inode->name));
+      if (!inode->unlinked) {
+         g_hash_table_remove(gInodeNameTable, inode);
+      }
+      g_hash_table_remove(gInodeTable, (gpointer)(uintptr_t)inode->ino);
+      free(inode->name);
+      free(inode);
+      inode = parent;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsInodeUnlinkLocked --
+ *
+ *    Remove a name from the name table. The inode itself stays until
+ *    the kernel forgets it. The caller holds gInodeLock.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsInodeUnlinkLocked(HgfsInode *parent,  // IN: parent directory
+                      const char *name)   // IN: name in the parent
+{
+   HgfsInode key;
+   HgfsInode *inode;
+
+   key.parent = parent;
+   key.name = (char *)name;
+   inode = g_hash_table_lookup(gInodeNameTable, &key);
+   if (inode != NULL) {
+      g_hash_table_remove(gInodeNameTable, inode);
+      inode->unlinked = TRUE;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsInodeInit --
+ *
+ *    Create the inode tables holding the root.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsInodeInit(void)
+{
+   gInodeTable = g_hash_table_new(g_direct_hash, g_direct_equal);
+   gInodeNameTable = g_hash_table_new(HgfsInodeNameHash, HgfsInodeNameEqual);
+
+   /* The kernel never forgets the root. */
+   gRootInode.ino = FUSE_ROOT_ID;
+   gRootInode.name = "";
+   gRootInode.nlookup = 1;
+   gRootInode.refCount = 1;
+   g_hash_table_insert(gInodeTable, (gpointer)(uintptr_t)gRootInode.ino,
+                       &gRootInode);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsInodeFree --
+ *
+ *    Free an inode left in the table at unmount.
+ *
+ * Results:
+ *    TRUE, to remove it from the table.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static gboolean
+HgfsInodeFree(gpointer key,   // IN: node id
+              gpointer value, // IN: inode
+              gpointer data)  // IN: unused
+{
+   HgfsInode *inode = value;
+
+   if (inode != &gRootInode) {
+      free(inode->name);
+      free(inode);
+   }
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsInodeExit --
+ *
+ *    Destroy the inode tables.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsInodeExit(void)
+{
+   g_hash_table_destroy(gInodeNameTable);
+   gInodeNameTable = NULL;
+   g_hash_table_foreach_remove(gInodeTable, HgfsInodeFree, NULL);
+   g_hash_table_destroy(gInodeTable);
+   gInodeTable = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsInodePath --
+ *
+ *    Build the HGFS absolute path of an inode, or of a name in a
+ *    directory inode, by walking up the parents.
+ *
+ * Results:
+ *    Returns zero on success, or a negative error on failure.
+ *
+ * Side effects:
+ *    The caller frees the path.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+HgfsInodePath(fuse_ino_t ino,     // IN: node id
+              const char *name,   // IN: name in the directory or NULL
+              char **path)        // OUT: absolute path
+{
+   HgfsInode *inode;
+   HgfsInode *node;
+   size_t len;
+   size_t nameLen = 0;
+   char *p;
+   int res = 0;
+
+   *path = NULL;
+
+   pthread_mutex_lock(&gInodeLock);
+   inode = HgfsInodeFindLocked(ino);
+   if (inode == NULL) {
+      res = -ESTALE;
+      goto exit;
+   }
+
+   len = gState->basePathLen;
+   for (node = inode; node->parent != NULL; node = node->parent) {
+      if (node->unlinked) {
+         res = -ENOENT;
+         goto exit;
+      }
+      len += 1 + strlen(node->name);
+   }
+   if (name != NULL) {
+      nameLen = strlen(name);
+      len += 1 + nameLen;
+   }
+   if (len == gState->basePathLen) {
+      /* The root is the base path with a trailing '/', like FUSE's "/". */
+      len++;
+   }
+
+   *path = malloc(len + 1);
+   if (*path == NULL) {
+      LOG(4, ("Can't allocate memory!\n"));
+      res = -ENOMEM;
+      goto exit;
+   }
+
+   p = *path + len;
+   *p = '\0';
+   if (name != NULL) {
+      p -= nameLen;
+      memcpy(p, name, nameLen);
+      *--p = '/';
+   }
+   for (node = inode; node->parent != NULL; node = node->parent) {
+      size_t size = strlen(node->name);
+
+      p -= size;
+      memcpy(p, node->name, size);
+      *--p = '/';
+   }
+   if (p == *path + len) {
+      *--p = '/';
+   }
+   ASSERT(p == *path + gState->basePathLen);
+   memcpy(*path, gState->basePath, gState->basePathLen);
+
+exit:
+   pthread_mutex_unlock(&gInodeLock);
+   return res;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsInodeLookup --
+ *
+ *    Count a lookup of a name in a directory, creating its inode on the
+ *    first lookup.
+ *
+ * Results:
+ *    Returns zero and the node id on success, or a negative error on
+ *    failure.
+ *
+ * Side effects:
+ *    The kernel must forget the node id once for each lookup.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+HgfsInodeLookup(fuse_ino_t parentIno,  // IN: directory node id
+                const char *name,      // IN: name in the directory
+                fuse_ino_t *ino)       // OUT: node id
+{
+   HgfsInode key;
+   HgfsInode *parent;
+   HgfsInode *inode;
+   int res = 0;
+
+   pthread_mutex_lock(&gInodeLock);
+   parent = HgfsInodeFindLocked(parentIno);
+   if (parent == NULL) {
+      res = -ESTALE;
+      goto exit;
+   }
+
+   key.parent = parent;
+   key.name = (char *)name;
+   inode = g_hash_table_lookup(gInodeNameTable, &key);
+   if (inode == NULL) {
+      inode = calloc(1, sizeof *inode);
+      if (inode != NULL) {
+         inode->name = strdup(name);
+      }
+      if (inode == NULL || inode->name == NULL) {
+         LOG(4, ("Can't allocate memory!\n"));
+         free(inode);
+         res = -ENOMEM;
+         goto exit;
+      }
+      inode->ino = gNextIno++;
+      inode->parent = parent;
+      parent->refCount++;
+      g_hash_table_insert(gInodeTable, (gpointer)(uintptr_t)inode->ino, inode);
+      g_hash_table_insert(gInodeNameTable, inode, inode);
+      LOG(6, ("New inode %lu (%s) in %lu\n", inode->ino, name, parentIno));
+   }
+
+   if (inode->nlookup++ == 0) {
+      inode->refCount++;
+   }
+   *ino = inode->ino;
+
+exit:
+   pthread_mutex_unlock(&gInodeLock);
+   return res;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsInodeForget --
+ *
+ *    Drop lookups the kernel forgot.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    The inode is freed once forgotten and childless.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsInodeForget(fuse_ino_t ino,         // IN: node id
+                unsigned long nlookup)  // IN: lookups to drop
+{
+   HgfsInode *inode;
+
+   pthread_mutex_lock(&gInodeLock);
+   inode = HgfsInodeFindLocked(ino);
+   if (inode != NULL && inode != &gRootInode) {
+      ASSERT(nlookup <= inode->nlookup);
+      inode->nlookup -= MIN(nlookup, inode->nlookup);
+      if (inode->nlookup == 0) {
+         HgfsInodeUnrefLocked(inode);
+      }
+   }
+   pthread_mutex_unlock(&gInodeLock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsInodeUnlink --
+ *
+ *    Forget the name of a deleted file.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsInodeUnlink(fuse_ino_t parentIno,  // IN: directory node id
+                const char *name)      // IN: name in the directory
+{
+   HgfsInode *parent;
+
+   pthread_mutex_lock(&gInodeLock);
+   parent = HgfsInodeFindLocked(parentIno);
+   if (parent != NULL) {
+      HgfsInodeUnlinkLocked(parent, name);
+   }
+   pthread_mutex_unlock(&gInodeLock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsInodeRename --
+ *
+ *    Move an inode to its new parent and name. Its children follow it
+ *    since their paths are built from their parents.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    An inode replaced by the rename is unlinked.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsInodeRename(fuse_ino_t parentIno,     // IN: source directory node id
+                const char *name,         // IN: source name
+                fuse_ino_t newParentIno,  // IN: target directory node id
+                const char *newName)      // IN: target name
+{
+   HgfsInode key;
+   HgfsInode *parent;
+   HgfsInode *newParent;
+   HgfsInode *inode;
+   char *inodeName;
+
+   pthread_mutex_lock(&gInodeLock);
+   parent = HgfsInodeFindLocked(parentIno);
+   newParent = HgfsInodeFindLocked(newParentIno);
+   if (parent == NULL || newParent == NULL ||
+       (parent == newParent && strcmp(name, newName) == 0)) {
+      goto exit;
+   }
+
+   HgfsInodeUnlinkLocked(newParent, newName);
+
+   key.parent = parent;
+   key.name = (char *)name;
+   inode = g_hash_table_lookup(gInodeNameTable, &key);
+   if (inode == NULL) {
+      goto exit;
+   }
+
+   g_hash_table_remove(gInodeNameTable, inode);
+   inodeName = strdup(newName);
+   if (inodeName == NULL) {
+      /* We can't name it, the next lookup creates a new inode. */
+      inode->unlinked = TRUE;
+      goto exit;
+   }
+   free(inode->name);
+   inode->name = inodeName;
+   if (newParent != parent) {
+      newParent->refCount++;
+      inode->parent = newParent;
+      HgfsInodeUnrefLocked(parent);
+   }
+   g_hash_table_insert(gInodeNameTable, inode, inode);
+
+exit:
+   pthread_mutex_unlock(&gInodeLock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsInodeCacheValidate --
+ *
+ *    Check the attributes of a file against those its cached pages were
+ *    read with, and record them for the next check. Pages are cached
+ *    only with -o pagecache.
+ *
+ * Results:
+ *    TRUE if the cached pages are still valid. *changed is set if pages
+ *    were cached but the file changed on the host since.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+HgfsInodeCacheValidate(fuse_ino_t ino,             // IN: node id
+                       const HgfsAttrInfo *attr,   // IN: current attributes
+                       Bool *changed)              // OUT: pages are stale
+{
+   HgfsInode *inode;
+   Bool valid = FALSE;
+
+   *changed = FALSE;
+   if (!gState->pageCache || attr->type != HGFS_FILE_TYPE_REGULAR) {
+      return FALSE;
+   }
+
+   pthread_mutex_lock(&gInodeLock);
+   inode = HgfsInodeFindLocked(ino);
+   if (inode != NULL) {
+      if (inode->cacheValid) {
+         valid = inode->cacheWriteTime == attr->writeTime &&
+                 inode->cacheSize == attr->size;
+         *changed = !valid;
+      }
+      inode->cacheValid = TRUE;
+      inode->cacheWriteTime = attr->writeTime;
+      inode->cacheSize = attr->size;
+   }
+   pthread_mutex_unlock(&gInodeLock);
+   return valid;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelInvalInode --
+ *
+ *    Drop the pages the kernel cached for a file changed on the host.
+ *    This must not be called before the request that found the change
+ *    is replied.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelInvalInode(fuse_ino_t ino)  // IN: node id
+{
+   int res;
+
+   LOG(4, ("Invalidate pages of ino %lu\n", ino));
+   res = fuse_lowlevel_notify_inval_inode(gChannel, ino, 0, 0);
+   if (res != 0 && res != -ENOENT) {
+      LOG(4, ("Invalidate failed. error = %d\n", res));
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelGetattr --
+ *
+ *    Get the attributes of a file from the cache or the HGFS server.
+ *
+ * Results:
+ *    Returns zero on success, or a negative error on failure.
+ *
+ * Side effects:
+ *    The attribute cache is updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+HgfsLowLevelGetattr(const char *path,    // IN: absolute path
+                    HgfsAttrInfo *attr)  // OUT: attributes
+{
+   int res;
+
+   res = HgfsGetAttrCache(path, attr);
+   LOG(4, ("Retrieve attr from cache. result = %d \n", res));
+   if (res == HGFS_ATTR_CACHE_MISS) {
+      /* Retrieve new complete attribute settings and update the cache. */
+      res = HgfsPrivateGetattr(HGFS_INVALID_HANDLE, path, attr);
+      LOG(4, ("Retrieve attr from server. result = %d \n", res));
+      if (res == 0) {
+         /* Symlink targets are read by readlink, not from the cache. */
+         free(attr->fileName);
+         attr->fileName = NULL;
+         HgfsSetAttrCache(path, attr);
+      } else if (res == -ENOENT) {
+         HgfsSetNegativeAttrCache(path);
+      }
+   }
+   return res;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelEntry --
+ *
+ *    Look up a name in a directory for the kernel.
+ *
+ * Results:
+ *    Returns zero and the entry on success, or a negative error on
+ *    failure. *stale is set if the pages the kernel cached for the
+ *    entry must be invalidated.
+ *
+ * Side effects:
+ *    The lookup count of the entry inode is incremented.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+HgfsLowLevelEntry(fuse_ino_t parent,            // IN: directory node id
+                  const char *name,             // IN: name in the directory
+                  struct fuse_entry_param *e,   // OUT: entry
+                  Bool *stale)                  // OUT/OPT: pages are stale
+{
+   HgfsAttrInfo attr = {0};
+   char *path = NULL;
+   Bool changed;
+   int res;
+
+   memset(e, 0, sizeof *e);
+   if (stale != NULL) {
+      *stale = FALSE;
+   }
+
+   res = HgfsInodePath(parent, name, &path);
+   if (res < 0) {
+      goto exit;
+   }
+
+   res = HgfsLowLevelGetattr(path, &attr);
+   if (res < 0) {
+      goto exit;
+   }
+
+   res = HgfsInodeLookup(parent, name, &e->ino);
+   if (res < 0) {
+      goto exit;
+   }
+
+   HgfsAttrToStat(&attr, &e->attr);
+   e->attr_timeout = gState->attrTimeout;
+   e->entry_timeout = gState->entryTimeout;
+   HgfsInodeCacheValidate(e->ino, &attr, &changed);
+   if (stale != NULL) {
+      *stale = changed;
+   }
+
+exit:
+   free(path);
+   return res;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelReplyEntry --
+ *
+ *    Reply to a request creating a directory entry.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    If the request was interrupted the lookup is dropped again.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelReplyEntry(fuse_req_t req,                     // IN: request
+                       int res,                            // IN: result
+                       const struct fuse_entry_param *e)   // IN: entry
+{
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+   } else if (fuse_reply_entry(req, e) != 0) {
+      HgfsInodeForget(e->ino, 1);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelLookup --
+ *
+ *    Look up a name in a directory and get its attributes. A missing
+ *    name is replied with node id zero so the kernel caches it too.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelLookup(fuse_req_t req,      // IN: request
+                   fuse_ino_t parent,   // IN: directory node id
+                   const char *name)    // IN: name to look up
+{
+   struct fuse_entry_param e;
+   Bool stale;
+   int res;
+
+   LOG(4, ("Entry(parent = %lu, name = %s)\n", parent, name));
+   res = HgfsLowLevelEntry(parent, name, &e, &stale);
+   if (res == -ENOENT && gState->entryTimeout > 0) {
+      memset(&e, 0, sizeof e);
+      e.entry_timeout = gState->entryTimeout;
+      fuse_reply_entry(req, &e);
+   } else {
+      HgfsLowLevelReplyEntry(req, res, &e);
+      if (res == 0 && stale) {
+         HgfsLowLevelInvalInode(e.ino);
+      }
+   }
+   LOG(4, ("Exit(%d)\n", res));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelForget --
+ *
+ *    The kernel dropped lookups of a node id.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelForget(fuse_req_t req,          // IN: request
+                   fuse_ino_t ino,          // IN: node id
+                   unsigned long nlookup)   // IN: lookups to drop
+{
+   LOG(4, ("Entry(ino = %lu, nlookup = %lu)\n", ino, nlookup));
+   HgfsInodeForget(ino, nlookup);
+   fuse_reply_none(req);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelGetattrOp --
+ *
+ *    Get the attributes of a file.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelGetattrOp(fuse_req_t req,              // IN: request
+                      fuse_ino_t ino,              // IN: node id
+                      struct fuse_file_info *fi)   // IN: unused
+{
+   HgfsAttrInfo attr = {0};
+   struct stat st;
+   char *path = NULL;
+   Bool stale;
+   int res;
+
+   LOG(4, ("Entry(ino = %lu)\n", ino));
+   res = HgfsInodePath(ino, NULL, &path);
+   if (res < 0) {
+      goto exit;
+   }
+
+   res = HgfsLowLevelGetattr(path, &attr);
+   if (res < 0) {
+      goto exit;
+   }
+
+   HgfsInodeCacheValidate(ino, &attr, &stale);
+   HgfsAttrToStat(&attr, &st);
+   fuse_reply_attr(req, &st, gState->attrTimeout);
+   if (stale) {
+      HgfsLowLevelInvalInode(ino);
+   }
+
+exit:
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+   }
+   LOG(4, ("Exit(%d)\n", res));
+   free(path);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelSetattr --
+ *
+ *    Change the mode, owner, size or times of a file.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelSetattr(fuse_req_t req,              // IN: request
+                    fuse_ino_t ino,              // IN: node id
+                    struct stat *st,             // IN: new attributes
+                    int toSet,                   // IN: FUSE_SET_ATTR_xxx
+                    struct fuse_file_info *fi)   // IN: unused
+{
+   HgfsAttrInfo newAttr = {0};
+   HgfsAttrInfo *attr = &newAttr;
+   uint64 now = HGFS_GET_TIME(time(NULL));
+   struct stat stbuf;
+   char *path = NULL;
+   int res;
+
+   LOG(4, ("Entry(ino = %lu, toSet = %#x)\n", ino, toSet));
+   res = HgfsInodePath(ino, NULL, &path);
+   if (res < 0) {
+      goto exit;
+   }
+
+   if (toSet & FUSE_SET_ATTR_MODE) {
+      attr->mask |= (HGFS_ATTR_VALID_SPECIAL_PERMS |
+                     HGFS_ATTR_VALID_OWNER_PERMS |
+                     HGFS_ATTR_VALID_GROUP_PERMS |
+                     HGFS_ATTR_VALID_OTHER_PERMS);
+      attr->specialPerms = (st->st_mode & (S_ISUID | S_ISGID | S_ISVTX)) >> 9;
+      attr->ownerPerms = (st->st_mode & S_IRWXU) >> 6;
+      attr->groupPerms = (st->st_mode & S_IRWXG) >> 3;
+      attr->otherPerms = st->st_mode & S_IRWXO;
+   }
+   if (toSet & FUSE_SET_ATTR_UID) {
+      attr->mask |= HGFS_ATTR_VALID_USERID;
+      attr->userId = st->st_uid;
+   }
+   if (toSet & FUSE_SET_ATTR_GID) {
+      attr->mask |= HGFS_ATTR_VALID_GROUPID;
+      attr->groupId = st->st_gid;
+   }
+   if (toSet & FUSE_SET_ATTR_SIZE) {
+      attr->mask |= (HGFS_ATTR_VALID_SIZE |
+                     HGFS_ATTR_VALID_WRITE_TIME |
+                     HGFS_ATTR_VALID_CHANGE_TIME);
+      attr->size = st->st_size;
+      attr->writeTime = now;
+   }
+   if (attr->mask != 0) {
+      /* As the path API, stamp the access and change times. */
+      attr->mask |= HGFS_ATTR_VALID_ACCESS_TIME;
+      attr->accessTime = attr->attrChangeTime = now;
+   }
+
+   if (toSet & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+      HgfsAttrInfo curAttr = {0};
+
+      res = HgfsLowLevelGetattr(path, &curAttr);
+      if (res < 0) {
+         goto exit;
+      }
+
+      /*
+       * There is no way to pass not 'followSymlinks' to setattr, so do
+       * nothing for the times of a symlink, as the path API.
+       */
+      if (curAttr.type != HGFS_FILE_TYPE_SYMLINK) {
+         if (toSet & FUSE_SET_ATTR_ATIME) {
+            attr->mask |= HGFS_ATTR_VALID_ACCESS_TIME;
+            attr->accessTime = (toSet & FUSE_SET_ATTR_ATIME_NOW) ? now :
+               HgfsConvertToNtTime(st->st_atim.tv_sec, st->st_atim.tv_nsec);
+         }
+         if (toSet & FUSE_SET_ATTR_MTIME) {
+            attr->mask |= HGFS_ATTR_VALID_WRITE_TIME;
+            attr->writeTime = (toSet & FUSE_SET_ATTR_MTIME_NOW) ? now :
+               HgfsConvertToNtTime(st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+         }
+      }
+   }
+
+   if (attr->mask != 0) {
+      res = HgfsSetattr(path, attr);
+      if (res < 0) {
+         LOG(4, ("path = %s , HgfsSetattr failed. res = %d\n", path, res));
+         goto exit;
+      }
+   }
+
+   /* Retrieve new complete attribute settings and update the cache. */
+   HgfsInvalidateAttrCache(path);
+   memset(attr, 0, sizeof *attr);
+   res = HgfsLowLevelGetattr(path, attr);
+   if (res < 0) {
+      LOG(4, ("path = %s , res = %d\n", path, res));
+      goto exit;
+   }
+
+   HgfsAttrToStat(attr, &stbuf);
+   fuse_reply_attr(req, &stbuf, gState->attrTimeout);
+
+exit:
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+   }
+   LOG(4, ("Exit(%d)\n", res));
+   free(path);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelReadlink --
+ *
+ *    Read the target of a symbolic link.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelReadlink(fuse_req_t req,   // IN: request
+                     fuse_ino_t ino)   // IN: node id
+{
+   HgfsAttrInfo attr = {0};
+   char *path = NULL;
+   int res;
+
+   LOG(4, ("Entry(ino = %lu)\n", ino));
+   res = HgfsInodePath(ino, NULL, &path);
+   if (res < 0) {
+      goto exit;
+   }
+
+   /* The attributes fileName field will hold the symlink target name. */
+   res = HgfsPrivateGetattr(HGFS_INVALID_HANDLE, path, &attr);
+   if (res < 0) {
+      goto exit;
+   }
+   if (attr.fileName == NULL) {
+      res = -EINVAL;
+      goto exit;
+   }
+
+   LOG(4, ("ReadLink: Path = %s, attr.fileName = %s \n", path, attr.fileName));
+   fuse_reply_readlink(req, attr.fileName);
+
+exit:
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+   }
+   LOG(4, ("Exit(%d)\n", res));
+   free(attr.fileName);
+   free(path);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelMkdir --
+ *
+ *    Create a directory.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelMkdir(fuse_req_t req,      // IN: request
+                  fuse_ino_t parent,   // IN: directory node id
+                  const char *name,    // IN: name of the new directory
+                  mode_t mode)         // IN: mode of the new directory
+{
+   struct fuse_entry_param e;
+   char *path = NULL;
+   int res;
+
+   LOG(4, ("Entry(parent = %lu, name = %s, mode = %#o)\n", parent, name, mode));
+   res = HgfsInodePath(parent, name, &path);
+   if (res < 0) {
+      goto exit;
+   }
+
+   res = HgfsMkdir(path, mode);
+   if (res < 0) {
+      goto exit;
+   }
+
+   HgfsInvalidateAttrCache(path);
+   res = HgfsLowLevelEntry(parent, name, &e, NULL);
+
+exit:
+   HgfsLowLevelReplyEntry(req, res, &e);
+   LOG(4, ("Exit(%d)\n", res));
+   free(path);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelSymlink --
+ *
+ *    Create a symbolic link.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelSymlink(fuse_req_t req,      // IN: request
+                    const char *link,    // IN: link target
+                    fuse_ino_t parent,   // IN: directory node id
+                    const char *name)    // IN: name of the link
+{
+   struct fuse_entry_param e;
+   char *path = NULL;
+   int res;
+
+   LOG(4, ("Entry(parent = %lu, name = %s, link = %s)\n", parent, name, link));
+   res = HgfsInodePath(parent, name, &path);
+   if (res < 0) {
+      goto exit;
+   }
+
+   res = HgfsSymlink(path, link);
+   if (res < 0) {
+      goto exit;
+   }
+
+   HgfsInvalidateAttrCache(path);
+   res = HgfsLowLevelEntry(parent, name, &e, NULL);
+
+exit:
+   HgfsLowLevelReplyEntry(req, res, &e);
+   LOG(4, ("Exit(%d)\n", res));
+   free(path);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelDelete --
+ *
+ *    Delete a file or a directory.
+ *
+ * Results:
+ *    Returns zero on success, or a negative error on failure.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+HgfsLowLevelDelete(fuse_ino_t parent,   // IN: directory node id
+                   const char *name,    // IN: name to delete
+                   HgfsOp op)           // IN: HGFS_OP_DELETE_FILE/DIR
+{
+   char *path = NULL;
+   int res;
+
+   res = HgfsInodePath(parent, name, &path);
+   if (res < 0) {
+      goto exit;
+   }
+
+   res = HgfsDelete(path, op);
+   if (res == 0) {
+      if (op == HGFS_OP_DELETE_DIR) {
+         HgfsInvalidateAttrCacheTree(path);
+      } else {
+         HgfsInvalidateAttrCache(path);
+      }
+      HgfsInodeUnlink(parent, name);
+   }
+
+exit:
+   free(path);
+   return res;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelUnlink --
+ *
+ *    Delete a file.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelUnlink(fuse_req_t req,      // IN: request
+                   fuse_ino_t parent,   // IN: directory node id
+                   const char *name)    // IN: name of the file
+{
+   int res;
+
+   LOG(4, ("Entry(parent = %lu, name = %s)\n", parent, name));
+   res = HgfsLowLevelDelete(parent, name, HGFS_OP_DELETE_FILE);
+   fuse_reply_err(req, -res);
+   LOG(4, ("Exit(%d)\n", res));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelRmdir --
+ *
+ *    Delete a directory.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelRmdir(fuse_req_t req,      // IN: request
+                  fuse_ino_t parent,   // IN: directory node id
+                  const char *name)    // IN: name of the directory
+{
+   int res;
+
+   LOG(4, ("Entry(parent = %lu, name = %s)\n", parent, name));
+   res = HgfsLowLevelDelete(parent, name, HGFS_OP_DELETE_DIR);
+   fuse_reply_err(req, -res);
+   LOG(4, ("Exit(%d)\n", res));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelRename --
+ *
+ *    Rename a file or a directory.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelRename(fuse_req_t req,          // IN: request
+                   fuse_ino_t parent,       // IN: source directory node id
+                   const char *name,        // IN: source name
+                   fuse_ino_t newParent,    // IN: target directory node id
+                   const char *newName)     // IN: target name
+{
+   char *from = NULL;
+   char *to = NULL;
+   int res;
+
+   LOG(4, ("Entry(%lu/%s -> %lu/%s)\n", parent, name, newParent, newName));
+   res = HgfsInodePath(parent, name, &from);
+   if (res < 0) {
+      goto exit;
+   }
+   res = HgfsInodePath(newParent, newName, &to);
+   if (res < 0) {
+      goto exit;
+   }
+
+   res = HgfsRename(from, to);
+   if (res == 0) {
+      HgfsInvalidateAttrCacheTree(from);
+      HgfsInvalidateAttrCacheTree(to);
+      HgfsInodeRename(parent, name, newParent, newName);
+   }
+
+exit:
+   fuse_reply_err(req, -res);
+   LOG(4, ("Exit(%d)\n", res));
+   free(from);
+   free(to);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelOpen --
+ *
+ *    Open a file.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    With -o pagecache, the attributes of the file are recorded.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelOpen(fuse_req_t req,              // IN: request
+                 fuse_ino_t ino,              // IN: node id
+                 struct fuse_file_info *fi)   // IN/OUT: file info
+{
+   HgfsAttrInfo attr = {0};
+   char *path = NULL;
+   Bool stale;
+   int res;
+
+   LOG(4, ("Entry(ino = %lu, flags = %#x)\n", ino, fi->flags));
+   res = HgfsInodePath(ino, NULL, &path);
+   if (res < 0) {
+      goto exit;
+   }
+
+   res = HgfsOpen(path, fi);
+   if (res < 0) {
+      goto exit;
+   }
+
+   /*
+    * Keep the pages cached by earlier opens if the file is unchanged,
+    * otherwise the kernel drops them now.
+    */
+   if (gState->pageCache && (fi->flags & O_TRUNC) == 0 &&
+       HgfsLowLevelGetattr(path, &attr) == 0) {
+      fi->keep_cache = HgfsInodeCacheValidate(ino, &attr, &stale);
+   }
+
+   if (fuse_reply_open(req, fi) != 0) {
+      /* The open was interrupted, nobody will release the handle. */
+      HgfsRelease(fi->fh);
+   }
+
+exit:
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+   }
+   LOG(4, ("Exit(%d)\n", res));
+   free(path);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelCreate --
+ *
+ *    Create and open a file.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelCreate(fuse_req_t req,              // IN: request
+                   fuse_ino_t parent,           // IN: directory node id
+                   const char *name,            // IN: name of the file
+                   mode_t mode,                 // IN: file mode
+                   struct fuse_file_info *fi)   // IN/OUT: file info
+{
+   struct fuse_entry_param e;
+   char *path = NULL;
+   int res;
+
+   LOG(4, ("Entry(parent = %lu, name = %s, mode = %#o)\n", parent, name, mode));
+   res = HgfsInodePath(parent, name, &path);
+   if (res < 0) {
+      goto exit;
+   }
+
+   res = HgfsCreate(path, mode, fi);
+   if (res < 0) {
+      goto exit;
+   }
+
+   HgfsInvalidateAttrCache(path);
+   res = HgfsLowLevelEntry(parent, name, &e, NULL);
+   if (res < 0) {
+      HgfsRelease(fi->fh);
+      goto exit;
+   }
+
+   if (fuse_reply_create(req, &e, fi) != 0) {
+      HgfsInodeForget(e.ino, 1);
+      HgfsRelease(fi->fh);
+   }
+
+exit:
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+   }
+   LOG(4, ("Exit(%d)\n", res));
+   free(path);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelRead --
+ *
+ *    Read from an open file.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelRead(fuse_req_t req,              // IN: request
+                 fuse_ino_t ino,              // IN: node id
+                 size_t size,                 // IN: size to read
+                 off_t off,                   // IN: offset to read from
+                 struct fuse_file_info *fi)   // IN: file info
+{
+   char *buf;
+   ssize_t res;
+
+   LOG(4, ("Entry(ino = %lu, fi->fh = %#"FMT64"x, %#"FMTSZ"x bytes @ %#"FMT64"x)\n",
+           ino, fi->fh, size, off));
+
+   buf = malloc(size);
+   if (buf == NULL) {
+      res = -ENOMEM;
+      fuse_reply_err(req, ENOMEM);
+      goto exit;
+   }
+
+   res = HgfsRead(fi, buf, size, off);
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+   } else {
+      fuse_reply_buf(req, buf, res);
+   }
+   free(buf);
+
+exit:
+   LOG(4, ("Exit(%"FMTSZ"d)\n", res));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelWrite --
+ *
+ *    Write to an open file.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelWrite(fuse_req_t req,              // IN: request
+                  fuse_ino_t ino,              // IN: node id
+                  const char *buf,             // IN: data to write
+                  size_t size,                 // IN: size to write
+                  off_t off,                   // IN: offset to write to
+                  struct fuse_file_info *fi)   // IN: file info
+{
+   char *path = NULL;
+   ssize_t res;
+
+   LOG(4, ("Entry(ino = %lu, fi->fh = %#"FMT64"x, write %#"FMTSZ"x bytes @ %#"FMT64"x)\n",
+           ino, fi->fh, size, off));
+
+   res = HgfsWrite(fi, buf, size, off);
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+      goto exit;
+   }
+
+   /* Even zero bytes written could change the attributes. */
+   if (HgfsInodePath(ino, NULL, &path) == 0) {
+      HgfsInvalidateAttrCache(path);
+   }
+   fuse_reply_write(req, res);
+
+exit:
+   LOG(4, ("Exit(%"FMTSZ"d)\n", res));
+   free(path);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelRelease --
+ *
+ *    Close an open file.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelRelease(fuse_req_t req,              // IN: request
+                    fuse_ino_t ino,              // IN: node id
+                    struct fuse_file_info *fi)   // IN: file info
+{
+   LOG(4, ("Entry(ino = %lu, fi->fh = %#"FMT64"x)\n", ino, fi->fh));
+   HgfsRelease(fi->fh);
+   fuse_reply_err(req, 0);
+   LOG(4, ("Exit(0)\n"));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelOpendir --
+ *
+ *    Open a directory for reading.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelOpendir(fuse_req_t req,              // IN: request
+                    fuse_ino_t ino,              // IN: node id
+                    struct fuse_file_info *fi)   // OUT: file info
+{
+   HgfsLowLevelDir *dir;
+   char *path = NULL;
+   int res;
+
+   LOG(4, ("Entry(ino = %lu)\n", ino));
+   dir = calloc(1, sizeof *dir);
+   if (dir == NULL) {
+      res = -ENOMEM;
+      goto exit;
+   }
+
+   res = HgfsInodePath(ino, NULL, &path);
+   if (res < 0) {
+      goto exit;
+   }
+
+   res = HgfsDirOpen(path, &dir->handle);
+   if (res < 0) {
+      goto exit;
+   }
+
+   fi->fh = (uintptr_t)dir;
+   if (fuse_reply_open(req, fi) != 0) {
+      HgfsDirClose(dir->handle);
+      free(dir);
+   }
+   dir = NULL;
+
+exit:
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+   }
+   LOG(4, ("Exit(%d)\n", res));
+   free(dir);
+   free(path);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelFillDir --
+ *
+ *    Directory filler passed to HgfsReaddir, appending the entry to the
+ *    directory buffer.
+ *
+ * Results:
+ *    Returns zero, or one if out of memory to stop the reading.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+HgfsLowLevelFillDir(void *data,                // IN: directory state
+                    const char *name,          // IN: entry name
+                    const struct stat *st,     // IN: entry attributes
+                    off_t off)                 // IN: unused
+{
+   HgfsLowLevelDir *dir = data;
+   size_t entrySize;
+
+   entrySize = fuse_add_direntry(dir->req, NULL, 0, name, NULL, 0);
+   if (dir->size + entrySize > dir->allocated) {
+      size_t allocated = MAX(2 * dir->allocated, dir->size + entrySize);
+      char *buf = realloc(dir->buf, allocated);
+
+      if (buf == NULL) {
+         dir->error = -ENOMEM;
+         return 1;
+      }
+      dir->buf = buf;
+      dir->allocated = allocated;
+   }
+
+   /* The offset of an entry is the offset of the next one. */
+   fuse_add_direntry(dir->req, dir->buf + dir->size, entrySize, name, st,
+                     dir->size + entrySize);
+   dir->size += entrySize;
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelReaddir --
+ *
+ *    Read a directory. The whole directory is read from the HGFS server
+ *    on the first call, or when rewound, and the kernel then reads the
+ *    entries by offset.
+ *
+ *    This FUSE version has no readdirplus, instead the attributes in the
+ *    listing fill the attribute cache and the lookups that follow are
+ *    answered from it.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelReaddir(fuse_req_t req,              // IN: request
+                    fuse_ino_t ino,              // IN: node id
+                    size_t size,                 // IN: maximum reply size
+                    off_t off,                   // IN: offset to read from
+                    struct fuse_file_info *fi)   // IN: file info
+{
+   HgfsLowLevelDir *dir = (HgfsLowLevelDir *)(uintptr_t)fi->fh;
+   char *path = NULL;
+   int res = 0;
+
+   LOG(4, ("Entry(ino = %lu, @ %#"FMT64"x)\n", ino, off));
+
+   if (!dir->filled || off == 0) {
+      res = HgfsInodePath(ino, NULL, &path);
+      if (res < 0) {
+         goto exit;
+      }
+
+      if (dir->filled) {
+         /* Rewound, get a new listing. */
+         dir->filled = FALSE;
+         HgfsDirClose(dir->handle);
+         dir->handle = HGFS_INVALID_HANDLE;
+         res = HgfsDirOpen(path, &dir->handle);
+         if (res < 0) {
+            goto exit;
+         }
+      }
+
+      dir->size = 0;
+      dir->error = 0;
+      dir->req = req;
+      res = HgfsReaddir(dir->handle, path, dir, HgfsLowLevelFillDir);
+      dir->req = NULL;
+      if (res == 0) {
+         res = dir->error;
+      }
+      if (res < 0) {
+         goto exit;
+      }
+      dir->filled = TRUE;
+   }
+
+   if (off < dir->size) {
+      fuse_reply_buf(req, dir->buf + off, MIN(dir->size - off, size));
+   } else {
+      fuse_reply_buf(req, NULL, 0);
+   }
+
+exit:
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+   }
+   LOG(4, ("Exit(%d)\n", res));
+   free(path);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelReleasedir --
+ *
+ *    Close a directory.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelReleasedir(fuse_req_t req,              // IN: request
+                       fuse_ino_t ino,              // IN: node id
+                       struct fuse_file_info *fi)   // IN: file info
+{
+   HgfsLowLevelDir *dir = (HgfsLowLevelDir *)(uintptr_t)fi->fh;
+
+   LOG(4, ("Entry(ino = %lu)\n", ino));
+   if (dir->handle != HGFS_INVALID_HANDLE) {
+      HgfsDirClose(dir->handle);
+   }
+   free(dir->buf);
+   free(dir);
+   fuse_reply_err(req, 0);
+   LOG(4, ("Exit(0)\n"));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelStatfs --
+ *
+ *    Stat the host for total and free bytes on disk.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelStatfs(fuse_req_t req,   // IN: request
+                   fuse_ino_t ino)   // IN: node id
+{
+   struct statvfs stbuf;
+   char *path = NULL;
+   int res;
+
+   LOG(4, ("Entry(ino = %lu)\n", ino));
+   res = HgfsInodePath(ino, NULL, &path);
+   if (res < 0) {
+      goto exit;
+   }
+
+   res = HgfsStatfs(path, &stbuf);
+   if (res == 0) {
+      fuse_reply_statfs(req, &stbuf);
+   }
+
+exit:
+   if (res < 0) {
+      fuse_reply_err(req, -res);
+   }
+   LOG(4, ("Exit(%d)\n", res));
+   free(path);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelAccess --
+ *
+ *    Check the access permissions of a file.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelAccess(fuse_req_t req,   // IN: request
+                   fuse_ino_t ino,   // IN: node id
+                   int mask)         // IN: access mask
+{
+   HgfsAttrInfo attr = {0};
+   char *path = NULL;
+   int res;
+
+   LOG(4, ("Entry(ino = %lu, mask = %#o)\n", ino, mask));
+   res = HgfsInodePath(ino, NULL, &path);
+   if (res < 0) {
+      goto exit;
+   }
+
+   res = HgfsLowLevelGetattr(path, &attr);
+   if (res < 0) {
+      goto exit;
+   }
+
+   res = HgfsAttrCheckAccess(&attr, mask);
+
+exit:
+   fuse_reply_err(req, -res);
+   LOG(4, ("Exit(%d)\n", res));
+   free(path);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelInit --
+ *
+ *    Initialization routine. We create the HGFS session here.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelInit(void *userdata,               // IN: unused
+                 struct fuse_conn_info *conn)  // IN/OUT: connection info
+{
+   int res;
+
+   LOG(4, ("Entry()\n"));
+
+#ifdef FUSE_CAP_AUTO_INVAL_DATA
+   /* Also let the kernel drop pages when it sees the file changed. */
+   if (gState->pageCache && (conn->capable & FUSE_CAP_AUTO_INVAL_DATA)) {
+      conn->want |= FUSE_CAP_AUTO_INVAL_DATA;
+   }
+#endif
+
+   res = HgfsCreateSession();
+   if (res < 0) {
+      LOG(4, ("Create session failed. error = %d\n", res));
+   }
+
+   LOG(4, ("Exit()\n"));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelDestroy --
+ *
+ *    Cleanup routine.
+ *
+ * Results:
+ *    None
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsLowLevelDestroy(void *userdata)  // IN: unused
+{
+   int res;
+
+   LOG(4, ("Entry()\n"));
+
+   res = HgfsDestroySession();
+   if (res < 0) {
+      LOG(4, ("Destroy session failed. error = %d\n", res));
+   }
+
+   HgfsTransportExit();
+
+   free(gState->basePath);
+
+   if (gState->conf != NULL) {
+      g_key_file_free(gState->conf);
+      gState->conf = NULL;
+   }
+
+   LOG(4, ("Exit()\n"));
+}
+
+
+/*--------------------------------------------------------------------------- */
+static struct fuse_lowlevel_ops vmhgfs_lowlevel_operations = {
+   .init        = HgfsLowLevelInit,
+   .destroy     = HgfsLowLevelDestroy,
+   .lookup      = HgfsLowLevelLookup,
+   .forget      = HgfsLowLevelForget,
+   .getattr     = HgfsLowLevelGetattrOp,
+   .setattr     = HgfsLowLevelSetattr,
+   .readlink    = HgfsLowLevelReadlink,
+   .mkdir       = HgfsLowLevelMkdir,
+   .unlink      = HgfsLowLevelUnlink,
+   .rmdir       = HgfsLowLevelRmdir,
+   .symlink     = HgfsLowLevelSymlink,
+   .rename      = HgfsLowLevelRename,
+   .open        = HgfsLowLevelOpen,
+   .read        = HgfsLowLevelRead,
+   .write       = HgfsLowLevelWrite,
+   .release     = HgfsLowLevelRelease,
+   .opendir     = HgfsLowLevelOpendir,
+   .readdir     = HgfsLowLevelReaddir,
+   .releasedir  = HgfsLowLevelReleasedir,
+   .statfs      = HgfsLowLevelStatfs,
+   .access      = HgfsLowLevelAccess,
+   .create      = HgfsLowLevelCreate,
+};
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsLowLevelMain --
+ *
+ *    Mount and serve the file system with the FUSE low-level API, the
+ *    counterpart of fuse_main for the path API.
+ *
+ * Results:
+ *    Returns zero on success, one on failure.
+ *
+ * Side effects:
+ *    The arguments are freed.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+HgfsLowLevelMain(struct fuse_args *args)  // IN/OUT: FUSE arguments
+{
+   struct fuse_session *se;
+   struct fuse_chan *ch;
+   char *mountpoint = NULL;
+   int multithreaded;
+   int foreground;
+   int res = -1;
+
+   if (fuse_parse_cmdline(args, &mountpoint, &multithreaded,
+                          &foreground) != 0) {
+      goto exit;
+   }
+
+   ch = fuse_mount(mountpoint, args);
+   if (ch == NULL) {
+      goto exit;
+   }
+
+   HgfsInodeInit();
+   gChannel = ch;
+   se = fuse_lowlevel_new(args, &vmhgfs_lowlevel_operations,
+                          sizeof vmhgfs_lowlevel_operations, NULL);
+   if (se != NULL) {
+      if (fuse_daemonize(foreground) == 0 &&
+          fuse_set_signal_handlers(se) == 0) {
+         fuse_session_add_chan(se, ch);
+         res = multithreaded ? fuse_session_loop_mt(se) :
+                               fuse_session_loop(se);
+         fuse_remove_signal_handlers(se);
+         fuse_session_remove_chan(ch);
+      }
+      fuse_session_destroy(se);
+   }
+   fuse_unmount(mountpoint, ch);
+   HgfsInodeExit();
+
+exit:
+   free(mountpoint);
+   fuse_opt_free_args(args);
+   return res == 0 ? 0 : 1;
+}
@@ -30,6 +30,7 @@
 #include "cache.h"
 #include "filesystem.h"
 #include "file.h"
+#include "lowlevel.h"
 
 /*
  *----------------------------------------------------------------------
@@ -126,7 +127,6 @@ hgfs_getattr(const char *path,    //IN: path of a file/directory
    HgfsHandle fileHandle = HGFS_INVALID_HANDLE;
    HgfsAttrInfo newAttr = {0};
    HgfsAttrInfo *attr = &newAttr;
-   uint32 d_type;
    char *abspath = NULL;
    int res;
 
@@ -138,12 +138,14 @@ hgfs_getattr(const char *path,    //IN: path of a file/directory
 
    res = HgfsGetAttrCache(abspath, attr);
    LOG(4, ("Retrieve attr from cache. result = %d \n", res));
-   if (res != 0) {
+   if (res == HGFS_ATTR_CACHE_MISS) {
       /* Retrieve new complete attribute settings and update the cache. */
       res = HgfsPrivateGetattr(fileHandle, abspath, attr);
       LOG(4, ("Retrieve attr from server. result = %d \n", res));
       if (res == 0 ) {
          HgfsSetAttrCache(abspath, attr);
+      } else if (res == -ENOENT) {
+         HgfsSetNegativeAttrCache(abspath);
       }
    }
 
@@ -152,60 +154,7 @@ hgfs_getattr(const char *path,    //IN: path of a file/directory
    }
 
    LOG(4, ("fill stat for %s\n", abspath));
-
-   memset(stbuf, 0, sizeof *stbuf);
-
-   if (attr->mask & HGFS_ATTR_VALID_SPECIAL_PERMS) {
-      stbuf->st_mode |= (attr->specialPerms << 9);
-   }
-   if (attr->mask & HGFS_ATTR_VALID_OWNER_PERMS) {
-      stbuf->st_mode |= (attr->ownerPerms << 6);
-   }
-   if (attr->mask & HGFS_ATTR_VALID_GROUP_PERMS) {
-      stbuf->st_mode |= (attr->groupPerms << 3);
-   }
-   if (attr->mask & HGFS_ATTR_VALID_OTHER_PERMS) {
-      stbuf->st_mode |= (attr->otherPerms);
-   }
-
-   /* Mask the access mode. */
-   switch (attr->type) {
-   case HGFS_FILE_TYPE_SYMLINK:
-      d_type = DT_LNK;
-      break;
-
-   case HGFS_FILE_TYPE_REGULAR:
-      d_type = DT_REG;
-      break;
-
-   case HGFS_FILE_TYPE_DIRECTORY:
-      d_type = DT_DIR;
-      break;
-
-   default:
-      d_type = DT_UNKNOWN;
-      break;
-   }
-
-   stbuf->st_mode |= d_type << 12;
-   stbuf->st_blksize = HGFS_BLOCKSIZE;
-   stbuf->st_blocks = HgfsCalcBlockSize(attr->size);
-   stbuf->st_size = attr->size;
-   stbuf->st_ino = attr->hostFileId;
-   stbuf->st_nlink = 1;
-   stbuf->st_uid = attr->userId;
-   stbuf->st_gid = attr->groupId;
-   stbuf->st_rdev = 0;
-
-   if (attr->mask & HGFS_ATTR_VALID_ACCESS_TIME) {
-      HGFS_SET_TIME(stbuf->st_atime, attr->accessTime);
-   }
-   if (attr->mask & HGFS_ATTR_VALID_WRITE_TIME) {
-      HGFS_SET_TIME(stbuf->st_mtime, attr->writeTime);
-   }
-   if (attr->mask & HGFS_ATTR_VALID_CHANGE_TIME) {
-      HGFS_SET_TIME(stbuf->st_ctime, attr->attrChangeTime);
-   }
+   HgfsAttrToStat(attr, stbuf);
 
 exit:
    LOG(4, ("Exit(%d)\n", res));
@@ -237,7 +186,6 @@ hgfs_access(const char *path,  //IN: Path to a file.
    HgfsHandle fileHandle = HGFS_INVALID_HANDLE;
    HgfsAttrInfo newAttr = {0};
    HgfsAttrInfo *attr = &newAttr;
-   uint32 effectivePermissions;
    char *abspath = NULL;
    int res;
 
@@ -247,14 +195,16 @@ hgfs_access(const char *path,  //IN: Path to a file.
       goto exit;
    }
 
-   res = HgfsGetAttrCache(path, attr);
+   res = HgfsGetAttrCache(abspath, attr);
    LOG(4, ("Retrieve attr from cache. result = %d \n", res));
-   if (res != 0) {
+   if (res == HGFS_ATTR_CACHE_MISS) {
       /* Retrieve new complete attribute settings and update the cache. */
       res = HgfsPrivateGetattr(fileHandle, abspath, attr);
       LOG(4, ("Retrieve attr from server. result = %d \n", res));
       if (res == 0 ) {
          HgfsSetAttrCache(abspath, attr);
+      } else if (res == -ENOENT) {
+         HgfsSetNegativeAttrCache(abspath);
       }
    }
 
@@ -262,29 +212,7 @@ hgfs_access(const char *path,  //IN: Path to a file.
       goto exit;
    }
 
-   if (mask == F_OK) {
-      res = 0;  /* assume the above attr retrieval did the validation */
-      goto exit;
-   }
-
-   if (attr->mask & HGFS_ATTR_VALID_EFFECTIVE_PERMS) {
-      effectivePermissions = attr->effectivePerms;
-   } else {
-     /*
-      * If the server did not return actual effective permissions then
-      * need to calculate ourselves. However we should avoid unnecessary
-      * denial of access so perform optimistic permissions calculation.
-      * It is safe since host enforces necessary restrictions regardless of
-      * the client's decisions.
-      */
-     effectivePermissions = (attr->ownerPerms |
-                             attr->groupPerms |
-                             attr->otherPerms);
-  }
-
-  if ((effectivePermissions & mask) != mask) {
-     res = -EACCES;
-  }
+   res = HgfsAttrCheckAccess(attr, mask);
 
 exit:
    LOG(4, ("Exit(%d)\n", res));
@@ -388,7 +316,7 @@ hgfs_readdir(const char *path,          //IN: path to a directory
    }
 
    fi->fh = fileHandle;
-   res = HgfsReaddir(fileHandle, buf, filler);
+   res = HgfsReaddir(fileHandle, abspath, buf, filler);
 
 exit:
    LOG(4, ("Exit(%d)\n", res));
@@ -459,6 +387,9 @@ hgfs_mkdir(const char *path,  //IN: path to a new dir
    }
 
    res = HgfsMkdir(abspath, mode);
+   if (res == 0) {
+      HgfsInvalidateAttrCache(abspath);
+   }
 
 exit:
    LOG(4, ("Exit(%d)\n", res));
@@ -537,7 +468,7 @@ hgfs_rmdir(const char *path) //IN: path to a dir
 
    res = HgfsDelete(abspath, HGFS_OP_DELETE_DIR);
    if (res == 0) {
-      HgfsInvalidateAttrCache(abspath);
+      HgfsInvalidateAttrCacheTree(abspath);
    }
 
 exit:
@@ -578,6 +509,9 @@ hgfs_symlink(const char *symname,   //IN: symname target
 
    LOG(4, ("symname = %s, abs source = %s)\n", symname, absSource));
    res = HgfsSymlink(absSource, symname);
+   if (res == 0) {
+      HgfsInvalidateAttrCache(absSource);
+   }
 
 exit:
    LOG(4, ("Exit(%d)\n", res));
@@ -622,8 +556,8 @@ hgfs_rename(const char *from,  //IN: from path name
 
    res = HgfsRename(absfrom, absto);
    if (res == 0) {
-      HgfsInvalidateAttrCache(absfrom);
-      HgfsInvalidateAttrCache(absto);
+      HgfsInvalidateAttrCacheTree(absfrom);
+      HgfsInvalidateAttrCacheTree(absto);
    }
 
 exit:
@@ -1040,6 +974,9 @@ hgfs_create(const char *path,          //IN: path to a file
    }
 
    res = HgfsCreate(abspath, mode, fi);
+   if (res == 0) {
+      HgfsInvalidateAttrCache(abspath);
+   }
 
 exit:
    LOG(4, ("Exit(%d)\n", res));
@@ -1154,6 +1091,59 @@ exit:
    return res;
 }
 
+
+#if FUSE_USE_VERSION >= 34
+/*
+ *----------------------------------------------------------------------
+ *
+ * hgfs_copy_file_range
+ *
+ *    Copy a range of a file into another file on the host. Both files
+ *    are open, as FUSE only sends the request for open files.
+ *
+ * Results:
+ *    Returns the number of bytes copied, or -EOPNOTSUPP if the
+ *    server cannot copy, in which case the kernel copies the data.
+ *
+ * Side effects:
+ *    None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static ssize_t
+hgfs_copy_file_range(const char *pathIn,           //IN: path to the source
+                     struct fuse_file_info *fiIn,  //IN: source file info
+                     off_t offsetIn,               //IN: offset to copy from
+                     const char *pathOut,          //IN: path to the target
+                     struct fuse_file_info *fiOut, //IN: target file info
+                     off_t offsetOut,              //IN: offset to copy to
+                     size_t size,                  //IN: size to copy
+                     int flags)                    //IN: copy flags
+{
+   char *abspath = NULL;
+   ssize_t res;
+
+   LOG(4, ("Entry(%s @ %#"FMT64"x -> %s @ %#"FMT64"x, %#"FMTSZ"x bytes)\n",
+           pathIn, offsetIn, pathOut, offsetOut, size));
+
+   if (flags != 0) {
+      res = -EINVAL;
+      goto exit;
+   }
+
+   res = HgfsCopyFileRange(fiIn, offsetIn, fiOut, offsetOut, size);
+   if (res >= 0 && getAbsPath(pathOut, &abspath) == 0) {
+      HgfsInvalidateAttrCache(abspath);
+   }
+
+exit:
+   LOG(4, ("Exit(%"FMTSZ"d)\n", res));
+   freeAbsPath(abspath);
+   return res;
+}
+#endif
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1238,7 +1228,7 @@ exit:
  *
  * hgfs_init
  *
- *    Initialization routine. We spawn the cache purge thread here.
+ *    Initialization routine. We create the HGFS session here.
  *
  * Results:
  *    Returns NULL.
@@ -1250,23 +1240,18 @@ exit:
  */
 
 static void*
-hgfs_init(struct fuse_conn_info *conn) // IN: unused
+hgfs_init(struct fuse_conn_info *conn) // IN/OUT: connection info
 {
-   pthread_t purgeCacheThread;
-   int dummy;
    int res;
 
    LOG(4, ("Entry()\n"));
 
-   /*
-    * dummy argument is required for Solaris and FreeBSD while creating
-    * thread otherwise the program crashes.
-    */
-   res = pthread_create(&purgeCacheThread, NULL,
-                        HgfsPurgeCache, &dummy);
-   if (res < 0) {
-      LOG(4, ("Pthread create fail. error = %d\n", res));
+#ifdef FUSE_CAP_AUTO_INVAL_DATA
+   /* Also let the kernel drop pages when it sees the file changed. */
+   if (gState->pageCache && (conn->capable & FUSE_CAP_AUTO_INVAL_DATA)) {
+      conn->want |= FUSE_CAP_AUTO_INVAL_DATA;
    }
+#endif
 
    res = HgfsCreateSession();
    if (res < 0) {
@@ -1343,6 +1328,9 @@ static struct fuse_operations vmhgfs_operations = {
    .open        = hgfs_open,
    .read        = hgfs_read,
    .write       = hgfs_write,
+#if FUSE_USE_VERSION >= 34
+   .copy_file_range = hgfs_copy_file_range,
+#endif
    .statfs      = hgfs_statfs,
    .release     = hgfs_release,
    .create      = hgfs_create,
@@ -1390,6 +1378,10 @@ main(int argc,       //IN: Argument count
    }
    HgfsInitCache();
 
+   if (gState->lowLevel) {
+      return HgfsLowLevelMain(&args);
+   }
+
    return fuse_main(args.argc, args.argv, &vmhgfs_operations, NULL);
 }
 
@@ -96,6 +96,7 @@ HgfsCreateSessionProcessResult(const char *result,  // IN: Reply packet
    uint64 sessionId = HGFS_INVALID_SESSION_ID;
    uint8 headerVersion = HGFS_HEADER_VERSION_1;
    Bool sessionIdPresent = FALSE;
+   Bool copyFileRangeSupported = FALSE;
 
    uint32 information;
    HgfsHandle requestId;
@@ -145,12 +146,32 @@ HgfsCreateSessionProcessResult(const char *result,  // IN: Reply packet
        */
       sessionId = createSessionReply->sessionId;
       sessionIdPresent = TRUE;
+
+      if (replyPayloadSize >= offsetof(HgfsReplyCreateSessionV4, capabilities)) {
+         uint32 maxCapabilities =
+            (replyPayloadSize -
+             offsetof(HgfsReplyCreateSessionV4, capabilities)) /
+            sizeof(HgfsCapability);
+         uint32 numCapabilities = MIN(createSessionReply->numCapabilities,
+                                      maxCapabilities);
+         uint32 i;
+
+         for (i = 0; i < numCapabilities; i++) {
+            HgfsCapability *capability = &createSessionReply->capabilities[i];
+
+            if (capability->op == HGFS_OP_COPY_FILE_RANGE_V4 &&
+                capability->flags != HGFS_REQUEST_NOT_SUPPORTED) {
+               copyFileRangeSupported = TRUE;
+            }
+         }
+      }
    }
 
 out:
    gState->sessionId = sessionId;
    gState->headerVersion = headerVersion;
    gState->sessionEnabled = sessionIdPresent;
+   gState->copyFileRangeSupported = copyFileRangeSupported;
 
    LOG(4, ("Exit(%d)\n", status));
    return status;
@@ -336,6 +357,7 @@ HgfsDestroySessionProcessResult(const char *result,  // IN: Reply packet
 out:
    gState->sessionId = HGFS_INVALID_SESSION_ID;
    gState->sessionEnabled = FALSE;
+   gState->copyFileRangeSupported = FALSE;
 
    LOG(4, ("Exit(%d)\n", status));
    return status;
@@ -25,8 +25,12 @@
  *
  * The sends happen in the process context, where as a thread
  * handles the asynchronous replies. A queue of pending replies is
- * maintained and is protected by a lock. The channel opens and close
- * is protected by a mutex.
+ * maintained and is protected by a lock. Replies are matched to their
+ * requests by request id.
+ *
+ * Up to a window of requests are in flight at once: senders share the
+ * channel lock, and only opening, resetting or closing the channel
+ * takes it exclusively.
  */
 
 
@@ -39,15 +43,20 @@
 #include "vm_assert.h"
 
 static HgfsTransportChannel *gHgfsActiveChannel;     /* Current active channel. */
-static pthread_mutex_t gHgfsActiveChannelLock;       /* Current active channel lock. */
+static pthread_rwlock_t gHgfsActiveChannelLock;      /* Current active channel lock. */
 static Bool gHgfsActiveChannelLockInited;
+static uint32 gHgfsActiveChannelGeneration;          /* Bumped on each reset. */
 
 static struct list_head gHgfsPendingRequests;        /* Pending requests queue. */
 static pthread_mutex_t gHgfsPendingRequestsLock;     /* Pending requests queue lock. */
+static pthread_cond_t gHgfsPendingRequestsCond;      /* Signaled on completions. */
 static Bool gHgfsPendingRequestsLockInited;
 
-
-#define HgfsRequestId(req) ((HgfsRequest *)req)->id
+static uint32 gHgfsRequestsWindow;                   /* Max requests in flight. */
+static uint32 gHgfsRequestsInFlight;
+static pthread_mutex_t gHgfsRequestsWindowLock;      /* Requests window lock. */
+static pthread_cond_t gHgfsRequestsWindowCond;       /* Signaled when below window. */
+static Bool gHgfsRequestsWindowLockInited;
 
 static void HgfsTransportChannelClose(HgfsTransportChannel **channel);
 
@@ -207,6 +216,162 @@ HgfsTransportDequeueRequest(HgfsReq *req)   // IN: Request to dequeue
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsTransportReplyId --
+ *
+ *     Get the request id of a reply packet, which has an HgfsHeader
+ *     when sessions are enabled and an HgfsReply otherwise.
+ *
+ * Results:
+ *     TRUE and the id, or FALSE if the packet is too small.
+ *
+ * Side effects:
+ *     None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static Bool
+HgfsTransportReplyId(const char *packet,   // IN: reply packet
+                     size_t packetSize,    // IN: packet size
+                     HgfsHandle *id)       // OUT: request id
+{
+   const HgfsHeader *header = (const HgfsHeader *)packet;
+
+   if (packetSize >= sizeof *header && header->dummy == HGFS_OP_NEW_HEADER) {
+      *id = header->requestId;
+      return TRUE;
+   }
+   if (packetSize >= sizeof (HgfsReply)) {
+      *id = ((const HgfsReply *)packet)->id;
+      return TRUE;
+   }
+   return FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsTransportWaitReply --
+ *
+ *     Wait for the reply to a request sent on a channel which receives
+ *     its replies asynchronously. Replies of synchronous channels are
+ *     received by the send itself.
+ *
+ * Results:
+ *     None
+ *
+ * Side effects:
+ *     None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsTransportWaitReply(HgfsReq *req)   // IN: Request sent
+{
+   pthread_mutex_lock(&gHgfsPendingRequestsLock);
+   while (req->state != HGFS_REQ_STATE_COMPLETED) {
+      pthread_cond_wait(&gHgfsPendingRequestsCond, &gHgfsPendingRequestsLock);
+   }
+   pthread_mutex_unlock(&gHgfsPendingRequestsLock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsTransportWindowEnter --
+ *
+ *     Wait until a request can be sent within the requests window.
+ *
+ * Results:
+ *     None
+ *
+ * Side effects:
+ *     None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsTransportWindowEnter(void)
+{
+   pthread_mutex_lock(&gHgfsRequestsWindowLock);
+   while (gHgfsRequestsInFlight >= gHgfsRequestsWindow) {
+      pthread_cond_wait(&gHgfsRequestsWindowCond, &gHgfsRequestsWindowLock);
+   }
+   gHgfsRequestsInFlight++;
+   pthread_mutex_unlock(&gHgfsRequestsWindowLock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsTransportWindowExit --
+ *
+ *     Leave the requests window once a request is done.
+ *
+ * Results:
+ *     None
+ *
+ * Side effects:
+ *     A sender waiting for the window is woken up.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+HgfsTransportWindowExit(void)
+{
+   pthread_mutex_lock(&gHgfsRequestsWindowLock);
+   ASSERT(gHgfsRequestsInFlight > 0);
+   gHgfsRequestsInFlight--;
+   pthread_cond_signal(&gHgfsRequestsWindowCond);
+   pthread_mutex_unlock(&gHgfsRequestsWindowLock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * HgfsTransportSendOnChannel --
+ *
+ *     Send a request on the active channel and get its reply. The caller
+ *     holds the active channel lock, shared or exclusive.
+ *
+ * Results:
+ *     Zero on success, non-zero error on failure.
+ *
+ * Side effects:
+ *     None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+HgfsTransportSendOnChannel(HgfsReq *req)   // IN: Request to send
+{
+   int ret;
+
+   ASSERT(gHgfsActiveChannel->ops.send);
+
+   req->state = HGFS_REQ_STATE_SUBMITTED;
+   HgfsTransportEnqueueRequest(req);
+
+   ret = gHgfsActiveChannel->ops.send(gHgfsActiveChannel, req);
+   if (ret < 0) {
+      HgfsTransportDequeueRequest(req);
+      req->state = HGFS_REQ_STATE_UNSENT;
+   }
+   return ret;
+}
+
+
 /*
  * Public function implementations.
  */
@@ -239,7 +404,10 @@ HgfsTransportProcessPacket(char *receivedPacket,    //IN: received packet
    /* Got the reply. */
 
    ASSERT(receivedPacket != NULL && receivedSize > 0);
-   id = HgfsRequestId(receivedPacket);
+   if (!HgfsTransportReplyId(receivedPacket, receivedSize, &id)) {
+      LOG(4, ("Malformed packet, dropping reply.\n"));
+      return;
+   }
    LOG(8, ("Entered.\n"));
    LOG(6, ("Req id: %d\n", id));
    /*
@@ -253,6 +421,7 @@ HgfsTransportProcessPacket(char *receivedPacket,    //IN: received packet
       if (req->id == id) {
          ASSERT(req->state == HGFS_REQ_STATE_SUBMITTED);
          HgfsCompleteReq(req, receivedPacket, receivedSize);
+         pthread_cond_broadcast(&gHgfsPendingRequestsCond);
          found = TRUE;
          break;
       }
@@ -298,6 +467,7 @@ HgfsTransportBeforeExitingRecvThread(void)
       LOG(6, ("Injecting error reply to req id: %d\n", req->id));
       HgfsCompleteReq(req, (char *)&reply, sizeof reply);
    }
+   pthread_cond_broadcast(&gHgfsPendingRequestsCond);
    pthread_mutex_unlock(&gHgfsPendingRequestsLock);
 }
 
@@ -307,13 +477,14 @@ HgfsTransportBeforeExitingRecvThread(void)
  *
  * HgfsTransportSendRequest --
  *
- *     Sends the request via channel communication.
+ *     Sends the request via channel communication and waits for its
+ *     reply. Up to the requests window of senders run concurrently.
  *
  * Results:
  *     Zero on success, non-zero error on failure.
  *
  * Side effects:
- *     None
+ *     The channel is reopened if the send fails.
  *
  *----------------------------------------------------------------------
  */
@@ -321,44 +492,52 @@ HgfsTransportBeforeExitingRecvThread(void)
 int
 HgfsTransportSendRequest(HgfsReq *req)   // IN: Request to send
 {
-   int ret;
+   uint32 generation;
+   int ret = -ENOTCONN;
+
    ASSERT(req);
    ASSERT(req->state == HGFS_REQ_STATE_UNSENT);
    ASSERT(req->payloadSize <= HGFS_LARGE_PACKET_MAX);
 
-   pthread_mutex_lock(&gHgfsActiveChannelLock);
+   HgfsTransportWindowEnter();
 
-   /* Try opening the channel. */
-   if (NULL == gHgfsActiveChannel) {
-      ret = HgfsTransportChannelOpen(&gHgfsActiveChannel);
-      if (ret != 0) {
-         goto exit;
-      }
+   pthread_rwlock_rdlock(&gHgfsActiveChannelLock);
+   generation = gHgfsActiveChannelGeneration;
+   if (NULL != gHgfsActiveChannel) {
+      ret = HgfsTransportSendOnChannel(req);
    }
+   pthread_rwlock_unlock(&gHgfsActiveChannelLock);
 
-   ASSERT(gHgfsActiveChannel->ops.send);
-
-   HgfsTransportEnqueueRequest(req);
-
-   ret = gHgfsActiveChannel->ops.send(gHgfsActiveChannel, req);
    if (ret < 0) {
-      LOG(4, ("Send failed, status = %d. Try reopening the channel ...\n",
-              ret));
-      if (HgfsTransportChannelReset(&gHgfsActiveChannel)) {
-         ret = gHgfsActiveChannel->ops.send(gHgfsActiveChannel, req);
+      /*
+       * Open or reset the channel exclusively, unless another sender
+       * already did it since we sent, and retry once.
+       */
+      pthread_rwlock_wrlock(&gHgfsActiveChannelLock);
+      if (NULL == gHgfsActiveChannel) {
+         ret = HgfsTransportChannelOpen(&gHgfsActiveChannel);
+      } else if (generation == gHgfsActiveChannelGeneration) {
+         LOG(4, ("Send failed, status = %d. Try reopening the channel ...\n",
+                 ret));
+         ret = HgfsTransportChannelReset(&gHgfsActiveChannel) ? 0 : -ENOTCONN;
+         gHgfsActiveChannelGeneration++;
+      } else {
+         ret = 0;
+      }
+      if (ret == 0) {
+         ret = HgfsTransportSendOnChannel(req);
       }
+      pthread_rwlock_unlock(&gHgfsActiveChannelLock);
+   }
+
+   if (ret == 0) {
+      HgfsTransportWaitReply(req);
    }
 
-exit:
    ASSERT(req->state == HGFS_REQ_STATE_COMPLETED ||
-          req->state == HGFS_REQ_STATE_SUBMITTED ||
           req->state == HGFS_REQ_STATE_UNSENT);
 
-   pthread_mutex_unlock(&gHgfsActiveChannelLock);
-
-   if (ret < 0) {
-      HgfsTransportDequeueRequest(req);
-   }
+   HgfsTransportWindowExit();
 
    return ret;
 }
@@ -389,18 +568,49 @@ HgfsTransportInit(void)
    int res;
 
    gHgfsActiveChannel = NULL;
+   gHgfsActiveChannelGeneration = 0;
    gHgfsPendingRequestsLockInited = FALSE;
    gHgfsActiveChannelLockInited = FALSE;
+   gHgfsRequestsWindowLockInited = FALSE;
    INIT_LIST_HEAD(&gHgfsPendingRequests);
 
+   /* The window comes from the mount options, one serializes requests. */
+   gHgfsRequestsWindow = gState->maxRequests;
+   if (gHgfsRequestsWindow == 0) {
+      gHgfsRequestsWindow = 1;
+   } else if (gHgfsRequestsWindow > HGFS_TRANSPORT_MAX_REQUESTS) {
+      gHgfsRequestsWindow = HGFS_TRANSPORT_MAX_REQUESTS;
+   }
+   gHgfsRequestsInFlight = 0;
+   LOG(4, ("Up to %u requests in flight.\n", gHgfsRequestsWindow));
+
    res = pthread_mutex_init(&gHgfsPendingRequestsLock, NULL);
    if (res != 0) {
       res = -res;
       goto exit;
    }
+   res = pthread_cond_init(&gHgfsPendingRequestsCond, NULL);
+   if (res != 0) {
+      pthread_mutex_destroy(&gHgfsPendingRequestsLock);
+      res = -res;
+      goto exit;
+   }
    gHgfsPendingRequestsLockInited = TRUE;
 
-   res = pthread_mutex_init(&gHgfsActiveChannelLock, NULL);
+   res = pthread_mutex_init(&gHgfsRequestsWindowLock, NULL);
+   if (res != 0) {
+      res = -res;
+      goto exit;
+   }
+   res = pthread_cond_init(&gHgfsRequestsWindowCond, NULL);
+   if (res != 0) {
+      pthread_mutex_destroy(&gHgfsRequestsWindowLock);
+      res = -res;
+      goto exit;
+   }
+   gHgfsRequestsWindowLockInited = TRUE;
+
+   res = pthread_rwlock_init(&gHgfsActiveChannelLock, NULL);
    if (res != 0) {
       res = -res;
       goto exit;
@@ -439,17 +649,24 @@ HgfsTransportExit(void)
    LOG(8, ("Entered.\n"));
 
    if (gHgfsActiveChannelLockInited) {
-      pthread_mutex_lock(&gHgfsActiveChannelLock);
+      pthread_rwlock_wrlock(&gHgfsActiveChannelLock);
       HgfsTransportChannelClose(&gHgfsActiveChannel);
-      pthread_mutex_unlock(&gHgfsActiveChannelLock);
+      pthread_rwlock_unlock(&gHgfsActiveChannelLock);
 
-      pthread_mutex_destroy(&gHgfsActiveChannelLock);
+      pthread_rwlock_destroy(&gHgfsActiveChannelLock);
       gHgfsActiveChannelLockInited = FALSE;
    }
 
    ASSERT(list_empty(&gHgfsPendingRequests));
 
+   if (gHgfsRequestsWindowLockInited) {
+      pthread_cond_destroy(&gHgfsRequestsWindowCond);
+      pthread_mutex_destroy(&gHgfsRequestsWindowLock);
+      gHgfsRequestsWindowLockInited = FALSE;
+   }
+
    if (gHgfsPendingRequestsLockInited) {
+      pthread_cond_destroy(&gHgfsPendingRequestsCond);
       pthread_mutex_destroy(&gHgfsPendingRequestsLock);
       gHgfsPendingRequestsLockInited = FALSE;
    }
@@ -26,6 +26,10 @@
 #include "request.h"
 #include <pthread.h>
 
+/* Bounds of the number of requests in flight, see HgfsTransportInit. */
+#define HGFS_TRANSPORT_DEFAULT_REQUESTS 4
+#define HGFS_TRANSPORT_MAX_REQUESTS     16
+
 typedef enum {
    HGFS_CHANNEL_UNINITIALIZED,
    HGFS_CHANNEL_NOTCONNECTED,